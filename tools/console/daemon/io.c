@@ -50,6 +50,10 @@
 #include <sys/ioctl.h>
 #include <libutil.h>
 #endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
 #include <xen-tools/common-macros.h>
 
 /* Each 10 bits takes ~ 3 digits, plus one, plus one for nul terminator. */
@@ -76,9 +80,34 @@ static int log_hv_fd = -1;
 static xengnttab_handle *xgt_handle = NULL;
 static xenforeignmemory_handle *xfm_handle;
 
-static struct pollfd  *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
+enum io_source_type {
+	IO_XS,
+	IO_HV_LOG,
+	IO_CONSOLE_RING,
+	IO_CONSOLE_TTY,
+};
+
+/*
+ * A file descriptor waited for by handle_io().  Descriptors stay registered
+ * while open, with the events of interest updated as the state of their
+ * console changes, so that a wakeup only visits the ready ones.
+ */
+struct io_source {
+	int fd;
+	short events;		/* POLL* events registered for, 0 if none */
+	enum io_source_type type;
+	struct console *con;
+#ifndef USE_EPOLL
+	unsigned int idx;	/* slot in fds */
+#endif
+};
+
+struct io_ready {
+	struct io_source *src;
+	short revents;
+};
+
+static struct io_ready *io_ready;
 
 struct buffer {
 	char *data;
@@ -91,7 +120,7 @@ struct buffer {
 struct console {
 	const char *ttyname;
 	int master_fd;
-	int master_pollfd_idx;
+	struct io_source master_src;
 	int slave_fd;
 	int log_fd;
 	struct buffer buffer;
@@ -99,9 +128,11 @@ struct console {
 	const char *log_suffix;
 	int ring_ref;
 	xenevtchn_handle *xce_handle;
-	int xce_pollfd_idx;
+	struct io_source xce_src;
 	int event_count;
 	long long next_period;
+	bool throttled;
+	struct console *next_throttled;
 	xenevtchn_port_or_error_t local_port;
 	xenevtchn_port_or_error_t remote_port;
 	struct xencons_interface *interface;
@@ -149,6 +180,12 @@ struct domain {
 
 static struct domain *dom_head;
 
+/* Consoles waiting for the end of their rate limiting period. */
+static struct console *throttled_head;
+
+/* Some domain has been shut down and needs cleaning up. */
+static bool domains_dead;
+
 typedef void (*VOID_ITER_FUNC_ARG1)(struct console *);
 typedef int (*INT_ITER_FUNC_ARG1)(struct console *);
 typedef void (*VOID_ITER_FUNC_ARG2)(struct console *,  void *);
@@ -226,6 +263,215 @@ static inline int console_iter_int_arg3(struct domain *d,
 	return ret;
 }
 
+#ifdef USE_EPOLL
+
+/* How many ready descriptors are collected by one io_wait() */
+#define IO_READY_MAX 256
+
+static int epoll_fd = -1;
+
+static int io_init(void)
+{
+	io_ready = calloc(IO_READY_MAX, sizeof(*io_ready));
+	if (!io_ready)
+		return -1;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	return epoll_fd == -1 ? -1 : 0;
+}
+
+static void io_exit(void)
+{
+	if (epoll_fd != -1)
+		close(epoll_fd);
+	epoll_fd = -1;
+
+	free(io_ready);
+	io_ready = NULL;
+}
+
+/* The POLL* flags have the values of the matching EPOLL* ones on Linux. */
+static int io_ctl(struct io_source *src, int op, short events)
+{
+	struct epoll_event ev = {
+		.events = (unsigned short)events,
+		.data.ptr = src,
+	};
+
+	return epoll_ctl(epoll_fd, op, src->fd, &ev);
+}
+
+static int io_add(struct io_source *src, short events)
+{
+	return io_ctl(src, EPOLL_CTL_ADD, events);
+}
+
+static int io_mod(struct io_source *src, short events)
+{
+	return io_ctl(src, EPOLL_CTL_MOD, events);
+}
+
+static void io_del(struct io_source *src)
+{
+	io_ctl(src, EPOLL_CTL_DEL, 0);
+}
+
+/* Returns the number of entries filled in io_ready, or -1 on error. */
+static int io_wait(int timeout)
+{
+	static struct epoll_event events[IO_READY_MAX];
+	int i, ret;
+
+	ret = epoll_wait(epoll_fd, events, IO_READY_MAX, timeout);
+
+	for (i = 0; i < ret; i++) {
+		io_ready[i].src = events[i].data.ptr;
+		io_ready[i].revents = events[i].events;
+	}
+
+	return ret;
+}
+
+#else /* !USE_EPOLL */
+
+static struct pollfd *fds;
+static struct io_source **fd_sources;
+static unsigned int current_array_size;
+static unsigned int nr_fds;
+
+static int io_init(void)
+{
+	return 0;
+}
+
+static void io_exit(void)
+{
+	free(fds);
+	fds = NULL;
+	free(fd_sources);
+	fd_sources = NULL;
+	free(io_ready);
+	io_ready = NULL;
+	current_array_size = 0;
+	nr_fds = 0;
+}
+
+static int io_add(struct io_source *src, short events)
+{
+	if (current_array_size < nr_fds + 1) {
+		/* Round up to 2^8 boundary, in practice this just
+		 * make newsize larger than current_array_size.
+		 */
+		unsigned long newsize = ROUNDUP(nr_fds + 1, 8);
+		void *p;
+
+		p = realloc(fds, sizeof(*fds) * newsize);
+		if (!p)
+			return -1;
+		fds = p;
+		p = realloc(fd_sources, sizeof(*fd_sources) * newsize);
+		if (!p)
+			return -1;
+		fd_sources = p;
+		p = realloc(io_ready, sizeof(*io_ready) * newsize);
+		if (!p)
+			return -1;
+		io_ready = p;
+		current_array_size = newsize;
+	}
+
+	fds[nr_fds].fd = src->fd;
+	fds[nr_fds].events = events;
+	fds[nr_fds].revents = 0;
+	fd_sources[nr_fds] = src;
+	src->idx = nr_fds++;
+
+	return 0;
+}
+
+static int io_mod(struct io_source *src, short events)
+{
+	fds[src->idx].events = events;
+
+	return 0;
+}
+
+static void io_del(struct io_source *src)
+{
+	unsigned int last = --nr_fds;
+
+	fds[src->idx] = fds[last];
+	fd_sources[src->idx] = fd_sources[last];
+	fd_sources[src->idx]->idx = src->idx;
+}
+
+/* Returns the number of entries filled in io_ready, or -1 on error. */
+static int io_wait(int timeout)
+{
+	unsigned int i;
+	int ret, n = 0;
+
+	ret = poll(fds, nr_fds, timeout);
+
+	for (i = 0; ret > 0 && i < nr_fds; i++) {
+		if (!fds[i].revents)
+			continue;
+		io_ready[n].src = fd_sources[i];
+		io_ready[n].revents = fds[i].revents;
+		n++;
+	}
+
+	return ret < 0 ? ret : n;
+}
+
+#endif /* USE_EPOLL */
+
+static void io_source_init(struct io_source *src, enum io_source_type type,
+			   struct console *con)
+{
+	src->fd = -1;
+	src->events = 0;
+	src->type = type;
+	src->con = con;
+}
+
+/*
+ * Wait for events on fd, replacing the descriptor or events registered
+ * before.  Passing no events or an fd of -1 stops waiting, which needs to be
+ * done before the descriptor is closed.
+ */
+static void io_set(struct io_source *src, int fd, short events)
+{
+	int ret;
+
+	if (fd == -1)
+		events = 0;
+
+	if (src->events && (src->fd != fd || !events)) {
+		io_del(src);
+		src->events = 0;
+	}
+
+	src->fd = fd;
+	if (src->events == events)
+		return;
+
+	if (src->events)
+		ret = io_mod(src, events);
+	else
+		ret = io_add(src, events);
+	if (ret) {
+		dolog(LOG_ERR, "Failed to wait for fd %d: %d (%s)",
+		      fd, errno, strerror(errno));
+		if (src->events)
+			io_del(src);
+		events = 0;
+	}
+	src->events = events;
+}
+
+static void console_update_io(struct console *con);
+
 static void do_replace_escape(const char *src, char *dest, int len)
 {
 	int i;
@@ -485,6 +731,7 @@ static int create_console_log(struct console *con)
 static void console_close_tty(struct console *con)
 {
 	if (con->master_fd != -1) {
+		io_set(&con->master_src, -1, 0);
 		close(con->master_fd);
 		con->master_fd = -1;
 	}
@@ -743,8 +990,10 @@ static int console_create_ring(struct console *con)
 
 	con->local_port = -1;
 	con->remote_port = -1;
-	if (con->xce_handle != NULL)
+	if (con->xce_handle != NULL) {
+		io_set(&con->xce_src, -1, 0);
 		xenevtchn_close(con->xce_handle);
+	}
 
 	/* Opening evtchn independently for each console is a bit
 	 * wasteful, but that's how the code is structured... */
@@ -781,6 +1030,7 @@ static int console_create_ring(struct console *con)
 		con->log_fd = create_console_log(con);
 
  out:
+	console_update_io(con);
 	return err;
 }
 
@@ -820,13 +1070,13 @@ static int console_init(struct console *con, struct domain *dom, void **data)
 	}
 
 	con->master_fd = -1;
-	con->master_pollfd_idx = -1;
+	io_source_init(&con->master_src, IO_CONSOLE_TTY, con);
 	con->slave_fd = -1;
 	con->log_fd = -1;
 	con->ring_ref = -1;
 	con->local_port = -1;
 	con->remote_port = -1;
-	con->xce_pollfd_idx = -1;
+	io_source_init(&con->xce_src, IO_CONSOLE_RING, con);
 	con->next_period = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + RATE_LIMIT_PERIOD;
 	con->d = dom;
 	con->ttyname = (*con_type)->ttyname;
@@ -914,6 +1164,16 @@ static void remove_domain(struct domain *dom)
 
 static void console_cleanup(struct console *con)
 {
+	struct console **pp;
+
+	if (con->throttled) {
+		for (pp = &throttled_head; *pp != con;
+		     pp = &(*pp)->next_throttled)
+			;
+		*pp = con->next_throttled;
+		con->throttled = false;
+	}
+
 	if (con->log_fd != -1) {
 		close(con->log_fd);
 		con->log_fd = -1;
@@ -937,8 +1197,10 @@ static void cleanup_domain(struct domain *d)
 
 static void console_close_evtchn(struct console *con)
 {
-	if (con->xce_handle != NULL)
+	if (con->xce_handle != NULL) {
+		io_set(&con->xce_src, -1, 0);
 		xenevtchn_close(con->xce_handle);
+	}
 
 	con->xce_handle = NULL;
 }
@@ -946,9 +1208,11 @@ static void console_close_evtchn(struct console *con)
 static void shutdown_domain(struct domain *d)
 {
 	d->is_dead = true;
+	domains_dead = true;
 	watch_domain(d, false);
 	console_iter_void_arg1(d, console_unmap_interface);
 	console_iter_void_arg1(d, console_close_evtchn);
+	console_iter_void_arg1(d, console_update_io);
 }
 
 static unsigned enum_pass = 0;
@@ -983,6 +1247,10 @@ static void enum_domains(void)
 		if (dom)
 			dom->last_seen = enum_pass;
 	}
+
+	for (dom = dom_head; dom; dom = dom->next)
+		if (dom->last_seen != enum_pass && !dom->is_dead)
+			shutdown_domain(dom);
 }
 
 static int ring_free_bytes(struct console *con)
@@ -1001,12 +1269,39 @@ static int ring_free_bytes(struct console *con)
 	return (sizeof(intf->in) - space);
 }
 
+/* Wait for the events con can make progress on in its current state. */
+static void console_update_io(struct console *con)
+{
+	short events = 0;
+
+	if (con->xce_handle != NULL && !con->throttled &&
+	    buffer_available(con))
+		events = POLLIN|POLLPRI;
+	io_set(&con->xce_src,
+	       con->xce_handle ? xenevtchn_fd(con->xce_handle) : -1, events);
+
+	events = 0;
+	if (con->master_fd != -1) {
+		if (!con->d->is_dead && con->interface &&
+		    ring_free_bytes(con))
+			events |= POLLIN;
+
+		if (!buffer_empty(&con->buffer))
+			events |= POLLOUT;
+
+		if (events)
+			events |= POLLPRI;
+	}
+	io_set(&con->master_src, con->master_fd, events);
+}
+
 static void console_handle_broken_tty(struct console *con, int recreate)
 {
 	console_close_tty(con);
 
 	if (recreate) {
 		console_create_tty(con);
+		console_update_io(con);
 	} else {
 		shutdown_domain(con->d);
 	}
@@ -1037,7 +1332,9 @@ static void handle_tty_read(struct console *con)
 	 * is no problem, but Linux can't handle this usefully, so we
 	 * keep the slave open for the duration.
 	 */
-	if (len < 0) {
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		/* Stale readiness of a tty recreated meanwhile. */
+	} else if (len < 0) {
 		console_handle_broken_tty(con, domain_is_valid(dom->domid));
 	} else if (domain_is_valid(dom->domid)) {
 		prod = intf->in_prod;
@@ -1064,7 +1361,9 @@ static void handle_tty_write(struct console *con)
 
 	len = write(con->master_fd, con->buffer.data + con->buffer.consumed,
 		    con->buffer.size - con->buffer.consumed);
- 	if (len < 1) {
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		/* Stale readiness of a tty recreated meanwhile. */
+	} else if (len < 1) {
 		dolog(LOG_DEBUG, "Write failed on domain %d: %zd, %d\n",
 		      dom->domid, len, errno);
 		console_handle_broken_tty(con, domain_is_valid(dom->domid));
@@ -1073,25 +1372,59 @@ static void handle_tty_write(struct console *con)
 	}
 }
 
-static void console_evtchn_unmask(struct console *con, void *data)
+static long long now_ms(void)
 {
-	long long now = *(long long *)data;
+	struct timespec ts;
 
-	if (!console_enabled(con))
-		return;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return -1;
+
+	return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/*
+ * CS 16257:955ee4fa1345 introduces a 5ms fuzz for select(), it is not clear
+ * poll() has similar behavior (returning a couple of ms sooner than
+ * requested) as well. Just leave the fuzz here. Remove it with a separate
+ * patch if necessary
+ */
+static bool console_period_over(struct console *con, long long now)
+{
+	if ((now+5) <= con->next_period)
+		return false;
+
+	con->next_period = now + RATE_LIMIT_PERIOD;
+	con->event_count = 0;
+
+	return true;
+}
 
-	/* CS 16257:955ee4fa1345 introduces a 5ms fuzz
-	 * for select(), it is not clear poll() has
-	 * similar behavior (returning a couple of ms
-	 * sooner than requested) as well. Just leave
-	 * the fuzz here. Remove it with a separate
-	 * patch if necessary */
-	if ((now+5) > con->next_period) {
-		con->next_period = now + RATE_LIMIT_PERIOD;
-		if (con->event_count >= RATE_LIMIT_ALLOWANCE)
+/*
+ * Re-enable the rate limited consoles whose period is over.  Returns the
+ * end of the earliest period still running, or 0 if there is none.
+ */
+static long long unthrottle_consoles(long long now)
+{
+	struct console **pp = &throttled_head, *con;
+	long long next_timeout = 0;
+
+	while ((con = *pp) != NULL) {
+		if (!console_period_over(con, now)) {
+			/* Determine if we're going to be the next time slice to expire */
+			if (!next_timeout || con->next_period < next_timeout)
+				next_timeout = con->next_period;
+			pp = &con->next_throttled;
+			continue;
+		}
+
+		*pp = con->next_throttled;
+		con->throttled = false;
+		if (console_enabled(con))
 			(void)xenevtchn_unmask(con->xce_handle, con->local_port);
-		con->event_count = 0;
+		console_update_io(con);
 	}
+
+	return next_timeout;
 }
 
 static void handle_ring_read(struct console *con)
@@ -1111,27 +1444,27 @@ static void handle_ring_read(struct console *con)
 		return;
 	}
 
+	console_period_over(con, now_ms());
 	con->event_count++;
 
 	buffer_append(con);
 
 	if (con->event_count < RATE_LIMIT_ALLOWANCE)
 		(void)xenevtchn_unmask(con->xce_handle, port);
+	else if (!con->throttled) {
+		con->throttled = true;
+		con->next_throttled = throttled_head;
+		throttled_head = con;
+	}
 }
 
-static void handle_console_ring(struct console *con)
+static void handle_console_ring(struct console *con, short revents)
 {
-	if (con->event_count < RATE_LIMIT_ALLOWANCE) {
-		if (con->xce_handle != NULL &&
-		    con->xce_pollfd_idx != -1 &&
-		    !(fds[con->xce_pollfd_idx].revents &
-		      ~(POLLIN|POLLOUT|POLLPRI)) &&
-		    (fds[con->xce_pollfd_idx].revents &
-		     POLLIN))
-			handle_ring_read(con);
-	}
+	if (!con->throttled && con->xce_handle != NULL &&
+	    !(revents & ~(POLLIN|POLLOUT|POLLPRI)) && (revents & POLLIN))
+		handle_ring_read(con);
 
-	con->xce_pollfd_idx = -1;
+	console_update_io(con);
 }
 
 static void handle_xs(void)
@@ -1218,109 +1551,51 @@ static void handle_log_reload(void)
 	}
 }
 
-/* Returns index inside fds array if succees, -1 if fail */
-static int set_fds(int fd, short events)
+static void handle_console_tty(struct console *con, short revents)
 {
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd  *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
-
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
-
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd) * (newsize-current_array_size));
-		current_array_size = newsize;
-	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
-}
-
-static void reset_fds(void)
-{
-	nr_fds = 0;
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-}
-
-static void maybe_add_console_evtchn_fd(struct console *con, void *data)
-{
-	long long next_timeout = *((long long *)data);
-
-	if (con->event_count >= RATE_LIMIT_ALLOWANCE) {
-		/* Determine if we're going to be the next time slice to expire */
-		if (!next_timeout ||
-		    con->next_period < next_timeout)
-			next_timeout = con->next_period;
-	} else if (con->xce_handle != NULL) {
-		if (buffer_available(con)) {
-			int evtchn_fd = xenevtchn_fd(con->xce_handle);
-			con->xce_pollfd_idx = set_fds(evtchn_fd,
-						      POLLIN|POLLPRI);
+	if (con->master_fd != -1) {
+		if (revents & ~(POLLIN|POLLOUT|POLLPRI))
+			console_handle_broken_tty(con, domain_is_valid(con->d->domid));
+		else {
+			if (revents & POLLIN)
+				handle_tty_read(con);
+			if (con->master_fd != -1 && (revents & POLLOUT))
+				handle_tty_write(con);
 		}
 	}
 
-	*((long long *)data) = next_timeout;
+	console_update_io(con);
 }
 
-static void maybe_add_console_tty_fd(struct console *con)
+static void cleanup_dead_domains(void)
 {
-	if (con->master_fd != -1) {
-		short events = 0;
-		if (!con->d->is_dead && ring_free_bytes(con))
-			events |= POLLIN;
+	struct domain *d, *n;
 
-		if (!buffer_empty(&con->buffer))
-			events |= POLLOUT;
-
-		if (events)
-			con->master_pollfd_idx =
-				set_fds(con->master_fd, events|POLLPRI);
+	for (d = dom_head; d; d = n) {
+		n = d->next;
+		if (d->is_dead)
+			cleanup_domain(d);
 	}
-}
 
-static void handle_console_tty(struct console *con)
-{
-	if (con->master_fd != -1 && con->master_pollfd_idx != -1) {
-		if (fds[con->master_pollfd_idx].revents &
-		    ~(POLLIN|POLLOUT|POLLPRI))
-			console_handle_broken_tty(con, domain_is_valid(con->d->domid));
-		else {
-			if (fds[con->master_pollfd_idx].revents &
-			    POLLIN)
-				handle_tty_read(con);
-			if (fds[con->master_pollfd_idx].revents &
-			    POLLOUT)
-				handle_tty_write(con);
-		}
-	}
-	con->master_pollfd_idx = -1;
+	domains_dead = false;
 }
 
 void handle_io(void)
 {
 	int ret;
 	xenevtchn_port_or_error_t log_hv_evtchn = -1;
-	int xce_pollfd_idx = -1;
-	int xs_pollfd_idx = -1;
+	struct io_source xs_src, xce_src;
 	xenevtchn_handle *xce_handle = NULL;
 
+	io_source_init(&xs_src, IO_XS, NULL);
+	io_source_init(&xce_src, IO_HV_LOG, NULL);
+
+	if (io_init()) {
+		dolog(LOG_ERR, "Failed to set up waiting for events: %d (%s)",
+		      errno, strerror(errno));
+		goto out;
+	}
+
 	if (log_hv) {
 		xce_handle = xenevtchn_open(NULL, 0);
 		if (xce_handle == NULL) {
@@ -1355,37 +1630,23 @@ void handle_io(void)
 		goto out;
 	}
 
+	io_set(&xs_src, xs_fileno(xs), POLLIN|POLLPRI);
+	if (log_hv)
+		io_set(&xce_src, xenevtchn_fd(xce_handle), POLLIN|POLLPRI);
+
 	enum_domains();
 
 	for (;;) {
-		struct domain *d, *n;
-		int poll_timeout; /* timeout in milliseconds */
-		struct timespec ts;
-		long long now, next_timeout = 0;
-
-		reset_fds();
+		int i, poll_timeout; /* timeout in milliseconds */
+		long long now, next_timeout;
 
-		xs_pollfd_idx = set_fds(xs_fileno(xs), POLLIN|POLLPRI);
-
-		if (log_hv)
-			xce_pollfd_idx = set_fds(xenevtchn_fd(xce_handle),
-						 POLLIN|POLLPRI);
-
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		now = now_ms();
+		if (now < 0)
 			break;
-		now = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 
 		/* Re-calculate any event counter allowances & unblock
 		   domains with new allowance */
-		for (d = dom_head; d; d = d->next) {
-
-			console_iter_void_arg2(d, console_evtchn_unmask, (void *)&now);
-
-			console_iter_void_arg2(d, maybe_add_console_evtchn_fd, 
-					       (void *)&next_timeout);
-
-			console_iter_void_arg1(d, maybe_add_console_tty_fd);
-		}
+		next_timeout = unthrottle_consoles(now);
 
 		/* If any domain has been rate limited, we need to work
 		   out what timeout to supply to poll */
@@ -1396,7 +1657,7 @@ void handle_io(void)
 			poll_timeout = (int)duration;
 		}
 
-		ret = poll(fds, nr_fds, next_timeout ? poll_timeout : -1);
+		ret = io_wait(next_timeout ? poll_timeout : -1);
 
 		if (log_reload) {
 			int saved_errno = errno;
@@ -1417,53 +1678,56 @@ void handle_io(void)
 			break;
 		}
 
-		if (log_hv && xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xce_handle: %d (%s)",
-				      errno, strerror(errno));
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN)
-				handle_hv_logs(xce_handle, false);
-
-			xce_pollfd_idx = -1;
-		}
+		for (i = 0; i < ret; i++) {
+			struct io_source *src = io_ready[i].src;
+			short revents = io_ready[i].revents;
 
-		if (ret <= 0)
-			continue;
+			/* Stopped waiting while handling an earlier one. */
+			if (!src->events)
+				continue;
 
-		if (xs_pollfd_idx != -1) {
-			if (fds[xs_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xs_handle: %d (%s)",
-				      errno, strerror(errno));
+			switch (src->type) {
+			case IO_XS:
+				if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+					dolog(LOG_ERR,
+					      "Failure in poll xs_handle: %d (%s)",
+					      errno, strerror(errno));
+					goto out_loop;
+				} else if (revents & POLLIN)
+					handle_xs();
 				break;
-			} else if (fds[xs_pollfd_idx].revents & POLLIN)
-				handle_xs();
-
-			xs_pollfd_idx = -1;
-		}
-
-		for (d = dom_head; d; d = n) {
-
-			n = d->next;
 
-			console_iter_void_arg1(d, handle_console_ring);
-
-			console_iter_void_arg1(d, handle_console_tty);
+			case IO_HV_LOG:
+				if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+					dolog(LOG_ERR,
+					      "Failure in poll xce_handle: %d (%s)",
+					      errno, strerror(errno));
+					goto out_loop;
+				} else if (revents & POLLIN)
+					handle_hv_logs(xce_handle, false);
+				break;
 
-			if (d->last_seen != enum_pass)
-				shutdown_domain(d);
+			case IO_CONSOLE_RING:
+				handle_console_ring(src->con, revents);
+				break;
 
-			if (d->is_dead)
-				cleanup_domain(d);
+			case IO_CONSOLE_TTY:
+				handle_console_tty(src->con, revents);
+				break;
+			}
 		}
+
+		/* Only free domains once no ready event refers to them. */
+		if (domains_dead)
+			cleanup_dead_domains();
 	}
 
-	free(fds);
-	current_array_size = 0;
+ out_loop:
+	io_set(&xs_src, -1, 0);
+	io_set(&xce_src, -1, 0);
 
  out:
+	io_exit();
 	if (log_hv_fd != -1) {
 		close(log_hv_fd);
 		log_hv_fd = -1;
@@ -736,6 +736,7 @@ x.ColoProxyScript = C.GoString(xc.colo_proxy_script)
 if err := x.UserspaceColoProxy.fromC(&xc.userspace_colo_proxy);err != nil {
 return fmt.Errorf("converting field UserspaceColoProxy: %v", err)
 }
+x.Workers = uint32(xc.workers)
 
  return nil}
 
@@ -751,6 +752,40 @@ xc.colo_proxy_script = C.CString(x.ColoProxyScript)}
 if err := x.UserspaceColoProxy.toC(&xc.userspace_colo_proxy); err != nil {
 return fmt.Errorf("converting field UserspaceColoProxy: %v", err)
 }
+xc.workers = C.uint32_t(x.Workers)
+
+ return nil
+ }
+
+// NewDomainSaveParams returns an instance of DomainSaveParams initialized with defaults.
+func NewDomainSaveParams() (*DomainSaveParams, error) {
+var (
+x DomainSaveParams
+xc C.libxl_domain_save_params)
+
+C.libxl_domain_save_params_init(&xc)
+defer C.libxl_domain_save_params_dispose(&xc)
+
+if err := x.fromC(&xc); err != nil {
+return nil, err }
+
+return &x, nil}
+
+func (x *DomainSaveParams) fromC(xc *C.libxl_domain_save_params) error {
+ x.Workers = uint32(xc.workers)
+x.Compression = SaveCompression(xc.compression)
+x.DeltaCacheMb = uint32(xc.delta_cache_mb)
+
+ return nil}
+
+func (x *DomainSaveParams) toC(xc *C.libxl_domain_save_params) (err error){defer func(){
+if err != nil{
+C.libxl_domain_save_params_dispose(xc)}
+}()
+
+xc.workers = C.uint32_t(x.Workers)
+xc.compression = C.libxl_save_compression(x.Compression)
+xc.delta_cache_mb = C.uint32_t(x.DeltaCacheMb)
 
  return nil
  }
@@ -3857,6 +3892,7 @@ return &x, nil}
 func (x *Numainfo) fromC(xc *C.libxl_numainfo) error {
  x.Size = uint64(xc.size)
 x.Free = uint64(xc.free)
+x.Dirty = uint64(xc.dirty)
 x.Dists = nil
 if n := int(xc.num_dists); n > 0 {
 cDists := (*[1<<28]C.uint32_t)(unsafe.Pointer(xc.dists))[:n:n]
@@ -3875,6 +3911,7 @@ C.libxl_numainfo_dispose(xc)}
 
 xc.size = C.uint64_t(x.Size)
 xc.free = C.uint64_t(x.Free)
+xc.dirty = C.uint64_t(x.Dirty)
 if numDists := len(x.Dists); numDists > 0 {
 xc.dists = (*C.uint32_t)(C.malloc(C.size_t(numDists*numDists)))
 xc.num_dists = C.int(numDists)
@@ -443,6 +443,20 @@ CheckpointedStream int
 StreamVersion uint32
 ColoProxyScript string
 UserspaceColoProxy Defbool
+Workers uint32
+}
+
+type SaveCompression int
+const(
+SaveCompressionNone SaveCompression = 0
+SaveCompressionZero SaveCompression = 1
+SaveCompressionLz4 SaveCompression = 2
+)
+
+type DomainSaveParams struct {
+Workers uint32
+Compression SaveCompression
+DeltaCacheMb uint32
 }
 
 type SchedParams struct {
@@ -488,6 +502,7 @@ type TeeType int
 const(
 TeeTypeNone TeeType = 0
 TeeTypeOptee TeeType = 1
+TeeTypeFfa TeeType = 2
 )
 
 type SveType int
@@ -1160,6 +1175,7 @@ Rref int
 type Numainfo struct {
 Size uint64
 Free uint64
+Dirty uint64
 Dists []uint32
 }
 
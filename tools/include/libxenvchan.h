@@ -42,6 +42,7 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#include <sys/uio.h>
 #include <xen/io/libxenvchan.h>
 #include <xen/xen.h>
 #include <xen/sys/evtchn.h>
@@ -84,6 +85,8 @@ struct libxenvchan {
 	unsigned int server_persist:1;
 	/* true if operations should block instead of returning 0 */
 	unsigned int blocking:1;
+	/* VCHAN_NOTIFY_* events held back by LIBXENVCHAN_DEFER_NOTIFY */
+	unsigned int notify_deferred:2;
 	/* communication rings */
 	struct libxenvchan_ring read, write;
 	/**
@@ -158,6 +161,72 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size);
  *         the vchan is nonblocking)
  */
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
+/**
+ * Scatter-gather versions of libxenvchan_read() and libxenvchan_write(): the
+ * stream is consumed into, or produced from, the buffers of the $iov array in
+ * order.  At most one notification is sent to the peer per ring update.
+ * @param ctrl The vchan control structure
+ * @param iov Array of buffers
+ * @param iovcnt Number of entries in $iov
+ * @return -1 on error, otherwise the amount of data transferred (which may be
+ *         zero if the vchan is nonblocking)
+ */
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov,
+                      int iovcnt);
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov,
+                       int iovcnt);
+
+/**
+ * Zero-copy access to the rings.  libxenvchan_read_begin() returns the data
+ * ready to be read, and libxenvchan_write_begin() the free space of the write
+ * ring, as (at most) two regions of the shared ring itself: the second one is
+ * only non-empty when the area wraps around the end of the ring.  The caller
+ * consumes from or produces into these regions in place, then releases the
+ * data read, or publishes the data written, with the matching _commit()
+ * call.  The regions stay valid until then, and no other read (respectively
+ * write) operation may be issued in between.
+ *
+ * The _begin() calls block if the vchan is blocking and no data (space) is
+ * available at all; they never return more than $size bytes.
+ *
+ * @param ctrl The vchan control structure
+ * @param iov Array of two entries, filled with the ring regions
+ * @param size Maximum amount of data (space) wanted
+ * @return -1 on error, otherwise the total size of the regions (which may be
+ *         zero if the vchan is nonblocking)
+ */
+int libxenvchan_read_begin(struct libxenvchan *ctrl, struct iovec iov[2],
+                           size_t size);
+int libxenvchan_write_begin(struct libxenvchan *ctrl, struct iovec iov[2],
+                            size_t size);
+
+/*
+ * Don't notify the peer on commit, but remember to do so on the next commit
+ * without this flag, on libxenvchan_flush() or libxenvchan_wait(), or when
+ * the vchan is closed.  Lets a batch of commits get away with a single event.
+ */
+#define LIBXENVCHAN_DEFER_NOTIFY 0x1
+
+/**
+ * Release $size bytes read from the regions given by libxenvchan_read_begin(),
+ * or publish $size bytes written to the regions given by
+ * libxenvchan_write_begin().
+ * @param ctrl The vchan control structure
+ * @param size Amount of data consumed or produced, from the start of the
+ *        regions; may be less than what _begin() returned
+ * @param flags LIBXENVCHAN_DEFER_NOTIFY or 0
+ * @return -1 on error (including $size exceeding the regions), 0 on success
+ */
+int libxenvchan_read_commit(struct libxenvchan *ctrl, size_t size,
+                            unsigned int flags);
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size,
+                             unsigned int flags);
+/**
+ * Send the notifications deferred by LIBXENVCHAN_DEFER_NOTIFY commits.
+ * @return -1 on error, 0 on success
+ */
+int libxenvchan_flush(struct libxenvchan *ctrl);
+
 /**
  * Waits for reads or writes to unblock, or for a close
  */
@@ -1445,6 +1445,54 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_CREATEINFO_XEND_SUSPEND_EVTCHN_COMPAT
 
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS
+ *
+ * If this is defined, libxl_domain_suspend_params() is available.  It takes
+ * a libxl_domain_save_params to tune the save/migration stream.  The
+ * 'workers' member sets the number of threads copying page data while the
+ * stream is written; 0 saves serially.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_SAVE_PARAMS_COMPRESSION
+ *
+ * If this is defined, libxl_domain_save_params has a 'compression' member
+ * selecting how page data is encoded in the stream.  Anything other than
+ * LIBXL_SAVE_COMPRESSION_NONE produces a stream which can only be restored
+ * by a libxl defining this macro.
+ */
+#define LIBXL_HAVE_DOMAIN_SAVE_PARAMS_COMPRESSION 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_SAVE_PARAMS_DELTA_CACHE
+ *
+ * If this is defined, libxl_domain_save_params has a 'delta_cache_mb' member.
+ * When non-zero, a live save keeps a cache of that many MiB of transmitted
+ * pages, and sends pages dirtied again in later iterations as deltas against
+ * it.  Such a stream can only be restored by a libxl defining this macro.
+ */
+#define LIBXL_HAVE_DOMAIN_SAVE_PARAMS_DELTA_CACHE 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_RESTORE_PARAMS_WORKERS
+ *
+ * If this is defined, libxl_domain_restore_params contains a 'workers'
+ * member setting the number of threads copying page data into the guest
+ * while the stream is read.  0 restores serially.
+ */
+#define LIBXL_HAVE_DOMAIN_RESTORE_PARAMS_WORKERS 1
+
+/*
+ * LIBXL_HAVE_NUMAINFO_DIRTY
+ *
+ * If this is defined, libxl_numainfo contains a 'dirty' member: the part of
+ * 'free' which has not been scrubbed yet.  Allocating it may first require
+ * clearing it, so 'free' - 'dirty' is the memory immediately available.
+ */
+#define LIBXL_HAVE_NUMAINFO_DIRTY 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1804,6 +1852,12 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
 
+int libxl_domain_suspend_params(libxl_ctx *ctx, uint32_t domid, int fd,
+                                int flags, /* LIBXL_SUSPEND_* */
+                                const libxl_domain_save_params *params,
+                                const libxl_asyncop_how *ao_how)
+                                LIBXL_EXTERNAL_CALLERS_ONLY;
+
 /*
  * Only suspend domain, do not save its state to file, do not destroy it.
  * Suspended domain can be resumed with libxl_domain_resume()
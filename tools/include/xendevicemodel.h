@@ -51,6 +51,24 @@ int xendevicemodel_create_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
     ioservid_t *id);
 
+/**
+ * This function instantiates an IOREQ Server, choosing the layout of its
+ * buffered ioreq ring.
+ *
+ * @parm dmod a handle to an open devicemodel interface.
+ * @parm domid the domain id to be serviced
+ * @parm handle_bufioreq how should the IOREQ Server handle buffered
+ *                       requests (HVM_IOREQSRV_BUFIOREQ_*)?
+ * @parm flags XEN_DMOP_bufioreq_ext for an extended buffered ioreq ring,
+ *             with notification suppression, or 0.
+ * @parm bufioreq_order the size of an extended ring, as a page order.
+ * @parm id pointer to an ioservid_t to receive the IOREQ Server id.
+ * @return 0 on success, -1 on failure.
+ */
+int xendevicemodel_create_ioreq_server_ext(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    unsigned int flags, unsigned int bufioreq_order, ioservid_t *id);
+
 /**
  * This function retrieves the necessary information to allow an
  * emulator to use an IOREQ Server.
@@ -365,6 +383,22 @@ int xendevicemodel_pin_memory_cacheattr(
 int xendevicemodel_nr_vcpus(
     xendevicemodel_handle *dmod, domid_t domid, unsigned int *vcpus);
 
+/**
+ * This function retrieves the buffered ioreq ring statistics of an IOREQ
+ * Server.
+ *
+ * @parm dmod a handle to an open devicemodel interface.
+ * @parm domid the domain id to be serviced
+ * @parm id the IOREQ Server id.
+ * @parm reset whether to reset the statistics once they have been read.
+ * @parm stats pointer to a xen_dm_op_get_ioreq_server_stats_t to receive
+ *             the statistics.
+ * @return 0 on success, -1 on failure.
+ */
+int xendevicemodel_get_ioreq_server_stats(
+    xendevicemodel_handle *dmod, domid_t domid, ioservid_t id, int reset,
+    xen_dm_op_get_ioreq_server_stats_t *stats);
+
 /**
  * This function restricts the use of this handle to the specified
  * domain.
@@ -439,6 +439,8 @@ struct precopy_stats
     unsigned int iteration;
     unsigned long total_written;
     long dirty_count; /* -1 if unknown */
+    unsigned long throughput; /* KiB/s of page data in the last iteration,
+                               * 0 if unknown */
 };
 
 /*
@@ -517,6 +519,48 @@ typedef enum {
     XC_STREAM_COLO,
 } xc_stream_type_t;
 
+/* Optional tuning of xc_domain_save(). */
+struct save_params {
+    /*
+     * Number of threads normalising and copying page data, while guest
+     * frames are being mapped and the stream is being written concurrently.
+     * 0 saves serially.
+     */
+    unsigned int nr_workers;
+#define XGS_MAX_WORKERS 64
+
+    /*
+     * Encoding of the page data.  Anything other than XGS_COMPRESS_NONE
+     * produces a stream which older versions of libxenguest cannot restore.
+     */
+    unsigned int compression;
+#define XGS_COMPRESS_NONE 0 /* Send every page in full. */
+#define XGS_COMPRESS_ZERO 1 /* Elide pages which are entirely zero. */
+#define XGS_COMPRESS_LZ4  2 /* Elide zero pages, and LZ4 each batch. */
+
+    /*
+     * Size in MiB of a cache of transmitted pages, from which pages dirtied
+     * again during a live migration are sent as deltas.  0 disables this.
+     * Not supported with XC_STREAM_COLO.  As with compression, the stream
+     * cannot be restored by older versions of libxenguest.
+     */
+    unsigned int delta_cache_mb;
+
+    /*
+     * Post-copy live migration.  Once the precopy policy stops iterating,
+     * the guest is resumed on the destination after sending only the pages
+     * it needs to start, and its vcpu and device state.  The remaining dirty
+     * pages are then sent as the destination faults on them, and pushed in
+     * the background.  Switchover downtime is then bounded, regardless of
+     * the guest's dirty rate, but the guest is lost should the stream fail
+     * after switchover.
+     *
+     * Requires an HVM guest, XC_STREAM_PLAIN and a recv_fd back channel.
+     * The destination must support mem_paging (HAP, and no passthrough).
+     */
+    bool postcopy;
+};
+
 /**
  * This function will save a running domain.
  *
@@ -526,13 +570,15 @@ typedef enum {
  * @param flags XCFLAGS_xxx
  * @param stream_type XC_STREAM_PLAIN if the far end of the stream
  *        doesn't use checkpointing
- * @param recv_fd Only used for XC_STREAM_COLO.  Contains backchannel from
- *        the destination side.
+ * @param recv_fd Only used for XC_STREAM_COLO, and for post-copy migration.
+ *        Contains backchannel from the destination side.
+ * @param params optional tuning, or NULL for the defaults
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags, struct save_callbacks *callbacks,
-                   xc_stream_type_t stream_type, int recv_fd);
+                   xc_stream_type_t stream_type, int recv_fd,
+                   const struct save_params *params);
 
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
@@ -554,6 +600,10 @@ struct restore_callbacks {
      * Called after the secondary vm is ready to resume.
      * Callback function resumes the guest & the device model,
      * returns to xc_domain_restore.
+     *
+     * Also called, after restore_results, when a post-copy stream switches
+     * over.  xc_domain_restore then continues to receive the guest's
+     * remaining memory while it runs.  Returns 1 on success.
      */
     int (*postcopy)(void *data);
 
@@ -587,6 +637,17 @@ struct restore_callbacks {
     void *data;
 };
 
+/* Optional tuning of xc_domain_restore(). */
+struct restore_params {
+    /*
+     * Number of threads mapping and copying page data into the guest, while
+     * the stream is read and the physmap populated concurrently.  0 restores
+     * serially.
+     */
+    unsigned int nr_workers;
+#define XGR_MAX_WORKERS 64
+};
+
 /**
  * This function will restore a saved domain.
  *
@@ -605,8 +666,9 @@ struct restore_callbacks {
  *        checkpointing
  * @param callbacks non-NULL to receive a callback to restore toolstack
  *        specific data
- * @param send_back_fd Only used for XC_STREAM_COLO.  Contains backchannel to
- *        the source side.
+ * @param send_back_fd Only used for XC_STREAM_COLO, and for post-copy
+ *        migration.  Contains backchannel to the source side.
+ * @param params optional tuning, or NULL for the defaults
  * @return 0 on success, -1 on failure
  */
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
@@ -614,7 +676,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       uint32_t store_domid, unsigned int console_evtchn,
                       unsigned long *console_mfn, uint32_t console_domid,
                       xc_stream_type_t stream_type,
-                      struct restore_callbacks *callbacks, int send_back_fd);
+                      struct restore_callbacks *callbacks, int send_back_fd,
+                      const struct restore_params *params);
 
 /**
  * This function will create a domain for a paravirtualized Linux
@@ -128,6 +128,32 @@ bool xs_mkdir(struct xs_handle *h, xs_transaction_t t,
 bool xs_rm(struct xs_handle *h, xs_transaction_t t,
 	   const char *path);
 
+/* Pipelined requests.
+ * Rather than waiting for each reply in turn, several requests can be sent
+ * on the same handle and their replies collected afterwards.  The submit
+ * functions take the same arguments as their synchronous counterparts and
+ * return a request id for xs_collect(), or 0 on failure.
+ */
+uint32_t xs_read_submit(struct xs_handle *h, xs_transaction_t t,
+			const char *path);
+uint32_t xs_write_submit(struct xs_handle *h, xs_transaction_t t,
+			 const char *path, const void *data, unsigned int len);
+uint32_t xs_mkdir_submit(struct xs_handle *h, xs_transaction_t t,
+			 const char *path);
+uint32_t xs_rm_submit(struct xs_handle *h, xs_transaction_t t,
+		      const char *path);
+
+/* Wait for the reply to a submitted request, which is consumed.
+ * Replies may be collected in any order, but every request id must be
+ * collected exactly once, or its reply is kept until the handle is closed.
+ * Returns a malloced value, nul terminated, as xs_read() does (for the
+ * other requests it is the daemon's acknowledgement): call free() on it
+ * after use.  len indicates length in bytes, not including terminator.
+ * Returns NULL on failure, with errno set from the daemon's reply, or to
+ * EINVAL for an id not returned by a submit function or already collected.
+ */
+void *xs_collect(struct xs_handle *h, uint32_t req_id, unsigned int *len);
+
 /* Fake function which will always return false (required to let
  * libxenstore remain at 3.0 version.
  */
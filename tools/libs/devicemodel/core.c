@@ -168,6 +168,14 @@ static int xendevicemodel_op(
 int xendevicemodel_create_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
     ioservid_t *id)
+{
+    return xendevicemodel_create_ioreq_server_ext(dmod, domid,
+                                                  handle_bufioreq, 0, 0, id);
+}
+
+int xendevicemodel_create_ioreq_server_ext(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    unsigned int flags, unsigned int bufioreq_order, ioservid_t *id)
 {
     struct xen_dm_op op;
     struct xen_dm_op_create_ioreq_server *data;
@@ -179,6 +187,8 @@ int xendevicemodel_create_ioreq_server(
     data = &op.u.create_ioreq_server;
 
     data->handle_bufioreq = handle_bufioreq;
+    data->flags = flags;
+    data->bufioreq_order = bufioreq_order;
 
     rc = xendevicemodel_op(dmod, domid, 1, &op, sizeof(op));
     if (rc)
@@ -645,6 +655,32 @@ int xendevicemodel_nr_vcpus(
     return 0;
 }
 
+int xendevicemodel_get_ioreq_server_stats(
+    xendevicemodel_handle *dmod, domid_t domid, ioservid_t id, int reset,
+    xen_dm_op_get_ioreq_server_stats_t *stats)
+{
+    struct xen_dm_op op;
+    struct xen_dm_op_get_ioreq_server_stats *data;
+    int rc;
+
+    memset(&op, 0, sizeof(op));
+
+    op.op = XEN_DMOP_get_ioreq_server_stats;
+    data = &op.u.get_ioreq_server_stats;
+
+    data->id = id;
+    if (reset)
+        data->flags |= XEN_DMOP_stats_reset;
+
+    rc = xendevicemodel_op(dmod, domid, 1, &op, sizeof(op));
+    if (rc)
+        return rc;
+
+    *stats = *data;
+
+    return 0;
+}
+
 int xendevicemodel_restrict(xendevicemodel_handle *dmod, domid_t domid)
 {
     return osdep_xendevicemodel_restrict(dmod, domid);
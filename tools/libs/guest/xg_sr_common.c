@@ -39,6 +39,11 @@ static const char *const mandatory_rec_types[] =
     [REC_TYPE_STATIC_DATA_END]              = "Static data end",
     [REC_TYPE_X86_CPUID_POLICY]             = "x86 CPUID policy",
     [REC_TYPE_X86_MSR_POLICY]               = "x86 MSR policy",
+    [REC_TYPE_COMPRESSED_PAGE_DATA]         = "Compressed page data",
+    [REC_TYPE_PAGE_DELTA]                   = "Page delta",
+    [REC_TYPE_POSTCOPY_PFNS]                = "Post-copy pfns",
+    [REC_TYPE_POSTCOPY_TRANSITION]          = "Post-copy transition",
+    [REC_TYPE_POSTCOPY_FAULT]               = "Post-copy fault",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -154,6 +159,8 @@ static void __attribute__((unused)) build_assertions(void)
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_tsc_info)      != 24);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_hvm_params_entry)  != 16);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_hvm_params)        != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_compressed_page_data_header) != 16);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_page_delta_header) != 8);
 }
 
 /*
@@ -96,6 +96,14 @@ struct xc_sr_save_ops
      */
     int (*check_vm_state)(struct xc_sr_context *ctx);
 
+    /**
+     * Set the bits in 'bitmap' (of p2m_size) for pfns which must be present
+     * before the guest can run on the destination, e.g. those used by the
+     * toolstack or Xen.  In a post-copy migration, these are sent ahead of
+     * the switchover rather than on demand.
+     */
+    int (*postcopy_resident)(struct xc_sr_context *ctx, unsigned long *bitmap);
+
     /**
      * Clean up the local environment.  Will be called exactly once, either
      * after a successful save, or upon encountering an error.
@@ -132,6 +140,10 @@ struct xc_sr_restore_ops
      * 'page' is expected to be modified in-place if a transformation is
      * required.
      *
+     * When restoring with page copy workers, calls for NOTAB pages may run
+     * concurrently.  Calls for all other types are serialised against each
+     * other and against populate_pfns().
+     *
      * @returns 0 for success, -1 for failure, with errno appropriately set.
      */
     int (*localise_page)(struct xc_sr_context *ctx, uint32_t type, void *page);
@@ -211,6 +223,69 @@ static inline int update_blob(struct xc_sr_blob *blob,
     return 0;
 }
 
+/*
+ * A batch of pages on its way into the stream.  Each batch passes through
+ * three stages: looking up the types and mapping the guest frames,
+ * normalising (and when pipelined, copying) the page contents, and writing
+ * the PAGE_DATA record.
+ */
+struct xc_sr_save_batch
+{
+    enum {
+        XC_SR_BATCH_FREE,   /* Owned by the thread filling batches. */
+        XC_SR_BATCH_MAPPED, /* Mapped, waiting for a worker. */
+        XC_SR_BATCH_BUSY,   /* Being normalised and copied by a worker. */
+        XC_SR_BATCH_READY,  /* Waiting to be written to the stream. */
+    } state;
+
+    unsigned int nr_pfns;         /* Entries in pfns[]. */
+    unsigned int nr_pages;        /* Pages with data in the stream. */
+    unsigned int nr_pages_mapped; /* Size of guest_mapping, in pages. */
+
+    xen_pfn_t *pfns;
+    /* Gfns of the batch pfns, compacted to those mapped by stage 1. */
+    xen_pfn_t *mfns;
+    xen_pfn_t *types;
+    /* Errors from attempting to map the gfns. */
+    int *errors;
+    void *guest_mapping;
+    /* Pointers to page data to send.  Mapped gfns or local allocations. */
+    void **guest_data;
+    /* Pointers to locally allocated pages.  Need freeing. */
+    void **local_pages;
+    /*
+     * Local copy of the page data.  Only allocated when pipelined, or when
+     * compressing, as the compressor needs the data to be contiguous.
+     */
+    void *buffer;
+    /* Pages elided from the stream as they are entirely zero. */
+    unsigned int nr_zero_pages;
+    /* LZ4 compressed page data, and the compressor's working memory. */
+    void *compressed;
+    size_t compressed_len; /* 0 if the page data is sent uncompressed. */
+    void *lz4_wrkmem;
+    /* Pfn and type list of the PAGE_DATA record. */
+    uint64_t *rec_pfns;
+    unsigned int nr_rec_pfns;
+    /*
+     * Pages sent as deltas in a PAGE_DELTA record, rather than in the
+     * PAGE_DATA record.  delta_map is indexed like pfns[].
+     */
+    unsigned int nr_delta_pages;
+    unsigned long *delta_map;
+    uint64_t *delta_pfns;
+    uint32_t *delta_lengths;
+    void *delta_data;
+    size_t delta_data_len;
+    /* iovec[] for writev(). */
+    struct iovec *iov;
+};
+
+struct xc_sr_save_pipeline;
+struct xc_sr_restore_pipeline;
+struct xc_sr_restore_postcopy;
+struct xc_sr_delta_cache;
+
 struct xc_sr_context
 {
     xc_interface *xch;
@@ -246,6 +321,42 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /*
+             * Batches in flight.  A single batch when saving serially, or
+             * the ring of batches shared by the pipeline threads.
+             */
+            struct xc_sr_save_batch *batches;
+            unsigned int nr_batches;
+
+            /* Number of page copy workers.  0 to save serially. */
+            unsigned int nr_workers;
+            struct xc_sr_save_pipeline *pipeline;
+
+            /* Encoding of the page data, XGS_COMPRESS_*. */
+            unsigned int compression;
+
+            /*
+             * Cache of transmitted pages, if sending re-dirtied pages as
+             * deltas.  Filled from the first iteration, but deltas are only
+             * sent once every page has been sent once (delta_active).
+             */
+            struct xc_sr_delta_cache *delta_cache;
+            unsigned long delta_cache_size;
+            bool delta_active;
+            unsigned long nr_delta_pages;
+
+            /*
+             * Post-copy migration.  Pages still to be sent after the guest
+             * was resumed on the destination.
+             */
+            bool postcopy;
+            bool postcopy_transitioned;
+            unsigned long *postcopy_pfns;
+            unsigned long nr_postcopy_pfns;
+
+            /* Total size of the PAGE_DATA records written. */
+            uint64_t page_data_bytes;
         } save;
 
         struct /* Restore data. */
@@ -297,6 +408,13 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Number of page copy workers.  0 to restore serially. */
+            unsigned int nr_workers;
+            struct xc_sr_restore_pipeline *pipeline;
+
+            /* Demand paging state of a post-copy stream, once started. */
+            struct xc_sr_restore_postcopy *postcopy;
         } restore;
     };
 
@@ -448,6 +566,9 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
  * This would ideally be private in restore.c, but is needed by
  * x86_pv_localise_page() if we receive pagetables frames ahead of the
  * contents of the frames they point at.
+ *
+ * While page copy workers may be running, callers must hold the restore
+ * pipeline's p2m lock.
  */
 int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
                   const xen_pfn_t *original_pfns, const uint32_t *types);
@@ -455,6 +576,30 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
 /* Handle a STATIC_DATA_END record. */
 int handle_static_data_end(struct xc_sr_context *ctx);
 
+/*
+ * Sender's cache of transmitted page contents, for sending pages again as
+ * deltas.  See xg_sr_delta.c.
+ */
+struct xc_sr_delta_cache *delta_cache_alloc(struct xc_sr_context *ctx,
+                                            unsigned long size);
+void delta_cache_free(struct xc_sr_delta_cache *cache);
+
+/*
+ * Record 'page' as the last transmitted contents of 'pfn'.  If an older copy
+ * was cached and 'delta' is given, encode the difference into it, returning
+ * its length, or 0 if the page should be sent in full as the delta exceeds
+ * 'max'.
+ */
+unsigned int delta_cache_update(struct xc_sr_delta_cache *cache,
+                                xen_pfn_t pfn, const void *page,
+                                void *delta, unsigned int max);
+
+/* Forget 'pfn', as it is being sent other than in full or as a delta. */
+void delta_cache_invalidate(struct xc_sr_delta_cache *cache, xen_pfn_t pfn);
+
+/* Apply an encoded delta to a page.  Returns -1 if it is malformed. */
+int delta_apply(const void *delta, unsigned int len, void *page);
+
 /* Page type known to the migration logic? */
 static inline bool is_known_page_type(uint32_t type)
 {
@@ -0,0 +1,246 @@
+/*
+ * Delta encoding of pages for the migration stream.
+ *
+ * A page which is dirtied again during a live migration is frequently only
+ * changed in a few places.  The sender keeps a bounded cache of the contents
+ * it last transmitted for recently dirtied pages, and may send such a page as
+ * the XOR of its old and new contents, run length encoded:
+ *
+ *   { uleb128 unchanged, uleb128 changed, changed bytes XOR old }*
+ *
+ * Bytes following the final changed run are unchanged.
+ */
+
+#include <pthread.h>
+
+#include "xg_sr_common.h"
+
+/* Slots are protected by one of a fixed number of locks. */
+#define DELTA_CACHE_LOCKS 64
+
+/*
+ * Direct mapped cache of transmitted page contents, indexed by pfn.  A page
+ * is only ever being sent by one thread at a time, but pages sharing a slot
+ * may be handled concurrently by different pipeline workers.
+ */
+struct xc_sr_delta_cache
+{
+    unsigned long nr_slots; /* Power of 2. */
+    xen_pfn_t *pfns;        /* INVALID_PFN for an empty slot. */
+    void *pages;
+    pthread_mutex_t locks[DELTA_CACHE_LOCKS];
+};
+
+struct xc_sr_delta_cache *delta_cache_alloc(struct xc_sr_context *ctx,
+                                            unsigned long size)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_delta_cache *cache;
+    unsigned long i, nr_slots = 1;
+
+    while ( (nr_slots << 1) * PAGE_SIZE <= size )
+        nr_slots <<= 1;
+
+    cache = calloc(1, sizeof(*cache));
+    if ( !cache )
+        goto err;
+
+    cache->nr_slots = nr_slots;
+    cache->pfns = malloc(nr_slots * sizeof(*cache->pfns));
+    cache->pages = malloc(nr_slots * PAGE_SIZE);
+    if ( !cache->pfns || !cache->pages )
+        goto err;
+
+    for ( i = 0; i < nr_slots; ++i )
+        cache->pfns[i] = INVALID_PFN;
+
+    for ( i = 0; i < DELTA_CACHE_LOCKS; ++i )
+        pthread_mutex_init(&cache->locks[i], NULL);
+
+    DPRINTF("Delta cache of %lu pages", nr_slots);
+
+    return cache;
+
+ err:
+    ERROR("Unable to allocate a delta cache of %lu bytes", size);
+    if ( cache )
+    {
+        free(cache->pages);
+        free(cache->pfns);
+        free(cache);
+    }
+    return NULL;
+}
+
+void delta_cache_free(struct xc_sr_delta_cache *cache)
+{
+    unsigned int i;
+
+    if ( !cache )
+        return;
+
+    for ( i = 0; i < DELTA_CACHE_LOCKS; ++i )
+        pthread_mutex_destroy(&cache->locks[i]);
+
+    free(cache->pages);
+    free(cache->pfns);
+    free(cache);
+}
+
+static unsigned int put_uleb128(uint8_t *dst, unsigned int val)
+{
+    unsigned int len = 0;
+
+    do {
+        dst[len] = val & 0x7f;
+        val >>= 7;
+        if ( val )
+            dst[len] |= 0x80;
+        len++;
+    } while ( val );
+
+    return len;
+}
+
+static int get_uleb128(const uint8_t *src, unsigned int len,
+                       unsigned int *pos, unsigned int *val)
+{
+    unsigned int shift = 0;
+
+    *val = 0;
+
+    do {
+        if ( *pos >= len || shift > 28 )
+            return -1;
+
+        *val |= (src[*pos] & 0x7fU) << shift;
+        shift += 7;
+    } while ( src[(*pos)++] & 0x80 );
+
+    return 0;
+}
+
+/*
+ * Encode the difference between the old and new contents of a page.  Returns
+ * the length of the encoding, or 0 if it would exceed 'max'.  A page with no
+ * changes encodes to a single empty run.
+ */
+static unsigned int delta_encode(const uint8_t *old, const uint8_t *new,
+                                 uint8_t *dst, unsigned int max)
+{
+    uint8_t hdr[10];
+    unsigned int i = 0, len = 0, start, unchanged, changed, hdr_len;
+    uint64_t a, b;
+
+    while ( i < PAGE_SIZE )
+    {
+        start = i;
+
+        /* Skip unchanged words, then bytes. */
+        for ( ; i + sizeof(a) <= PAGE_SIZE; i += sizeof(a) )
+        {
+            memcpy(&a, old + i, sizeof(a));
+            memcpy(&b, new + i, sizeof(b));
+            if ( a != b )
+                break;
+        }
+        while ( i < PAGE_SIZE && old[i] == new[i] )
+            ++i;
+
+        if ( i == PAGE_SIZE && len )
+            break;
+
+        unchanged = i - start;
+        start = i;
+
+        while ( i < PAGE_SIZE && old[i] != new[i] )
+            ++i;
+
+        changed = i - start;
+
+        hdr_len = put_uleb128(hdr, unchanged);
+        hdr_len += put_uleb128(hdr + hdr_len, changed);
+
+        if ( len + hdr_len + changed > max )
+            return 0;
+
+        memcpy(dst + len, hdr, hdr_len);
+        len += hdr_len;
+
+        for ( ; start < i; ++start )
+            dst[len++] = old[start] ^ new[start];
+    }
+
+    return len;
+}
+
+unsigned int delta_cache_update(struct xc_sr_delta_cache *cache,
+                                xen_pfn_t pfn, const void *page,
+                                void *delta, unsigned int max)
+{
+    unsigned long slot = pfn & (cache->nr_slots - 1);
+    pthread_mutex_t *lock = &cache->locks[slot % DELTA_CACHE_LOCKS];
+    void *cached = cache->pages + slot * PAGE_SIZE;
+    unsigned int len = 0;
+
+    pthread_mutex_lock(lock);
+
+    if ( delta && cache->pfns[slot] == pfn )
+        len = delta_encode(cached, page, delta, max);
+
+    cache->pfns[slot] = pfn;
+    memcpy(cached, page, PAGE_SIZE);
+
+    pthread_mutex_unlock(lock);
+
+    return len;
+}
+
+void delta_cache_invalidate(struct xc_sr_delta_cache *cache, xen_pfn_t pfn)
+{
+    unsigned long slot = pfn & (cache->nr_slots - 1);
+    pthread_mutex_t *lock = &cache->locks[slot % DELTA_CACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+
+    if ( cache->pfns[slot] == pfn )
+        cache->pfns[slot] = INVALID_PFN;
+
+    pthread_mutex_unlock(lock);
+}
+
+int delta_apply(const void *delta, unsigned int len, void *page)
+{
+    const uint8_t *src = delta;
+    uint8_t *dst = page;
+    unsigned int pos = 0, off = 0, unchanged, changed;
+
+    while ( pos < len )
+    {
+        if ( get_uleb128(src, len, &pos, &unchanged) ||
+             get_uleb128(src, len, &pos, &changed) )
+            return -1;
+
+        if ( unchanged > PAGE_SIZE - off ||
+             changed > PAGE_SIZE - off - unchanged ||
+             changed > len - pos )
+            return -1;
+
+        off += unchanged;
+
+        for ( ; changed; --changed )
+            dst[off++] ^= src[pos++];
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,159 @@
+/*
+ * LZ4 block compressor for the migration stream.
+ *
+ * Only the LZ4 decompressor is available in the tree (xen/common/lz4,
+ * linked into libxenguest via xg_dom_decompress_lz4.c), so this provides the
+ * lz4_compress() declared in xen/lz4.h.  It is a single pass, greedy
+ * implementation of the LZ4 block format, which trades some compression
+ * ratio for speed, and produces blocks the vendored decompressor accepts.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../../xen/include/xen/lz4.h"
+
+#define MINMATCH     4
+/* The last match must start at least this many bytes before the end. */
+#define MFLIMIT      12
+/* The last this many bytes are always literals. */
+#define LASTLITERALS 5
+#define MAX_DISTANCE 65535
+
+#define ML_BITS      4
+#define ML_MASK      ((1U << ML_BITS) - 1)
+#define RUN_MASK     ((1U << (8 - ML_BITS)) - 1)
+
+/* The hash table of recent positions fills the caller's working memory. */
+#define HASH_LOG     12
+#define HASH_ENTRIES (LZ4_MEM_COMPRESS / sizeof(const unsigned char *))
+
+/* After 2^SKIP_STRENGTH misses, search incompressible data more sparsely. */
+#define SKIP_STRENGTH 6
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, sizeof(val));
+
+    return val;
+}
+
+static unsigned int hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len)
+{
+    for ( ; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+/*
+ * Start a sequence with a run of literals.  The match length, if any, is
+ * filled into the low bits of the token by the caller.
+ */
+static unsigned char *put_literals(unsigned char *op, unsigned char **token,
+                                   const unsigned char *lit, size_t len)
+{
+    *token = op++;
+
+    if ( len >= RUN_MASK )
+    {
+        **token = RUN_MASK << ML_BITS;
+        op = put_length(op, len - RUN_MASK);
+    }
+    else
+        **token = len << ML_BITS;
+
+    memcpy(op, lit, len);
+
+    return op + len;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+                 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+    const unsigned char **table = wrkmem;
+    const unsigned char *ip = src, *anchor = src, *ref;
+    const unsigned char *const iend = src + src_len;
+    unsigned char *op = dst, *token;
+    unsigned int h, misses = 0;
+    size_t len, offset;
+    uint32_t seq;
+
+    memset(table, 0, HASH_ENTRIES * sizeof(*table));
+
+    /* Inputs too short to hold a match are sent as literals only. */
+    if ( src_len > MFLIMIT )
+    {
+        const unsigned char *const mflimit = iend - MFLIMIT;
+        const unsigned char *const matchlimit = iend - LASTLITERALS;
+
+        while ( ip < mflimit )
+        {
+            seq = read32(ip);
+            h = hash(seq);
+            ref = table[h];
+            table[h] = ip;
+
+            if ( !ref || ip - ref > MAX_DISTANCE || read32(ref) != seq )
+            {
+                ip += 1 + (misses++ >> SKIP_STRENGTH);
+                continue;
+            }
+
+            misses = 0;
+
+            /* Extend the match backwards over the pending literals... */
+            while ( ip > anchor && ref > src && ip[-1] == ref[-1] )
+            {
+                --ip;
+                --ref;
+            }
+
+            /* ... and forwards, up to the trailing literals. */
+            for ( len = MINMATCH;
+                  ip + len < matchlimit && ip[len] == ref[len]; ++len )
+                ;
+
+            op = put_literals(op, &token, anchor, ip - anchor);
+
+            offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+
+            if ( len - MINMATCH >= ML_MASK )
+            {
+                *token |= ML_MASK;
+                op = put_length(op, len - MINMATCH - ML_MASK);
+            }
+            else
+                *token |= len - MINMATCH;
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    op = put_literals(op, &token, anchor, iend - anchor);
+
+    *dst_len = op - dst;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
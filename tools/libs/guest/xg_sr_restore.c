@@ -1,9 +1,16 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
 
 #include "xg_sr_common.h"
 
+#include "../../xen/include/xen/lz4.h"
+
 /*
  * Read and validate the Image and Domain headers.
  */
@@ -186,232 +193,1574 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
         }
     }
 
-    rc = 0;
+    rc = 0;
+
+ err:
+    free(pfns);
+    free(mfns);
+
+    return rc;
+}
+
+/*
+ * Pipelined page restore.  The thread reading the stream validates each
+ * PAGE_DATA record, populates the physmap and records the page types, then
+ * queues the batch.  A pool of workers maps the frames and copies the page
+ * data into the guest, so populating the next batch overlaps with copying
+ * the previous ones.
+ *
+ * Any record other than PAGE_DATA drains the pipeline before it is handled,
+ * as it may depend on the contents of guest memory.
+ */
+struct xc_sr_restore_batch
+{
+    struct xc_sr_restore_batch *next;
+
+    unsigned int count;    /* Pfns in the record. */
+    unsigned int nr_pages; /* Pages of data in the record. */
+    xen_pfn_t *pfns;
+    uint32_t *types;
+    xen_pfn_t *mfns;       /* Gfns of the pages with data. */
+    void *page_data;
+    void *rec_data;        /* Record buffer holding page_data. */
+};
+
+struct xc_sr_restore_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* A batch has been queued. */
+    pthread_cond_t done; /* A batch has been completed. */
+
+    /* Queued batches, and batches queued or being copied. */
+    struct xc_sr_restore_batch *head, **tail;
+    unsigned int in_flight, max_in_flight;
+
+    /* Set on cleanup, and on the first error of a worker. */
+    bool stop, failed;
+    int failed_errno;
+
+    /*
+     * Serialises changes to the physmap and page type tracking, made by the
+     * reading thread and by the localisation of page tables.
+     */
+    pthread_mutex_t p2m_lock;
+
+    unsigned int nr_threads;
+    pthread_t threads[];
+};
+
+static void p2m_lock(struct xc_sr_context *ctx)
+{
+    if ( ctx->restore.pipeline )
+        pthread_mutex_lock(&ctx->restore.pipeline->p2m_lock);
+}
+
+static void p2m_unlock(struct xc_sr_context *ctx)
+{
+    if ( ctx->restore.pipeline )
+        pthread_mutex_unlock(&ctx->restore.pipeline->p2m_lock);
+}
+
+static void free_restore_batch(struct xc_sr_restore_batch *batch)
+{
+    free(batch->rec_data);
+    free(batch->mfns);
+    free(batch->types);
+    free(batch->pfns);
+    free(batch);
+}
+
+/*
+ * Given a list of pfns and their types, populate and record their types, and
+ * collect the gfns of the subset with page data into 'mfns'.  Returns the
+ * number of pages with data, or -1 on error.
+ */
+static int prepare_page_data(struct xc_sr_context *ctx, unsigned int count,
+                             const xen_pfn_t *pfns, const uint32_t *types,
+                             xen_pfn_t *mfns)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i, nr_pages = 0;
+    int rc;
+
+    p2m_lock(ctx);
+
+    rc = populate_pfns(ctx, count, pfns, types);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for batch of %u pages", count);
+        goto out;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+
+        if ( page_type_has_stream_data(types[i]) )
+            mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+    }
+
+    rc = nr_pages;
+
+ out:
+    p2m_unlock(ctx);
+
+    return rc;
+}
+
+/*
+ * Given a list of pfns, their types, the gfns of the subset with page data
+ * and a block of page data from the stream, map the relevant subset and copy
+ * the data into the guest.
+ */
+static int copy_page_data(struct xc_sr_context *ctx, unsigned int count,
+                          const xen_pfn_t *pfns, const uint32_t *types,
+                          const xen_pfn_t *mfns, unsigned int nr_pages,
+                          void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    int *map_errs = NULL;
+    int rc;
+    void *mapping = NULL, *guest_page = NULL;
+    unsigned int i, /* i indexes the pfns from the record. */
+        j;          /* j indexes the subset of pfns we decide to map. */
+
+    /* Nothing to do? */
+    if ( nr_pages == 0 )
+        return 0;
+
+    map_errs = malloc(nr_pages * sizeof(*map_errs));
+    if ( !map_errs )
+    {
+        rc = -1;
+        ERROR("Failed to allocate %zu bytes to process page data",
+              nr_pages * sizeof(*map_errs));
+        goto err;
+    }
+
+    mapping = guest_page = xenforeignmemory_map(
+        xch->fmem, ctx->domid, PROT_READ | PROT_WRITE,
+        nr_pages, mfns, map_errs);
+    if ( !mapping )
+    {
+        rc = -1;
+        PERROR("Unable to map %u mfns for %u pages of data",
+               nr_pages, count);
+        goto err;
+    }
+
+    for ( i = 0, j = 0; i < count; ++i )
+    {
+        if ( !page_type_has_stream_data(types[i]) )
+            continue;
+
+        if ( map_errs[j] )
+        {
+            rc = -1;
+            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
+                  pfns[i], mfns[j], types[i], map_errs[j]);
+            goto err;
+        }
+
+        /*
+         * Undo page normalisation done by the saver.  Localising a page
+         * table may populate further frames.
+         */
+        if ( types[i] != XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            p2m_lock(ctx);
+            rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+            p2m_unlock(ctx);
+        }
+        else
+            rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        if ( rc )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            goto err;
+        }
+
+        if ( ctx->restore.verify )
+        {
+            /* Verify mode - compare incoming data to what we already have. */
+            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
+                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+        }
+        else
+        {
+            /* Regular mode - copy incoming data into place. */
+            memcpy(guest_page, page_data, PAGE_SIZE);
+        }
+
+        ++j;
+        guest_page += PAGE_SIZE;
+        page_data += PAGE_SIZE;
+    }
+
+    rc = 0;
+
+ err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+
+    free(map_errs);
+
+    return rc;
+}
+
+static void *pipeline_worker(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_restore_pipeline *pl = ctx->restore.pipeline;
+    struct xc_sr_restore_batch *batch;
+    bool skip;
+    int rc, err;
+
+    pthread_mutex_lock(&pl->lock);
+
+    for ( ; ; )
+    {
+        while ( !pl->stop && !pl->head )
+            pthread_cond_wait(&pl->work, &pl->lock);
+
+        if ( pl->stop )
+            break;
+
+        batch = pl->head;
+        pl->head = batch->next;
+        if ( !pl->head )
+            pl->tail = &pl->head;
+        /* After a failure, just discard the remaining batches. */
+        skip = pl->failed;
+        pthread_mutex_unlock(&pl->lock);
+
+        rc = skip ? 0 :
+            copy_page_data(ctx, batch->count, batch->pfns, batch->types,
+                           batch->mfns, batch->nr_pages, batch->page_data);
+        err = errno;
+        free_restore_batch(batch);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc && !pl->failed )
+        {
+            pl->failed = true;
+            pl->failed_errno = err;
+        }
+        pl->in_flight--;
+        pthread_cond_broadcast(&pl->done);
+    }
+
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/* Report a failure of a worker to the caller.  Lock held. */
+static int pipeline_check(struct xc_sr_restore_pipeline *pl)
+{
+    if ( !pl->failed )
+        return 0;
+
+    errno = pl->failed_errno;
+    return -1;
+}
+
+/* Queue a prepared batch, waiting for the number in flight to drop. */
+static int pipeline_queue(struct xc_sr_context *ctx,
+                          struct xc_sr_restore_batch *batch)
+{
+    struct xc_sr_restore_pipeline *pl = ctx->restore.pipeline;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+
+    while ( !pl->failed && pl->in_flight >= pl->max_in_flight )
+        pthread_cond_wait(&pl->done, &pl->lock);
+
+    rc = pipeline_check(pl);
+    if ( !rc )
+    {
+        batch->next = NULL;
+        *pl->tail = batch;
+        pl->tail = &batch->next;
+        pl->in_flight++;
+        pthread_cond_signal(&pl->work);
+    }
+
+    pthread_mutex_unlock(&pl->lock);
+
+    return rc;
+}
+
+/* Wait for all queued batches to be copied into the guest. */
+static int pipeline_drain(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_pipeline *pl = ctx->restore.pipeline;
+    int rc;
+
+    if ( !pl )
+        return 0;
+
+    pthread_mutex_lock(&pl->lock);
+    while ( pl->in_flight )
+        pthread_cond_wait(&pl->done, &pl->lock);
+    rc = pipeline_check(pl);
+    pthread_mutex_unlock(&pl->lock);
+
+    return rc;
+}
+
+static void pipeline_stop(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_pipeline *pl = ctx->restore.pipeline;
+    struct xc_sr_restore_batch *batch;
+    unsigned int i;
+
+    if ( !pl )
+        return;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->stop = true;
+    pthread_cond_broadcast(&pl->work);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_threads; ++i )
+        pthread_join(pl->threads[i], NULL);
+
+    while ( (batch = pl->head) != NULL )
+    {
+        pl->head = batch->next;
+        free_restore_batch(batch);
+    }
+
+    pthread_mutex_destroy(&pl->p2m_lock);
+    pthread_cond_destroy(&pl->done);
+    pthread_cond_destroy(&pl->work);
+    pthread_mutex_destroy(&pl->lock);
+
+    free(pl);
+    ctx->restore.pipeline = NULL;
+}
+
+static int pipeline_start(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pipeline *pl;
+    unsigned int i;
+    int rc;
+
+    pl = calloc(1, sizeof(*pl) +
+                ctx->restore.nr_workers * sizeof(*pl->threads));
+    if ( !pl )
+    {
+        ERROR("Unable to allocate memory for the restore pipeline");
+        return -1;
+    }
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->work, NULL);
+    pthread_cond_init(&pl->done, NULL);
+    pthread_mutex_init(&pl->p2m_lock, NULL);
+    pl->tail = &pl->head;
+    /* Keep every worker busy while the next batches are being read. */
+    pl->max_in_flight = 2 * ctx->restore.nr_workers;
+    ctx->restore.pipeline = pl;
+
+    for ( i = 0; i < ctx->restore.nr_workers; ++i )
+    {
+        rc = pthread_create(&pl->threads[i], NULL, pipeline_worker, ctx);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to start restore pipeline thread %u", i);
+            pipeline_stop(ctx);
+            return -1;
+        }
+        pl->nr_threads++;
+    }
+
+    DPRINTF("Restoring with %u page copy workers", ctx->restore.nr_workers);
+
+    return 0;
+}
+
+/*
+ * Post-copy migration.  The source sends the pages needed to run the guest,
+ * then lists the remainder in POSTCOPY_PFNS records.  These are paged out
+ * using mem_paging, and at POSTCOPY_TRANSITION the guest is resumed.  A
+ * guest access to an outstanding page raises a vm_event request, which is
+ * forwarded to the source as a POSTCOPY_FAULT record, and the vcpu is resumed
+ * once the page arrives in the stream.
+ */
+struct xc_sr_restore_postcopy
+{
+    /* Pages paged out and not yet received, and those faulted on. */
+    unsigned long *outstanding, *requested;
+    unsigned long nr_outstanding;
+    xen_pfn_t max_pfn; /* Size of the bitmaps, less 1. */
+
+    /* Set at the switchover, once the guest has been resumed. */
+    bool active;
+    bool paging_enabled;
+
+    xenevtchn_handle *xce;
+    xenevtchn_port_or_error_t port;
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+    bool notify;
+
+    /* Requests from paused vcpus, awaiting their page. */
+    vm_event_request_t *waiting;
+    unsigned int nr_waiting, max_waiting;
+
+    /* Faults not yet sent to the source. */
+    uint64_t *faults;
+    unsigned int nr_faults;
+
+    void *zero_page;
+};
+
+static void postcopy_teardown(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+
+    if ( !pc )
+        return;
+
+    if ( pc->paging_enabled && xc_mem_paging_disable(xch, ctx->domid) )
+        PERROR("Failed to disable paging");
+
+    if ( pc->xce )
+    {
+        if ( pc->port >= 0 )
+            xenevtchn_unbind(pc->xce, pc->port);
+        xenevtchn_close(pc->xce);
+    }
+
+    if ( pc->ring_page )
+        xenforeignmemory_unmap(xch->fmem, pc->ring_page, 1);
+
+    free(pc->zero_page);
+    free(pc->faults);
+    free(pc->waiting);
+    free(pc->requested);
+    free(pc->outstanding);
+    free(pc);
+
+    ctx->restore.postcopy = NULL;
+}
+
+/*
+ * Set up the paging ring for the guest, which must already have its HVM
+ * params from the stream.
+ */
+static int postcopy_setup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc;
+    uint64_t ring_pfn;
+    xen_pfn_t pfn;
+    uint32_t port;
+    int rc;
+
+    pc = calloc(1, sizeof(*pc));
+    if ( !pc )
+    {
+        ERROR("Unable to allocate memory for post-copy state");
+        return -1;
+    }
+
+    pc->port = -1;
+    ctx->restore.postcopy = pc;
+
+    pc->faults = malloc(MAX_BATCH_SIZE * sizeof(*pc->faults));
+    pc->zero_page = calloc(1, PAGE_SIZE);
+    if ( !pc->faults || !pc->zero_page )
+    {
+        ERROR("Unable to allocate memory for post-copy state");
+        return -1;
+    }
+
+    if ( xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_PAGING_RING_PFN,
+                          &ring_pfn) )
+    {
+        PERROR("Failed to get paging ring pfn");
+        return -1;
+    }
+
+    if ( !ring_pfn )
+    {
+        ERROR("No paging ring pfn for post-copy");
+        return -1;
+    }
+
+    pfn = ring_pfn;
+
+    p2m_lock(ctx);
+    rc = populate_pfns(ctx, 1, &pfn, NULL);
+    p2m_unlock(ctx);
+    if ( rc )
+        return rc;
+
+    pc->ring_page = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                         PROT_READ | PROT_WRITE, 1, &pfn,
+                                         NULL);
+    if ( !pc->ring_page )
+    {
+        PERROR("Failed to map paging ring pfn %#"PRIpfn, pfn);
+        return -1;
+    }
+
+    if ( xc_mem_paging_enable(xch, ctx->domid, &port) )
+    {
+        switch ( errno )
+        {
+        case EBUSY:
+            ERROR("Paging is already enabled for the domain");
+            break;
+        case ENODEV:
+            ERROR("Post-copy requires Hardware Assisted Paging");
+            break;
+        case EMLINK:
+            ERROR("Post-copy is not supported with iommu passthrough");
+            break;
+        case EXDEV:
+            ERROR("Post-copy is not supported in a PoD guest");
+            break;
+        default:
+            PERROR("Failed to enable paging");
+            break;
+        }
+        return -1;
+    }
+
+    pc->paging_enabled = true;
+
+    pc->xce = xenevtchn_open(NULL, 0);
+    if ( !pc->xce )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+
+    pc->port = xenevtchn_bind_interdomain(pc->xce, ctx->domid, port);
+    if ( pc->port < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        return -1;
+    }
+
+    SHARED_RING_INIT((vm_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->back_ring, (vm_event_sring_t *)pc->ring_page,
+                   XC_PAGE_SIZE);
+
+    /* The ring is in use by Xen, and is no longer part of the guest. */
+    if ( xc_domain_decrease_reservation_exact(xch, ctx->domid, 1, 0, &pfn) )
+    {
+        PERROR("Failed to remove paging ring from the guest physmap");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Expand the post-copy bitmaps to contain 'pfn', in the manner of
+ * pfn_set_populated().
+ */
+static int postcopy_track_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    xen_pfn_t new_max;
+    size_t old_sz, new_sz;
+    unsigned long *o, *r;
+
+    if ( pc->outstanding && pfn <= pc->max_pfn )
+        return 0;
+
+    new_max = pfn;
+    new_max |= new_max >> 1;
+    new_max |= new_max >> 2;
+    new_max |= new_max >> 4;
+    new_max |= new_max >> 8;
+    new_max |= new_max >> 16;
+#ifdef __x86_64__
+    new_max |= new_max >> 32;
+#endif
+
+    old_sz = pc->outstanding ? bitmap_size(pc->max_pfn + 1) : 0;
+    new_sz = bitmap_size(new_max + 1);
+
+    o = realloc(pc->outstanding, new_sz);
+    if ( o )
+        pc->outstanding = o;
+    r = realloc(pc->requested, new_sz);
+    if ( r )
+        pc->requested = r;
+
+    if ( !o || !r )
+    {
+        ERROR("Failed to realloc post-copy bitmaps");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset((uint8_t *)o + old_sz, 0, new_sz - old_sz);
+    memset((uint8_t *)r + old_sz, 0, new_sz - old_sz);
+    pc->max_pfn = new_max;
+
+    return 0;
+}
+
+static bool postcopy_is_outstanding(const struct xc_sr_restore_postcopy *pc,
+                                    xen_pfn_t pfn)
+{
+    return pc->outstanding && pfn <= pc->max_pfn &&
+        test_bit(pfn, pc->outstanding);
+}
+
+static void postcopy_respond(struct xc_sr_restore_postcopy *pc,
+                             const vm_event_request_t *req)
+{
+    vm_event_back_ring_t *back_ring = &pc->back_ring;
+    vm_event_response_t rsp = {
+        .version = VM_EVENT_INTERFACE_VERSION,
+        .vcpu_id = req->vcpu_id,
+        .flags = req->flags,
+        .reason = VM_EVENT_REASON_MEM_PAGING,
+        .u.mem_paging.gfn = req->u.mem_paging.gfn,
+        .u.mem_paging.flags = req->u.mem_paging.flags,
+    };
+
+    memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt), &rsp,
+           sizeof(rsp));
+    back_ring->rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(back_ring);
+
+    pc->notify = true;
+}
+
+static int postcopy_notify(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+
+    if ( !pc->notify )
+        return 0;
+
+    pc->notify = false;
+
+    if ( xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Send the faulted pfns collected so far to the source, in a
+ * POSTCOPY_FAULT record on the back channel.
+ */
+static int postcopy_send_faults(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    struct xc_sr_rhdr rhdr = {
+        .type = REC_TYPE_POSTCOPY_FAULT,
+        .length = pc->nr_faults * sizeof(*pc->faults),
+    };
+    struct iovec iov[] = {
+        { &rhdr,      sizeof(rhdr) },
+        { pc->faults, rhdr.length },
+    };
+
+    if ( !pc->nr_faults )
+        return 0;
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write post-copy faults to the back channel");
+        return -1;
+    }
+
+    pc->nr_faults = 0;
+
+    return 0;
+}
+
+/*
+ * Handle the requests on the paging ring.  Faults on outstanding pages are
+ * forwarded to the source, with paused vcpus resumed when the page arrives.
+ * Anything else is resumed immediately.
+ */
+static int postcopy_handle_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    vm_event_back_ring_t *back_ring = &pc->back_ring;
+    vm_event_request_t req, *waiting;
+    xen_pfn_t gfn;
+    int rc;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION ||
+             req.reason != VM_EVENT_REASON_MEM_PAGING )
+        {
+            ERROR("Unexpected vm_event request: version %#x, reason %u",
+                  req.version, req.reason);
+            return -1;
+        }
+
+        gfn = req.u.mem_paging.gfn;
+
+        if ( postcopy_is_outstanding(pc, gfn) )
+        {
+            if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+            {
+                /* Released by the guest.  Any data for it is discarded. */
+                clear_bit(gfn, pc->outstanding);
+                --pc->nr_outstanding;
+            }
+            else
+            {
+                if ( req.flags & VM_EVENT_FLAG_VCPU_PAUSED )
+                {
+                    if ( pc->nr_waiting == pc->max_waiting )
+                    {
+                        unsigned int max = pc->max_waiting ?: 16;
+
+                        waiting = realloc(pc->waiting,
+                                          2 * max * sizeof(*waiting));
+                        if ( !waiting )
+                        {
+                            ERROR("Failed to realloc post-copy requests");
+                            return -1;
+                        }
+
+                        pc->waiting = waiting;
+                        pc->max_waiting = 2 * max;
+                    }
+
+                    pc->waiting[pc->nr_waiting++] = req;
+                }
+
+                if ( !test_and_set_bit(gfn, pc->requested) )
+                {
+                    if ( pc->nr_faults == MAX_BATCH_SIZE )
+                    {
+                        rc = postcopy_send_faults(ctx);
+                        if ( rc )
+                            return rc;
+                    }
+
+                    pc->faults[pc->nr_faults++] = gfn;
+                }
+
+                continue;
+            }
+        }
+
+        if ( (req.flags & VM_EVENT_FLAG_VCPU_PAUSED) ||
+             (req.u.mem_paging.flags & MEM_PAGING_EVICT_FAIL) )
+            postcopy_respond(pc, &req);
+    }
+
+    rc = postcopy_send_faults(ctx);
+    if ( rc )
+        return rc;
+
+    return postcopy_notify(ctx);
+}
+
+/*
+ * Service the paging ring until there is more of the stream to read.
+ */
+static int postcopy_wait(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    struct pollfd fds[] = {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(pc->xce), .events = POLLIN },
+    };
+    xenevtchn_port_or_error_t port;
+    int rc;
+
+    for ( ;; )
+    {
+        rc = postcopy_handle_requests(ctx);
+        if ( rc )
+            return rc;
+
+        rc = poll(fds, ARRAY_SIZE(fds), -1);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll the stream and paging event channel");
+            return -1;
+        }
+
+        if ( fds[1].revents )
+        {
+            port = xenevtchn_pending(pc->xce);
+            if ( port < 0 )
+            {
+                PERROR("Failed to get pending paging event");
+                return -1;
+            }
+
+            if ( xenevtchn_unmask(pc->xce, port) )
+            {
+                PERROR("Failed to unmask paging event channel");
+                return -1;
+            }
+        }
+
+        if ( fds[0].revents )
+            return postcopy_handle_requests(ctx);
+    }
+}
+
+/*
+ * Load the page data for outstanding pages into the guest, and resume any
+ * vcpus waiting for them.  Data for pages which are not outstanding is
+ * stale, as the guest has already been resumed.
+ */
+static int postcopy_load_pages(struct xc_sr_context *ctx, unsigned int count,
+                               const xen_pfn_t *pfns, const uint32_t *types,
+                               void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    unsigned int i, j;
+    void *page;
+
+    for ( i = 0; i < count; ++i, page_data += page ? PAGE_SIZE : 0 )
+    {
+        page = page_type_has_stream_data(types[i]) ? page_data : NULL;
+
+        if ( !postcopy_is_outstanding(pc, pfns[i]) )
+            continue;
+
+        if ( xc_mem_paging_load(xch, ctx->domid, pfns[i],
+                                page ?: pc->zero_page) )
+        {
+            PERROR("Failed to load pfn %#"PRIpfn, pfns[i]);
+            return -1;
+        }
+
+        clear_bit(pfns[i], pc->outstanding);
+        --pc->nr_outstanding;
+
+        for ( j = 0; j < pc->nr_waiting; )
+        {
+            if ( pc->waiting[j].u.mem_paging.gfn != pfns[i] )
+            {
+                ++j;
+                continue;
+            }
+
+            postcopy_respond(pc, &pc->waiting[j]);
+            pc->waiting[j] = pc->waiting[--pc->nr_waiting];
+        }
+    }
+
+    return postcopy_notify(ctx);
+}
+
+/*
+ * POSTCOPY_PFNS record.  Page out the listed pfns ahead of the switchover.
+ */
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    const uint64_t *data = rec->data;
+    unsigned int i, count = rec->length / sizeof(*data);
+    xen_pfn_t *pfns = NULL;
+    int rc = -1;
+
+    if ( ctx->stream_type != XC_STREAM_PLAIN ||
+         ctx->restore.guest_type != DHDR_TYPE_X86_HVM ||
+         ctx->restore.send_back_fd < 0 )
+    {
+        ERROR("Post-copy requires a plain HVM stream with a back channel");
+        goto err;
+    }
+
+    if ( ctx->restore.verify )
+    {
+        ERROR("Post-copy is incompatible with verify mode");
+        goto err;
+    }
+
+    if ( pc && pc->active )
+    {
+        ERROR("%s record after switchover", rec_type_to_str(rec->type));
+        goto err;
+    }
+
+    if ( rec->length % sizeof(*data) )
+    {
+        ERROR("%s record length %u not a multiple of %zu",
+              rec_type_to_str(rec->type), rec->length, sizeof(*data));
+        goto err;
+    }
+
+    if ( !pc )
+    {
+        rc = postcopy_setup(ctx);
+        if ( rc )
+            goto err;
+        pc = ctx->restore.postcopy;
+        rc = -1;
+    }
+
+    pfns = malloc(count * sizeof(*pfns));
+    if ( count && !pfns )
+    {
+        ERROR("Unable to allocate memory for %u post-copy pfns", count);
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        pfns[i] = data[i];
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfns[i]) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum",
+                  pfns[i], i);
+            goto err;
+        }
+
+        if ( postcopy_track_pfn(ctx, pfns[i]) )
+            goto err;
+    }
+
+    p2m_lock(ctx);
+    rc = populate_pfns(ctx, count, pfns, NULL);
+    p2m_unlock(ctx);
+    if ( rc )
+        goto err;
+
+    rc = -1;
+    for ( i = 0; i < count; ++i )
+    {
+        if ( test_bit(pfns[i], pc->outstanding) )
+            continue;
+
+        if ( xc_mem_paging_nominate(xch, ctx->domid, pfns[i]) ||
+             xc_mem_paging_evict(xch, ctx->domid, pfns[i]) )
+        {
+            PERROR("Failed to page out pfn %#"PRIpfn, pfns[i]);
+            goto err;
+        }
+
+        set_bit(pfns[i], pc->outstanding);
+        ++pc->nr_outstanding;
+    }
+
+    rc = 0;
+
+ err:
+    free(pfns);
+    return rc;
+}
+
+/*
+ * POSTCOPY_TRANSITION record.  Complete the restore of the guest state and
+ * resume it, with the outstanding pages to follow.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    int rc;
+
+    if ( !pc || pc->active )
+    {
+        ERROR("%s record without preceding %s records",
+              rec_type_to_str(REC_TYPE_POSTCOPY_TRANSITION),
+              rec_type_to_str(REC_TYPE_POSTCOPY_PFNS));
+        return -1;
+    }
+
+    if ( !ctx->restore.callbacks->postcopy ||
+         !ctx->restore.callbacks->restore_results )
+    {
+        ERROR("Post-copy requires the postcopy and restore_results callbacks");
+        return -1;
+    }
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                            ctx->restore.console_gfn,
+                                            ctx->restore.callbacks->data);
+
+    /* Resume the guest. */
+    rc = ctx->restore.callbacks->postcopy(ctx->restore.callbacks->data);
+    if ( rc != 1 )
+    {
+        ERROR("postcopy() callback failed: %d", rc);
+        return -1;
+    }
+
+    pc->active = true;
+    IPRINTF("Post-copy switchover, %lu pages outstanding", pc->nr_outstanding);
+
+    return 0;
+}
+
+/*
+ * At the END record of a post-copy stream, every outstanding page must have
+ * been received.
+ */
+static int postcopy_complete(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    int rc;
+
+    if ( !pc->active )
+    {
+        ERROR("Stream ended without post-copy switchover");
+        return -1;
+    }
+
+    rc = postcopy_handle_requests(ctx);
+    if ( rc )
+        return rc;
+
+    if ( pc->nr_outstanding || pc->nr_waiting )
+    {
+        ERROR("Stream ended with %lu post-copy pages outstanding",
+              pc->nr_outstanding);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Given a list of pfns, their types, and a block of page data from the
+ * stream, populate and record their types, map the relevant subset and copy
+ * the data into the guest.  With a pipeline, the mapping and copying is
+ * handed to the workers, along with ownership of the record data.
+ */
+static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
+                             xen_pfn_t *pfns, uint32_t *types,
+                             struct xc_sr_record *rec, void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_batch *batch;
+    xen_pfn_t *mfns;
+    int nr_pages, rc;
+
+    if ( ctx->restore.postcopy && ctx->restore.postcopy->active )
+        return postcopy_load_pages(ctx, count, pfns, types, page_data);
+
+    mfns = malloc(count * sizeof(*mfns));
+    if ( !mfns )
+    {
+        ERROR("Failed to allocate %zu bytes to process page data",
+              count * sizeof(*mfns));
+        return -1;
+    }
+
+    nr_pages = prepare_page_data(ctx, count, pfns, types, mfns);
+    if ( nr_pages < 0 )
+    {
+        free(mfns);
+        return -1;
+    }
+
+    if ( !ctx->restore.pipeline || nr_pages == 0 )
+    {
+        rc = copy_page_data(ctx, count, pfns, types, mfns, nr_pages,
+                            page_data);
+        free(mfns);
+        return rc;
+    }
+
+    batch = calloc(1, sizeof(*batch));
+    if ( !batch )
+    {
+        ERROR("Failed to allocate memory for a batch of %u pages", count);
+        free(mfns);
+        return -1;
+    }
+
+    batch->count = count;
+    batch->nr_pages = nr_pages;
+    batch->pfns = pfns;
+    batch->types = types;
+    batch->mfns = mfns;
+    batch->page_data = page_data;
+    batch->rec_data = rec->data;
+    rec->data = NULL;
+
+    rc = pipeline_queue(ctx, batch);
+    if ( rc )
+    {
+        /* Hand the buffers back to the caller, which frees them. */
+        rec->data = batch->rec_data;
+        free(mfns);
+        free(batch);
+    }
+
+    return rc;
+}
+
+/*
+ * Page data may only follow the static data records.  Check for this ahead
+ * of handling page data from the stream.
+ */
+static int check_static_data_end(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    /*
+     * v2 compatibility only exists for x86 streams.  This is a bit of a
+     * bodge, but it is less bad than duplicating handle_page_data() between
+     * different architectures.
+     */
+#if defined(__i386__) || defined(__x86_64__)
+    /* v2 compat.  Infer the position of STATIC_DATA_END. */
+    if ( ctx->restore.format_version < 3 && !ctx->restore.seen_static_data_end )
+    {
+        if ( handle_static_data_end(ctx) )
+        {
+            ERROR("Inferred STATIC_DATA_END record failed");
+            return -1;
+        }
+    }
+
+    if ( !ctx->restore.seen_static_data_end )
+    {
+        ERROR("No STATIC_DATA_END seen");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Validate a PAGE_DATA record from the stream, and pass the results to
+ * process_page_data() to actually perform the legwork.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned int i, pages_of_data = 0;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL, pfn;
+    uint32_t *types = NULL, type;
+
+    if ( check_static_data_end(ctx) )
+        goto err;
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+
+    if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        goto err;
+    }
+
+    if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    {
+        ERROR("PAGE_DATA record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    for ( i = 0; i < pages->count; ++i )
+    {
+        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            goto err;
+        }
+
+        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( !is_known_page_type(type) )
+        {
+            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            goto err;
+        }
+
+        if ( page_type_has_stream_data(type) )
+            /* NOTAB and all L1 through L4 tables (including pinned) should
+             * have a page worth of data in the record. */
+            pages_of_data++;
+
+        pfns[i] = pfn;
+        types[i] = type;
+    }
+
+    if ( rec->length != (sizeof(*pages) +
+                         (sizeof(uint64_t) * pages->count) +
+                         (PAGE_SIZE * pages_of_data)) )
+    {
+        ERROR("PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %lu", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        goto err;
+    }
+
+    rc = process_page_data(ctx, pages->count, pfns, types, rec,
+                           &pages->pfn[pages->count]);
+
+    /* The pipeline has taken ownership of the batch? */
+    if ( !rc && !rec->data )
+        return rc;
 
  err:
+    free(types);
     free(pfns);
-    free(mfns);
 
     return rc;
 }
 
 /*
- * Given a list of pfns, their types, and a block of page data from the
- * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * Validate a COMPRESSED_PAGE_DATA record from the stream, and expand it into
+ * a block of page data for process_page_data().  Zero pages are written out
+ * like any other, as the frame may hold data sent by an earlier iteration.
  */
-static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+static int handle_compressed_page_data(struct xc_sr_context *ctx,
+                                       struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
-    int *map_errs = malloc(count * sizeof(*map_errs));
-    int rc;
-    void *mapping = NULL, *guest_page = NULL;
-    unsigned int i, /* i indexes the pfns from the record. */
-        j,          /* j indexes the subset of pfns we decide to map. */
-        nr_pages = 0;
+    struct xc_sr_rec_compressed_page_data_header *pages = rec->data;
+    unsigned int i, j, count, pages_of_data = 0, zero_pages = 0;
+    size_t data_len;
+    void *data = NULL, *src, *dst;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL, pfn;
+    uint32_t *types = NULL, type;
+
+    if ( check_static_data_end(ctx) )
+        goto err;
 
-    if ( !mfns || !map_errs )
+    if ( rec->length < sizeof(*pages) )
     {
-        rc = -1;
-        ERROR("Failed to allocate %zu bytes to process page data",
-              count * (sizeof(*mfns) + sizeof(*map_errs)));
+        ERROR("COMPRESSED_PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
         goto err;
     }
 
-    rc = populate_pfns(ctx, count, pfns, types);
-    if ( rc )
+    if ( pages->count < 1 )
     {
-        ERROR("Failed to populate pfns for batch of %u pages", count);
+        ERROR("Expected at least 1 pfn in COMPRESSED_PAGE_DATA record");
         goto err;
     }
+    count = pages->count;
 
-    for ( i = 0; i < count; ++i )
+    if ( rec->length != (sizeof(*pages) +
+                         (sizeof(uint64_t) * pages->count) +
+                         pages->data_length) )
     {
-        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
-
-        if ( page_type_has_stream_data(types[i]) )
-            mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+        ERROR("COMPRESSED_PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %u", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), pages->data_length);
+        goto err;
     }
 
-    /* Nothing to do? */
-    if ( nr_pages == 0 )
-        goto done;
-
-    mapping = guest_page = xenforeignmemory_map(
-        xch->fmem, ctx->domid, PROT_READ | PROT_WRITE,
-        nr_pages, mfns, map_errs);
-    if ( !mapping )
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
     {
-        rc = -1;
-        PERROR("Unable to map %u mfns for %u pages of data",
-               nr_pages, count);
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
         goto err;
     }
 
-    for ( i = 0, j = 0; i < count; ++i )
+    for ( i = 0; i < pages->count; ++i )
     {
-        if ( !page_type_has_stream_data(types[i]) )
-            continue;
+        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            goto err;
+        }
 
-        if ( map_errs[j] )
+        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( !is_known_page_type(type) )
         {
-            rc = -1;
-            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
-                  pfns[i], mfns[j], types[i], map_errs[j]);
+            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
             goto err;
         }
 
-        /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
-        if ( rc )
+        if ( !(pages->pfn[i] & PAGE_DATA_ZERO) )
         {
-            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
-                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            if ( page_type_has_stream_data(type) )
+                pages_of_data++;
+        }
+        else if ( page_type_has_stream_data(type) )
+            zero_pages++;
+        else
+        {
+            ERROR("Zero page marker on pfn %#"PRIpfn" (index %u) of type %#"
+                  PRIx32" without data", pfn, i, type);
             goto err;
         }
 
-        if ( ctx->restore.verify )
+        pfns[i] = pfn;
+        types[i] = type;
+    }
+
+    data_len = pages_of_data * PAGE_SIZE;
+
+    if ( pages_of_data + zero_pages )
+    {
+        data = malloc((pages_of_data + zero_pages) * PAGE_SIZE);
+        if ( !data )
         {
-            /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
-                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
-                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            ERROR("Unable to allocate memory for %u pages of data",
+                  pages_of_data + zero_pages);
+            goto err;
+        }
+    }
+
+    /* Decode the page data into the tail of the buffer... */
+    src = &pages->pfn[pages->count];
+    dst = data + zero_pages * PAGE_SIZE;
+
+    switch ( pages->compression )
+    {
+    case COMPRESSED_PAGE_DATA_NONE:
+        if ( pages->data_length != data_len )
+        {
+            ERROR("COMPRESSED_PAGE_DATA record has %u bytes of page data, "
+                  "expected %zu", pages->data_length, data_len);
+            goto err;
+        }
+
+        if ( data_len )
+            memcpy(dst, src, data_len);
+        break;
+
+    case COMPRESSED_PAGE_DATA_LZ4:
+        if ( !data_len ||
+             lz4_decompress_unknownoutputsize(src, pages->data_length,
+                                              dst, &data_len) ||
+             data_len != pages_of_data * PAGE_SIZE )
+        {
+            ERROR("Failed to decompress %u pages of data", pages_of_data);
+            goto err;
         }
+        break;
+
+    default:
+        ERROR("Unknown compression %#"PRIx32" in COMPRESSED_PAGE_DATA record",
+              pages->compression);
+        goto err;
+    }
+
+    /* ... then move it into place, leaving gaps for the zero pages. */
+    src = dst;
+    for ( i = 0, j = 0; i < pages->count; ++i )
+    {
+        if ( !page_type_has_stream_data(types[i]) )
+            continue;
+
+        dst = data + j++ * PAGE_SIZE;
+
+        if ( pages->pfn[i] & PAGE_DATA_ZERO )
+            memset(dst, 0, PAGE_SIZE);
         else
         {
-            /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
+            if ( dst != src )
+                memmove(dst, src, PAGE_SIZE);
+            src += PAGE_SIZE;
         }
+    }
 
-        ++j;
-        guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
+    if ( data )
+    {
+        free(rec->data);
+        rec->data = data;
     }
 
- done:
-    rc = 0;
+    rc = process_page_data(ctx, count, pfns, types, rec, data);
 
- err:
-    if ( mapping )
-        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+    /* The pipeline has taken ownership of the batch? */
+    if ( !rc && !rec->data )
+        return rc;
 
-    free(map_errs);
-    free(mfns);
+    /* Otherwise, the page data is freed along with the record. */
+    data = NULL;
+
+ err:
+    free(data);
+    free(types);
+    free(pfns);
 
     return rc;
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Apply a PAGE_DELTA record to pages already in the guest.  Handled with the
+ * pipeline drained, as the deltas apply to the contents sent previously.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int handle_page_delta(struct xc_sr_context *ctx,
+                             struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
-    struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned int i, pages_of_data = 0;
+    struct xc_sr_rec_page_delta_header *hdr = rec->data;
+    const uint32_t *lengths;
+    const void *delta;
+    xen_pfn_t *gfns = NULL, pfn;
+    int *map_errs = NULL;
+    void *mapping = NULL;
+    unsigned int i, count;
+    size_t expected;
     int rc = -1;
 
-    xen_pfn_t *pfns = NULL, pfn;
-    uint32_t *types = NULL, type;
+    if ( rec->length < sizeof(*hdr) )
+    {
+        ERROR("PAGE_DELTA record truncated: length %u, min %zu",
+              rec->length, sizeof(*hdr));
+        goto err;
+    }
 
-    /*
-     * v2 compatibility only exists for x86 streams.  This is a bit of a
-     * bodge, but it is less bad than duplicating handle_page_data() between
-     * different architectures.
-     */
-#if defined(__i386__) || defined(__x86_64__)
-    /* v2 compat.  Infer the position of STATIC_DATA_END. */
-    if ( ctx->restore.format_version < 3 && !ctx->restore.seen_static_data_end )
+    count = hdr->count;
+    if ( count < 1 )
     {
-        rc = handle_static_data_end(ctx);
-        if ( rc )
-        {
-            ERROR("Inferred STATIC_DATA_END record failed");
-            goto err;
-        }
-        rc = -1;
+        ERROR("Expected at least 1 pfn in PAGE_DELTA record");
+        goto err;
     }
 
-    if ( !ctx->restore.seen_static_data_end )
+    expected = sizeof(*hdr) + count * (sizeof(uint64_t) + sizeof(uint32_t));
+    if ( rec->length < expected )
     {
-        ERROR("No STATIC_DATA_END seen");
+        ERROR("PAGE_DELTA record (length %u) too short to contain %u deltas",
+              rec->length, count);
         goto err;
     }
-#endif
 
-    if ( rec->length < sizeof(*pages) )
+    lengths = (const void *)&hdr->pfn[count];
+    for ( i = 0; i < count; ++i )
+        expected += lengths[i];
+
+    if ( rec->length != expected )
     {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
+        ERROR("PAGE_DELTA record wrong size: length %u, expected %zu",
+              rec->length, expected);
         goto err;
     }
 
-    if ( pages->count < 1 )
+    if ( ctx->restore.verify )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        ERROR("PAGE_DELTA record in verify mode");
         goto err;
     }
 
-    if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    /* Outstanding post-copy pages have no previous contents to apply to. */
+    if ( ctx->restore.postcopy )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
+        ERROR("PAGE_DELTA record in post-copy stream");
         goto err;
     }
 
-    pfns = malloc(pages->count * sizeof(*pfns));
-    types = malloc(pages->count * sizeof(*types));
-    if ( !pfns || !types )
+    gfns = malloc(count * sizeof(*gfns));
+    map_errs = malloc(count * sizeof(*map_errs));
+    if ( !gfns || !map_errs )
     {
-        ERROR("Unable to allocate enough memory for %u pfns",
-              pages->count);
+        ERROR("Unable to allocate enough memory for %u pfns", count);
         goto err;
     }
 
-    for ( i = 0; i < pages->count; ++i )
+    for ( i = 0; i < count; ++i )
     {
-        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
-        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        pfn = hdr->pfn[i];
+        if ( pfn & ~PAGE_DATA_PFN_MASK ||
+             !ctx->restore.ops.pfn_is_valid(ctx, pfn) ||
+             !pfn_is_populated(ctx, pfn) )
         {
-            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            ERROR("Bad pfn %#"PRIpfn" (index %u) for delta", pfn, i);
             goto err;
         }
 
-        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
-        if ( !is_known_page_type(type) )
+        gfns[i] = ctx->restore.ops.pfn_to_gfn(ctx, pfn);
+    }
+
+    mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                   PROT_READ | PROT_WRITE, count, gfns,
+                                   map_errs);
+    if ( !mapping )
+    {
+        PERROR("Unable to map %u mfns for page deltas", count);
+        goto err;
+    }
+
+    delta = &lengths[count];
+    for ( i = 0; i < count; ++i )
+    {
+        if ( map_errs[i] )
         {
-            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
-                  type, pfn, i);
+            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn") failed with %d",
+                  (xen_pfn_t)hdr->pfn[i], gfns[i], map_errs[i]);
             goto err;
         }
 
-        if ( page_type_has_stream_data(type) )
-            /* NOTAB and all L1 through L4 tables (including pinned) should
-             * have a page worth of data in the record. */
-            pages_of_data++;
+        if ( delta_apply(delta, lengths[i], mapping + i * PAGE_SIZE) )
+        {
+            ERROR("Malformed delta for pfn %#"PRIpfn,
+                  (xen_pfn_t)hdr->pfn[i]);
+            goto err;
+        }
 
-        pfns[i] = pfn;
-        types[i] = type;
+        delta += lengths[i];
     }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
-    {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
-              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
-        goto err;
-    }
+    rc = 0;
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
  err:
-    free(types);
-    free(pfns);
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, count);
+
+    free(map_errs);
+    free(gfns);
 
     return rc;
 }
@@ -534,6 +1883,10 @@ static int handle_checkpoint(struct xc_sr_context *ctx)
                 goto err;
         }
         ctx->restore.buffered_rec_num = 0;
+
+        rc = pipeline_drain(ctx);
+        if ( rc )
+            goto err;
         IPRINTF("All records processed");
     }
     else
@@ -648,6 +2001,18 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     xc_interface *xch = ctx->xch;
     int rc = 0;
 
+    /* Other records may depend on the page data sent ahead of them. */
+    if ( rec->type != REC_TYPE_PAGE_DATA &&
+         rec->type != REC_TYPE_COMPRESSED_PAGE_DATA )
+    {
+        rc = pipeline_drain(ctx);
+        if ( rc )
+        {
+            PERROR("Failed to restore page data");
+            goto out;
+        }
+    }
+
     switch ( rec->type )
     {
     case REC_TYPE_END:
@@ -657,6 +2022,14 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_COMPRESSED_PAGE_DATA:
+        rc = handle_compressed_page_data(ctx, rec);
+        break;
+
+    case REC_TYPE_PAGE_DELTA:
+        rc = handle_page_delta(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -670,11 +2043,20 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_static_data_end(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
     }
 
+ out:
     free(rec->data);
     rec->data = NULL;
 
@@ -725,6 +2107,9 @@ static int setup(struct xc_sr_context *ctx)
     }
     ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
 
+    if ( ctx->restore.nr_workers )
+        rc = pipeline_start(ctx);
+
  err:
     return rc;
 }
@@ -736,6 +2121,9 @@ static void cleanup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
+    pipeline_stop(ctx);
+    postcopy_teardown(ctx);
+
     for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
         free(ctx->restore.buffered_records[i].data);
 
@@ -767,6 +2155,13 @@ static int restore(struct xc_sr_context *ctx)
 
     do
     {
+        if ( ctx->restore.postcopy && ctx->restore.postcopy->active )
+        {
+            rc = postcopy_wait(ctx);
+            if ( rc )
+                goto err;
+        }
+
         rc = read_record(ctx, ctx->fd, &rec);
         if ( rc )
         {
@@ -808,6 +2203,17 @@ static int restore(struct xc_sr_context *ctx)
 
     } while ( rec.type != REC_TYPE_END );
 
+    if ( ctx->restore.postcopy )
+    {
+        /* The guest is already running. */
+        rc = postcopy_complete(ctx);
+        if ( rc )
+            goto err;
+
+        IPRINTF("Restore successful");
+        goto done;
+    }
+
  remus_failover:
     if ( ctx->stream_type == XC_STREAM_COLO )
     {
@@ -821,6 +2227,10 @@ static int restore(struct xc_sr_context *ctx)
      * With Remus, if we reach here, there must be some error on primary,
      * failover from the last checkpoint state.
      */
+    rc = pipeline_drain(ctx);
+    if ( rc )
+        goto err;
+
     rc = ctx->restore.ops.stream_complete(ctx);
     if ( rc )
         goto err;
@@ -850,7 +2260,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       uint32_t store_domid, unsigned int console_evtchn,
                       unsigned long *console_gfn, uint32_t console_domid,
                       xc_stream_type_t stream_type,
-                      struct restore_callbacks *callbacks, int send_back_fd)
+                      struct restore_callbacks *callbacks, int send_back_fd,
+                      const struct restore_params *params)
 {
     bool hvm;
     xen_pfn_t nr_pfns;
@@ -867,6 +2278,15 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.restore.xenstore_domid = store_domid;
     ctx.restore.callbacks = callbacks;
     ctx.restore.send_back_fd = send_back_fd;
+    ctx.restore.nr_workers = params ? params->nr_workers : 0;
+
+    if ( ctx.restore.nr_workers > XGR_MAX_WORKERS )
+    {
+        ERROR("Too many restore workers requested: %u (max %u)",
+              ctx.restore.nr_workers, XGR_MAX_WORKERS);
+        errno = EINVAL;
+        return -1;
+    }
 
     /* Sanity check stream_type-related parameters */
     switch ( stream_type )
@@ -895,8 +2315,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     }
 
     hvm = ctx.dominfo.flags & XEN_DOMINF_hvm_guest;
-    DPRINTF("fd %d, dom %u, hvm %u, stream_type %d",
-            io_fd, dom, hvm, stream_type);
+    DPRINTF("fd %d, dom %u, hvm %u, stream_type %d, workers %u",
+            io_fd, dom, hvm, stream_type, ctx.restore.nr_workers);
 
     ctx.domid = dom;
 
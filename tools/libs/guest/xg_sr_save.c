@@ -1,8 +1,20 @@
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "xg_sr_common.h"
 
+#include "../../xen/include/xen/lz4.h"
+
+/*
+ * Largest delta worth sending in place of a page.  Beyond this, the page
+ * data compresses about as well, without the receiver having to read back
+ * the old contents.
+ */
+#define DELTA_MAX (PAGE_SIZE / 2)
+
 /*
  * Writes an Image header and Domain header into the stream.
  */
@@ -75,155 +87,482 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
+ * Allocate the arrays of a batch.  The local copy of the page data is only
+ * needed when the batch is processed by the pipeline, or compressed.
+ */
+static int alloc_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    bool pipelined = ctx->save.nr_workers;
+    bool lz4 = ctx->save.compression == XGS_COMPRESS_LZ4;
+    bool delta = ctx->save.delta_cache;
+
+    batch->pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->pfns));
+    batch->mfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->mfns));
+    batch->types = malloc(MAX_BATCH_SIZE * sizeof(*batch->types));
+    batch->errors = malloc(MAX_BATCH_SIZE * sizeof(*batch->errors));
+    batch->guest_data = calloc(MAX_BATCH_SIZE, sizeof(*batch->guest_data));
+    batch->local_pages = calloc(MAX_BATCH_SIZE, sizeof(*batch->local_pages));
+    batch->rec_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->rec_pfns));
+    batch->iov = malloc((MAX_BATCH_SIZE + 5) * sizeof(*batch->iov));
+
+    if ( pipelined || lz4 )
+        batch->buffer = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+
+    if ( lz4 )
+    {
+        batch->compressed =
+            malloc(lz4_compressbound(MAX_BATCH_SIZE * PAGE_SIZE));
+        batch->lz4_wrkmem = malloc(LZ4_MEM_COMPRESS);
+    }
+
+    if ( delta )
+    {
+        batch->delta_map = bitmap_alloc(MAX_BATCH_SIZE);
+        batch->delta_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->delta_pfns));
+        batch->delta_lengths = malloc(MAX_BATCH_SIZE *
+                                      sizeof(*batch->delta_lengths));
+        batch->delta_data = malloc(MAX_BATCH_SIZE * DELTA_MAX);
+    }
+
+    if ( !batch->pfns || !batch->mfns || !batch->types || !batch->errors ||
+         !batch->guest_data || !batch->local_pages || !batch->rec_pfns ||
+         !batch->iov || ((pipelined || lz4) && !batch->buffer) ||
+         (lz4 && (!batch->compressed || !batch->lz4_wrkmem)) ||
+         (delta && (!batch->delta_map || !batch->delta_pfns ||
+                    !batch->delta_lengths || !batch->delta_data)) )
+        return -1;
+
+    return 0;
+}
+
+static void unmap_batch(struct xc_sr_context *ctx,
+                        struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+
+    batch->guest_mapping = NULL;
+    batch->nr_pages_mapped = 0;
+}
+
+/*
+ * Drop the guest mapping and the local pages held by a batch, making it
+ * ready to be refilled.
+ */
+static void release_batch(struct xc_sr_context *ctx,
+                          struct xc_sr_save_batch *batch)
+{
+    unsigned int i;
+
+    unmap_batch(ctx, batch);
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        free(batch->local_pages[i]);
+        batch->local_pages[i] = NULL;
+        batch->guest_data[i] = NULL;
+    }
+}
+
+static void free_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    if ( batch->local_pages && batch->guest_data )
+        release_batch(ctx, batch);
+
+    free(batch->delta_data);
+    free(batch->delta_lengths);
+    free(batch->delta_pfns);
+    free(batch->delta_map);
+    free(batch->iov);
+    free(batch->rec_pfns);
+    free(batch->lz4_wrkmem);
+    free(batch->compressed);
+    free(batch->local_pages);
+    free(batch->guest_data);
+    free(batch->buffer);
+    free(batch->errors);
+    free(batch->types);
+    free(batch->mfns);
+    free(batch->pfns);
+}
+
+/*
+ * Pipelined page transmission.  The thread running the save loop looks up
+ * the types of each batch and maps its frames, a pool of workers normalises
+ * and copies the page data, and a writer thread emits the PAGE_DATA records
+ * in the order the batches were submitted.
  *
- * This function:
- * - gets the types for each pfn in the batch.
- * - for each pfn with real data:
- *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * The batches form a ring indexed by monotonic counters.  All state changes
+ * happen under the lock; the contents of a batch belong to the single thread
+ * handling its current stage.
  */
-static int write_batch(struct xc_sr_context *ctx)
+struct xc_sr_save_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t space; /* A batch has been written. */
+    pthread_cond_t work;  /* A batch has been mapped. */
+    pthread_cond_t ready; /* A batch has been copied. */
+
+    /* Batches mapped, handed to workers, and written. */
+    unsigned long submitted, dispatched, written;
+
+    /* Set on cleanup, and on the first error of any stage. */
+    bool stop, failed;
+    int failed_errno;
+
+    /* threads[0] is the writer, followed by the workers. */
+    unsigned int nr_threads;
+    pthread_t threads[];
+};
+
+static struct xc_sr_save_batch *pipeline_batch(struct xc_sr_context *ctx,
+                                               unsigned long idx)
+{
+    return &ctx->save.batches[idx % ctx->save.nr_batches];
+}
+
+/* Record the first failure and wake everyone.  Called with the lock held. */
+static void pipeline_fail(struct xc_sr_save_pipeline *pl, int err)
+{
+    if ( !pl->failed )
+    {
+        pl->failed = true;
+        pl->failed_errno = err;
+    }
+
+    pthread_cond_broadcast(&pl->space);
+    pthread_cond_broadcast(&pl->work);
+    pthread_cond_broadcast(&pl->ready);
+}
+
+/*
+ * Mark a pfn to be sent again later.  Workers may defer pages concurrently
+ * with the thread mapping batches, so serialise against them.
+ */
+static void defer_page(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+
+    if ( pl )
+        pthread_mutex_lock(&pl->lock);
+
+    set_bit(pfn, ctx->save.deferred_pages);
+    ++ctx->save.nr_deferred_pages;
+
+    if ( pl )
+        pthread_mutex_unlock(&pl->lock);
+}
+
+/*
+ * Stage 1: gets the types for each pfn in the batch, and maps the pages
+ * which have data to send.
+ */
+static int map_batch(struct xc_sr_context *ctx, struct xc_sr_save_batch *batch)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned int i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned int nr_pfns = ctx->save.nr_batch_pfns;
-    void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec = {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    xen_pfn_t *mfns = batch->mfns, *types = batch->types;
+    unsigned int i, nr_pfns = batch->nr_pfns;
 
     assert(nr_pfns != 0);
 
-    /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
-    /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
-    /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
-    /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
-    /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
-    /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
-
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
-    {
-        ERROR("Unable to allocate arrays for a batch of %u pages",
-              nr_pfns);
-        goto err;
-    }
+    batch->nr_pages = 0;
 
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch->pfns[i]);
 
         /* Likely a ballooned page. */
         if ( mfns[i] == INVALID_MFN )
-        {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
-        }
+            defer_page(ctx, batch->pfns[i]);
     }
 
-    rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
-    if ( rc )
+    if ( xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types) )
     {
         PERROR("Failed to get types for pfn batch");
-        goto err;
+        return -1;
     }
-    rc = -1;
 
     for ( i = 0; i < nr_pfns; ++i )
     {
         if ( !is_known_page_type(types[i]) )
         {
             ERROR("Unknown type %#"PRIpfn" for pfn %#"PRIpfn, types[i], mfns[i]);
-            goto err;
+            return -1;
         }
 
         if ( !page_type_has_stream_data(types[i]) )
             continue;
 
-        mfns[nr_pages++] = mfns[i];
+        mfns[batch->nr_pages++] = mfns[i];
     }
 
-    if ( nr_pages > 0 )
+    if ( batch->nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(
-            xch->fmem, ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        batch->guest_mapping = xenforeignmemory_map(
+            xch->fmem, ctx->domid, PROT_READ, batch->nr_pages, mfns,
+            batch->errors);
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
-            goto err;
+            return -1;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = batch->nr_pages;
+    }
 
-        for ( i = 0, p = 0; i < nr_pfns; ++i )
-        {
-            if ( !page_type_has_stream_data(types[i]) )
-                continue;
+    return 0;
+}
 
-            if ( errors[p] )
-            {
-                ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
-                goto err;
-            }
+/*
+ * Once every page has been sent, try sending a page again as a delta against
+ * the contents last sent.  Returns true if it is, in which case it is left
+ * out of the PAGE_DATA record.  Pages sent in full are cached for the next
+ * iteration, including during the first.
+ */
+static bool delta_page(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch, unsigned int i,
+                       const void *page)
+{
+    unsigned int len;
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
-            rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
+    if ( !ctx->save.delta_cache )
+        return false;
 
-            if ( orig_page != page )
-                local_pages[i] = page;
+    /* Normalised page tables don't match what the receiver holds. */
+    if ( batch->types[i] != XEN_DOMCTL_PFINFO_NOTAB )
+    {
+        delta_cache_invalidate(ctx->save.delta_cache, batch->pfns[i]);
+        return false;
+    }
 
-            if ( rc )
+    len = delta_cache_update(ctx->save.delta_cache, batch->pfns[i], page,
+                             ctx->save.delta_active ?
+                             batch->delta_data + batch->delta_data_len : NULL,
+                             DELTA_MAX);
+    if ( !len )
+        return false;
+
+    set_bit(i, batch->delta_map);
+    batch->delta_pfns[batch->nr_delta_pages] = batch->pfns[i];
+    batch->delta_lengths[batch->nr_delta_pages] = len;
+    batch->nr_delta_pages++;
+    batch->delta_data_len += len;
+
+    return true;
+}
+
+static bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+
+    return !p[0] && !memcmp(p, p + 1, PAGE_SIZE - sizeof(*p));
+}
+
+/*
+ * Stage 2: attempts to localise the mapped pages, and constructs the pfn list
+ * of the PAGE_DATA record.  With 'copy' set, the page data is copied into the
+ * batch's buffer and the guest mapping is dropped straight away.
+ *
+ * When compressing the stream, pages which are entirely zero are elided, and
+ * with LZ4 the remaining data (which must have been copied) is compressed.
+ * Pages may be sent as deltas instead, in a separate PAGE_DELTA record.
+ */
+static int process_batch(struct xc_sr_context *ctx,
+                         struct xc_sr_save_batch *batch, bool copy)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *types = batch->types;
+    unsigned int i, p, nr_copied = 0;
+    bool elide_zero = ctx->save.compression != XGS_COMPRESS_NONE;
+    void *page, *orig_page;
+    size_t len;
+    int rc;
+
+    batch->nr_zero_pages = 0;
+    batch->compressed_len = 0;
+    batch->nr_delta_pages = 0;
+    batch->delta_data_len = 0;
+
+    if ( ctx->save.delta_active )
+        bitmap_clear(batch->delta_map, MAX_BATCH_SIZE);
+
+    for ( i = 0, p = 0; p < batch->nr_pages_mapped && i < batch->nr_pfns; ++i )
+    {
+        if ( !page_type_has_stream_data(types[i]) )
+            continue;
+
+        if ( batch->errors[p] )
+        {
+            ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
+                  batch->pfns[i], batch->mfns[p], batch->errors[p]);
+            return -1;
+        }
+
+        orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
+        rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
+
+        if ( orig_page != page )
+            batch->local_pages[i] = page;
+
+        if ( rc )
+        {
+            if ( rc == -1 && errno == EAGAIN )
             {
-                if ( rc == -1 && errno == EAGAIN )
-                {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
-                    types[i] = XEN_DOMCTL_PFINFO_XTAB;
-                    --nr_pages;
-                }
-                else
-                    goto err;
+                defer_page(ctx, batch->pfns[i]);
+                types[i] = XEN_DOMCTL_PFINFO_XTAB;
+                --batch->nr_pages;
             }
             else
-                guest_data[i] = page;
+                return -1;
+        }
+        else if ( elide_zero && page_is_zero(page) )
+        {
+            free(batch->local_pages[i]);
+            batch->local_pages[i] = NULL;
+            ++batch->nr_zero_pages;
+            --batch->nr_pages;
 
-            rc = -1;
-            ++p;
+            if ( ctx->save.delta_cache )
+                delta_cache_invalidate(ctx->save.delta_cache, batch->pfns[i]);
         }
+        else if ( delta_page(ctx, batch, i, page) )
+        {
+            free(batch->local_pages[i]);
+            batch->local_pages[i] = NULL;
+            --batch->nr_pages;
+        }
+        else if ( copy )
+        {
+            batch->guest_data[i] = memcpy(batch->buffer +
+                                          (nr_copied++ * PAGE_SIZE),
+                                          page, PAGE_SIZE);
+            free(batch->local_pages[i]);
+            batch->local_pages[i] = NULL;
+        }
+        else
+            batch->guest_data[i] = page;
+
+        ++p;
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    if ( copy )
+        unmap_batch(ctx, batch);
+
+    for ( i = 0, p = 0; i < batch->nr_pfns; ++i )
     {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
-        goto err;
+        if ( batch->nr_delta_pages && test_bit(i, batch->delta_map) )
+            continue;
+
+        /* The receiver drops any earlier contents of invalid pages. */
+        if ( ctx->save.delta_cache && !page_type_has_stream_data(types[i]) )
+            delta_cache_invalidate(ctx->save.delta_cache, batch->pfns[i]);
+
+        batch->rec_pfns[p] = ((uint64_t)(types[i]) << 32) | batch->pfns[i];
+
+        /* Pages which should have data, but were elided, are all zero. */
+        if ( page_type_has_stream_data(types[i]) && !batch->guest_data[i] )
+            batch->rec_pfns[p] |= PAGE_DATA_ZERO;
+
+        ++p;
     }
+    batch->nr_rec_pfns = p;
 
-    hdr.count = nr_pfns;
+    if ( ctx->save.compression == XGS_COMPRESS_LZ4 && batch->nr_pages )
+    {
+        assert(copy);
 
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+        len = batch->nr_pages * PAGE_SIZE;
+        if ( lz4_compress(batch->buffer, len, batch->compressed,
+                          &batch->compressed_len, batch->lz4_wrkmem) )
+        {
+            ERROR("Failed to compress %u pages", batch->nr_pages);
+            return -1;
+        }
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+        /* Incompressible data is sent as it is. */
+        if ( batch->compressed_len >= len )
+            batch->compressed_len = 0;
+    }
+
+    return 0;
+}
+
+/* Writes the pages of a batch which are sent as deltas. */
+static int write_page_delta(struct xc_sr_context *ctx,
+                            struct xc_sr_save_batch *batch)
+{
+    static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+
+    xc_interface *xch = ctx->xch;
+    unsigned int nr_deltas = batch->nr_delta_pages;
+    struct xc_sr_rec_page_delta_header hdr = { .count = nr_deltas };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_PAGE_DELTA,
+        .length = sizeof(hdr) +
+                  nr_deltas * (sizeof(*batch->delta_pfns) +
+                               sizeof(*batch->delta_lengths)) +
+                  batch->delta_data_len,
+    };
+    struct iovec iov[] = {
+        { &rec.type,            sizeof(rec.type) },
+        { &rec.length,          sizeof(rec.length) },
+        { &hdr,                 sizeof(hdr) },
+        { batch->delta_pfns,    nr_deltas * sizeof(*batch->delta_pfns) },
+        { batch->delta_lengths, nr_deltas * sizeof(*batch->delta_lengths) },
+        { batch->delta_data,    batch->delta_data_len },
+        { (void *)zeroes,       ROUNDUP(rec.length, REC_ALIGN_ORDER) -
+                                rec.length },
+    };
+
+    if ( writev_exact(ctx->fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write page deltas to stream");
+        return -1;
+    }
+
+    ctx->save.nr_delta_pages += nr_deltas;
+    ctx->save.page_data_bytes += sizeof(rec.type) + sizeof(rec.length) +
+        ROUNDUP(rec.length, REC_ALIGN_ORDER);
+
+    return 0;
+}
+
+/*
+ * Stage 3: writes the batch into the stream as a PAGE_DATA record, or as a
+ * COMPRESSED_PAGE_DATA record if any pages were elided or compressed, along
+ * with a PAGE_DELTA record if needed.  Page data which is contiguous in
+ * memory is sent using a single iovec.
+ */
+static int write_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+
+    xc_interface *xch = ctx->xch;
+    unsigned int i, nr_pfns = batch->nr_rec_pfns, nr_pages = batch->nr_pages;
+    struct iovec *iov = batch->iov;
+    int iovcnt;
+    struct xc_sr_rec_page_data_header hdr = { .count = nr_pfns };
+    struct xc_sr_rec_compressed_page_data_header chdr = {
+        .count = nr_pfns,
+        .compression = (batch->compressed_len ? COMPRESSED_PAGE_DATA_LZ4
+                                              : COMPRESSED_PAGE_DATA_NONE),
+        .data_length = (batch->compressed_len ?: nr_pages * PAGE_SIZE),
+    };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_PAGE_DATA,
+    };
+
+    if ( batch->nr_delta_pages && write_page_delta(ctx, batch) )
+        return -1;
+
+    /* Every page may have been sent as a delta. */
+    if ( !nr_pfns )
+        return 0;
 
     iov[0].iov_base = &rec.type;
     iov[0].iov_len = sizeof(rec.type);
@@ -231,68 +570,332 @@ static int write_batch(struct xc_sr_context *ctx)
     iov[1].iov_base = &rec.length;
     iov[1].iov_len = sizeof(rec.length);
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    if ( batch->nr_zero_pages || batch->compressed_len )
+    {
+        rec.type = REC_TYPE_COMPRESSED_PAGE_DATA;
+        iov[2].iov_base = &chdr;
+        iov[2].iov_len = sizeof(chdr);
+    }
+    else
+    {
+        iov[2].iov_base = &hdr;
+        iov[2].iov_len = sizeof(hdr);
+    }
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    iov[3].iov_base = batch->rec_pfns;
+    iov[3].iov_len = nr_pfns * sizeof(*batch->rec_pfns);
 
     iovcnt = 4;
 
-    if ( nr_pages )
+    rec.length = iov[2].iov_len + iov[3].iov_len;
+
+    if ( batch->compressed_len )
+    {
+        iov[iovcnt].iov_base = batch->compressed;
+        iov[iovcnt].iov_len = batch->compressed_len;
+        iovcnt++;
+
+        rec.length += batch->compressed_len;
+        nr_pages = 0;
+    }
+    else
+        rec.length += nr_pages * PAGE_SIZE;
+
+    for ( i = 0; nr_pages && i < batch->nr_pfns; ++i )
     {
-        for ( i = 0; i < nr_pfns; ++i )
+        if ( !batch->guest_data[i] )
+            continue;
+
+        if ( iovcnt > 4 &&
+             iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len ==
+             batch->guest_data[i] )
+            iov[iovcnt - 1].iov_len += PAGE_SIZE;
+        else
         {
-            if ( guest_data[i] )
-            {
-                iov[iovcnt].iov_base = guest_data[i];
-                iov[iovcnt].iov_len = PAGE_SIZE;
-                iovcnt++;
-                --nr_pages;
-            }
+            iov[iovcnt].iov_base = batch->guest_data[i];
+            iov[iovcnt].iov_len = PAGE_SIZE;
+            iovcnt++;
         }
+        --nr_pages;
+    }
+
+    /* Compressed data needs padding up to the record alignment. */
+    if ( ROUNDUP(rec.length, REC_ALIGN_ORDER) != rec.length )
+    {
+        iov[iovcnt].iov_base = (void *)zeroes;
+        iov[iovcnt].iov_len = ROUNDUP(rec.length, REC_ALIGN_ORDER) - rec.length;
+        iovcnt++;
     }
 
     if ( writev_exact(ctx->fd, iov, iovcnt) )
     {
         PERROR("Failed to write page data to stream");
-        goto err;
+        return -1;
     }
 
     /* Sanity check we have sent all the pages we expected to. */
     assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
 
- err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
-    free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
+    ctx->save.page_data_bytes += sizeof(rec.type) + sizeof(rec.length) +
+        ROUNDUP(rec.length, REC_ALIGN_ORDER);
+
+    return 0;
+}
+
+static void *pipeline_worker(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+    int rc, err;
+
+    pthread_mutex_lock(&pl->lock);
+
+    for ( ; ; )
+    {
+        while ( !pl->stop && !pl->failed && pl->dispatched == pl->submitted )
+            pthread_cond_wait(&pl->work, &pl->lock);
+
+        if ( pl->stop || pl->failed )
+            break;
+
+        batch = pipeline_batch(ctx, pl->dispatched++);
+        batch->state = XC_SR_BATCH_BUSY;
+        pthread_mutex_unlock(&pl->lock);
+
+        rc = process_batch(ctx, batch, true);
+        err = errno;
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc )
+            pipeline_fail(pl, err);
+        else
+        {
+            batch->state = XC_SR_BATCH_READY;
+            pthread_cond_signal(&pl->ready);
+        }
+    }
+
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+static void *pipeline_writer(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+    int rc, err;
+
+    pthread_mutex_lock(&pl->lock);
+
+    for ( ; ; )
+    {
+        /* Batches complete out of order; wait for the oldest one. */
+        while ( !pl->stop && !pl->failed &&
+                pipeline_batch(ctx, pl->written)->state != XC_SR_BATCH_READY )
+            pthread_cond_wait(&pl->ready, &pl->lock);
+
+        if ( pl->stop || pl->failed )
+            break;
+
+        batch = pipeline_batch(ctx, pl->written);
+        pthread_mutex_unlock(&pl->lock);
+
+        rc = write_batch(ctx, batch);
+        err = errno;
+        release_batch(ctx, batch);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc )
+            pipeline_fail(pl, err);
+        else
+        {
+            batch->state = XC_SR_BATCH_FREE;
+            pl->written++;
+            pthread_cond_signal(&pl->space);
+        }
+    }
+
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/* Report a failure of another stage to the caller.  Lock held. */
+static int pipeline_check(struct xc_sr_save_pipeline *pl)
+{
+    if ( !pl->failed )
+        return 0;
+
+    errno = pl->failed_errno;
+    return -1;
+}
+
+/*
+ * Hand the current batch to the pipeline, waiting for a free slot in the
+ * ring.  Mapping happens on the calling thread.
+ */
+static int pipeline_submit(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+    while ( !pl->failed && pl->submitted - pl->written == ctx->save.nr_batches )
+        pthread_cond_wait(&pl->space, &pl->lock);
+    rc = pipeline_check(pl);
+    pthread_mutex_unlock(&pl->lock);
+
+    if ( rc )
+        return rc;
+
+    batch = pipeline_batch(ctx, pl->submitted);
+    assert(batch->state == XC_SR_BATCH_FREE);
+
+    batch->nr_pfns = ctx->save.nr_batch_pfns;
+    memcpy(batch->pfns, ctx->save.batch_pfns,
+           batch->nr_pfns * sizeof(*batch->pfns));
+
+    rc = map_batch(ctx, batch);
+
+    pthread_mutex_lock(&pl->lock);
+    if ( rc )
+        pipeline_fail(pl, errno);
+    else
+    {
+        batch->state = XC_SR_BATCH_MAPPED;
+        pl->submitted++;
+        pthread_cond_signal(&pl->work);
+    }
+    rc = pipeline_check(pl);
+    pthread_mutex_unlock(&pl->lock);
 
     return rc;
 }
 
+/*
+ * Wait for all submitted batches to be written.  Nothing else may be written
+ * into the stream while batches are in flight.
+ */
+static int pipeline_drain(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+    while ( !pl->failed && pl->written != pl->submitted )
+        pthread_cond_wait(&pl->space, &pl->lock);
+    rc = pipeline_check(pl);
+    pthread_mutex_unlock(&pl->lock);
+
+    return rc;
+}
+
+static void pipeline_stop(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    unsigned int i;
+
+    if ( !pl )
+        return;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->stop = true;
+    pthread_cond_broadcast(&pl->work);
+    pthread_cond_broadcast(&pl->ready);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_threads; ++i )
+        pthread_join(pl->threads[i], NULL);
+
+    pthread_cond_destroy(&pl->ready);
+    pthread_cond_destroy(&pl->work);
+    pthread_cond_destroy(&pl->space);
+    pthread_mutex_destroy(&pl->lock);
+
+    free(pl);
+    ctx->save.pipeline = NULL;
+}
+
+/*
+ * Start the writer and the worker threads.  The batches must have been
+ * allocated already.
+ */
+static int pipeline_start(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pl;
+    unsigned int i;
+    int rc;
+
+    pl = calloc(1, sizeof(*pl) +
+                (ctx->save.nr_workers + 1) * sizeof(*pl->threads));
+    if ( !pl )
+    {
+        ERROR("Unable to allocate memory for the save pipeline");
+        return -1;
+    }
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->space, NULL);
+    pthread_cond_init(&pl->work, NULL);
+    pthread_cond_init(&pl->ready, NULL);
+    ctx->save.pipeline = pl;
+
+    for ( i = 0; i <= ctx->save.nr_workers; ++i )
+    {
+        rc = pthread_create(&pl->threads[i], NULL,
+                            i ? pipeline_worker : pipeline_writer, ctx);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to start save pipeline thread %u", i);
+            pipeline_stop(ctx);
+            return -1;
+        }
+        pl->nr_threads++;
+    }
+
+    DPRINTF("Saving with %u page copy workers", ctx->save.nr_workers);
+
+    return 0;
+}
+
 /*
  * Flush a batch of pfns into the stream.
  */
 static int flush_batch(struct xc_sr_context *ctx)
 {
+    struct xc_sr_save_batch *batch = &ctx->save.batches[0];
     int rc = 0;
 
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
-    rc = write_batch(ctx);
+    if ( ctx->save.pipeline )
+        rc = pipeline_submit(ctx);
+    else
+    {
+        batch->nr_pfns = ctx->save.nr_batch_pfns;
+        memcpy(batch->pfns, ctx->save.batch_pfns,
+               batch->nr_pfns * sizeof(*batch->pfns));
+
+        rc = map_batch(ctx, batch);
+        if ( !rc )
+            rc = process_batch(ctx, batch,
+                               ctx->save.compression == XGS_COMPRESS_LZ4);
+        if ( !rc )
+            rc = write_batch(ctx, batch);
+
+        release_batch(ctx, batch);
+    }
 
     if ( !rc )
     {
+        ctx->save.nr_batch_pfns = 0;
         VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.batch_pfns,
                                     MAX_BATCH_SIZE *
                                     sizeof(*ctx->save.batch_pfns));
@@ -356,6 +959,28 @@ static int suspend_domain(struct xc_sr_context *ctx)
     return 0;
 }
 
+/*
+ * Account the page data sent by an iteration, started at 'start', in the
+ * precopy statistics.
+ */
+static void update_throughput(struct xc_sr_context *ctx,
+                              const struct timespec *start, uint64_t bytes)
+{
+    xc_interface *xch = ctx->xch;
+    struct timespec now;
+    uint64_t usec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    usec = (now.tv_sec - start->tv_sec) * 1000000ULL +
+        (now.tv_nsec - start->tv_nsec) / 1000;
+
+    ctx->save.stats.throughput = usec ? (bytes * 1000000 / 1024) / usec : 0;
+
+    DPRINTF("Sent %"PRIu64" bytes of page data in %"PRIu64"us (%lu KiB/s)",
+            bytes, usec, ctx->save.stats.throughput);
+}
+
 /*
  * Send a subset of pages in the guests p2m, according to the dirty bitmap.
  * Used for each subsequent iteration of the live migration loop.
@@ -368,10 +993,15 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     xc_interface *xch = ctx->xch;
     xen_pfn_t p;
     unsigned long written;
+    unsigned long start_deltas = ctx->save.nr_delta_pages;
+    uint64_t start_bytes = ctx->save.page_data_bytes;
+    struct timespec start;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     for ( p = 0, written = 0; p < ctx->save.p2m_size; ++p )
     {
         if ( !test_bit(p, dirty_bitmap) )
@@ -392,11 +1022,27 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     if ( rc )
         return rc;
 
+    if ( ctx->save.pipeline )
+    {
+        rc = pipeline_drain(ctx);
+        if ( rc )
+        {
+            PERROR("Failed to send page data");
+            return rc;
+        }
+    }
+
     if ( written > entries )
         DPRINTF("Bitmap contained more entries than expected...");
 
     xc_report_progress_step(xch, entries, entries);
 
+    update_throughput(ctx, &start, ctx->save.page_data_bytes - start_bytes);
+
+    if ( ctx->save.delta_active )
+        DPRINTF("Sent %lu of %lu pages as deltas",
+                ctx->save.nr_delta_pages - start_deltas, written);
+
     return ctx->save.ops.check_vm_state(ctx);
 }
 
@@ -537,6 +1183,9 @@ static int send_memory_live(struct xc_sr_context *ctx)
             rc = send_dirty_pages(ctx, stats.dirty_count);
             if ( rc )
                 goto out;
+
+            /* Every page has been sent, so later ones may be deltas. */
+            ctx->save.delta_active = ctx->save.delta_cache;
         }
 
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
@@ -693,6 +1342,295 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Write the POSTCOPY_PFNS records, listing the pages to be sent after the
+ * guest has been resumed on the destination.
+ */
+static int write_postcopy_pfns(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_PFNS };
+    uint64_t *pfns;
+    unsigned int nr = 0;
+    xen_pfn_t p;
+    int rc = 0;
+
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate memory for post-copy pfn list");
+        return -1;
+    }
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( !test_bit(p, ctx->save.postcopy_pfns) )
+            continue;
+
+        pfns[nr++] = p;
+
+        if ( nr == MAX_BATCH_SIZE )
+        {
+            rc = write_split_record(ctx, &rec, pfns, nr * sizeof(*pfns));
+            if ( rc )
+                goto out;
+            nr = 0;
+        }
+    }
+
+    if ( nr )
+        rc = write_split_record(ctx, &rec, pfns, nr * sizeof(*pfns));
+
+ out:
+    free(pfns);
+    return rc;
+}
+
+/*
+ * Read a POSTCOPY_FAULT record from the destination, and queue the pages it
+ * names which are still outstanding.
+ */
+static int handle_postcopy_fault(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    const uint64_t *pfns;
+    unsigned int i, count;
+    int rc;
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        return rc;
+
+    if ( rec.type != REC_TYPE_POSTCOPY_FAULT )
+    {
+        ERROR("Expected %s record, got %s",
+              rec_type_to_str(REC_TYPE_POSTCOPY_FAULT),
+              rec_type_to_str(rec.type));
+        rc = -1;
+        goto out;
+    }
+
+    if ( rec.length % sizeof(*pfns) )
+    {
+        ERROR("%s record length %u not a multiple of %zu",
+              rec_type_to_str(rec.type), rec.length, sizeof(*pfns));
+        rc = -1;
+        goto out;
+    }
+
+    pfns = rec.data;
+    count = rec.length / sizeof(*pfns);
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( pfns[i] >= ctx->save.p2m_size )
+        {
+            ERROR("Faulting pfn %#"PRIx64" out of range", pfns[i]);
+            rc = -1;
+            goto out;
+        }
+
+        /* Already sent, or already requested by an earlier fault. */
+        if ( !test_and_clear_bit(pfns[i], ctx->save.postcopy_pfns) )
+            continue;
+
+        --ctx->save.nr_postcopy_pfns;
+
+        rc = add_to_batch(ctx, pfns[i]);
+        if ( rc )
+            goto out;
+    }
+
+    rc = flush_batch(ctx);
+
+ out:
+    free(rec.data);
+    return rc;
+}
+
+/*
+ * Send the outstanding pages of a post-copy migration, in pfn order, but
+ * ahead of that any which the destination reports the guest faulting on.
+ */
+static int send_postcopy_pages(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long entries = ctx->save.nr_postcopy_pfns;
+    xen_pfn_t p = 0;
+    int rc = 0;
+
+    xc_set_progress_prefix(xch, "Post-copy");
+
+    while ( ctx->save.nr_postcopy_pfns )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll for post-copy faults");
+            goto out;
+        }
+
+        if ( rc )
+        {
+            rc = handle_postcopy_fault(ctx);
+            if ( rc )
+                goto out;
+            continue;
+        }
+
+        /* Background transfer of the next batch. */
+        for ( ; p < ctx->save.p2m_size &&
+                ctx->save.nr_batch_pfns < MAX_BATCH_SIZE; ++p )
+        {
+            if ( !test_and_clear_bit(p, ctx->save.postcopy_pfns) )
+                continue;
+
+            --ctx->save.nr_postcopy_pfns;
+            ctx->save.batch_pfns[ctx->save.nr_batch_pfns++] = p;
+        }
+
+        if ( ctx->save.nr_batch_pfns == 0 )
+        {
+            ERROR("%lu post-copy pages outstanding, but none found",
+                  ctx->save.nr_postcopy_pfns);
+            rc = -1;
+            goto out;
+        }
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, entries - ctx->save.nr_postcopy_pfns,
+                                entries);
+    }
+
+    rc = flush_batch(ctx);
+    if ( !rc && ctx->save.pipeline )
+        rc = pipeline_drain(ctx);
+
+    if ( rc )
+        PERROR("Failed to send post-copy page data");
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    return rc;
+}
+
+/*
+ * Suspend the domain and send the dirty memory which the destination needs
+ * to run it, followed by the end of checkpoint records.  The guest is then
+ * resumed on the destination, and the remaining dirty memory is sent in the
+ * background or as the guest faults on it.
+ */
+static int suspend_and_send_postcopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_TRANSITION };
+    unsigned long *resident = NULL, nr_resident = 0;
+    xen_pfn_t p;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = suspend_domain(ctx);
+    if ( rc )
+        goto out;
+
+    if ( xc_logdirty_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
+         ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        rc = -1;
+        goto out;
+    }
+
+    bitmap_or(dirty_bitmap, ctx->save.deferred_pages, ctx->save.p2m_size);
+    bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
+    ctx->save.nr_deferred_pages = 0;
+
+    resident = bitmap_alloc(ctx->save.p2m_size);
+    if ( !resident )
+    {
+        ERROR("Unable to allocate memory for resident page bitmap");
+        rc = -1;
+        goto out;
+    }
+
+    rc = ctx->save.ops.postcopy_resident(ctx, resident);
+    if ( rc )
+        goto out;
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( !test_bit(p, dirty_bitmap) )
+            continue;
+
+        if ( test_bit(p, resident) )
+        {
+            ++nr_resident;
+            continue;
+        }
+
+        clear_bit(p, dirty_bitmap);
+        set_bit(p, ctx->save.postcopy_pfns);
+        ++ctx->save.nr_postcopy_pfns;
+    }
+
+    DPRINTF("Post-copy: %lu pages before, %lu pages after switchover",
+            nr_resident, ctx->save.nr_postcopy_pfns);
+
+    /* The destination replaces the outstanding pages wholesale. */
+    ctx->save.delta_active = false;
+
+    xc_set_progress_prefix(xch, "Post-copy resident");
+    rc = send_dirty_pages(ctx, nr_resident);
+    xc_set_progress_prefix(xch, NULL);
+    if ( rc )
+        goto out;
+
+    /* Nothing left to send lazily; complete as an ordinary migration. */
+    if ( !ctx->save.nr_postcopy_pfns )
+        goto out;
+
+    if ( !dominfo_shutdown_with(&ctx->dominfo, SHUTDOWN_suspend) )
+    {
+        ERROR("Domain has not been suspended");
+        rc = -1;
+        goto out;
+    }
+
+    rc = ctx->save.ops.end_of_checkpoint(ctx);
+    if ( rc )
+        goto out;
+
+    rc = write_postcopy_pfns(ctx);
+    if ( rc )
+        goto out;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        goto out;
+
+    ctx->save.postcopy_transitioned = true;
+    xc_report_progress_single(xch, "Post-copy switchover");
+
+    rc = send_postcopy_pages(ctx);
+
+ out:
+    free(resident);
+    return rc;
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -702,6 +1640,9 @@ static int verify_frames(struct xc_sr_context *ctx)
 
     DPRINTF("Enabling verify mode");
 
+    /* The receiver compares the pages sent, so they must be sent in full. */
+    ctx->save.delta_active = false;
+
     rc = write_record(ctx, &rec);
     if ( rc )
         goto out;
@@ -743,11 +1684,16 @@ static int send_domain_memory_live(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
-    rc = suspend_and_send_dirty(ctx);
+    if ( ctx->save.postcopy )
+        rc = suspend_and_send_postcopy(ctx);
+    else
+        rc = suspend_and_send_dirty(ctx);
     if ( rc )
         goto out;
 
-    if ( ctx->save.debug && ctx->stream_type == XC_STREAM_PLAIN )
+    /* The destination guest may already be running. */
+    if ( ctx->save.debug && ctx->stream_type == XC_STREAM_PLAIN &&
+         !ctx->save.postcopy_transitioned )
     {
         rc = verify_frames(ctx);
         if ( rc )
@@ -792,6 +1738,7 @@ static int send_domain_memory_nonlive(struct xc_sr_context *ctx)
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    unsigned int i;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
@@ -815,6 +1762,64 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    if ( ctx->save.postcopy )
+    {
+        ctx->save.postcopy_pfns = bitmap_alloc(ctx->save.p2m_size);
+        if ( !ctx->save.postcopy_pfns )
+        {
+            ERROR("Unable to allocate memory for post-copy bitmap");
+            rc = -1;
+            errno = ENOMEM;
+            goto err;
+        }
+    }
+
+    /*
+     * Enough batches for every worker to have one, with one more being
+     * mapped and one more being written.
+     */
+    ctx->save.nr_batches = ctx->save.nr_workers ? ctx->save.nr_workers + 2 : 1;
+    ctx->save.batches = calloc(ctx->save.nr_batches,
+                               sizeof(*ctx->save.batches));
+    if ( !ctx->save.batches )
+    {
+        ERROR("Unable to allocate memory for %u page batches",
+              ctx->save.nr_batches);
+        rc = -1;
+        errno = ENOMEM;
+        goto err;
+    }
+
+    if ( ctx->save.live && ctx->save.delta_cache_size )
+    {
+        ctx->save.delta_cache = delta_cache_alloc(ctx,
+                                                  ctx->save.delta_cache_size);
+        if ( !ctx->save.delta_cache )
+        {
+            rc = -1;
+            errno = ENOMEM;
+            goto err;
+        }
+    }
+
+    for ( i = 0; i < ctx->save.nr_batches; ++i )
+    {
+        if ( alloc_batch(ctx, &ctx->save.batches[i]) )
+        {
+            ERROR("Unable to allocate memory for page batch %u", i);
+            rc = -1;
+            errno = ENOMEM;
+            goto err;
+        }
+    }
+
+    if ( ctx->save.nr_workers )
+    {
+        rc = pipeline_start(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = 0;
 
  err:
@@ -824,9 +1829,16 @@ static int setup(struct xc_sr_context *ctx)
 static void cleanup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    unsigned int i;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    pipeline_stop(ctx);
+
+    for ( i = 0; ctx->save.batches && i < ctx->save.nr_batches; ++i )
+        free_batch(ctx, &ctx->save.batches[i]);
+    free(ctx->save.batches);
+    delta_cache_free(ctx->save.delta_cache);
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0);
@@ -836,6 +1848,7 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    free(ctx->save.postcopy_pfns);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
@@ -899,9 +1912,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
             goto err;
         }
 
-        rc = ctx->save.ops.end_of_checkpoint(ctx);
-        if ( rc )
-            goto err;
+        /* Already sent ahead of a post-copy switchover. */
+        if ( !ctx->save.postcopy_transitioned )
+        {
+            rc = ctx->save.ops.end_of_checkpoint(ctx);
+            if ( rc )
+                goto err;
+        }
 
         if ( ctx->stream_type != XC_STREAM_PLAIN )
         {
@@ -980,7 +1997,8 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
 
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags, struct save_callbacks *callbacks,
-                   xc_stream_type_t stream_type, int recv_fd)
+                   xc_stream_type_t stream_type, int recv_fd,
+                   const struct save_params *params)
 {
     struct xc_sr_context ctx = {
         .xch = xch,
@@ -994,6 +2012,34 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
     ctx.save.recv_fd = recv_fd;
+    ctx.save.nr_workers = params ? params->nr_workers : 0;
+    ctx.save.compression = params ? params->compression : XGS_COMPRESS_NONE;
+    ctx.save.delta_cache_size =
+        params ? (unsigned long)params->delta_cache_mb << 20 : 0;
+    ctx.save.postcopy = params ? params->postcopy : false;
+
+    if ( ctx.save.nr_workers > XGS_MAX_WORKERS )
+    {
+        ERROR("Too many save workers requested: %u (max %u)",
+              ctx.save.nr_workers, XGS_MAX_WORKERS);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( ctx.save.compression > XGS_COMPRESS_LZ4 )
+    {
+        ERROR("Unknown page data compression %u", ctx.save.compression);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The secondary runs the guest, so its pages diverge from the cache. */
+    if ( ctx.save.delta_cache_size && stream_type == XC_STREAM_COLO )
+    {
+        ERROR("Delta encoding of pages is not supported with COLO");
+        errno = EINVAL;
+        return -1;
+    }
 
     if ( xc_domain_getinfo_single(xch, dom, &ctx.dominfo) < 0 )
     {
@@ -1003,6 +2049,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
 
     hvm = ctx.dominfo.flags & XEN_DOMINF_hvm_guest;
 
+    if ( ctx.save.postcopy &&
+         (!hvm || !ctx.save.live || stream_type != XC_STREAM_PLAIN ||
+          recv_fd < 0) )
+    {
+        ERROR("Post-copy requires a live, plain migration of an HVM guest,"
+              " with a back channel");
+        errno = EINVAL;
+        return -1;
+    }
+
     /* Sanity check stream_type-related parameters */
     switch ( stream_type )
     {
@@ -1022,8 +2078,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
         break;
     }
 
-    DPRINTF("fd %d, dom %u, flags %u, hvm %d",
-            io_fd, dom, flags, hvm);
+    DPRINTF("fd %d, dom %u, flags %u, hvm %d, workers %u, compression %u,"
+            " postcopy %d", io_fd, dom, flags, hvm, ctx.save.nr_workers,
+            ctx.save.compression, ctx.save.postcopy);
 
     ctx.domid = dom;
 
@@ -211,6 +211,76 @@ static int x86_hvm_end_of_checkpoint(struct xc_sr_context *ctx)
     return 0;
 }
 
+/*
+ * save_ops function.  The special pages named by HVM params are used by the
+ * toolstack and Xen, and are reset or remapped as the guest is restored.
+ */
+static int x86_hvm_postcopy_resident(struct xc_sr_context *ctx,
+                                     unsigned long *bitmap)
+{
+    static const unsigned int params[] = {
+        HVM_PARAM_STORE_PFN,
+        HVM_PARAM_IOREQ_PFN,
+        HVM_PARAM_BUFIOREQ_PFN,
+        HVM_PARAM_PAGING_RING_PFN,
+        HVM_PARAM_MONITOR_RING_PFN,
+        HVM_PARAM_SHARING_RING_PFN,
+        HVM_PARAM_CONSOLE_PFN,
+        HVM_PARAM_IDENT_PT,
+        HVM_PARAM_VM86_TSS_SIZED,
+        HVM_PARAM_VM_GENERATION_ID_ADDR,
+    };
+
+    xc_interface *xch = ctx->xch;
+    uint64_t value, nr_ioreq_server_pages;
+    xen_pfn_t pfn;
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(params); i++ )
+    {
+        if ( xc_hvm_param_get(xch, ctx->domid, params[i], &value) )
+        {
+            PERROR("Failed to get HVMPARAM at index %u", params[i]);
+            return -1;
+        }
+
+        switch ( params[i] )
+        {
+        case HVM_PARAM_IDENT_PT:
+        case HVM_PARAM_VM_GENERATION_ID_ADDR:
+            pfn = value >> PAGE_SHIFT;
+            break;
+
+        case HVM_PARAM_VM86_TSS_SIZED:
+            /* Size in the upper half, address in the lower. */
+            pfn = (uint32_t)value >> PAGE_SHIFT;
+            break;
+
+        default:
+            pfn = value;
+            break;
+        }
+
+        if ( value && pfn < ctx->save.p2m_size )
+            set_bit(pfn, bitmap);
+    }
+
+    if ( xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_IOREQ_SERVER_PFN,
+                          &value) ||
+         xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_NR_IOREQ_SERVER_PAGES,
+                          &nr_ioreq_server_pages) )
+    {
+        PERROR("Failed to get ioreq server pages");
+        return -1;
+    }
+
+    for ( pfn = value; value && pfn < value + nr_ioreq_server_pages &&
+                       pfn < ctx->save.p2m_size; pfn++ )
+        set_bit(pfn, bitmap);
+
+    return 0;
+}
+
 static int x86_hvm_cleanup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -237,6 +307,7 @@ struct xc_sr_save_ops save_ops_x86_hvm =
     .start_of_checkpoint = x86_hvm_start_of_checkpoint,
     .end_of_checkpoint   = x86_hvm_end_of_checkpoint,
     .check_vm_state      = x86_hvm_check_vm_state,
+    .postcopy_resident   = x86_hvm_postcopy_resident,
     .cleanup             = x86_hvm_cleanup,
 };
 
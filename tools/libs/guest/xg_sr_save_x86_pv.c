@@ -1116,6 +1116,18 @@ static int x86_pv_check_vm_state(struct xc_sr_context *ctx)
     return x86_pv_check_vm_state_p2m_list(ctx);
 }
 
+/* save_ops function.  Post-copy relies on mem_paging, which is HVM only. */
+static int x86_pv_postcopy_resident(struct xc_sr_context *ctx,
+                                    unsigned long *bitmap)
+{
+    xc_interface *xch = ctx->xch;
+
+    ERROR("Post-copy migration is not supported for PV guests");
+    errno = EOPNOTSUPP;
+
+    return -1;
+}
+
 static int x86_pv_cleanup(struct xc_sr_context *ctx)
 {
     free(ctx->x86.pv.p2m_pfns);
@@ -1142,6 +1154,7 @@ struct xc_sr_save_ops save_ops_x86_pv =
     .start_of_checkpoint = x86_pv_start_of_checkpoint,
     .end_of_checkpoint   = x86_pv_end_of_checkpoint,
     .check_vm_state      = x86_pv_check_vm_state,
+    .postcopy_resident   = x86_pv_postcopy_resident,
     .cleanup             = x86_pv_cleanup,
 };
 
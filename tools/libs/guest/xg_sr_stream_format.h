@@ -76,6 +76,11 @@ struct xc_sr_rhdr
 #define REC_TYPE_STATIC_DATA_END            0x00000010U
 #define REC_TYPE_X86_CPUID_POLICY           0x00000011U
 #define REC_TYPE_X86_MSR_POLICY             0x00000012U
+#define REC_TYPE_COMPRESSED_PAGE_DATA       0x00000013U
+#define REC_TYPE_PAGE_DELTA                 0x00000014U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000015U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000016U
+#define REC_TYPE_POSTCOPY_FAULT             0x00000017U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +95,31 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/* COMPRESSED_PAGE_DATA */
+struct xc_sr_rec_compressed_page_data_header
+{
+    uint32_t count;
+    uint32_t compression;
+    uint32_t data_length;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
+#define COMPRESSED_PAGE_DATA_NONE 0x00000000U
+#define COMPRESSED_PAGE_DATA_LZ4  0x00000001U
+
+/* Set in a pfn entry of a COMPRESSED_PAGE_DATA record for an all-zero page. */
+#define PAGE_DATA_ZERO      0x0010000000000000ULL
+
+/* PAGE_DELTA */
+struct xc_sr_rec_page_delta_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+    /* Followed by uint32_t length[count], and the encoded deltas. */
+};
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
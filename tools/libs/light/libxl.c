@@ -533,6 +533,7 @@ libxl_numainfo *libxl_get_numainfo(libxl_ctx *ctx, int *nr)
        LIBXL_NUMAINFO_INVALID_ENTRY : val
         ret[i].size = V(meminfo[i].memsize, XEN_INVALID_MEM_SZ);
         ret[i].free = V(meminfo[i].memfree, XEN_INVALID_MEM_SZ);
+        ret[i].dirty = V(meminfo[i].memdirty, XEN_INVALID_MEM_SZ);
         ret[i].num_dists = num_nodes;
         for (j = 0; j < ret[i].num_dists; j++) {
             unsigned idx = i * num_nodes + j;
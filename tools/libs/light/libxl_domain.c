@@ -502,12 +502,38 @@ static void domain_suspend_cb(libxl__egc *egc,
 
 }
 
-int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
-                         const libxl_asyncop_how *ao_how)
+static int domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                          const libxl_domain_save_params *params,
+                          const libxl_asyncop_how *ao_how)
 {
     AO_CREATE(ctx, domid, ao_how);
+    unsigned int compression;
     int rc;
 
+    if (params && params->workers > XGS_MAX_WORKERS) {
+        LOGD(ERROR, domid, "Too many save workers: %u (max %u)",
+             params->workers, XGS_MAX_WORKERS);
+        rc = ERROR_INVAL;
+        goto out_err;
+    }
+
+    switch (params ? params->compression : LIBXL_SAVE_COMPRESSION_NONE) {
+    case LIBXL_SAVE_COMPRESSION_NONE:
+        compression = XGS_COMPRESS_NONE;
+        break;
+    case LIBXL_SAVE_COMPRESSION_ZERO:
+        compression = XGS_COMPRESS_ZERO;
+        break;
+    case LIBXL_SAVE_COMPRESSION_LZ4:
+        compression = XGS_COMPRESS_LZ4;
+        break;
+    default:
+        LOGD(ERROR, domid, "Unknown save compression %d",
+             params->compression);
+        rc = ERROR_INVAL;
+        goto out_err;
+    }
+
     libxl_domain_type type = libxl__domain_type(gc, domid);
     if (type == LIBXL_DOMAIN_TYPE_INVALID) {
         rc = ERROR_FAIL;
@@ -526,6 +552,9 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
+    dss->save_workers = params ? params->workers : 0;
+    dss->save_compression = compression;
+    dss->save_delta_cache_mb = params ? params->delta_cache_mb : 0;
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
                                      ~(O_NONBLOCK|O_NDELAY), 0,
@@ -539,6 +568,20 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     return AO_CREATE_FAIL(rc);
 }
 
+int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                         const libxl_asyncop_how *ao_how)
+{
+    return domain_suspend(ctx, domid, fd, flags, NULL, ao_how);
+}
+
+int libxl_domain_suspend_params(libxl_ctx *ctx, uint32_t domid, int fd,
+                                int flags,
+                                const libxl_domain_save_params *params,
+                                const libxl_asyncop_how *ao_how)
+{
+    return domain_suspend(ctx, domid, fd, flags, params, ao_how);
+}
+
 static void domain_suspend_empty_cb(libxl__egc *egc,
                               libxl__domain_suspend_state *dss, int rc)
 {
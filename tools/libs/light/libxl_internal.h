@@ -3654,6 +3654,9 @@ struct libxl__domain_save_state {
     int debug;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
+    unsigned int save_workers;
+    unsigned int save_compression; /* XGS_COMPRESS_* */
+    unsigned int save_delta_cache_mb;
     /* private */
     int rc;
     int xcflags;
@@ -61,6 +61,7 @@ void libxl__xc_domain_restore(libxl__egc *egc, libxl__domain_create_state *dcs,
         state->store_domid, state->console_port,
         state->console_domid,
         cbflags, dcs->restore_params.checkpointed_stream,
+        dcs->restore_params.workers,
     };
 
     shs->ao = ao;
@@ -88,7 +89,8 @@ void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_save_state *dss,
 
     const unsigned long argnums[] = {
         dss->domid, dss->xcflags, cbflags,
-        dss->checkpointed_stream,
+        dss->checkpointed_stream, dss->save_workers, dss->save_compression,
+        dss->save_delta_cache_mb,
     };
 
     shs->ao = ao;
@@ -251,6 +251,11 @@ int main(int argc, char **argv)
         uint32_t flags =                    strtoul(NEXTARG,0,10);
         unsigned cbflags =                  strtoul(NEXTARG,0,10);
         xc_stream_type_t stream_type =      strtoul(NEXTARG,0,10);
+        struct save_params params = {
+            .nr_workers =                   strtoul(NEXTARG,0,10),
+            .compression =                  strtoul(NEXTARG,0,10),
+            .delta_cache_mb =               strtoul(NEXTARG,0,10),
+        };
         assert(!*++argv);
 
         helper_setcallbacks_save(&cb, cbflags);
@@ -258,7 +263,8 @@ int main(int argc, char **argv)
         startup("save");
         setup_signals(save_signal_handler);
 
-        r = xc_domain_save(xch, io_fd, dom, flags, &cb, stream_type, recv_fd);
+        r = xc_domain_save(xch, io_fd, dom, flags, &cb, stream_type, recv_fd,
+                           &params);
         complete(r);
 
     } else if (!strcmp(mode,"--restore-domain")) {
@@ -273,6 +279,9 @@ int main(int argc, char **argv)
         domid_t console_domid =             strtoul(NEXTARG,0,10);
         unsigned cbflags =                  strtoul(NEXTARG,0,10);
         xc_stream_type_t stream_type =      strtoul(NEXTARG,0,10);
+        struct restore_params params = {
+            .nr_workers =                   strtoul(NEXTARG,0,10),
+        };
         assert(!*++argv);
 
         helper_setcallbacks_restore(&cb, cbflags);
@@ -285,7 +294,8 @@ int main(int argc, char **argv)
 
         r = xc_domain_restore(xch, io_fd, dom, store_evtchn, &store_mfn,
                               store_domid, console_evtchn, &console_mfn,
-                              console_domid, stream_type, &cb, send_back_fd);
+                              console_domid, stream_type, &cb, send_back_fd,
+                              &params);
         helper_stub_restore_results(store_mfn,console_mfn,0);
         complete(r);
 
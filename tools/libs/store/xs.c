@@ -80,19 +80,28 @@ struct xs_handle {
 	bool unwatch_filter;
 
 	/*
-         * A list of replies. Currently only one will ever be outstanding
-         * because we serialise requests. The requester can wait on the
-         * conditional variable for its response.
+         * A list of replies, matched to their requests by req_id. More than
+         * one will be outstanding if requests have been submitted with
+         * xs_*_submit() and not yet collected. The requester can wait on
+         * the conditional variable for its response.
          */
 	XEN_TAILQ_HEAD(, struct xs_stored_msg) reply_list;
 	pthread_mutex_t reply_mutex;
 	pthread_cond_t reply_condvar;
 
-	/* One request at a time. */
+	/* One request written at a time. */
 	pthread_mutex_t request_mutex;
 
+	/* req_id of the last request sent. */
+	uint32_t req_id;
+
+	/* req_ids returned by xs_*_submit() and not yet collected. */
+	uint32_t *submitted;
+	unsigned int nr_submitted, max_submitted;
+
 	/* Lock discipline:
 	 *  Only holder of the request lock may write to h->fd.
+	 *  Only holder of the request lock may access req_id and submitted.
 	 *  Only holder of the request lock may access read_thr_exists.
 	 *  If read_thr_exists==0, only holder of request lock may read h->fd;
 	 *  If read_thr_exists==1, only the read thread may read h->fd.
@@ -109,6 +118,7 @@ struct xs_handle {
 #define mutex_lock(m)		pthread_mutex_lock(m)
 #define mutex_unlock(m)		pthread_mutex_unlock(m)
 #define condvar_signal(c)	pthread_cond_signal(c)
+#define condvar_broadcast(c)	pthread_cond_broadcast(c)
 #define condvar_wait(c,m)	pthread_cond_wait(c,m)
 #define cleanup_push(f, a)	\
     pthread_cleanup_push((void (*)(void *))(f), (void *)(a))
@@ -139,11 +149,18 @@ struct xs_handle {
 	int watch_pipe[2];
 	/* Filtering watch event in unwatch function? */
 	bool unwatch_filter;
+	/* req_id of the last request sent. */
+	uint32_t req_id;
+
+	/* req_ids returned by xs_*_submit() and not yet collected. */
+	uint32_t *submitted;
+	unsigned int nr_submitted, max_submitted;
 };
 
 #define mutex_lock(m)		((void)0)
 #define mutex_unlock(m)		((void)0)
 #define condvar_signal(c)	((void)0)
+#define condvar_broadcast(c)	((void)0)
 #define condvar_wait(c,m)	((void)0)
 #define cleanup_push(f, a)	((void)0)
 #define cleanup_pop(run)	((void)0)
@@ -369,6 +386,7 @@ static void close_fds_free(struct xs_handle *h) {
 	xentoolcore__deregister_active_handle(&h->tc_ah);
         close(h->fd);
         
+	free(h->submitted);
 	free(h);
 }
 
@@ -481,33 +499,51 @@ static int get_error(const char *errorstring)
 	return xsd_errors[i].errnum;
 }
 
-/* Adds extra nul terminator, because we generally (always?) hold strings. */
-static void *read_reply(
-	struct xs_handle *h, enum xsd_sockmsg_type *type, unsigned int *len)
+static struct xs_stored_msg *find_reply(struct xs_handle *h, uint32_t req_id)
 {
 	struct xs_stored_msg *msg;
-	char *body;
-	int read_from_thread;
 
-	read_from_thread = read_thread_exists(h);
+	XEN_TAILQ_FOREACH(msg, &h->reply_list, list)
+		if (msg->hdr.req_id == req_id)
+			return msg;
 
-	/* Read from comms channel ourselves if there is no reader thread. */
-	if (!read_from_thread && (read_message(h, 0) == -1))
-		return NULL;
+	return NULL;
+}
+
+/* Adds extra nul terminator, because we generally (always?) hold strings.
+ * Replies to other requests which are read meanwhile are left queued for
+ * their own requesters.  Must be called with the request lock held unless
+ * the reader thread exists.
+ */
+static void *read_reply(struct xs_handle *h, uint32_t req_id,
+			enum xsd_sockmsg_type *type, unsigned int *len)
+{
+	struct xs_stored_msg *msg;
+	char *body;
 
 	mutex_lock(&h->reply_mutex);
+	while (!(msg = find_reply(h, req_id))) {
 #ifdef USE_PTHREAD
-	while (XEN_TAILQ_EMPTY(&h->reply_list) && read_from_thread && h->fd != -1)
-		condvar_wait(&h->reply_condvar, &h->reply_mutex);
+		if (read_thread_exists(h)) {
+			if (h->fd == -1)
+				break;
+			condvar_wait(&h->reply_condvar, &h->reply_mutex);
+			continue;
+		}
 #endif
-	if (XEN_TAILQ_EMPTY(&h->reply_list)) {
+		/* Read from comms channel ourselves if there is no reader
+		 * thread. */
+		mutex_unlock(&h->reply_mutex);
+		if (read_message(h, 0) == -1)
+			return NULL;
+		mutex_lock(&h->reply_mutex);
+	}
+	if (!msg) {
 		mutex_unlock(&h->reply_mutex);
 		errno = EINVAL;
 		return NULL;
 	}
-	msg = XEN_TAILQ_FIRST(&h->reply_list);
 	XEN_TAILQ_REMOVE(&h->reply_list, msg, list);
-	assert(XEN_TAILQ_EMPTY(&h->reply_list));
 	mutex_unlock(&h->reply_mutex);
 
 	*type = msg->hdr.type;
@@ -520,60 +556,102 @@ static void *read_reply(
 	return body;
 }
 
-/* Send message to xs, get malloc'ed reply.  NULL and set errno on error. */
-static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
-		      enum xsd_sockmsg_type type,
-		      const struct iovec *iovec,
-		      unsigned int num_vecs,
-		      unsigned int *len)
+static bool request_fits(const struct iovec *iovec, unsigned int num_vecs)
+{
+	unsigned int i, len = 0;
+
+	for (i = 0; i < num_vecs; i++)
+		len += iovec[i].iov_len;
+
+	if (len > XENSTORE_PAYLOAD_MAX) {
+		errno = E2BIG;
+		return false;
+	}
+
+	return true;
+}
+
+/* Send a request to xs, with the request lock held.  Returns its req_id,
+ * or 0 if it could not be written in full, leaving h->fd unusable.
+ */
+static uint32_t write_request(struct xs_handle *h, xs_transaction_t t,
+			      enum xsd_sockmsg_type type,
+			      const struct iovec *iovec,
+			      unsigned int num_vecs)
 {
 	struct xsd_sockmsg msg;
-	void *ret = NULL;
-	int saved_errno;
 	unsigned int i;
-	struct sigaction ignorepipe, oldact;
+
+	/* req_id 0 is never used, so that it can indicate failure. */
+	if (!++h->req_id)
+		++h->req_id;
 
 	msg.tx_id = t;
-	msg.req_id = 0;
+	msg.req_id = h->req_id;
 	msg.type = type;
 	msg.len = 0;
 	for (i = 0; i < num_vecs; i++)
 		msg.len += iovec[i].iov_len;
 
-	if (msg.len > XENSTORE_PAYLOAD_MAX) {
-		errno = E2BIG;
+	if (!xs_write_all(h->fd, &msg, sizeof(msg)))
 		return 0;
-	}
+
+	for (i = 0; i < num_vecs; i++)
+		if (!xs_write_all(h->fd, iovec[i].iov_base, iovec[i].iov_len))
+			return 0;
+
+	return msg.req_id;
+}
+
+static void ignore_sigpipe(struct sigaction *oldact)
+{
+	struct sigaction ignorepipe;
 
 	ignorepipe.sa_handler = SIG_IGN;
 	sigemptyset(&ignorepipe.sa_mask);
 	ignorepipe.sa_flags = 0;
-	sigaction(SIGPIPE, &ignorepipe, &oldact);
+	sigaction(SIGPIPE, &ignorepipe, oldact);
+}
+
+/* Send message to xs, get malloc'ed reply.  NULL and set errno on error. */
+static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
+		      enum xsd_sockmsg_type type,
+		      const struct iovec *iovec,
+		      unsigned int num_vecs,
+		      unsigned int *len)
+{
+	enum xsd_sockmsg_type reply_type;
+	void *ret = NULL;
+	int saved_errno;
+	uint32_t req_id;
+	struct sigaction oldact;
+
+	if (!request_fits(iovec, num_vecs))
+		return 0;
+
+	ignore_sigpipe(&oldact);
 
 	mutex_lock(&h->request_mutex);
 
-	if (!xs_write_all(h->fd, &msg, sizeof(msg)))
+	req_id = write_request(h, t, type, iovec, num_vecs);
+	if (!req_id)
 		goto fail;
 
-	for (i = 0; i < num_vecs; i++)
-		if (!xs_write_all(h->fd, iovec[i].iov_base, iovec[i].iov_len))
-			goto fail;
-
-	ret = read_reply(h, &msg.type, len);
+	ret = read_reply(h, req_id, &reply_type, len);
 	if (!ret)
 		goto fail;
 
 	mutex_unlock(&h->request_mutex);
 
 	sigaction(SIGPIPE, &oldact, NULL);
-	if (msg.type == XS_ERROR) {
+	if (reply_type == XS_ERROR) {
 		saved_errno = get_error(ret);
 		free(ret);
 		errno = saved_errno;
 		return NULL;
 	}
 
-	if (msg.type != type) {
+	if (reply_type != type) {
 		free(ret);
 		saved_errno = EBADF;
 		goto close_fd;
@@ -592,6 +670,60 @@ close_fd:
 	return NULL;
 }
 
+/* We're in a bad state, so close fd.  Called with the request lock held,
+ * so that no other thread is writing a request to it.  Preserves errno.
+ */
+static void close_fd_locked(struct xs_handle *h)
+{
+	int saved_errno = errno;
+
+	close(h->fd);
+	h->fd = -1;
+	errno = saved_errno;
+}
+
+/* Send message to xs without waiting for the reply, which is picked up by
+ * xs_collect().  Returns the req_id, or 0 and sets errno on error.
+ */
+static uint32_t xs_submitv(struct xs_handle *h, xs_transaction_t t,
+			   enum xsd_sockmsg_type type,
+			   const struct iovec *iovec,
+			   unsigned int num_vecs)
+{
+	uint32_t req_id = 0;
+	struct sigaction oldact;
+
+	if (!request_fits(iovec, num_vecs))
+		return 0;
+
+	ignore_sigpipe(&oldact);
+
+	mutex_lock(&h->request_mutex);
+
+	if (h->nr_submitted == h->max_submitted) {
+		unsigned int max = h->max_submitted ? 2 * h->max_submitted : 16;
+		uint32_t *ids = realloc(h->submitted, max * sizeof(*ids));
+
+		if (!ids)
+			goto out;
+		h->submitted = ids;
+		h->max_submitted = max;
+	}
+
+	req_id = write_request(h, t, type, iovec, num_vecs);
+	if (req_id)
+		h->submitted[h->nr_submitted++] = req_id;
+	else
+		close_fd_locked(h);
+
+out:
+	mutex_unlock(&h->request_mutex);
+
+	sigaction(SIGPIPE, &oldact, NULL);
+
+	return req_id;
+}
+
 /* free(), but don't change errno. */
 static void free_no_errno(void *p)
 {
@@ -613,6 +745,17 @@ static void *xs_single(struct xs_handle *h, xs_transaction_t t,
 	return xs_talkv(h, t, type, &iovec, 1, len);
 }
 
+static uint32_t xs_submit_single(struct xs_handle *h, xs_transaction_t t,
+				 enum xsd_sockmsg_type type,
+				 const char *string)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)string;
+	iovec.iov_len = strlen(string) + 1;
+	return xs_submitv(h, t, type, &iovec, 1);
+}
+
 static bool xs_bool(char *reply)
 {
 	if (!reply)
@@ -759,6 +902,86 @@ bool xs_rm(struct xs_handle *h, xs_transaction_t t,
 	return xs_bool(xs_single(h, t, XS_RM, path, NULL));
 }
 
+uint32_t xs_read_submit(struct xs_handle *h, xs_transaction_t t,
+			const char *path)
+{
+	return xs_submit_single(h, t, XS_READ, path);
+}
+
+uint32_t xs_write_submit(struct xs_handle *h, xs_transaction_t t,
+			 const char *path, const void *data, unsigned int len)
+{
+	struct iovec iovec[2];
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+	iovec[1].iov_base = (void *)data;
+	iovec[1].iov_len = len;
+
+	return xs_submitv(h, t, XS_WRITE, iovec, ARRAY_SIZE(iovec));
+}
+
+uint32_t xs_mkdir_submit(struct xs_handle *h, xs_transaction_t t,
+			 const char *path)
+{
+	return xs_submit_single(h, t, XS_MKDIR, path);
+}
+
+uint32_t xs_rm_submit(struct xs_handle *h, xs_transaction_t t,
+		      const char *path)
+{
+	return xs_submit_single(h, t, XS_RM, path);
+}
+
+void *xs_collect(struct xs_handle *h, uint32_t req_id, unsigned int *len)
+{
+	enum xsd_sockmsg_type type;
+	void *ret;
+	int saved_errno;
+	unsigned int i;
+
+	mutex_lock(&h->request_mutex);
+
+	/* A reply which will never come would be waited for forever. */
+	for (i = 0; i < h->nr_submitted; i++)
+		if (h->submitted[i] == req_id)
+			break;
+	if (i == h->nr_submitted) {
+		mutex_unlock(&h->request_mutex);
+		errno = EINVAL;
+		return NULL;
+	}
+	h->submitted[i] = h->submitted[--h->nr_submitted];
+
+	if (read_thread_exists(h)) {
+		/* Let other requests be sent while we wait. */
+		mutex_unlock(&h->request_mutex);
+		ret = read_reply(h, req_id, &type, len);
+		if (!ret) {
+			mutex_lock(&h->request_mutex);
+			close_fd_locked(h);
+			mutex_unlock(&h->request_mutex);
+		}
+	} else {
+		ret = read_reply(h, req_id, &type, len);
+		if (!ret)
+			close_fd_locked(h);
+		mutex_unlock(&h->request_mutex);
+	}
+
+	if (!ret)
+		return NULL;
+
+	if (type == XS_ERROR) {
+		saved_errno = get_error(ret);
+		free(ret);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	return ret;
+}
+
 /* Get permissions of node (first element is owner).
  * Returns malloced array, or NULL: call free() after use.
  */
@@ -1341,15 +1564,9 @@ static int read_message(struct xs_handle *h, int nonblocking)
 	} else {
 		mutex_lock(&h->reply_mutex);
 
-		/* There should only ever be one response pending! */
-		if (!XEN_TAILQ_EMPTY(&h->reply_list)) {
-			mutex_unlock(&h->reply_mutex);
-			saved_errno = EEXIST;
-			goto error_freebody;
-		}
-
 		XEN_TAILQ_INSERT_TAIL(&h->reply_list, msg, list);
-		condvar_signal(&h->reply_condvar);
+		/* Requesters wait for different replies: wake them all. */
+		condvar_broadcast(&h->reply_condvar);
 
 		mutex_unlock(&h->reply_mutex);
 	}
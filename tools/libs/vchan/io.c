@@ -112,6 +112,46 @@ static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
 		return 0;
 }
 
+/**
+ * Notify the peer of our ring updates, together with any held back so far,
+ * or hold this one back if the caller is batching commits.
+ */
+static inline int notify_peer(struct libxenvchan *ctrl, uint8_t bit,
+                              unsigned int flags)
+{
+	if (flags & LIBXENVCHAN_DEFER_NOTIFY) {
+		ctrl->notify_deferred |= bit;
+		return 0;
+	}
+	bit |= ctrl->notify_deferred;
+	ctrl->notify_deferred = 0;
+	return send_notify(ctrl, bit);
+}
+
+int libxenvchan_flush(struct libxenvchan *ctrl)
+{
+	if (!ctrl->notify_deferred)
+		return 0;
+	return notify_peer(ctrl, 0, 0);
+}
+
+/**
+ * Describe the len bytes of the ring starting at index idx as (at most) two
+ * contiguous regions.
+ */
+static void ring_regions(void *ring, uint32_t ring_size, uint32_t idx,
+                         size_t len, struct iovec iov[2])
+{
+	uint32_t real_idx = idx & (ring_size - 1);
+	size_t avail_contig = ring_size - real_idx;
+	if (avail_contig > len)
+		avail_contig = len;
+	iov[0].iov_base = ring + real_idx;
+	iov[0].iov_len = avail_contig;
+	iov[1].iov_base = ring;
+	iov[1].iov_len = len - avail_contig;
+}
+
 /*
  * Get the amount of buffer space available, and do nothing about
  * notifications.
@@ -198,7 +238,11 @@ int libxenvchan_buffer_space(struct libxenvchan *ctrl)
 
 int libxenvchan_wait(struct libxenvchan *ctrl)
 {
-	int ret = xenevtchn_pending(ctrl->event);
+	int ret;
+	/* The peer may be waiting for the updates we held back */
+	if (libxenvchan_flush(ctrl))
+		return -1;
+	ret = xenevtchn_pending(ctrl->event);
 	if (ret < 0)
 		return -1;
 	xenevtchn_unmask(ctrl->event, ret);
@@ -225,7 +269,7 @@ static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
 	}
 	xen_wmb(); /* write data /then/ notify */
 	wr_prod(ctrl) += size;
-	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+	if (notify_peer(ctrl, VCHAN_NOTIFY_WRITE, 0))
 		return -1;
 	return size;
 }
@@ -301,7 +345,7 @@ static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 	xen_mb(); /* consume /then/ notify */
 	rd_cons(ctrl) += size;
-	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
+	if (notify_peer(ctrl, VCHAN_NOTIFY_READ, 0))
 		return -1;
 	return size;
 }
@@ -344,6 +388,178 @@ int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 }
 
+/* Position in the caller's iovec array for readv/writev. */
+struct iov_cursor {
+	const struct iovec *iov;
+	size_t off;
+};
+
+static size_t iov_size(const struct iovec *iov, int iovcnt)
+{
+	size_t size = 0;
+	while (iovcnt-- > 0)
+		size += (iov++)->iov_len;
+	return size;
+}
+
+/**
+ * Copy len bytes between a ring region and the caller's buffers at the
+ * cursor, advancing it.
+ */
+static void iov_copy(struct iov_cursor *cur, void *ring, size_t len,
+                     int to_ring)
+{
+	while (len) {
+		void *buf = cur->iov->iov_base + cur->off;
+		size_t n = cur->iov->iov_len - cur->off;
+		if (n > len)
+			n = len;
+		if (to_ring)
+			memcpy(ring, buf, n);
+		else
+			memcpy(buf, ring, n);
+		ring += n;
+		len -= n;
+		cur->off += n;
+		if (cur->off == cur->iov->iov_len) {
+			cur->iov++;
+			cur->off = 0;
+		}
+	}
+}
+
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov,
+                       int iovcnt)
+{
+	struct iov_cursor cur = { .iov = iov };
+	struct iovec ring[2];
+	size_t size = iov_size(iov, iovcnt), pos = 0;
+	int avail;
+
+	if (!libxenvchan_is_open(ctrl))
+		return -1;
+	while (1) {
+		avail = fast_get_buffer_space(ctrl, size - pos);
+		if (pos + avail > size)
+			avail = size - pos;
+		if (avail) {
+			ring_regions(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl),
+			             avail, ring);
+			xen_mb(); /* read indexes /then/ write data */
+			iov_copy(&cur, ring[0].iov_base, ring[0].iov_len, 1);
+			iov_copy(&cur, ring[1].iov_base, ring[1].iov_len, 1);
+			xen_wmb(); /* write data /then/ notify */
+			wr_prod(ctrl) += avail;
+			if (notify_peer(ctrl, VCHAN_NOTIFY_WRITE, 0))
+				return -1;
+			pos += avail;
+		}
+		if (pos == size || !ctrl->blocking)
+			return pos;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov,
+                      int iovcnt)
+{
+	struct iov_cursor cur = { .iov = iov };
+	struct iovec ring[2];
+	size_t size = iov_size(iov, iovcnt);
+
+	while (1) {
+		int avail = fast_get_data_ready(ctrl, size);
+		if (avail && size > avail)
+			size = avail;
+		if (avail) {
+			ring_regions((void *)rd_ring(ctrl), rd_ring_size(ctrl),
+			             rd_cons(ctrl), size, ring);
+			xen_rmb(); /* data read must happen /after/ rd_cons read */
+			iov_copy(&cur, ring[0].iov_base, ring[0].iov_len, 0);
+			iov_copy(&cur, ring[1].iov_base, ring[1].iov_len, 0);
+			xen_mb(); /* consume /then/ notify */
+			rd_cons(ctrl) += size;
+			if (notify_peer(ctrl, VCHAN_NOTIFY_READ, 0))
+				return -1;
+			return size;
+		}
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_write_begin(struct libxenvchan *ctrl, struct iovec iov[2],
+                            size_t size)
+{
+	int avail;
+	while (1) {
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		avail = fast_get_buffer_space(ctrl, size);
+		if (avail)
+			break;
+		if (!ctrl->blocking)
+			break;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+	if (size > avail)
+		size = avail;
+	ring_regions(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), size, iov);
+	xen_mb(); /* read indexes /then/ let the caller write data */
+	return size;
+}
+
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size,
+                             unsigned int flags)
+{
+	if (size > raw_get_buffer_space(ctrl))
+		return -1;
+	xen_wmb(); /* write data /then/ notify */
+	wr_prod(ctrl) += size;
+	return notify_peer(ctrl, VCHAN_NOTIFY_WRITE, flags) ? -1 : 0;
+}
+
+int libxenvchan_read_begin(struct libxenvchan *ctrl, struct iovec iov[2],
+                           size_t size)
+{
+	int avail;
+	while (1) {
+		avail = fast_get_data_ready(ctrl, size);
+		if (avail)
+			break;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			break;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+	if (size > avail)
+		size = avail;
+	ring_regions((void *)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl),
+	             size, iov);
+	xen_rmb(); /* data read must happen /after/ rd_cons read */
+	return size;
+}
+
+int libxenvchan_read_commit(struct libxenvchan *ctrl, size_t size,
+                            unsigned int flags)
+{
+	if (size > raw_get_data_ready(ctrl))
+		return -1;
+	xen_mb(); /* consume /then/ notify */
+	rd_cons(ctrl) += size;
+	return notify_peer(ctrl, VCHAN_NOTIFY_READ, flags) ? -1 : 0;
+}
+
 int libxenvchan_is_open(struct libxenvchan* ctrl)
 {
 	if (ctrl->is_server)
@@ -361,6 +577,9 @@ void libxenvchan_close(struct libxenvchan *ctrl)
 {
 	if (!ctrl)
 		return;
+	/* Publish commits made with LIBXENVCHAN_DEFER_NOTIFY */
+	if (ctrl->ring && ctrl->event)
+		libxenvchan_flush(ctrl);
 	if (ctrl->read.order >= PAGE_SHIFT)
 		munmap(ctrl->read.buffer, 1 << ctrl->read.order);
 	if (ctrl->write.order >= PAGE_SHIFT)
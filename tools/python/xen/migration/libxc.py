@@ -58,6 +58,11 @@ REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
 REC_TYPE_static_data_end            = 0x00000010
 REC_TYPE_x86_cpuid_policy           = 0x00000011
 REC_TYPE_x86_msr_policy             = 0x00000012
+REC_TYPE_compressed_page_data       = 0x00000013
+REC_TYPE_page_delta                 = 0x00000014
+REC_TYPE_postcopy_pfns              = 0x00000015
+REC_TYPE_postcopy_transition        = 0x00000016
+REC_TYPE_postcopy_fault             = 0x00000017
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -79,6 +84,11 @@ rec_type_to_str = {
     REC_TYPE_static_data_end            : "Static data end",
     REC_TYPE_x86_cpuid_policy           : "x86 CPUID policy",
     REC_TYPE_x86_msr_policy             : "x86 MSR policy",
+    REC_TYPE_compressed_page_data       : "Compressed page data",
+    REC_TYPE_page_delta                 : "Page delta",
+    REC_TYPE_postcopy_pfns              : "Post-copy pfns",
+    REC_TYPE_postcopy_transition        : "Post-copy transition",
+    REC_TYPE_postcopy_fault             : "Post-copy fault",
 }
 
 # page_data
@@ -101,6 +111,15 @@ PAGE_DATA_TYPE_BROKEN        = (0xd << PAGE_DATA_TYPE_SHIFT) # Broken
 PAGE_DATA_TYPE_XALLOC        = (0xe << PAGE_DATA_TYPE_SHIFT) # Allocate-only
 PAGE_DATA_TYPE_XTAB          = (0xf << PAGE_DATA_TYPE_SHIFT) # Invalid
 
+# compressed_page_data
+COMPRESSED_PAGE_DATA_FORMAT  = "IIII"
+COMPRESSED_PAGE_DATA_NONE    = 0x00000000
+COMPRESSED_PAGE_DATA_LZ4     = 0x00000001
+PAGE_DATA_ZERO               = (1 << 52) # Page is entirely zero
+
+# page_delta
+PAGE_DELTA_FORMAT            = "II"
+
 # x86_pv_info
 X86_PV_INFO_FORMAT        = "BBHI"
 
@@ -294,6 +313,130 @@ class VerifyLibxc(VerifyBase):
                               (minsz, pfnsz, pagesz, len(content)))
 
 
+    def verify_record_compressed_page_data(self, content):
+        """ Compressed Page Data record """
+        minsz = calcsize(COMPRESSED_PAGE_DATA_FORMAT)
+
+        if self.version < 3:
+            raise RecordError("Compressed page data record found in v2 stream")
+
+        if len(content) <= minsz:
+            raise RecordError(
+                "COMPRESSED_PAGE_DATA record must be at least %d bytes long" %
+                (minsz, ))
+
+        count, compression, datasz, res1 = unpack(COMPRESSED_PAGE_DATA_FORMAT,
+                                                  content[:minsz])
+
+        if res1 != 0:
+            raise StreamError(
+                "Reserved bits set in COMPRESSED_PAGE_DATA record 0x%04x" %
+                (res1, ))
+
+        if compression not in (COMPRESSED_PAGE_DATA_NONE,
+                               COMPRESSED_PAGE_DATA_LZ4):
+            raise RecordError("Unknown compression 0x%08x" % (compression, ))
+
+        pfnsz = count * 8
+        if (len(content) - minsz) < pfnsz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must contain a "
+                              "pfn record for each count")
+
+        pfns = list(unpack("=%dQ" % (count, ), content[minsz:minsz + pfnsz]))
+
+        nr_pages = 0
+        for idx, pfn in enumerate(pfns):
+
+            if pfn & PAGE_DATA_PFN_RESZ_MASK & ~PAGE_DATA_ZERO:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x" %
+                                  (idx, pfn & PAGE_DATA_PFN_RESZ_MASK))
+
+            if pfn >> PAGE_DATA_TYPE_SHIFT in (5, 6, 7, 8):
+                raise RecordError("Invalid type value in pfn[%d]: 0x%016x" %
+                                  (idx, pfn & PAGE_DATA_TYPE_LTAB_MASK))
+
+            has_data = PAGE_DATA_TYPE_NOTAB <= \
+                (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) <= PAGE_DATA_TYPE_L4TAB
+
+            if pfn & PAGE_DATA_ZERO:
+                if not has_data:
+                    raise RecordError("Zero marker on pfn[%d] without data: "
+                                      "0x%016x" % (idx, pfn))
+            elif has_data:
+                nr_pages += 1
+
+        if len(content) != minsz + pfnsz + datasz:
+            raise RecordError("Expected %u + %u + %u, got %u" %
+                              (minsz, pfnsz, datasz, len(content)))
+
+        if (compression == COMPRESSED_PAGE_DATA_NONE and
+                datasz != nr_pages * 4096):
+            raise RecordError("Expected %u bytes of page data, got %u" %
+                              (nr_pages * 4096, datasz))
+
+
+    def verify_record_page_delta(self, content):
+        """ Page Delta record """
+        minsz = calcsize(PAGE_DELTA_FORMAT)
+
+        if self.version < 3:
+            raise RecordError("Page delta record found in v2 stream")
+
+        if len(content) <= minsz:
+            raise RecordError("PAGE_DELTA record must be at least %d bytes long"
+                              % (minsz, ))
+
+        count, res1 = unpack(PAGE_DELTA_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in PAGE_DELTA record 0x%04x" %
+                              (res1, ))
+
+        if count == 0:
+            raise RecordError("PAGE_DELTA record with no pages")
+
+        pfnsz = count * 8
+        lensz = count * 4
+        if (len(content) - minsz) < pfnsz + lensz:
+            raise RecordError("PAGE_DELTA record must contain a pfn and length "
+                              "for each count")
+
+        pfns = unpack("=%dQ" % (count, ), content[minsz:minsz + pfnsz])
+        for idx, pfn in enumerate(pfns):
+            if pfn & ~PAGE_DATA_PFN_MASK:
+                raise RecordError("Type or reserved bits set in pfn[%d]: "
+                                  "0x%016x" % (idx, pfn))
+
+        lengths = unpack("=%dI" % (count, ),
+                         content[minsz + pfnsz:minsz + pfnsz + lensz])
+
+        if len(content) != minsz + pfnsz + lensz + sum(lengths):
+            raise RecordError("Expected %u + %u + %u + %u, got %u" %
+                              (minsz, pfnsz, lensz, sum(lengths),
+                               len(content)))
+
+
+    def verify_record_postcopy_pfns(self, content):
+        """ post-copy pfns record """
+
+        if len(content) % 8 != 0:
+            raise RecordError("Record length %u, expected multiple of 8" %
+                              (len(content), ))
+
+
+    def verify_record_postcopy_transition(self, content):
+        """ post-copy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Post-copy transition record with non-zero "
+                              "length")
+
+
+    def verify_record_postcopy_fault(self, content):
+        """ post-copy fault """
+        raise RecordError("Found post-copy fault record in stream")
+
+
     def verify_record_x86_pv_info(self, content):
         """ x86 PV Info record """
 
@@ -525,4 +668,16 @@ record_verifiers = {
         VerifyLibxc.verify_record_x86_cpuid_policy,
     REC_TYPE_x86_msr_policy:
         VerifyLibxc.verify_record_x86_msr_policy,
+
+    REC_TYPE_compressed_page_data:
+        VerifyLibxc.verify_record_compressed_page_data,
+    REC_TYPE_page_delta:
+        VerifyLibxc.verify_record_page_delta,
+
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_fault:
+        VerifyLibxc.verify_record_postcopy_fault,
     }
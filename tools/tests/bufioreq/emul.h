@@ -0,0 +1,86 @@
+/*
+ * Test harness for the buffered ioreq ring.
+ */
+
+#ifndef _TEST_BUFIOREQ_
+#define _TEST_BUFIOREQ_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <xen-tools/common-macros.h>
+
+#include <xen/hvm/dm_op.h>
+#include <xen/hvm/hvm_op.h>
+
+/* Xen's view of the ring pointers. */
+#define __XEN__
+#include <xen/hvm/ioreq.h>
+#undef __XEN__
+
+#define PAGE_SIZE 4096
+
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define read_atomic(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define guest_cmpxchg(d, p, o, n) __sync_val_compare_and_swap(p, o, n)
+#define guest_cmpxchg64 guest_cmpxchg
+
+#define gdprintk(lvl, fmt, args...) printf(fmt, ## args)
+
+typedef pthread_mutex_t spinlock_t;
+#define spin_lock(l) pthread_mutex_lock(l)
+#define spin_unlock(l) pthread_mutex_unlock(l)
+
+#define IOREQ_STATUS_HANDLED   1
+#define IOREQ_STATUS_UNHANDLED 2
+
+/* The emulator's event channel. */
+extern sem_t test_event;
+#define notify_via_xen_event_channel(d, port) sem_post(&test_event)
+
+struct domain {
+    unsigned int domain_id;
+};
+
+struct vcpu {
+    struct domain *domain;
+};
+
+extern struct vcpu test_vcpu;
+#define current (&test_vcpu)
+
+struct ioreq_page {
+    void *va;
+};
+
+/* Just the fields the buffered ring code looks at. */
+struct ioreq_server {
+    struct domain          *emulator;
+    struct ioreq_page      bufioreq;
+    spinlock_t             bufioreq_lock;
+    evtchn_port_t          bufioreq_evtchn;
+    uint8_t                bufioreq_handling;
+    bool                   bufioreq_ext;
+    uint8_t                bufioreq_order;
+    struct {
+        unsigned int       max_used;
+        uint64_t           requests, notifications, suppressed, full;
+    } bufioreq_stats;
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
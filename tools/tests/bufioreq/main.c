@@ -0,0 +1,208 @@
+/*
+ * Test for the buffered ioreq ring.
+ *
+ * Xen's side of the ring, ioreq_send_buffered() from xen/common/ioreq.c, is
+ * run in one thread, queueing a numbered stream of requests of all sizes.
+ * Another thread plays the emulator, draining the ring and checking the
+ * stream, and waiting for the event channel, with a semaphore standing in
+ * for it, whenever the ring is empty.  For an extended ring the emulator
+ * sets notify before waiting as described in public/hvm/ioreq.h, so a lost
+ * wakeup shows up as the emulator waiting in vain with requests queued.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emul.h"
+
+/* The buffered ring handling of xen/common/ioreq.c, verbatim. */
+#include "bufioreq.c"
+
+/* How long either side waits for the other before giving up. */
+#define EVENT_TIMEOUT 10
+
+sem_t test_event;
+static struct domain test_domain;
+struct vcpu test_vcpu = { .domain = &test_domain };
+
+static struct ioreq_server srv;
+static unsigned long nr_reqs;
+
+static void wait_event(uint64_t seq)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += EVENT_TIMEOUT;
+
+    while ( sem_timedwait(&test_event, &ts) )
+    {
+        if ( errno == ETIMEDOUT )
+            errx(1, "lost wakeup at request %"PRIu64, seq);
+        if ( errno != EINTR )
+            err(1, "sem_timedwait");
+    }
+}
+
+static void check_slot(const buf_ioreq_t *b, uint64_t seq, uint32_t data)
+{
+    if ( b->type != IOREQ_TYPE_COPY || b->dir != IOREQ_WRITE ||
+         b->addr != (seq & 0xfffff) || b->data != data )
+        errx(1, "request %"PRIu64" corrupted", seq);
+}
+
+/* Drain the ring until all requests have been seen. */
+static void *emulator(void *arg)
+{
+    union bufioreq_pointers *ptrs, p;
+    buf_ioreq_t *slots, b;
+    uint32_t *notify;
+    unsigned int nr = bufioreq_ring(&srv, &ptrs, &slots, &notify);
+    uint64_t seq = 0;
+
+    while ( seq < nr_reqs )
+    {
+        p.full = __atomic_load_n(&ptrs->full, __ATOMIC_ACQUIRE);
+
+        if ( p.write_pointer - p.read_pointer > nr )
+            errx(1, "ring overrun at request %"PRIu64, seq);
+
+        if ( p.read_pointer == p.write_pointer )
+        {
+            if ( notify )
+            {
+                __atomic_store_n(notify, 1, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if ( __atomic_load_n(&ptrs->write_pointer,
+                                     __ATOMIC_RELAXED) != p.read_pointer )
+                    continue;
+            }
+            wait_event(seq);
+            continue;
+        }
+
+        b = slots[p.read_pointer % nr];
+        if ( b.size == 3 )
+        {
+            check_slot(&b, seq, seq);
+            b = slots[(p.read_pointer + 1) % nr];
+            check_slot(&b, seq, ~seq);
+        }
+        else
+            check_slot(&b, seq, seq & ((1ULL << (8 << b.size)) - 1));
+        seq++;
+
+        /* Xen may be canonicalizing the pointers, so add atomically. */
+        __atomic_fetch_add(&ptrs->read_pointer, b.size == 3 ? 2 : 1,
+                           __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void test_ring(bool ext, unsigned int order, unsigned int handling)
+{
+    size_t size = ext ? PAGE_SIZE << order : PAGE_SIZE;
+    ioreq_t p = { .count = 1, .type = IOREQ_TYPE_COPY, .dir = IOREQ_WRITE };
+    unsigned int nr;
+    uint64_t seq;
+    time_t full;
+    pthread_t t;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.emulator = &test_domain;
+    srv.bufioreq_handling = handling;
+    srv.bufioreq_ext = ext;
+    srv.bufioreq_order = order;
+    srv.bufioreq.va = aligned_alloc(PAGE_SIZE, size);
+    if ( !srv.bufioreq.va )
+        err(1, "aligned_alloc");
+    memset(srv.bufioreq.va, 0, size);
+    nr = bufioreq_nr_slots(&srv);
+
+    pthread_mutex_init(&srv.bufioreq_lock, NULL);
+    if ( sem_init(&test_event, 0, 0) )
+        err(1, "sem_init");
+    if ( pthread_create(&t, NULL, emulator, NULL) )
+        errx(1, "pthread_create");
+
+    for ( seq = 0; seq < nr_reqs; seq++ )
+    {
+        p.size = 1u << (rand() % 4);
+        p.addr = seq & 0xfffff;
+        p.data = p.size == 8 ? (seq & 0xffffffff) | ((uint64_t)~seq << 32)
+                             : seq & ((1ULL << (8 * p.size)) - 1);
+
+        /* A full ring would make Xen forward the request synchronously. */
+        for ( full = 0; ioreq_send_buffered(&srv, &p) != IOREQ_STATUS_HANDLED;
+              sched_yield() )
+        {
+            if ( !full )
+                full = time(NULL);
+            else if ( time(NULL) - full > EVENT_TIMEOUT )
+                errx(1, "ring stuck at request %"PRIu64, seq);
+        }
+    }
+
+    pthread_join(t, NULL);
+
+    if ( srv.bufioreq_stats.requests != nr_reqs ||
+         srv.bufioreq_stats.notifications + srv.bufioreq_stats.suppressed !=
+         nr_reqs || srv.bufioreq_stats.max_used > nr ||
+         (!ext && srv.bufioreq_stats.suppressed) )
+        errx(1, "bad statistics");
+
+    printf("%s ring, %u slots, %s pointers: %"PRIu64" events, "
+           "%"PRIu64" suppressed, %"PRIu64" full, %u max used\n",
+           ext ? "extended" : "legacy", nr,
+           handling == HVM_IOREQSRV_BUFIOREQ_ATOMIC ? "atomic" : "legacy",
+           srv.bufioreq_stats.notifications, srv.bufioreq_stats.suppressed,
+           srv.bufioreq_stats.full, srv.bufioreq_stats.max_used);
+
+    sem_destroy(&test_event);
+    pthread_mutex_destroy(&srv.bufioreq_lock);
+    free(srv.bufioreq.va);
+}
+
+int main(int argc, char **argv)
+{
+    nr_reqs = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000000;
+    srand(argc > 2 ? strtoul(argv[2], NULL, 0) : 1);
+
+    test_ring(false, 0, HVM_IOREQSRV_BUFIOREQ_LEGACY);
+    test_ring(false, 0, HVM_IOREQSRV_BUFIOREQ_ATOMIC);
+    test_ring(true, 0, HVM_IOREQSRV_BUFIOREQ_LEGACY);
+    test_ring(true, 0, HVM_IOREQSRV_BUFIOREQ_ATOMIC);
+    test_ring(true, XEN_DMOP_BUFIOREQ_MAX_ORDER, HVM_IOREQSRV_BUFIOREQ_ATOMIC);
+
+    printf("%lu requests per ring: OK\n", nr_reqs);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,76 @@
+/*
+ * Test harness for the ioreq server I/O range index.
+ */
+
+#ifndef _TEST_IOREQ_INDEX_
+#define _TEST_IOREQ_INDEX_
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xen-tools/common-macros.h>
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define ASSERT(x) assert(x)
+
+/* Allocations can be made to fail, and live ones are counted for leaks. */
+extern unsigned int xmalloc_fail_rate;
+extern unsigned long xmalloc_live;
+
+static inline void *test_malloc(size_t size)
+{
+    void *p;
+
+    if ( xmalloc_fail_rate && !(rand() % xmalloc_fail_rate) )
+        return NULL;
+
+    p = malloc(size);
+    if ( p )
+        xmalloc_live++;
+
+    return p;
+}
+
+static inline void test_free(void *p)
+{
+    if ( p )
+        xmalloc_live--;
+    free(p);
+}
+
+#define xmalloc(type) ((type *)test_malloc(sizeof(type)))
+#define xfree(p) test_free(p)
+
+typedef int rwlock_t;
+#define write_lock(l) ({ assert(!*(l)); *(l) = -1; })
+#define write_unlock(l) ({ assert(*(l) == -1); *(l) = 0; })
+
+#include "rbtree.h"
+
+#define MAX_NR_IOREQ_SERVERS 8
+#define NR_IO_RANGE_TYPES 3
+
+/* Just the fields the index code looks at. */
+struct domain {
+    struct {
+        rwlock_t index_lock;
+        struct rb_root index[NR_IO_RANGE_TYPES];
+    } ioreq_server;
+};
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,297 @@
+/*
+ * Unit test for the ioreq server I/O range index.
+ *
+ * Random sequences of range maps and unmaps, server destructions and
+ * lookups are run against the index of xen/common/ioreq.c and checked
+ * against a brute force model holding the servers of each value, both at
+ * the bottom and at the top of the unsigned long space.  Allocations are
+ * made to fail at random, which must leave the index unchanged.  After
+ * each change the tree is checked to be a valid red-black tree of sorted,
+ * disjoint and fully merged segments matching the model.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "emul.h"
+
+/* The index handling of xen/common/ioreq.c, verbatim. */
+#include "ioreq-index.c"
+
+unsigned int xmalloc_fail_rate;
+unsigned long xmalloc_live;
+
+/* Values covered by the model, from 'base' onwards. */
+#define NR_VALUES 1024
+
+static uint8_t ref[NR_IO_RANGE_TYPES][NR_VALUES];
+static unsigned long base;
+
+static struct domain dom;
+
+static unsigned long nr_maps, nr_unmaps, nr_failed, nr_hits;
+
+static void rand_range(unsigned int *s, unsigned int *e)
+{
+    *s = rand() % NR_VALUES;
+    /* Mostly short ranges, so that the index stays fragmented. */
+    *e = *s + (rand() % 4 ? rand() % 8 : rand() % 128);
+    if ( *e >= NR_VALUES )
+        *e = NR_VALUES - 1;
+}
+
+/* Returns the black height of the subtree, checking the red-black rules. */
+static unsigned int check_node(struct rb_node *n,
+                               const struct rb_node *parent)
+{
+    const struct ioreq_segment *x;
+    unsigned int l, r;
+
+    if ( !n )
+        return 1;
+
+    assert(rb_parent(n) == parent);
+    /* A red node has black children. */
+    if ( !(n->__rb_parent_color & 1) )
+        assert((!n->rb_left || (n->rb_left->__rb_parent_color & 1)) &&
+               (!n->rb_right || (n->rb_right->__rb_parent_color & 1)));
+
+    x = rb_entry(n, struct ioreq_segment, node);
+    if ( n->rb_left )
+        assert(rb_entry(n->rb_left, struct ioreq_segment, node)->e < x->s);
+    if ( n->rb_right )
+        assert(rb_entry(n->rb_right, struct ioreq_segment, node)->s > x->e);
+
+    l = check_node(n->rb_left, n);
+    r = check_node(n->rb_right, n);
+    assert(l == r);
+
+    return l + (n->__rb_parent_color & 1);
+}
+
+static void check_index(unsigned int type)
+{
+    const struct rb_root *root = &dom.ioreq_server.index[type];
+    const struct ioreq_segment *x, *prev = NULL;
+    struct rb_node *n;
+    unsigned int i = 0;
+
+    if ( root->rb_node )
+        assert(root->rb_node->__rb_parent_color & 1);
+    check_node(root->rb_node, NULL);
+
+    for ( n = rb_first(root); n; n = rb_next(n) )
+    {
+        x = rb_entry(n, struct ioreq_segment, node);
+
+        assert(x->s <= x->e);
+        assert(x->s >= base && x->e - base < NR_VALUES);
+        assert(x->servers);
+        assert(x->servers < (1U << MAX_NR_IOREQ_SERVERS));
+        if ( prev )
+        {
+            assert(prev->e < x->s);
+            /* Neighbours with the same servers are merged. */
+            assert(prev->e + 1 != x->s || prev->servers != x->servers);
+        }
+
+        for ( ; i < x->s - base; i++ )
+            assert(!ref[type][i]);
+        for ( ; i <= x->e - base; i++ )
+            assert(ref[type][i] == x->servers);
+
+        prev = x;
+    }
+
+    for ( ; i < NR_VALUES; i++ )
+        assert(!ref[type][i]);
+}
+
+static bool ref_any(unsigned int type, unsigned int s, unsigned int e,
+                    unsigned int id)
+{
+    for ( ; s <= e; s++ )
+        if ( ref[type][s] & (1U << id) )
+            return true;
+
+    return false;
+}
+
+static bool ref_all(unsigned int type, unsigned int s, unsigned int e,
+                    unsigned int id)
+{
+    for ( ; s <= e; s++ )
+        if ( !(ref[type][s] & (1U << id)) )
+            return false;
+
+    return true;
+}
+
+static void ref_set(unsigned int type, unsigned int s, unsigned int e,
+                    unsigned int id, bool add)
+{
+    for ( ; s <= e; s++ )
+        if ( add )
+            ref[type][s] |= 1U << id;
+        else
+            ref[type][s] &= ~(1U << id);
+}
+
+/* As ioreq_server_{,un}map_io_range() do, with the rangeset in the model. */
+static void map_range(unsigned int type, unsigned int s, unsigned int e,
+                      unsigned int id, bool add)
+{
+    struct rb_root *root = &dom.ioreq_server.index[type];
+    struct ioreq_segment *spare = NULL;
+
+    if ( add ? ref_any(type, s, e, id) : !ref_all(type, s, e, id) )
+        return;
+
+    if ( ioreq_index_reserve(root, base + s, base + e, add, &spare) )
+        nr_failed++;
+    else
+    {
+        write_lock(&dom.ioreq_server.index_lock);
+        ioreq_index_update(root, base + s, base + e, id, add, &spare);
+        write_unlock(&dom.ioreq_server.index_lock);
+        ref_set(type, s, e, id, add);
+        if ( add )
+            nr_maps++;
+        else
+            nr_unmaps++;
+    }
+
+    ioreq_index_free(spare);
+}
+
+static void unmap_range(unsigned int type, unsigned int id)
+{
+    unsigned int s, e;
+
+    rand_range(&s, &e);
+
+    /* Mostly pick part of a range of the server, for the unmap to succeed. */
+    if ( rand() % 4 && (ref[type][s] & (1U << id)) )
+    {
+        for ( e = s; e + 1 < NR_VALUES && (ref[type][e + 1] & (1U << id)) &&
+                     rand() % 16; e++ )
+            ;
+    }
+
+    map_range(type, s, e, id, false);
+}
+
+static void lookup(unsigned int type)
+{
+    unsigned int s, e, i, servers;
+
+    rand_range(&s, &e);
+    for ( i = s, servers = ~0U; i <= e; i++ )
+        servers &= ref[type][i];
+
+    assert(ioreq_index_lookup(&dom.ioreq_server.index[type], base + s,
+                              base + e) == servers);
+    if ( servers )
+        nr_hits++;
+}
+
+static void test_random(unsigned long start, unsigned long nr_ops)
+{
+    unsigned int type, id, s, e;
+    unsigned long i;
+
+    base = start;
+
+    for ( i = 0; i < nr_ops; i++ )
+    {
+        type = rand() % NR_IO_RANGE_TYPES;
+        id = rand() % MAX_NR_IOREQ_SERVERS;
+        xmalloc_fail_rate = rand() % 8 ? 0 : 4;
+
+        switch ( rand() % 16 )
+        {
+        case 0 ... 5:
+            rand_range(&s, &e);
+            map_range(type, s, e, id, true);
+            break;
+
+        case 6 ... 10:
+            unmap_range(type, id);
+            break;
+
+        case 11:
+            /* Map the whole window, down to or up from the space's ends. */
+            map_range(type, 0, NR_VALUES - 1, id, true);
+            break;
+
+        case 12:
+            if ( rand() % 8 )
+                continue;
+            ioreq_index_remove_server(&dom, id);
+            for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+            {
+                ref_set(type, 0, NR_VALUES - 1, id, false);
+                check_index(type);
+            }
+            continue;
+
+        default:
+            lookup(type);
+            continue;
+        }
+
+        check_index(type);
+    }
+
+    xmalloc_fail_rate = 0;
+    for ( id = 0; id < MAX_NR_IOREQ_SERVERS; id++ )
+        ioreq_index_remove_server(&dom, id);
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+    {
+        for ( s = 0; s < NR_VALUES; s++ )
+            ref[type][s] = 0;
+        check_index(type);
+    }
+
+    if ( xmalloc_live )
+        printf("%lu segments leaked\n", xmalloc_live);
+    assert(!xmalloc_live);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long nr_ops = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+    unsigned int type;
+
+    srand(argc > 2 ? strtoul(argv[2], NULL, 0) : 1);
+
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        dom.ioreq_server.index[type] = RB_ROOT;
+
+    test_random(0, nr_ops);
+    test_random(~0UL - NR_VALUES + 1, nr_ops);
+
+    printf("%lu maps, %lu unmaps, %lu failed, %lu lookups hit: OK\n",
+           nr_maps, nr_unmaps, nr_failed, nr_hits);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,71 @@
+/*
+ * Test harness for the rangeset code.
+ */
+
+#ifndef _TEST_RANGESET_
+#define _TEST_RANGESET_
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xen-tools/common-macros.h>
+
+typedef bool bool_t;
+
+#define smp_wmb()
+#define prefetch(x) __builtin_prefetch(x)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define ASSERT(x) assert(x)
+#define BUG_ON(x) assert(!(x))
+#define cf_check
+
+#define SWAP(a, b) \
+   do { typeof(a) t_ = (a); (a) = (b); (b) = t_; } while ( 0 )
+
+#define xmalloc(type) ((type *)malloc(sizeof(type)))
+#define xfree(p) free(p)
+
+#define printk printf
+#define safe_strcpy(d, s) \
+    (strncpy(d, s, sizeof(d) - 1), (d)[sizeof(d) - 1] = '\0')
+
+typedef bool spinlock_t;
+#define spin_lock_init(l) (*(l) = false)
+#define spin_lock(l) (*(l) = true)
+#define spin_unlock(l) (*(l) = false)
+
+typedef int rwlock_t;
+#define rwlock_init(l) (*(l) = 0)
+#define read_lock(l) ({ assert(*(l) >= 0); (*(l))++; })
+#define read_unlock(l) ({ assert(*(l) > 0); (*(l))--; })
+#define write_lock(l) ({ assert(!*(l)); *(l) = -1; })
+#define write_unlock(l) ({ assert(*(l) == -1); *(l) = 0; })
+
+#include "list.h"
+#include "rbtree.h"
+
+struct domain {
+    unsigned int domain_id;
+    struct list_head rangesets;
+    spinlock_t rangesets_lock;
+};
+
+#include "rangeset.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
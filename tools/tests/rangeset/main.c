@@ -0,0 +1,368 @@
+/*
+ * Unit test and microbenchmark for rangesets.
+ *
+ * Random sequences of operations are checked against a bitmap of the same
+ * values, both at the bottom and at the top of the unsigned long space, and
+ * the cost of lookups and updates is measured as the number of ranges in a
+ * set grows.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#include "emul.h"
+
+/* Values covered by the reference bitmap, from 'base' onwards. */
+#define NR_VALUES 1024
+
+static bool ref[NR_VALUES];
+static unsigned long base;
+
+static unsigned int rand_value(void)
+{
+    return rand() % NR_VALUES;
+}
+
+static void rand_range(unsigned int *s, unsigned int *e)
+{
+    *s = rand_value();
+    /* Mostly short ranges, so that the set stays fragmented. */
+    *e = *s + (rand() % 4 ? rand() % 8 : rand() % 128);
+    if ( *e >= NR_VALUES )
+        *e = NR_VALUES - 1;
+}
+
+static void ref_set(unsigned int s, unsigned int e, bool val)
+{
+    for ( ; s <= e; s++ )
+        ref[s] = val;
+}
+
+struct check {
+    unsigned int next;  /* Lowest value not reported yet. */
+    unsigned int end;   /* Highest value to be reported. */
+    unsigned int nr;    /* Number of ranges reported. */
+};
+
+/* Each range reported must be a maximal run of set values in the bitmap. */
+static int cf_check check_range(unsigned long s, unsigned long e, void *data)
+{
+    struct check *c = data;
+    unsigned int i;
+
+    assert(s - base >= c->next && e >= s && e - base <= c->end);
+    for ( i = c->next; i < s - base; i++ )
+        assert(!ref[i]);
+    for ( ; i <= e - base; i++ )
+        assert(ref[i]);
+    assert(e - base == c->end || !ref[e - base + 1]);
+
+    c->next = e - base + 1;
+    c->nr++;
+
+    return 0;
+}
+
+static unsigned int check_set(struct rangeset *r)
+{
+    struct check c = { 0, NR_VALUES - 1, 0 };
+    unsigned int i, s, e;
+
+    assert(!rangeset_report_ranges(r, 0, ~0UL, check_range, &c));
+    for ( i = c.next; i < NR_VALUES; i++ )
+        assert(!ref[i]);
+    assert(rangeset_is_empty(r) == !c.nr);
+
+    /* Random lookups. */
+    for ( i = 0; i < 16; i++ )
+    {
+        bool all = true, any = false;
+        unsigned int j;
+
+        rand_range(&s, &e);
+        for ( j = s; j <= e; j++ )
+        {
+            all &= ref[j];
+            any |= ref[j];
+        }
+        assert(rangeset_contains_range(r, base + s, base + e) == all);
+        assert(rangeset_overlaps_range(r, base + s, base + e) == any);
+        assert(rangeset_contains_singleton(r, base + s) == ref[s]);
+    }
+
+    return c.nr;
+}
+
+/* Report a window of the set, checking it against the bitmap. */
+static void check_window(struct rangeset *r)
+{
+    struct check c;
+    unsigned int s, e, i;
+
+    rand_range(&s, &e);
+    c.next = s;
+    c.end = e;
+    c.nr = 0;
+    assert(!rangeset_report_ranges(r, base + s, base + e, check_range, &c));
+    for ( i = c.next; i <= e; i++ )
+        assert(!ref[i]);
+}
+
+static void test_random(unsigned long start)
+{
+    enum { ITERS = 200000 };
+    struct rangeset *r = rangeset_new(NULL, "test", 0);
+    unsigned int i, s, e, nr = 0;
+    bool limited = false;
+
+    assert(r);
+    base = start;
+    memset(ref, 0, sizeof(ref));
+
+    for ( i = 0; i < ITERS; i++ )
+    {
+        int rc;
+
+        /* Run some of the time with a limit, to exercise -ENOMEM. */
+        if ( !(i % 10000) )
+        {
+            limited = !limited;
+            rangeset_limit(r, limited ? nr + 8 : -1);
+        }
+
+        rand_range(&s, &e);
+        if ( rand() % 2 )
+        {
+            rc = rangeset_add_range(r, base + s, base + e);
+            assert(!rc || (limited && rc == -ENOMEM));
+            if ( !rc )
+                ref_set(s, e, true);
+        }
+        else
+        {
+            rc = rangeset_remove_range(r, base + s, base + e);
+            assert(!rc || (limited && rc == -ENOMEM));
+            if ( !rc )
+                ref_set(s, e, false);
+        }
+
+        if ( !(i % 16) )
+        {
+            nr = check_set(r);
+            check_window(r);
+        }
+    }
+
+    rangeset_destroy(r);
+}
+
+/* A gap of the given size is searched from 0 upwards. */
+static void test_claim(void)
+{
+    struct rangeset *r = rangeset_new(NULL, "claim", 0);
+    unsigned int i, j, size;
+    unsigned long s;
+
+    assert(r);
+    base = 0;
+    memset(ref, 0, sizeof(ref));
+
+    for ( i = 0; i < 2000; i++ )
+    {
+        unsigned int first = NR_VALUES;
+
+        if ( rand() % 2 )
+        {
+            unsigned int rs, re;
+
+            rand_range(&rs, &re);
+            assert(!rangeset_remove_range(r, rs, re));
+            ref_set(rs, re, false);
+            continue;
+        }
+
+        size = rand() % 16 + 1;
+        for ( j = 0; j + size <= NR_VALUES; j++ )
+        {
+            unsigned int k;
+
+            for ( k = 0; k < size && !ref[j + k]; k++ )
+                ;
+            if ( k == size )
+            {
+                first = j;
+                break;
+            }
+        }
+        if ( first == NR_VALUES )
+            break;
+
+        assert(!rangeset_claim_range(r, size, &s));
+        assert(s == first);
+        ref_set(s, s + size - 1, true);
+        check_set(r);
+    }
+
+    rangeset_destroy(r);
+}
+
+struct consume {
+    unsigned int nr;
+};
+
+/* Consume part of each range, stopping after a few ranges. */
+static int cf_check consume_range(unsigned long s, unsigned long e, void *data,
+                                  unsigned long *c)
+{
+    struct consume *ctxt = data;
+
+    *c = (e - s) / 2 + 1;
+    ref_set(s - base, s - base + *c - 1, false);
+
+    return ++ctxt->nr == 4;
+}
+
+static void test_consume_swap_merge(void)
+{
+    struct rangeset *a = rangeset_new(NULL, "a", 0);
+    struct rangeset *b = rangeset_new(NULL, "b", 0);
+    bool ref_b[NR_VALUES];
+    struct consume c = { 0 };
+    unsigned int i, s, e;
+
+    assert(a && b);
+    base = 0;
+    memset(ref, 0, sizeof(ref));
+
+    for ( i = 0; i < 64; i++ )
+    {
+        rand_range(&s, &e);
+        assert(!rangeset_add_range(a, s, e));
+        ref_set(s, e, true);
+    }
+
+    assert(rangeset_consume_ranges(a, consume_range, &c) == 1);
+    check_set(a);
+    assert(!rangeset_consume_ranges(a, consume_range, &c));
+    check_set(a);
+    assert(rangeset_is_empty(a));
+
+    for ( i = 0; i < 64; i++ )
+    {
+        rand_range(&s, &e);
+        assert(!rangeset_add_range(b, s, e));
+        ref_set(s, e, true);
+    }
+    memcpy(ref_b, ref, sizeof(ref));
+
+    rangeset_swap(a, b);
+    check_set(a);
+    assert(rangeset_is_empty(b));
+
+    memset(ref, 0, sizeof(ref));
+    for ( i = 0; i < 64; i++ )
+    {
+        rand_range(&s, &e);
+        assert(!rangeset_add_range(b, s, e));
+        ref_set(s, e, true);
+    }
+    assert(!rangeset_merge(b, a));
+    for ( i = 0; i < NR_VALUES; i++ )
+        ref[i] |= ref_b[i];
+    check_set(b);
+
+    rangeset_destroy(a);
+    rangeset_destroy(b);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * With a set of 'nr' disjoint ranges, as e.g. the I/O memory permissions of
+ * a hardware domain or the MMIO ranges of an ioreq server, measure random
+ * lookups, and the insertion and removal of a range in a random gap.
+ */
+static void bench(unsigned int nr)
+{
+    enum { ITERS = 1000000 };
+    struct rangeset *r = rangeset_new(NULL, "bench", 0);
+    unsigned int i, hits = 0;
+    double start, lookup, update;
+
+    assert(r);
+    srand(nr);
+
+    for ( i = 0; i < nr; i++ )
+        assert(!rangeset_add_range(r, i * 16UL, i * 16UL + 7));
+
+    start = now_ns();
+    for ( i = 0; i < ITERS; i++ )
+    {
+        unsigned long s = rand() % (nr * 16UL);
+
+        hits += rangeset_contains_range(r, s, s + 3);
+    }
+    lookup = now_ns() - start;
+
+    start = now_ns();
+    for ( i = 0; i < ITERS; i++ )
+    {
+        unsigned long s = (rand() % nr) * 16UL + 10;
+
+        assert(!rangeset_add_range(r, s, s + 3));
+        assert(!rangeset_remove_range(r, s, s + 3));
+    }
+    update = now_ns() - start;
+
+    printf("%7u ranges: %8.1f ns per lookup, %8.1f ns per add + remove\n",
+           nr, lookup / ITERS, update / ITERS);
+
+    assert(hits);
+    rangeset_destroy(r);
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int sizes[] = { 16, 256, 4096, 65536, 1048576 };
+    unsigned int i;
+
+    srand(0);
+    test_random(0);
+    test_random(~0UL - NR_VALUES + 1);
+    test_claim();
+    test_consume_swap_merge();
+    printf("Rangeset operations: OK\n");
+
+    for ( i = 0; i < ARRAY_SIZE(sizes); i++ )
+        bench(sizes[i]);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
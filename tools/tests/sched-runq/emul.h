@@ -0,0 +1,91 @@
+/*
+ * Test harness for the credit2 runqueue code.
+ */
+
+#ifndef _TEST_SCHED_RUNQ_
+#define _TEST_SCHED_RUNQ_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xen-tools/common-macros.h>
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define ASSERT(x) assert(x)
+
+#include "rbtree.h"
+
+typedef int64_t s_time_t;
+#define MILLISECS(ms) ((s_time_t)((ms) * 1000000ULL))
+#define MICROSECS(us) ((s_time_t)((us) * 1000ULL))
+
+/* Just the fields the runqueue code looks at. */
+struct domain {
+    unsigned int domain_id;
+};
+
+struct sched_unit {
+    struct domain *domain;
+    unsigned int unit_id;
+    bool is_running;
+};
+
+struct csched2_runqueue_data {
+    struct rb_root runq;
+    struct rb_node *runq_first;
+};
+
+struct csched2_unit {
+    struct sched_unit *unit;
+    struct csched2_runqueue_data *rqd;
+    int credit;
+    unsigned int flags;
+    struct rb_node runq_elem;
+};
+
+#define CSFLAG_scheduled (1U << 1)
+
+/* All units are on CPU 0, whose runqueue is the one being tested. */
+static struct csched2_runqueue_data *test_rqd;
+static struct {
+    bool *schedule_lock;
+} test_sched_res;
+
+static inline unsigned int sched_unit_master(const struct sched_unit *unit)
+{
+    return 0;
+}
+
+static inline int c2r(unsigned int cpu)
+{
+    return 0;
+}
+
+static inline struct csched2_runqueue_data *c2rqd(unsigned int cpu)
+{
+    return test_rqd;
+}
+
+#define get_sched_res(cpu) (&test_sched_res)
+#define spin_is_locked(l) true
+#define is_idle_unit(u) false
+
+#define tb_init_done false
+#define TRC_CSCHED2_RUNQ_POS 0
+#define __trace_var(e, c, s, d) ((void)(d))
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,324 @@
+/*
+ * Unit test and microbenchmark for the credit2 runqueue.
+ *
+ * The runqueue is kept as a red-black tree ordered by decreasing credit,
+ * with units of equal credit in order of insertion.  This checks credit2's
+ * runq_insert(), runq_remove() and runq_for_each_safe(), built from the
+ * hypervisor sources, against the linear list walk they replaced, and
+ * compares the cost of both as the runqueue grows.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#include "emul.h"
+
+/* The runqueue handling of xen/common/sched/credit2.c, verbatim. */
+#include "credit2-runq.c"
+
+#define CREDIT_MAX (CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX)
+
+struct unit {
+    struct csched2_unit svc;
+    struct sched_unit unit;
+
+    /* List based runqueue, as used before. */
+    struct unit *next, *prev;
+};
+
+struct runq {
+    struct csched2_runqueue_data rqd;
+    struct unit list;       /* Sentinel of the list based runqueue. */
+};
+
+static struct unit *rb_unit(struct rb_node *n)
+{
+    return n ? container_of(runq_elem(n), struct unit, svc) : NULL;
+}
+
+static void tree_insert(struct runq *rq, struct unit *u)
+{
+    test_rqd = &rq->rqd;
+    runq_insert(&u->svc);
+}
+
+static void tree_remove(struct runq *rq, struct unit *u)
+{
+    runq_remove(&u->svc);
+}
+
+/* The list walk runq_insert() used to do. */
+static void list_insert(struct runq *rq, struct unit *u)
+{
+    struct unit *iter;
+
+    for ( iter = rq->list.next; iter != &rq->list; iter = iter->next )
+        if ( u->svc.credit > iter->svc.credit )
+            break;
+
+    u->next = iter;
+    u->prev = iter->prev;
+    iter->prev->next = u;
+    iter->prev = u;
+}
+
+static void list_remove(struct runq *rq, struct unit *u)
+{
+    u->prev->next = u->next;
+    u->next->prev = u->prev;
+}
+
+static void runq_init(struct runq *rq)
+{
+    rq->rqd.runq = RB_ROOT;
+    rq->rqd.runq_first = NULL;
+    rq->list.next = rq->list.prev = &rq->list;
+}
+
+static void unit_init(struct runq *rq, struct unit *u, int credit)
+{
+    u->svc.unit = &u->unit;
+    u->svc.rqd = &rq->rqd;
+    u->svc.credit = credit;
+    RB_CLEAR_NODE(&u->svc.runq_elem);
+}
+
+static int rand_credit(void)
+{
+    /* A narrow range, so that there are plenty of ties. */
+    return CSCHED2_CREDIT_INIT - (rand() % 1000) * 1000;
+}
+
+/* As reset_credit(): a monotonic change of every credit, queued or not. */
+static void reset_credit(struct unit *units, unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        units[i].svc.credit += CSCHED2_CREDIT_INIT;
+        if ( units[i].svc.credit > CREDIT_MAX )
+            units[i].svc.credit = CREDIT_MAX;
+    }
+}
+
+static void check_order(struct runq *rq, unsigned int nr_queued)
+{
+    struct rb_node *n = rq->rqd.runq_first;
+    struct unit *l = rq->list.next;
+    unsigned int nr = 0;
+
+    assert(n == rb_first(&rq->rqd.runq));
+
+    for ( ; n; n = rb_next(n), l = l->next, nr++ )
+    {
+        assert(l != &rq->list);
+        assert(rb_unit(n) == l);
+    }
+
+    assert(l == &rq->list);
+    assert(nr == nr_queued);
+}
+
+static void test_ordering(void)
+{
+    enum { NR = 257, ITERS = 100000 };
+    static struct unit units[NR];
+    struct runq rq;
+    unsigned int i, nr_queued = 0;
+
+    runq_init(&rq);
+
+    for ( i = 0; i < NR; i++ )
+        unit_init(&rq, &units[i], rand_credit());
+
+    for ( i = 0; i < ITERS; i++ )
+    {
+        struct unit *u = &units[rand() % NR];
+
+        switch ( rand() % 8 )
+        {
+        case 0:
+            reset_credit(units, NR);
+            break;
+
+        case 1:
+            /* Pick the first, as the scheduler does, and let it run. */
+            if ( !runq_first(&rq.rqd) )
+                break;
+            u = rb_unit(rq.rqd.runq_first);
+            assert(u == rq.list.next);
+            /* fallthrough */
+        default:
+            if ( unit_on_runq(&u->svc) )
+            {
+                tree_remove(&rq, u);
+                list_remove(&rq, u);
+                nr_queued--;
+                u->svc.credit -= rand() % 2000000;
+            }
+            else
+            {
+                tree_insert(&rq, u);
+                list_insert(&rq, u);
+                nr_queued++;
+            }
+            break;
+        }
+
+        if ( !(i % 64) )
+            check_order(&rq, nr_queued);
+    }
+
+    check_order(&rq, nr_queued);
+}
+
+/*
+ * Walk the runqueue as runq_candidate() does, taking some of the units off
+ * it on the way as parking them does: every unit queued must still be seen,
+ * in order.
+ */
+static void test_walk_remove(void)
+{
+    enum { NR = 257, ITERS = 1000 };
+    static struct unit units[NR];
+    struct runq rq;
+    struct rb_node *iter, *next;
+    struct unit *l;
+    unsigned int i, j, nr_queued;
+
+    for ( i = 0; i < ITERS; i++ )
+    {
+        runq_init(&rq);
+        for ( j = 0, nr_queued = 0; j < NR; j++ )
+        {
+            unit_init(&rq, &units[j], rand_credit());
+            if ( rand() % 4 )
+            {
+                tree_insert(&rq, &units[j]);
+                list_insert(&rq, &units[j]);
+                nr_queued++;
+            }
+        }
+
+        l = rq.list.next;
+        runq_for_each_safe( iter, next, &rq.rqd )
+        {
+            struct unit *u = rb_unit(iter), *lnext = l->next;
+
+            assert(u == l);
+            if ( rand() % 2 )
+            {
+                tree_remove(&rq, u);
+                list_remove(&rq, u);
+                nr_queued--;
+            }
+            l = lnext;
+        }
+        assert(l == &rq.list);
+
+        check_order(&rq, nr_queued);
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * With a runqueue of 'nr' units, repeatedly deschedule the first unit and
+ * queue it back with less credit, and wake up a random unit, which is what
+ * happens on every scheduling decision and wakeup.
+ */
+static void bench(unsigned int nr, bool tree)
+{
+    enum { ITERS = 200000 };
+    struct unit *units = calloc(nr + 1, sizeof(*units));
+    struct runq rq;
+    unsigned int i;
+    double start, elapsed;
+
+    assert(units);
+    runq_init(&rq);
+    srand(nr);
+
+    for ( i = 0; i <= nr; i++ )
+        unit_init(&rq, &units[i], rand_credit());
+
+    for ( i = 0; i < nr; i++ )
+    {
+        tree ? tree_insert(&rq, &units[i]) : list_insert(&rq, &units[i]);
+    }
+
+    start = now_ns();
+
+    for ( i = 0; i < ITERS; i++ )
+    {
+        struct unit *u = tree ? rb_unit(rq.rqd.runq_first) : rq.list.next;
+        struct unit *w = &units[nr];
+
+        tree ? tree_remove(&rq, u) : list_remove(&rq, u);
+        u->svc.credit -= rand() % 100000;
+        if ( u->svc.credit < CSCHED2_CREDIT_INIT / 2 )
+            u->svc.credit += CSCHED2_CREDIT_INIT / 2;
+        tree ? tree_insert(&rq, u) : list_insert(&rq, u);
+
+        /* A waking unit, with an arbitrary amount of credit. */
+        w->svc.credit = rand_credit();
+        tree ? tree_insert(&rq, w) : list_insert(&rq, w);
+        tree ? tree_remove(&rq, w) : list_remove(&rq, w);
+    }
+
+    elapsed = now_ns() - start;
+
+    printf("%6u units: %-5s %8.1f ns per deschedule + wakeup\n",
+           nr, tree ? "tree" : "list", elapsed / ITERS);
+
+    free(units);
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int sizes[] = { 4, 16, 64, 256, 1024, 4096 };
+    unsigned int i;
+
+    srand(0);
+    test_ordering();
+    printf("Runqueue ordering: OK\n");
+    test_walk_remove();
+    printf("Runqueue walk with removal: OK\n");
+
+    for ( i = 0; i < ARRAY_SIZE(sizes); i++ )
+    {
+        bench(sizes[i], false);
+        bench(sizes[i], true);
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
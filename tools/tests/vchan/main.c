@@ -0,0 +1,420 @@
+/*
+ * Test for the libxenvchan ring code.
+ *
+ * A client and a server end of a vchan share a ring in this process, with
+ * the event channel replaced by a pending count per end.  The client writes
+ * a known byte stream with random mixes of write, writev, send and
+ * write_begin/commit, the server reads it back with read, readv, recv and
+ * read_begin/commit, both with commits randomly deferring notifications.
+ *
+ * Besides the data, the notifications are checked: whenever an end found
+ * nothing to do and its peer has since made progress for it, without any
+ * notification held back, the end must have been sent an event.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libxenvchan.h>
+
+#include "vchan.h"
+
+#define RING_ORDER 10
+#define RING_SIZE  (1u << RING_ORDER)
+
+struct xenevtchn_handle {
+    unsigned int pending;
+    /* Found nothing to do, with 'seen' bytes of data or space available. */
+    bool waiting;
+    unsigned int seen;
+};
+
+/* Port n notifies evtchn[n]: the writer is 0, the reader 1. */
+static struct xenevtchn_handle evtchn[2];
+static unsigned long nr_events;
+
+static struct vchan_interface *ring;
+static struct libxenvchan *wr, *rd;
+
+/* Bytes of the stream written and read so far. */
+static uint64_t wr_pos, rd_pos;
+
+static uint8_t buf[4 * RING_SIZE];
+
+int xenevtchn_notify(xenevtchn_handle *xce, evtchn_port_t port)
+{
+    evtchn[port].pending++;
+    nr_events++;
+    return 0;
+}
+
+xenevtchn_port_or_error_t xenevtchn_pending(xenevtchn_handle *xce)
+{
+    abort();
+}
+
+int xenevtchn_unmask(xenevtchn_handle *xce, evtchn_port_t port)
+{
+    abort();
+}
+
+int xenevtchn_fd(xenevtchn_handle *xce)
+{
+    abort();
+}
+
+int xenevtchn_close(xenevtchn_handle *xce)
+{
+    return 0;
+}
+
+int xengnttab_unmap(xengnttab_handle *xgt, void *start_address,
+                    uint32_t count)
+{
+    return 0;
+}
+
+int xengnttab_close(xengnttab_handle *xgt)
+{
+    return 0;
+}
+
+int xengntshr_unshare(xengntshr_handle *xgs, void *start_address,
+                      uint32_t count)
+{
+    return 0;
+}
+
+int xengntshr_close(xengntshr_handle *xgs)
+{
+    return 0;
+}
+
+void close_xs_srv(struct libxenvchan *ctrl)
+{
+}
+
+static uint8_t pattern(uint64_t pos)
+{
+    return pos * 31 + (pos >> 9);
+}
+
+static unsigned int data_ready(void)
+{
+    return ring->left.prod - ring->left.cons;
+}
+
+static unsigned int space_free(void)
+{
+    return RING_SIZE - data_ready();
+}
+
+static void produce(void *p, size_t len)
+{
+    uint8_t *b = p;
+
+    while ( len-- )
+        *b++ = pattern(wr_pos++);
+}
+
+static void consume(const void *p, size_t len)
+{
+    const uint8_t *b = p;
+
+    for ( ; len--; rd_pos++ )
+        if ( *b++ != pattern(rd_pos) )
+            errx(1, "byte %"PRIu64" corrupted", rd_pos);
+}
+
+static void check(int rc, const char *op)
+{
+    if ( rc < 0 )
+        errx(1, "%s failed at %"PRIu64"/%"PRIu64, op, wr_pos, rd_pos);
+}
+
+static void produce_regions(const struct iovec iov[2], size_t len)
+{
+    size_t first = len < iov[0].iov_len ? len : iov[0].iov_len;
+
+    produce(iov[0].iov_base, first);
+    produce(iov[1].iov_base, len - first);
+}
+
+static void consume_regions(const struct iovec iov[2], size_t len)
+{
+    size_t first = len < iov[0].iov_len ? len : iov[0].iov_len;
+
+    consume(iov[0].iov_base, first);
+    consume(iov[1].iov_base, len - first);
+}
+
+static void drain(void)
+{
+    while ( data_ready() )
+    {
+        int rc = libxenvchan_read(rd, buf, sizeof(buf));
+
+        check(rc, "read");
+        consume(buf, rc);
+    }
+}
+
+static size_t rand_size(void)
+{
+    /* Mostly small sizes, but some beyond what the ring holds. */
+    return 1 + (rand() % 4 ? rand() % (RING_SIZE / 4)
+                           : rand() % (2 * RING_SIZE));
+}
+
+/* Split buf into up to four random buffers, some possibly empty. */
+static int rand_iov(struct iovec iov[4])
+{
+    int i, cnt = 1 + rand() % 4;
+    size_t off = 0;
+
+    for ( i = 0; i < cnt; i++ )
+    {
+        iov[i].iov_base = buf + off;
+        iov[i].iov_len = rand() % 3 ? rand() % RING_SIZE : 0;
+        off += iov[i].iov_len;
+    }
+
+    return cnt;
+}
+
+static unsigned int flags(void)
+{
+    return rand() % 2 ? LIBXENVCHAN_DEFER_NOTIFY : 0;
+}
+
+static void writer_op(void)
+{
+    struct iovec iov[4];
+    size_t size = rand_size(), len;
+    int i, cnt, rc = 0;
+
+    switch ( rand() % 5 )
+    {
+    case 0:
+        produce(buf, size);
+        rc = libxenvchan_write(wr, buf, size);
+        check(rc, "write");
+        wr_pos -= size - rc;
+        break;
+
+    case 1:
+        cnt = rand_iov(iov);
+        for ( i = 0, size = 0; i < cnt; i++ )
+            size += iov[i].iov_len;
+        if ( !size )
+            return;
+        for ( i = 0; i < cnt; i++ )
+            produce(iov[i].iov_base, iov[i].iov_len);
+        rc = libxenvchan_writev(wr, iov, cnt);
+        check(rc, "writev");
+        wr_pos -= size - rc;
+        break;
+
+    case 2:
+        produce(buf, size);
+        rc = libxenvchan_send(wr, buf, size);
+        check(rc, "send");
+        if ( !rc )
+            wr_pos -= size;
+        break;
+
+    case 3:
+        rc = libxenvchan_write_begin(wr, iov, size);
+        check(rc, "write_begin");
+        len = rc ? rand() % (rc + 1) : 0;
+        produce_regions(iov, len);
+        check(libxenvchan_write_commit(wr, len, flags()), "write_commit");
+        break;
+
+    case 4:
+        check(libxenvchan_flush(wr), "flush");
+        return;
+    }
+
+    if ( !rc )
+    {
+        evtchn[0].waiting = true;
+        evtchn[0].seen = space_free();
+    }
+}
+
+static void reader_op(void)
+{
+    struct iovec iov[4];
+    size_t size = rand_size(), len;
+    int i, cnt, rc = 0;
+
+    switch ( rand() % 5 )
+    {
+    case 0:
+        rc = libxenvchan_read(rd, buf, size);
+        check(rc, "read");
+        consume(buf, rc);
+        break;
+
+    case 1:
+        cnt = rand_iov(iov);
+        for ( i = 0, size = 0; i < cnt; i++ )
+            size += iov[i].iov_len;
+        if ( !size )
+            return;
+        rc = libxenvchan_readv(rd, iov, cnt);
+        check(rc, "readv");
+        for ( i = 0, len = rc; len; len -= iov[i++].iov_len )
+        {
+            if ( iov[i].iov_len > len )
+                iov[i].iov_len = len;
+            consume(iov[i].iov_base, iov[i].iov_len);
+        }
+        break;
+
+    case 2:
+        rc = libxenvchan_recv(rd, buf, size);
+        check(rc, "recv");
+        consume(buf, rc);
+        break;
+
+    case 3:
+        rc = libxenvchan_read_begin(rd, iov, size);
+        check(rc, "read_begin");
+        len = rc ? rand() % (rc + 1) : 0;
+        consume_regions(iov, len);
+        check(libxenvchan_read_commit(rd, len, flags()), "read_commit");
+        break;
+
+    case 4:
+        check(libxenvchan_flush(rd), "flush");
+        return;
+    }
+
+    if ( !rc )
+    {
+        evtchn[1].waiting = true;
+        evtchn[1].seen = data_ready();
+    }
+}
+
+/*
+ * An end which found nothing to do must have been notified once its peer
+ * has made progress for it, unless the peer is still holding the
+ * notification back.
+ */
+static void check_wakeup(const struct libxenvchan *peer,
+                         struct xenevtchn_handle *e, unsigned int avail)
+{
+    if ( e->waiting && avail > e->seen && !peer->notify_deferred &&
+         !e->pending )
+        errx(1, "lost wakeup at %"PRIu64"/%"PRIu64, wr_pos, rd_pos);
+}
+
+static struct libxenvchan *init_end(bool server)
+{
+    struct libxenvchan *ctrl = calloc(1, sizeof(*ctrl));
+
+    if ( !ctrl )
+        err(1, "calloc");
+
+    ctrl->ring = ring;
+    ctrl->event = &evtchn[server];
+    ctrl->event_port = !server;
+    ctrl->is_server = server;
+
+    return ctrl;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long i, nr_ops = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000000;
+    unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    void *left = malloc(RING_SIZE), *right = malloc(RING_SIZE);
+    struct iovec iov[2];
+
+    ring = calloc(1, sizeof(*ring));
+    if ( !ring || !left || !right )
+        err(1, "malloc");
+    ring->left_order = ring->right_order = RING_ORDER;
+    ring->cli_live = ring->srv_live = 1;
+    ring->cli_notify = ring->srv_notify = VCHAN_NOTIFY_WRITE;
+
+    /* The client writes to the left ring, which the server reads. */
+    wr = init_end(false);
+    rd = init_end(true);
+    wr->write.shr = rd->read.shr = &ring->left;
+    wr->write.buffer = rd->read.buffer = left;
+    wr->write.order = rd->read.order = RING_ORDER;
+    wr->read.shr = rd->write.shr = &ring->right;
+    wr->read.buffer = rd->write.buffer = right;
+    wr->read.order = rd->write.order = RING_ORDER;
+
+    srand(seed);
+
+    for ( i = 0; i < nr_ops; i++ )
+    {
+        /* Whoever acts next has either been woken up or is polling. */
+        if ( rand() % 2 )
+        {
+            evtchn[0] = (struct xenevtchn_handle){};
+            writer_op();
+            check_wakeup(wr, &evtchn[1], data_ready());
+        }
+        else
+        {
+            evtchn[1] = (struct xenevtchn_handle){};
+            reader_op();
+            check_wakeup(rd, &evtchn[0], space_free());
+        }
+    }
+
+    /* Data committed with notifications held back is signalled on close. */
+    check(libxenvchan_flush(rd), "flush");
+    drain();
+    evtchn[1] = (struct xenevtchn_handle){};
+    if ( libxenvchan_read(rd, buf, 1) )
+        errx(1, "data left after draining");
+
+    if ( libxenvchan_write_begin(wr, iov, 100) != 100 )
+        errx(1, "no room in an empty ring");
+    produce_regions(iov, 100);
+    check(libxenvchan_write_commit(wr, 100, LIBXENVCHAN_DEFER_NOTIFY),
+          "write_commit");
+    if ( evtchn[1].pending )
+        errx(1, "deferred commit notified");
+    libxenvchan_close(wr);
+    if ( ring->cli_notify & VCHAN_NOTIFY_WRITE )
+        errx(1, "deferred commit not signalled on close");
+
+    drain();
+    if ( rd_pos != wr_pos )
+        errx(1, "read %"PRIu64" bytes of %"PRIu64, rd_pos, wr_pos);
+    libxenvchan_close(rd);
+
+    printf("%lu ops, %"PRIu64" bytes, %lu events: OK\n",
+           nr_ops, wr_pos, nr_events);
+
+    free(left);
+    free(right);
+    free(ring);
+
+    return 0;
+}
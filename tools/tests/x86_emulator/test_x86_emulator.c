@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/mman.h>
 
 asm ( ".pushsection .test, \"ax\", @progbits; .popsection" );
@@ -760,6 +761,43 @@ static struct x86_emulate_ops emulops = {
     .put_fpu    = emul_test_put_fpu,
 };
 
+/*
+ * The kind of accesses a device driver makes to an emulated MMIO BAR: the
+ * same few MOVs executed over and over again at the same addresses.
+ */
+static const uint8_t mmio_loop[] = {
+    0x8b, 0x08,             /* mov (%eax),%ecx          */
+    0x89, 0x50, 0x10,       /* mov %edx,0x10(%eax)      */
+    0x8b, 0x4c, 0x98, 0x08, /* mov 8(%eax,%ebx,4),%ecx  */
+    0xc6, 0x40, 0x20, 0x05, /* movb $5,0x20(%eax)       */
+    0x0f, 0xb7, 0x50, 0x02, /* movzwl 2(%eax),%edx      */
+    0xeb, 0xed,             /* jmp mmio_loop            */
+};
+#define MMIO_LOOP_INSNS 6
+
+static int emulate_insns(struct x86_emulate_ctxt *ctxt, unsigned long nr)
+{
+    int rc = X86EMUL_OKAY;
+
+    while ( nr-- && rc == X86EMUL_OKAY )
+        rc = x86_emulate(ctxt, &emulops);
+
+    return rc;
+}
+
+static unsigned long mmio_loop_ns(struct x86_emulate_ctxt *ctxt, unsigned long nr)
+{
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ( emulate_insns(ctxt, nr) != X86EMUL_OKAY )
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start.tv_sec) * 1000000000UL +
+           end.tv_nsec - start.tv_nsec;
+}
+
 #define EFLAGS_ALWAYS_SET (X86_EFLAGS_IF | X86_EFLAGS_MBS)
 #define EFLAGS_MASK (X86_EFLAGS_ARITH_MASK | EFLAGS_ALWAYS_SET)
 
@@ -924,6 +962,7 @@ int main(int argc, char **argv)
 
     ctxt.regs = &regs;
     ctxt.force_writeback = 0;
+    ctxt.decode_cache = NULL;
     ctxt.cpu_policy = &cp;
     ctxt.lma       = sizeof(void *) == 8;
     ctxt.addr_size = 8 * sizeof(void *);
@@ -5332,6 +5371,64 @@ int main(int argc, char **argv)
     else
         printf("skipped\n");
 
+    printf("%-40s", "Testing decode cache...");
+    ctxt.decode_cache = x86_decode_cache_alloc();
+    if ( !ctxt.decode_cache )
+        goto fail;
+    memcpy(instr, mmio_loop, sizeof(mmio_loop));
+    /* A miss, then hits with different base registers. */
+    for ( i = 0; i < 3; i++ )
+    {
+        unsigned int *base = res + i * 16;
+
+        memset(res, 0, 64 * sizeof(*res));
+        base[0] = 0xaabbccdd;
+        base[3] = 0x12345678;
+        regs.eflags = 0x200;
+        regs.eip    = (unsigned long)&instr[0];
+        regs.eax    = (unsigned long)base;
+        regs.ebx    = 1;
+        regs.edx    = 0x11223344;
+        rc = emulate_insns(&ctxt, MMIO_LOOP_INSNS);
+        if ( (rc != X86EMUL_OKAY) ||
+             (regs.ecx != 0x12345678) ||
+             (regs.edx != 0xaabb) ||
+             (base[4] != 0x11223344) ||
+             (base[8] != 5) ||
+             (regs.eflags != 0x200) ||
+             (regs.eip != (unsigned long)&instr[0]) )
+            goto fail;
+    }
+    /* Modified code must not be satisfied from the cache. */
+    instr[4] = 0x14;
+    memset(res, 0, 64 * sizeof(*res));
+    regs.eax = (unsigned long)res;
+    regs.edx = 0x11223344;
+    rc = emulate_insns(&ctxt, MMIO_LOOP_INSNS);
+    if ( (rc != X86EMUL_OKAY) ||
+         (res[4] != 0) ||
+         (res[5] != 0x11223344) ||
+         (regs.eip != (unsigned long)&instr[0]) )
+        goto fail;
+    printf("okay\n");
+
+    printf("%-40s", "Timing MMIO loop emulation...");
+    memcpy(instr, mmio_loop, sizeof(mmio_loop));
+    regs.eip = (unsigned long)&instr[0];
+    regs.eax = (unsigned long)res;
+    {
+        unsigned long nr = MMIO_LOOP_INSNS * 20000;
+        unsigned long cached = mmio_loop_ns(&ctxt, nr), uncached;
+
+        x86_decode_cache_free(ctxt.decode_cache);
+        ctxt.decode_cache = NULL;
+        uncached = mmio_loop_ns(&ctxt, nr);
+        if ( !cached || !uncached || regs.eip != (unsigned long)&instr[0] )
+            goto fail;
+        printf("%lu ns/insn (%lu uncached)\n",
+               cached / nr, uncached / nr);
+    }
+
     if ( stack_exec )
         evex_disp8_test(instr, &ctxt, &emulops);
 
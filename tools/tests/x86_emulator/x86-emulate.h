@@ -46,6 +46,9 @@
 #define ASSERT assert
 #define ASSERT_UNREACHABLE() assert(!__LINE__)
 
+#define xzalloc(type) ((type *)calloc(1, sizeof(type)))
+#define xfree free
+
 #define DEFINE_PER_CPU(type, var) type per_cpu_##var
 #define this_cpu(var) per_cpu_##var
 
@@ -0,0 +1,704 @@
+/*
+ * stress-xenconsoled.c
+ *
+ * Run xenconsoled's I/O loop against many emulated domains, a few of which
+ * produce console output, and measure the daemon's wakeups and CPU time per
+ * KB of output delivered to the console ttys.
+ *
+ * The domains exist only in this process: their console rings are plain
+ * memory, event channels are pipes, and xenstore and the hypervisor calls
+ * used by the daemon are answered from local state.  The daemon's ttys are
+ * real ptys, drained by a reader thread.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <xenctrl.h>
+#include <xenevtchn.h>
+#include <xenforeignmemory.h>
+#include <xengnttab.h>
+#include <xenstore.h>
+#include <xen/io/console.h>
+
+#include "io.h"
+
+/* Settings normally made by xenconsoled's main.c. */
+int log_reload;
+int log_guest;
+int log_hv;
+int log_time_hv;
+int log_time_guest;
+char *log_dir;
+int discard_overflowed_data = 1;
+int replace_escape;
+
+struct xs_handle *xs;
+xc_interface *xc;
+
+struct xenevtchn_handle {
+    int pipe[2];
+    pthread_mutex_t lock;
+    bool pending, masked, queued;
+    struct guest *guest;
+};
+
+struct guest {
+    struct xencons_interface *intf;
+    xenevtchn_handle *evtchn;
+    int tty_fd;
+    unsigned long long produced, consumed;
+};
+
+static struct guest *guests;
+static unsigned int nr_guests = 1000;
+static unsigned int nr_active = 10;
+static unsigned long long total_kb = 16384;
+static unsigned int chunk = 64;
+
+static int xs_pipe[2];
+static pthread_mutex_t guests_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int ttys_ready;
+static pid_t daemon_tid;
+static unsigned long notifies;
+
+static struct option options[] = {
+    { "domains", 1, NULL, 'n' },
+    { "active", 1, NULL, 'a' },
+    { "kb", 1, NULL, 'k' },
+    { "chunk", 1, NULL, 'c' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: stress-xenconsoled [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -n|--domains <n>  number of domains (default 1000)\n");
+    fprintf(out, "  -a|--active <n>   domains producing output (default 10)\n");
+    fprintf(out, "  -k|--kb <n>       KB of output in total (default 16384)\n");
+    fprintf(out, "  -c|--chunk <n>    bytes per ring write (default 64)\n");
+    fprintf(out, "  -h|--help         print this usage information\n");
+    exit(ret);
+}
+
+static struct guest *domid_to_guest(uint32_t domid)
+{
+    if ( domid < 1 || domid > nr_guests )
+        return NULL;
+
+    return &guests[domid - 1];
+}
+
+/*
+ * Event channels.  A port is masked when its event is picked up by
+ * xenevtchn_pending() and events arriving while masked are delivered on
+ * unmask, like the Linux evtchn driver does.
+ */
+static void evtchn_signal(xenevtchn_handle *xce)
+{
+    char c = 0;
+
+    xce->queued = true;
+    xce->masked = true;
+    if ( write(xce->pipe[1], &c, 1) != 1 )
+        err(1, "write() to event channel pipe");
+}
+
+static void evtchn_fire(xenevtchn_handle *xce)
+{
+    pthread_mutex_lock(&xce->lock);
+    xce->pending = true;
+    if ( !xce->masked && !xce->queued )
+        evtchn_signal(xce);
+    pthread_mutex_unlock(&xce->lock);
+}
+
+xenevtchn_handle *xenevtchn_open(struct xentoollog_logger *logger,
+                                 unsigned int flags)
+{
+    xenevtchn_handle *xce = calloc(1, sizeof(*xce));
+
+    if ( !xce )
+        return NULL;
+
+    if ( pipe(xce->pipe) )
+    {
+        free(xce);
+        return NULL;
+    }
+    fcntl(xce->pipe[0], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&xce->lock, NULL);
+
+    return xce;
+}
+
+int xenevtchn_close(xenevtchn_handle *xce)
+{
+    struct guest *g = xce->guest;
+
+    if ( g )
+    {
+        pthread_mutex_lock(&guests_lock);
+        g->evtchn = NULL;
+        pthread_mutex_unlock(&guests_lock);
+    }
+
+    close(xce->pipe[0]);
+    close(xce->pipe[1]);
+    pthread_mutex_destroy(&xce->lock);
+    free(xce);
+
+    return 0;
+}
+
+int xenevtchn_fd(xenevtchn_handle *xce)
+{
+    return xce->pipe[0];
+}
+
+xenevtchn_port_or_error_t xenevtchn_bind_interdomain(xenevtchn_handle *xce,
+                                                     uint32_t domid,
+                                                     evtchn_port_t remote_port)
+{
+    struct guest *g = domid_to_guest(domid);
+
+    if ( !g )
+    {
+        errno = ESRCH;
+        return -1;
+    }
+
+    pthread_mutex_lock(&guests_lock);
+    g->evtchn = xce;
+    xce->guest = g;
+    pthread_mutex_unlock(&guests_lock);
+
+    return domid;
+}
+
+xenevtchn_port_or_error_t xenevtchn_bind_virq(xenevtchn_handle *xce,
+                                              unsigned int virq)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+xenevtchn_port_or_error_t xenevtchn_pending(xenevtchn_handle *xce)
+{
+    xenevtchn_port_or_error_t port = -1;
+    char c;
+
+    pthread_mutex_lock(&xce->lock);
+    if ( xce->queued && read(xce->pipe[0], &c, 1) == 1 )
+    {
+        xce->queued = false;
+        xce->pending = false;
+        port = xce->guest - guests + 1;
+    }
+    pthread_mutex_unlock(&xce->lock);
+
+    return port;
+}
+
+int xenevtchn_unmask(xenevtchn_handle *xce, evtchn_port_t port)
+{
+    pthread_mutex_lock(&xce->lock);
+    xce->masked = false;
+    if ( xce->pending && !xce->queued )
+        evtchn_signal(xce);
+    pthread_mutex_unlock(&xce->lock);
+
+    return 0;
+}
+
+int xenevtchn_notify(xenevtchn_handle *xce, evtchn_port_t port)
+{
+    __atomic_add_fetch(&notifies, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/* Ring mappings. */
+xengnttab_handle *xengnttab_open(struct xentoollog_logger *logger,
+                                 unsigned int open_flags)
+{
+    return NULL;
+}
+
+int xengnttab_close(xengnttab_handle *xgt)
+{
+    return 0;
+}
+
+void *xengnttab_map_grant_ref(xengnttab_handle *xgt, uint32_t domid,
+                              uint32_t ref, int prot)
+{
+    return NULL;
+}
+
+int xengnttab_unmap(xengnttab_handle *xgt, void *start_address,
+                    uint32_t count)
+{
+    return 0;
+}
+
+xenforeignmemory_handle *xenforeignmemory_open(struct xentoollog_logger *logger,
+                                               unsigned int open_flags)
+{
+    return (xenforeignmemory_handle *)&guests;
+}
+
+int xenforeignmemory_close(xenforeignmemory_handle *fmem)
+{
+    return 0;
+}
+
+void *xenforeignmemory_map(xenforeignmemory_handle *fmem, uint32_t dom,
+                           int prot, size_t pages, const xen_pfn_t arr[],
+                           int err[])
+{
+    struct guest *g = domid_to_guest(dom);
+
+    if ( !g )
+    {
+        errno = ESRCH;
+        return NULL;
+    }
+
+    return g->intf;
+}
+
+int xenforeignmemory_unmap(xenforeignmemory_handle *fmem, void *addr,
+                           size_t pages)
+{
+    return 0;
+}
+
+/* Hypervisor calls. */
+int xc_domain_getinfolist(xc_interface *xch, uint32_t first_domain,
+                          unsigned int max_domains, xc_domaininfo_t *info)
+{
+    unsigned int i;
+
+    for ( i = 0; i < max_domains && first_domain + i <= nr_guests; i++ )
+    {
+        memset(&info[i], 0, sizeof(info[i]));
+        info[i].domain = first_domain + i;
+    }
+
+    return i;
+}
+
+int xc_domain_getinfo_single(xc_interface *xch, uint32_t domid,
+                             xc_domaininfo_t *info)
+{
+    if ( !domid_to_guest(domid) )
+    {
+        errno = ESRCH;
+        return -1;
+    }
+
+    return 0;
+}
+
+int xc_evtchn_status(xc_interface *xch, xc_evtchn_status_t *status)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int xc_readconsolering(xc_interface *xch, char *buffer,
+                       unsigned int *pnr_chars, int clear, int incremental,
+                       uint32_t *pindex)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+/* Xenstore: /local/domain/<domid>/console/{ring-ref,port,tty}. */
+char *xs_get_domain_path(struct xs_handle *h, unsigned int domid)
+{
+    char *path;
+
+    if ( asprintf(&path, "/local/domain/%u", domid) < 0 )
+        return NULL;
+
+    return path;
+}
+
+static struct guest *xs_console_node(const char *path, const char **node)
+{
+    unsigned int domid;
+    int n = 0;
+
+    if ( sscanf(path, "/local/domain/%u/console/%n", &domid, &n) != 1 || !n )
+        return NULL;
+
+    *node = path + n;
+
+    return domid_to_guest(domid);
+}
+
+void *xs_read(struct xs_handle *h, xs_transaction_t t, const char *path,
+              unsigned int *len)
+{
+    const char *node;
+    struct guest *g = xs_console_node(path, &node);
+    char *val = NULL;
+
+    if ( g && (!strcmp(node, "ring-ref") || !strcmp(node, "port")) )
+        val = strdup("1");
+
+    if ( !val )
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if ( len )
+        *len = strlen(val);
+
+    return val;
+}
+
+bool xs_write(struct xs_handle *h, xs_transaction_t t, const char *path,
+              const void *data, unsigned int len)
+{
+    const char *node;
+    struct guest *g = xs_console_node(path, &node);
+    char *tty;
+    int fd;
+
+    if ( !g || strcmp(node, "tty") )
+        return true;
+
+    if ( g - guests >= nr_active )
+    {
+        pthread_mutex_lock(&guests_lock);
+        ttys_ready++;
+        pthread_mutex_unlock(&guests_lock);
+        return true;
+    }
+
+    tty = strndup(data, len);
+    if ( !tty )
+        return false;
+
+    fd = open(tty, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if ( fd < 0 )
+        err(1, "open(%s)", tty);
+    free(tty);
+
+    pthread_mutex_lock(&guests_lock);
+    if ( g->tty_fd >= 0 )
+        close(g->tty_fd);
+    else
+        ttys_ready++;
+    g->tty_fd = fd;
+    pthread_mutex_unlock(&guests_lock);
+
+    return true;
+}
+
+bool xs_watch(struct xs_handle *h, const char *path, const char *token)
+{
+    return true;
+}
+
+bool xs_unwatch(struct xs_handle *h, const char *path, const char *token)
+{
+    return true;
+}
+
+char **xs_read_watch(struct xs_handle *h, unsigned int *num)
+{
+    return NULL;
+}
+
+int xs_fileno(struct xs_handle *h)
+{
+    return xs_pipe[0];
+}
+
+/* Guest side. */
+static unsigned int ring_write(struct guest *g, unsigned int bytes)
+{
+    struct xencons_interface *intf = g->intf;
+    XENCONS_RING_IDX cons, prod;
+    unsigned int i;
+
+    cons = __atomic_load_n(&intf->out_cons, __ATOMIC_ACQUIRE);
+    prod = intf->out_prod;
+
+    if ( bytes > sizeof(intf->out) - (prod - cons) )
+        bytes = sizeof(intf->out) - (prod - cons);
+
+    for ( i = 0; i < bytes; i++, prod++ )
+        intf->out[MASK_XENCONS_IDX(prod, intf->out)] =
+            (prod % 64) == 63 ? '\n' : 'a' + prod % 26;
+
+    __atomic_store_n(&intf->out_prod, prod, __ATOMIC_RELEASE);
+
+    return bytes;
+}
+
+static void *reader(void *arg)
+{
+    struct pollfd *fds = calloc(nr_active, sizeof(*fds));
+    unsigned long long remaining = total_kb * 1024;
+    char buf[4096];
+    unsigned int i;
+    ssize_t len;
+
+    if ( !fds )
+        err(2, "calloc() failure");
+
+    while ( remaining )
+    {
+        pthread_mutex_lock(&guests_lock);
+        for ( i = 0; i < nr_active; i++ )
+        {
+            fds[i].fd = guests[i].tty_fd;
+            fds[i].events = POLLIN;
+        }
+        pthread_mutex_unlock(&guests_lock);
+
+        if ( poll(fds, nr_active, -1) < 0 && errno != EINTR )
+            err(1, "poll()");
+
+        for ( i = 0; i < nr_active; i++ )
+        {
+            if ( !(fds[i].revents & POLLIN) )
+                continue;
+
+            len = read(fds[i].fd, buf, sizeof(buf));
+            if ( len <= 0 )
+                continue;
+
+            guests[i].consumed += len;
+            remaining -= len < remaining ? len : remaining;
+        }
+    }
+
+    free(fds);
+
+    return NULL;
+}
+
+static void *run_daemon(void *arg)
+{
+    daemon_tid = syscall(SYS_gettid);
+
+    handle_io();
+
+    errx(1, "handle_io() returned");
+}
+
+static long ctxt_switches(void)
+{
+    char *fname, line[128];
+    long val = -1;
+    FILE *f;
+
+    if ( asprintf(&fname, "/proc/self/task/%d/status", daemon_tid) < 0 )
+        return -1;
+
+    f = fopen(fname, "r");
+    free(fname);
+    if ( !f )
+        return -1;
+
+    while ( fgets(line, sizeof(line), f) )
+        if ( sscanf(line, "voluntary_ctxt_switches: %ld", &val) == 1 )
+            break;
+
+    fclose(f);
+
+    return val;
+}
+
+static double thread_cpu(clockid_t cid)
+{
+    struct timespec tp;
+
+    clock_gettime(cid, &tp);
+
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+static double now(void)
+{
+    return thread_cpu(CLOCK_MONOTONIC);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long produced = 0, total;
+    unsigned int i, n;
+    pthread_t daemon_thr, reader_thr;
+    clockid_t cid;
+    double cpu, start, wall;
+    long switches;
+    struct rlimit rl;
+    int opt;
+
+    while ( (opt = getopt_long(argc, argv, "n:a:k:c:h", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            nr_guests = atoi(optarg);
+            break;
+        case 'a':
+            nr_active = atoi(optarg);
+            break;
+        case 'k':
+            total_kb = atoll(optarg);
+            break;
+        case 'c':
+            chunk = atoi(optarg);
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !nr_guests || !nr_active || nr_active > nr_guests ||
+         !total_kb || !chunk )
+        usage(1);
+
+    /* A tty pair and an event channel pipe per domain, and the readers. */
+    if ( !getrlimit(RLIMIT_NOFILE, &rl) )
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if ( rl.rlim_cur < nr_guests * 4ULL + 64 )
+            errx(2, "need %llu file descriptors, have %llu",
+                 nr_guests * 4ULL + 64, (unsigned long long)rl.rlim_cur);
+    }
+
+    guests = calloc(nr_guests, sizeof(*guests));
+    if ( !guests )
+        err(2, "calloc() failure");
+    for ( i = 0; i < nr_guests; i++ )
+    {
+        guests[i].intf = calloc(1, sizeof(*guests[i].intf));
+        if ( !guests[i].intf )
+            err(2, "calloc() failure");
+        guests[i].tty_fd = -1;
+    }
+
+    if ( pipe(xs_pipe) )
+        err(2, "pipe()");
+    xs = (struct xs_handle *)&xs_pipe;
+    xc = (xc_interface *)&xs_pipe;
+
+    if ( pthread_create(&daemon_thr, NULL, run_daemon, NULL) )
+        errx(2, "pthread_create() failure");
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&guests_lock);
+        n = ttys_ready;
+        pthread_mutex_unlock(&guests_lock);
+        if ( n == nr_guests )
+            break;
+        usleep(1000);
+    }
+
+    if ( pthread_getcpuclockid(daemon_thr, &cid) )
+        errx(2, "pthread_getcpuclockid() failure");
+
+    printf("%u domains, %u producing %llu KB in %u byte writes\n",
+           nr_guests, nr_active, total_kb, chunk);
+
+    if ( pthread_create(&reader_thr, NULL, reader, NULL) )
+        errx(2, "pthread_create() failure");
+
+    cpu = thread_cpu(cid);
+    switches = ctxt_switches();
+    start = now();
+
+    total = total_kb * 1024;
+    for ( i = 0; produced < total; i = (i + 1) % nr_active )
+    {
+        struct guest *g = &guests[i];
+        unsigned int len = chunk;
+
+        if ( len > total - produced )
+            len = total - produced;
+
+        len = ring_write(g, len);
+        if ( !len )
+        {
+            if ( i == nr_active - 1 )
+                usleep(100);
+            continue;
+        }
+
+        produced += len;
+        g->produced += len;
+
+        pthread_mutex_lock(&guests_lock);
+        if ( g->evtchn )
+            evtchn_fire(g->evtchn);
+        pthread_mutex_unlock(&guests_lock);
+    }
+
+    pthread_join(reader_thr, NULL);
+
+    wall = now() - start;
+    cpu = thread_cpu(cid) - cpu;
+
+    for ( i = 0; i < nr_active; i++ )
+        if ( guests[i].consumed != guests[i].produced )
+            errx(1, "domain %u: %llu bytes written, %llu bytes received",
+                 i + 1, guests[i].produced, guests[i].consumed);
+
+    printf("%-18s: %10.3f s, %8.0f KB/s\n", "elapsed", wall, total_kb / wall);
+    printf("%-18s: %10.3f s, %8.2f us/KB\n", "daemon CPU", cpu,
+           cpu * 1e6 / total_kb);
+    if ( switches >= 0 )
+    {
+        switches = ctxt_switches() - switches;
+        printf("%-18s: %10ld, %8.2f /KB\n", "daemon wakeups", switches,
+               (double)switches / total_kb);
+    }
+    printf("%-18s: %10lu\n", "ring notifications", notifies);
+
+    return 0;
+}
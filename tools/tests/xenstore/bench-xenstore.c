@@ -0,0 +1,275 @@
+/*
+ * bench-xenstore.c
+ *
+ * Populate Xenstore with many nodes, measuring the request rates and the
+ * memory used for the nodes.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <xenstore.h>
+
+#define BENCH_PATH "xenstore-bench"
+
+static struct xs_handle *xsh;
+static char *path;
+static unsigned int nodes = 1000000;
+static unsigned int width = 10;
+static unsigned int levels;
+static unsigned int queue = 64;
+static char *data;
+static unsigned int data_len = 8;
+
+static struct option options[] = {
+    { "nodes", 1, NULL, 'n' },
+    { "width", 1, NULL, 'w' },
+    { "size", 1, NULL, 's' },
+    { "queue", 1, NULL, 'q' },
+    { "pid", 1, NULL, 'p' },
+    { "keep", 0, NULL, 'k' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: bench-xenstore [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -n|--nodes <n>   number of leaf nodes (default 1000000)\n");
+    fprintf(out, "  -w|--width <n>   children per directory (default 10)\n");
+    fprintf(out, "  -s|--size <n>    data bytes per leaf node (default 8)\n");
+    fprintf(out, "  -q|--queue <n>   requests in flight (default 64)\n");
+    fprintf(out, "  -p|--pid <pid>   pid of a local xenstored, for its RSS\n");
+    fprintf(out, "  -k|--keep        don't remove the nodes at the end\n");
+    fprintf(out, "  -h|--help        print this usage information\n");
+    exit(ret);
+}
+
+/* Leaf node i is <path>/<digit>/.../<digit>, i in base <width>. */
+static void node_path(char *buf, unsigned int i)
+{
+    unsigned int l, div = 1;
+
+    for ( l = 1; l < levels; l++ )
+        div *= width;
+
+    buf += sprintf(buf, "%s", path);
+    for ( ; div; div /= width )
+        buf += sprintf(buf, "/%u", (i / div) % width);
+}
+
+/* All nodes below <path>, including the implicitly created directories. */
+static unsigned long total_nodes(void)
+{
+    unsigned long total = 0, n = nodes;
+    unsigned int l;
+
+    for ( l = 0; l < levels; l++ )
+    {
+        total += n;
+        n = (n + width - 1) / width;
+    }
+
+    return total;
+}
+
+static double now(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/* Send a request for each leaf node, keeping <queue> of them in flight. */
+static void run_phase(const char *name, bool write)
+{
+    uint32_t *reqs;
+    char buf[XENSTORE_ABS_PATH_MAX];
+    unsigned int i, done = 0;
+    double start;
+    void *reply;
+
+    reqs = calloc(queue, sizeof(*reqs));
+    if ( !reqs )
+        err(2, "calloc() failure");
+
+    start = now();
+
+    for ( i = 0; i < nodes + queue; i++ )
+    {
+        if ( i >= queue )
+        {
+            reply = xs_collect(xsh, reqs[i % queue], NULL);
+            if ( !reply )
+                err(1, "%s of node %u failed", name, i - queue);
+            free(reply);
+            done++;
+        }
+
+        if ( i >= nodes )
+            continue;
+
+        node_path(buf, i);
+        reqs[i % queue] = write
+                          ? xs_write_submit(xsh, XBT_NULL, buf, data, data_len)
+                          : xs_read_submit(xsh, XBT_NULL, buf);
+        if ( !reqs[i % queue] )
+            err(1, "%s of node %u failed", name, i);
+    }
+
+    printf("%-10s: %10.0f ops/s\n", name, done / (now() - start));
+
+    free(reqs);
+}
+
+static long rss_kb(pid_t pid)
+{
+    char *fname, line[128];
+    FILE *f;
+    long kb = -1;
+
+    if ( !pid || asprintf(&fname, "/proc/%d/status", pid) < 0 )
+        return -1;
+
+    f = fopen(fname, "r");
+    free(fname);
+    if ( !f )
+        return -1;
+
+    while ( fgets(line, sizeof(line), f) )
+        if ( sscanf(line, "VmRSS: %ld kB", &kb) == 1 )
+            break;
+
+    fclose(f);
+
+    return kb;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    pid_t pid = 0;
+    bool keep = false;
+    long rss_before, rss_after;
+    unsigned int n;
+    char **dir, *stats;
+    double start;
+
+    while ( (opt = getopt_long(argc, argv, "n:w:s:q:p:kh", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            nodes = atoi(optarg);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 's':
+            data_len = atoi(optarg);
+            break;
+        case 'q':
+            queue = atoi(optarg);
+            break;
+        case 'p':
+            pid = atoi(optarg);
+            break;
+        case 'k':
+            keep = true;
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !nodes || width < 2 || !queue ||
+         data_len > XENSTORE_PAYLOAD_MAX / 2 )
+        usage(1);
+
+    for ( levels = 1, n = nodes - 1; n >= width; n /= width )
+        levels++;
+
+    data = malloc(data_len);
+    if ( !data )
+        err(2, "malloc() failure");
+    memset(data, 'x', data_len);
+
+    if ( asprintf(&path, "%s/%u", BENCH_PATH, getpid()) < 0 )
+        err(2, "asprintf() malloc failure");
+
+    xsh = xs_open(0);
+    if ( !xsh )
+    {
+        fprintf(stderr, "could not connect to xenstore\n");
+        exit(2);
+    }
+
+    printf("%u leaf nodes in %u levels, %lu nodes in total\n",
+           nodes, levels, total_nodes());
+
+    rss_before = rss_kb(pid);
+
+    run_phase("create", true);
+
+    rss_after = rss_kb(pid);
+
+    run_phase("read", false);
+    run_phase("rewrite", true);
+
+    if ( rss_before >= 0 && rss_after >= 0 )
+        printf("xenstored RSS grew by %ld kB, %ld bytes per node\n",
+               rss_after - rss_before,
+               (rss_after - rss_before) * 1024 / (long)total_nodes());
+
+    stats = xs_control_command(xsh, "nodes", NULL, 0);
+    if ( stats )
+        printf("%s", stats);
+    free(stats);
+
+    if ( !keep )
+    {
+        start = now();
+        if ( !xs_rm(xsh, XBT_NULL, path) )
+            err(1, "removing nodes failed");
+        printf("%-10s: %10.0f nodes/s\n", "remove",
+               total_nodes() / (now() - start));
+
+        dir = xs_directory(xsh, XBT_NULL, BENCH_PATH, &n);
+        if ( dir && !n )
+            xs_rm(xsh, XBT_NULL, BENCH_PATH);
+        free(dir);
+    }
+
+    xs_close(xsh);
+
+    return 0;
+}
@@ -405,6 +405,113 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+static int test_ta4_init(uintptr_t par)
+{
+    xs_rm(xsh, XBT_NULL, paths[0]);
+    xs_rm(xsh, XBT_NULL, paths[1]);
+    return 0;
+}
+
+static int test_ta4(uintptr_t par)
+{
+    xs_transaction_t t;
+    int ret;
+
+    t = xs_transaction_start(xsh);
+    if ( t == XBT_NULL )
+        return errno;
+    if ( !xs_write(xsh, t, paths[0], "a", 1) )
+        goto out;
+    if ( !xs_write(xsh, XBT_NULL, paths[1], "b", 1) )
+        goto out;
+    if ( !xs_transaction_end(xsh, t, false) )
+        return errno;
+    return 0;
+
+ out:
+    ret = errno;
+    xs_transaction_end(xsh, t, true);
+    return ret;
+}
+
+static int test_ta4_deinit(uintptr_t par)
+{
+    return verify_node(paths[0], "a", 1) ?: verify_node(paths[1], "b", 1);
+}
+
+static int test_watch_init(uintptr_t par)
+{
+    char **vec;
+    unsigned int i, num;
+
+    if ( par > WRITE_BUFFERS_N )
+        return EFBIG;
+
+    if ( !xs_watch(xsh, path, "parent") )
+        return errno;
+    for ( i = 0; i < par; i++ )
+        if ( !xs_watch(xsh, paths[i], "child") )
+            return errno;
+
+    /* Consume the events fired when setting up the watches. */
+    for ( i = 0; i <= par; i++ )
+    {
+        vec = xs_read_watch(xsh, &num);
+        if ( !vec )
+            return errno;
+        free(vec);
+    }
+
+    return 0;
+}
+
+static int test_watch(uintptr_t par)
+{
+    char **vec;
+    unsigned int parent = 0, child = 0;
+    int ret = 0;
+
+    if ( !xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) )
+        return errno;
+
+    /*
+     * Events are sent before the reply, so all are pending by now: only the
+     * watches on the node itself and on its parent may have fired.
+     */
+    while ( (vec = xs_check_watch(xsh)) )
+    {
+        if ( strcmp(vec[XS_WATCH_PATH], paths[0]) )
+            ret = EINVAL;
+        else if ( !strcmp(vec[XS_WATCH_TOKEN], "parent") )
+            parent++;
+        else if ( !strcmp(vec[XS_WATCH_TOKEN], "child") )
+            child++;
+        else
+            ret = EINVAL;
+        free(vec);
+    }
+    if ( errno != EAGAIN )
+        return errno;
+
+    if ( !ret && (parent != 1 || child != !!par) )
+        ret = ENOENT;
+
+    return ret;
+}
+
+static int test_watch_deinit(uintptr_t par)
+{
+    unsigned int i;
+
+    if ( !xs_unwatch(xsh, path, "parent") )
+        return errno;
+    for ( i = 0; i < par; i++ )
+        if ( !xs_unwatch(xsh, paths[i], "child") )
+            return errno;
+
+    return 0;
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
@@ -419,6 +526,9 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("ta merge", test_ta4, 0, "Transaction adding sibling nodes"),
+TEST("watch", test_watch, 0, "Fire watch on parent node"),
+TEST("watch n", test_watch, WRITE_BUFFERS_N, "Fire watches among siblings"),
 };
 
 static void cleanup(void)
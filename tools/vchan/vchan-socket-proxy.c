@@ -37,7 +37,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <getopt.h>
 
@@ -82,11 +84,6 @@ static void usage(char** argv)
     exit(1);
 }
 
-#define BUFSIZE 8192
-char inbuf[BUFSIZE];
-char outbuf[BUFSIZE];
-int insiz = 0;
-int outsiz = 0;
 int verbose = 0;
 
 struct vchan_proxy_state {
@@ -95,35 +92,74 @@ struct vchan_proxy_state {
     int input_fd;
 };
 
-static void vchan_wr(struct libxenvchan *ctrl) {
-    int ret;
+static void log_data(const char *from, const struct iovec *iov, int len) {
+    int len0 = len < iov[0].iov_len ? len : iov[0].iov_len;
 
-    if (!insiz)
-        return;
-    ret = libxenvchan_write(ctrl, inbuf, insiz);
-    if (ret < 0) {
-        fprintf(stderr, "vchan write failed\n");
-        exit(1);
-    }
-    if (verbose)
-        fprintf(stderr, "wrote %d bytes to vchan\n", ret);
-    if (ret > 0) {
-        insiz -= ret;
-        memmove(inbuf, inbuf + ret, insiz);
+    fprintf(stderr, "from-%s: %.*s%.*s\n", from,
+            len0, (char *)iov[0].iov_base,
+            len - len0, (char *)iov[1].iov_base);
+}
+
+/*
+ * Read from the socket straight into the vchan ring, until either the socket
+ * or the ring space is exhausted.  Returns 0 on EOF, 1 otherwise.
+ *
+ * The ring updates are only published to the peer by the next
+ * libxenvchan_flush() or libxenvchan_wait().
+ */
+static int socket_rd(struct vchan_proxy_state *state) {
+    struct iovec iov[2];
+    int avail, ret;
+
+    for (;;) {
+        avail = libxenvchan_write_begin(state->ctrl, iov, SIZE_MAX);
+        if (avail < 0) {
+            fprintf(stderr, "vchan write failed\n");
+            exit(1);
+        }
+        if (!avail)
+            return 1;
+        ret = readv(state->input_fd, iov, 2);
+        if (ret < 0 && errno != EAGAIN)
+            exit(1);
+        if (ret <= 0)
+            return ret < 0;
+        if (verbose)
+            log_data("unix", iov, ret);
+        if (libxenvchan_write_commit(state->ctrl, ret,
+                                     LIBXENVCHAN_DEFER_NOTIFY) < 0) {
+            fprintf(stderr, "vchan write failed\n");
+            exit(1);
+        }
+        if (ret < avail)
+            return 1;
     }
 }
 
-static void socket_wr(int output_fd) {
-    int ret;
+/*
+ * Write the data ready in the vchan ring straight to the socket, until either
+ * the data or the socket space is exhausted.
+ */
+static void socket_wr(struct vchan_proxy_state *state) {
+    struct iovec iov[2];
+    int avail, ret;
 
-    if (!outsiz)
-        return;
-    ret = write(output_fd, outbuf, outsiz);
-    if (ret < 0 && errno != EAGAIN)
-        exit(1);
-    if (ret > 0) {
-        outsiz -= ret;
-        memmove(outbuf, outbuf + ret, outsiz);
+    while (libxenvchan_data_ready(state->ctrl)) {
+        avail = libxenvchan_read_begin(state->ctrl, iov, SIZE_MAX);
+        if (avail <= 0)
+            exit(1);
+        ret = writev(state->output_fd, iov, 2);
+        if (ret < 0 && errno != EAGAIN)
+            exit(1);
+        if (ret <= 0)
+            return;
+        if (verbose)
+            log_data("vchan", iov, ret);
+        if (libxenvchan_read_commit(state->ctrl, ret,
+                                    LIBXENVCHAN_DEFER_NOTIFY) < 0)
+            exit(1);
+        if (ret < avail)
+            return;
     }
 }
 
@@ -273,13 +309,13 @@ out:
 
 
 static void discard_buffers(struct libxenvchan *ctrl) {
-    /* discard local buffers */
-    insiz = 0;
-    outsiz = 0;
+    struct iovec iov[2];
+    int ret;
 
     /* discard remaining incoming data */
     while (libxenvchan_data_ready(ctrl)) {
-        if (libxenvchan_read(ctrl, inbuf, BUFSIZE) == -1) {
+        ret = libxenvchan_read_begin(ctrl, iov, SIZE_MAX);
+        if (ret == -1 || libxenvchan_read_commit(ctrl, ret, 0) == -1) {
             perror("vchan read");
             exit(1);
         }
@@ -299,13 +335,19 @@ int data_loop(struct vchan_proxy_state *state)
         FD_ZERO(&rfds);
         FD_ZERO(&wfds);
 
+        /* one event for all the ring updates of the last round */
+        if (libxenvchan_flush(state->ctrl)) {
+            perror("vchan notify");
+            exit(1);
+        }
+
         max_fd = -1;
-        if (state->input_fd != -1 && insiz != BUFSIZE) {
+        if (state->input_fd != -1 && libxenvchan_buffer_space(state->ctrl)) {
             FD_SET(state->input_fd, &rfds);
             if (state->input_fd > max_fd)
                 max_fd = state->input_fd;
         }
-        if (state->output_fd != -1 && outsiz) {
+        if (state->output_fd != -1 && libxenvchan_data_ready(state->ctrl)) {
             FD_SET(state->output_fd, &wfds);
             if (state->output_fd > max_fd)
                 max_fd = state->output_fd;
@@ -323,8 +365,8 @@ int data_loop(struct vchan_proxy_state *state)
             if (!libxenvchan_is_open(state->ctrl)) {
                 if (verbose)
                     fprintf(stderr, "vchan client disconnected\n");
-                while (outsiz)
-                    socket_wr(state->output_fd);
+                while (libxenvchan_data_ready(state->ctrl))
+                    socket_wr(state);
                 close(state->output_fd);
                 state->output_fd = -1;
                 close(state->input_fd);
@@ -332,45 +374,22 @@ int data_loop(struct vchan_proxy_state *state)
                 discard_buffers(state->ctrl);
                 break;
             }
-            vchan_wr(state->ctrl);
         }
 
-        if (FD_ISSET(state->input_fd, &rfds)) {
-            ret = read(state->input_fd, inbuf + insiz, BUFSIZE - insiz);
-            if (ret < 0 && errno != EAGAIN)
-                exit(1);
-            if (verbose)
-                fprintf(stderr, "from-unix: %.*s\n", ret, inbuf + insiz);
-            if (ret == 0) {
-                /* EOF on socket, write everything in the buffer and close the
-                 * state->input_fd socket */
-                while (insiz) {
-                    vchan_wr(state->ctrl);
-                    libxenvchan_wait(state->ctrl);
-                }
-                close(state->input_fd);
-                if (state->input_fd == state->output_fd)
-                    state->output_fd = -1;
-                state->input_fd = -1;
-                /* TODO: maybe signal the vchan client somehow? */
-                break;
-            }
-            if (ret)
-                insiz += ret;
-            vchan_wr(state->ctrl);
-        }
-        if (FD_ISSET(state->output_fd, &wfds))
-            socket_wr(state->output_fd);
-        while (libxenvchan_data_ready(state->ctrl) && outsiz < BUFSIZE) {
-            ret = libxenvchan_read(state->ctrl, outbuf + outsiz,
-                                   BUFSIZE - outsiz);
-            if (ret < 0)
-                exit(1);
-            if (verbose)
-                fprintf(stderr, "from-vchan: %.*s\n", ret, outbuf + outsiz);
-            outsiz += ret;
-            socket_wr(state->output_fd);
+        if (state->input_fd != -1 && FD_ISSET(state->input_fd, &rfds) &&
+            !socket_rd(state)) {
+            /* EOF on socket, the data read so far is in the ring already:
+             * publish it and close the state->input_fd socket */
+            libxenvchan_flush(state->ctrl);
+            close(state->input_fd);
+            if (state->input_fd == state->output_fd)
+                state->output_fd = -1;
+            state->input_fd = -1;
+            /* TODO: maybe signal the vchan client somehow? */
+            break;
         }
+        if (state->output_fd != -1)
+            socket_wr(state);
     }
     return 0;
 }
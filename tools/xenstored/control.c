@@ -31,6 +31,9 @@
 #include "control.h"
 #include "domain.h"
 #include "lu.h"
+#include "nodedb.h"
+#include "transaction.h"
+#include "watch.h"
 
 struct cmd_s {
 	char *cmd;
@@ -281,6 +284,33 @@ static int do_control_print(const void *ctx, struct connection *conn,
 	return 0;
 }
 
+static int do_control_nodes(const void *ctx, struct connection *conn,
+			    const char **vec, int num)
+{
+	if (num)
+		return EINVAL;
+
+	return nodedb_get_stats(ctx, conn);
+}
+
+static int do_control_transactions(const void *ctx, struct connection *conn,
+				   const char **vec, int num)
+{
+	if (num > 1 || (num == 1 && strcmp(vec[0], "-r")))
+		return EINVAL;
+
+	return transaction_get_stats(ctx, conn, num == 1);
+}
+
+static int do_control_watches(const void *ctx, struct connection *conn,
+			      const char **vec, int num)
+{
+	if (num)
+		return EINVAL;
+
+	return watch_get_stats(ctx, conn);
+}
+
 static int do_control_help(const void *, struct connection *, const char **,
 			   int);
 
@@ -315,10 +345,13 @@ static struct cmd_s cmds[] = {
 	{ "logfile", do_control_logfile, "<file>" },
 	{ "memreport", do_control_memreport, "[<file>]" },
 #endif
+	{ "nodes", do_control_nodes, "" },
 	{ "print", do_control_print, "<string>" },
 	{ "quota", do_control_quota,
 		"[set <name> <val>|<domid>|max [-r]]" },
 	{ "quota-soft", do_control_quota_s, "[set <name> <val>]" },
+	{ "transactions", do_control_transactions, "[-r]" },
+	{ "watches", do_control_watches, "" },
 	{ "help", do_control_help, "" },
 };
 
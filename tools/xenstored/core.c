@@ -53,6 +53,7 @@
 #include "domain.h"
 #include "control.h"
 #include "lu.h"
+#include "nodedb.h"
 
 #ifndef NO_SOCKETS
 #if defined(HAVE_SYSTEMD)
@@ -84,7 +85,6 @@ bool keep_orphans = false;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 char *tracefile = NULL;
-static struct hashtable *nodes;
 unsigned int trace_flags = TRACE_OBJ | TRACE_IO;
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
@@ -565,25 +565,17 @@ const struct node_hdr *db_fetch(const char *db_name, size_t *size)
 {
 	const struct node_hdr *hdr;
 
-	hdr = hashtable_search(nodes, db_name);
+	hdr = nodedb_find(db_name, size);
 	if (!hdr) {
 		errno = ENOENT;
 		return NULL;
 	}
 
-	*size = calc_node_acc_size(hdr);
-
 	trace_tdb("read %s size %zu\n", db_name, *size + strlen(db_name));
 
 	return hdr;
 }
 
-static const struct xs_permissions *perms_from_node_hdr(
-	const struct node_hdr *hdr)
-{
-	return (const struct xs_permissions *)(hdr + 1);
-}
-
 static void get_acc_data(const char *name, struct node_account_data *acc)
 {
 	size_t size;
@@ -613,7 +605,7 @@ static unsigned int get_acc_domid(struct connection *conn, const char *name,
 	return (!conn || name[0] == '/' || name[0] == '@') ? domid : conn->id;
 }
 
-int db_write(struct connection *conn, const char *db_name, void *data,
+int db_write(struct connection *conn, const char *db_name, const void *data,
 	     size_t size, struct node_account_data *acc,
 	     enum write_node_mode mode, bool no_quota_check)
 {
@@ -621,7 +613,6 @@ int db_write(struct connection *conn, const char *db_name, void *data,
 	struct node_account_data old_acc = {};
 	unsigned int old_domid, new_domid;
 	size_t name_len = strlen(db_name);
-	const char *name;
 	int ret;
 
 	if (!acc)
@@ -650,16 +641,12 @@ int db_write(struct connection *conn, const char *db_name, void *data,
 		return ret;
 	}
 
-	if (mode == NODE_CREATE) {
-		/* db_name could be modified later, so allocate a copy. */
-		name = talloc_strdup(data, db_name);
-		ret = name ? hashtable_add(nodes, name, data) : ENOMEM;
-	} else
-		ret = hashtable_replace(nodes, db_name, data);
+	if (mode == NODE_CREATE)
+		ret = nodedb_add(db_name, data, size);
+	else
+		ret = nodedb_replace(db_name, data, size);
 
 	if (ret) {
-		/* Free data, as it isn't owned by hashtable now. */
-		talloc_free(data);
 		domain_memory_add_nochk(conn, new_domid, -size - name_len);
 		/* Error path, so no quota check. */
 		if (old_acc.memory)
@@ -692,7 +679,7 @@ void db_delete(struct connection *conn, const char *name,
 
 	get_acc_data(name, acc);
 
-	hashtable_remove(nodes, name);
+	nodedb_remove(name);
 	trace_tdb("delete %s\n", name);
 
 	if (acc->memory) {
@@ -842,6 +829,7 @@ int write_node_raw(struct connection *conn, const char *db_name,
 	size_t size;
 	void *p;
 	struct node_hdr *hdr;
+	int ret;
 
 	if (domain_adjust_node_perms(node))
 		return errno;
@@ -873,23 +861,24 @@ int write_node_raw(struct connection *conn, const char *db_name,
 	p += node->hdr.datalen;
 	memcpy(p, node->children, node->hdr.childlen);
 
-	if (db_write(conn, db_name, data, size, &node->acc, mode,
-		     no_quota_check))
-		return EIO;
+	ret = db_write(conn, db_name, data, size, &node->acc, mode,
+		       no_quota_check);
+	talloc_free(data);
 
-	return 0;
+	return ret ? EIO : 0;
 }
 
 /*
  * Write the node. If the node is written, caller can find the DB name used in
  * node->db_name. This can later be used if the change needs to be reverted.
  */
-static int write_node(struct connection *conn, struct node *node,
-		      enum write_node_mode mode, bool no_quota_check)
+static int write_node_access(struct connection *conn, struct node *node,
+			     enum node_access_type type,
+			     enum write_node_mode mode, bool no_quota_check)
 {
 	int ret;
 
-	if (access_node(conn, node, NODE_ACCESS_WRITE, &node->db_name))
+	if (access_node(conn, node, type, &node->db_name))
 		return errno;
 
 	ret = write_node_raw(conn, node->db_name, node, mode, no_quota_check);
@@ -904,6 +893,13 @@ static int write_node(struct connection *conn, struct node *node,
 	return ret;
 }
 
+static int write_node(struct connection *conn, struct node *node,
+		      enum write_node_mode mode, bool no_quota_check)
+{
+	return write_node_access(conn, node, NODE_ACCESS_WRITE, mode,
+				 no_quota_check);
+}
+
 unsigned int perm_for_conn(struct connection *conn,
 			   const struct node_perms *perms)
 {
@@ -968,6 +964,10 @@ static int ask_parents(struct connection *conn, const void *ctx,
 		return 0;
 	}
 
+	/* Its permissions are going to decide the error of the request. */
+	if (conn && conn->transaction)
+		ta_node_read(conn->transaction, name);
+
 	*perm = perm_for_conn_from_node(conn, node);
 
 	return 0;
@@ -1011,6 +1011,9 @@ static bool get_node_chk_perm(struct connection *conn, const void *ctx,
 		errno = EACCES;
 		success = false;
 	}
+	/* Its contents are going to be used for the request. */
+	if (success && conn && conn->transaction)
+		ta_node_read(conn->transaction, name);
 	/* Clean up errno if they weren't supposed to know. */
 	if (!success && !read_node_can_propagate_errno())
 		errno = errno_from_parents(conn, ctx, name, errno, perm);
@@ -1565,8 +1568,12 @@ static struct node *create_node(struct connection *conn, const void *ctx,
 			goto err;
 		}
 
-		ret = write_node(conn, i, i->parent ? NODE_CREATE : NODE_MODIFY,
-				 false);
+		/* The existing node at the top just gets a new child. */
+		if (i->parent)
+			ret = write_node(conn, i, NODE_CREATE, false);
+		else
+			ret = write_node_access(conn, i, NODE_ACCESS_ADD_CHILD,
+						NODE_MODIFY, false);
 		if (ret)
 			goto err;
 
@@ -2402,7 +2409,7 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static unsigned int hash_from_key_fn(const void *k)
+unsigned int hash_from_key_fn(const void *k)
 {
 	const char *str = k;
 	unsigned int hash = 5381;
@@ -2414,17 +2421,16 @@ static unsigned int hash_from_key_fn(const void *k)
 	return hash;
 }
 
-static int keys_equal_fn(const void *key1, const void *key2)
+int keys_equal_fn(const void *key1, const void *key2)
 {
 	return 0 == strcmp(key1, key2);
 }
 
 void setup_structure(bool live_update)
 {
-	nodes = create_hashtable(NULL, "nodes", hash_from_key_fn, keys_equal_fn,
-				 HASHTABLE_FREE_KEY | HASHTABLE_FREE_VALUE);
-	if (!nodes)
-		barf_perror("Could not create nodes hashtable");
+	errno = nodedb_init(NULL);
+	if (errno)
+		barf_perror("Could not create node data base");
 
 	if (live_update)
 		manual_node("/", NULL);
@@ -2497,7 +2503,7 @@ static int check_store_enoent(const void *ctx, struct connection *conn,
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(const void *key, void *val, void *private)
+static int clean_store_(const char *key, const void *val, void *private)
 {
 	struct hashtable *reachable = private;
 	char *slash;
@@ -2531,7 +2537,7 @@ static int clean_store_(const void *key, void *val, void *private)
  */
 static void clean_store(struct check_store_data *data)
 {
-	hashtable_iterate(nodes, clean_store_, data->reachable);
+	nodedb_iterate(clean_store_, data->reachable);
 	domain_check_acc(data->domains);
 }
 
@@ -187,6 +187,12 @@ struct node_hdr {
 	uint32_t childlen;
 };
 
+static inline const struct xs_permissions *perms_from_node_hdr(
+	const struct node_hdr *hdr)
+{
+	return (const struct xs_permissions *)(hdr + 1);
+}
+
 struct node_perms {
 	unsigned int num;
 	struct xs_permissions *p;
@@ -403,9 +409,13 @@ extern xengnttab_handle **xgt_handle;
 
 int remember_string(struct hashtable *hash, const char *str);
 
+/* Hash and key compare functions for hashtables keyed by strings. */
+unsigned int hash_from_key_fn(const void *k);
+int keys_equal_fn(const void *key1, const void *key2);
+
 /* Data base access functions. */
 const struct node_hdr *db_fetch(const char *db_name, size_t *size);
-int db_write(struct connection *conn, const char *db_name, void *data,
+int db_write(struct connection *conn, const char *db_name, const void *data,
 	     size_t size, struct node_account_data *acc,
 	     enum write_node_mode mode, bool no_quota_check);
 void db_delete(struct connection *conn, const char *name,
@@ -0,0 +1,504 @@
+/*
+    Node data base of Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The data base holds one record per node, keyed by the node's name (its
+ * path, a path prefixed by a transaction generation count, or a special
+ * node name like "@releaseDomain").
+ *
+ * Xenstore is mostly populated with many small nodes, so the memory needed
+ * per node is kept low:
+ * - A name is split at its last '/'.  The part in front of it is interned,
+ *   i.e. stored only once and shared by the records of all sibling nodes.
+ *   The record itself holds only the last path component.
+ * - Records are carved from large chunks of memory, instead of paying for
+ *   a talloc and a malloc header with each one.  Freed memory is kept in
+ *   free lists per size class and reused, but chunks are never released.
+ *   Records too large for any size class are allocated individually.
+ * - The hash tables link the records directly.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "talloc.h"
+#include "core.h"
+#include "nodedb.h"
+
+#define DB_ALIGN_SHIFT   3
+#define DB_ALIGN         (1U << DB_ALIGN_SHIFT)
+#define DB_CHUNK_SIZE    (64 * 1024)
+/* Largest allocation served from the chunks. */
+#define DB_SMALL_MAX     1024
+#define DB_CLASSES       (DB_SMALL_MAX / DB_ALIGN)
+#define DB_TABLE_MIN     1024
+
+struct db_link {
+	struct db_link *next;
+	unsigned int hash;
+	/* Data size of a record, name length of a prefix. */
+	unsigned int len;
+};
+
+struct db_prefix {
+	struct db_link link;
+	unsigned int refs;
+	char name[];		/* '\0' terminated. */
+};
+
+struct db_rec {
+	struct db_link link;
+	struct db_prefix *prefix;	/* NULL if the name has no '/'. */
+	/* Node data, followed by the '\0' terminated last name component. */
+	uint64_t data[];
+};
+
+struct db_table {
+	struct db_link **buckets;
+	unsigned int mask;
+	unsigned int count;
+};
+
+static struct {
+	void *ctx;
+	struct db_table recs;
+	struct db_table prefixes;
+
+	void *free[DB_CLASSES];
+	char *chunk;
+	size_t chunk_left;
+
+	unsigned long chunks;
+	unsigned long used;
+	unsigned long large;
+	unsigned long large_bytes;
+} db;
+
+static void *db_alloc(size_t size)
+{
+	void *p;
+	unsigned int idx;
+
+	size = ROUNDUP(size, DB_ALIGN_SHIFT);
+
+	if (size > DB_SMALL_MAX) {
+		p = talloc_size(db.ctx, size);
+		if (p) {
+			db.large++;
+			db.large_bytes += size;
+		}
+		return p;
+	}
+
+	idx = size / DB_ALIGN - 1;
+	if (db.free[idx]) {
+		p = db.free[idx];
+		db.free[idx] = *(void **)p;
+	} else {
+		if (db.chunk_left < size) {
+			p = talloc_size(db.ctx, DB_CHUNK_SIZE);
+			if (!p)
+				return NULL;
+
+			/* Don't waste the rest of the old chunk. */
+			if (db.chunk_left) {
+				idx = db.chunk_left / DB_ALIGN - 1;
+				*(void **)db.chunk = db.free[idx];
+				db.free[idx] = db.chunk;
+			}
+
+			db.chunk = p;
+			db.chunk_left = DB_CHUNK_SIZE;
+			db.chunks++;
+		}
+		p = db.chunk;
+		db.chunk += size;
+		db.chunk_left -= size;
+	}
+
+	db.used += size;
+
+	return p;
+}
+
+static void db_free(void *p, size_t size)
+{
+	unsigned int idx;
+
+	size = ROUNDUP(size, DB_ALIGN_SHIFT);
+
+	if (size > DB_SMALL_MAX) {
+		talloc_free(p);
+		db.large--;
+		db.large_bytes -= size;
+		return;
+	}
+
+	idx = size / DB_ALIGN - 1;
+	*(void **)p = db.free[idx];
+	db.free[idx] = p;
+
+	db.used -= size;
+}
+
+static unsigned int db_hash(const char *str, unsigned int len)
+{
+	unsigned int hash = 5381;
+
+	while (len--)
+		hash = ((hash << 5) + hash) + (unsigned char)*str++;
+
+	return hash;
+}
+
+static struct db_link **table_bucket(const struct db_table *t,
+				     unsigned int hash)
+{
+	/* Spread the bits of the hash, as only the low ones are used. */
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	return t->buckets + (hash & t->mask);
+}
+
+static int table_init(struct db_table *t)
+{
+	t->buckets = talloc_zero_array(db.ctx, struct db_link *, DB_TABLE_MIN);
+	if (!t->buckets)
+		return ENOMEM;
+
+	t->mask = DB_TABLE_MIN - 1;
+	t->count = 0;
+
+	return 0;
+}
+
+static void table_expand(struct db_table *t)
+{
+	struct db_table new = { .mask = 2 * t->mask + 1 };
+	struct db_link *l, *next, **bucket;
+	unsigned int i;
+
+	new.buckets = talloc_zero_array(db.ctx, struct db_link *,
+					new.mask + 1);
+	/* Keep going with the current table, try again next time. */
+	if (!new.buckets)
+		return;
+
+	for (i = 0; i <= t->mask; i++) {
+		for (l = t->buckets[i]; l; l = next) {
+			next = l->next;
+			bucket = table_bucket(&new, l->hash);
+			l->next = *bucket;
+			*bucket = l;
+		}
+	}
+
+	talloc_free(t->buckets);
+	t->buckets = new.buckets;
+	t->mask = new.mask;
+}
+
+static void table_insert(struct db_table *t, struct db_link *l)
+{
+	struct db_link **bucket;
+
+	if (t->count > t->mask)
+		table_expand(t);
+
+	bucket = table_bucket(t, l->hash);
+	l->next = *bucket;
+	*bucket = l;
+	t->count++;
+}
+
+static void table_unlink(struct db_table *t, struct db_link *l)
+{
+	struct db_link **pl;
+
+	for (pl = table_bucket(t, l->hash); *pl != l; pl = &(*pl)->next)
+		;
+
+	*pl = l->next;
+	t->count--;
+}
+
+static size_t prefix_size(unsigned int len)
+{
+	return sizeof(struct db_prefix) + len + 1;
+}
+
+static struct db_prefix *prefix_get(const char *name, unsigned int len)
+{
+	unsigned int hash = db_hash(name, len);
+	struct db_prefix *prefix;
+	struct db_link *l;
+
+	for (l = *table_bucket(&db.prefixes, hash); l; l = l->next) {
+		prefix = container_of(l, struct db_prefix, link);
+		if (l->hash == hash && l->len == len &&
+		    !memcmp(prefix->name, name, len)) {
+			prefix->refs++;
+			return prefix;
+		}
+	}
+
+	prefix = db_alloc(prefix_size(len));
+	if (!prefix)
+		return NULL;
+
+	prefix->link.hash = hash;
+	prefix->link.len = len;
+	prefix->refs = 1;
+	memcpy(prefix->name, name, len);
+	prefix->name[len] = 0;
+	table_insert(&db.prefixes, &prefix->link);
+
+	return prefix;
+}
+
+static void prefix_put(struct db_prefix *prefix)
+{
+	if (!prefix || --prefix->refs)
+		return;
+
+	table_unlink(&db.prefixes, &prefix->link);
+	db_free(prefix, prefix_size(prefix->link.len));
+}
+
+static char *rec_name(const struct db_rec *rec)
+{
+	return (char *)rec->data + rec->link.len;
+}
+
+static size_t rec_size(size_t size, const char *comp)
+{
+	return sizeof(struct db_rec) + size + strlen(comp) + 1;
+}
+
+static struct db_rec *rec_find(const char *name)
+{
+	const char *slash = strrchr(name, '/');
+	const char *comp = slash ? slash + 1 : name;
+	unsigned int len = slash ? slash - name : 0;
+	unsigned int hash = db_hash(name, strlen(name));
+	struct db_rec *rec;
+	struct db_link *l;
+
+	for (l = *table_bucket(&db.recs, hash); l; l = l->next) {
+		if (l->hash != hash)
+			continue;
+		rec = container_of(l, struct db_rec, link);
+		if (strcmp(rec_name(rec), comp))
+			continue;
+		if (!slash ? !rec->prefix
+			   : rec->prefix && rec->prefix->link.len == len &&
+			     !memcmp(rec->prefix->name, name, len))
+			return rec;
+	}
+
+	return NULL;
+}
+
+static struct db_rec *rec_alloc(struct db_prefix *prefix, unsigned int hash,
+				const char *comp, const void *data,
+				size_t size)
+{
+	struct db_rec *rec;
+
+	rec = db_alloc(rec_size(size, comp));
+	if (!rec)
+		return NULL;
+
+	rec->link.hash = hash;
+	rec->link.len = size;
+	rec->prefix = prefix;
+	memcpy(rec->data, data, size);
+	strcpy(rec_name(rec), comp);
+
+	return rec;
+}
+
+int nodedb_init(const void *ctx)
+{
+	db.ctx = talloc_named_const(ctx, 0, "nodedb");
+	if (!db.ctx)
+		return ENOMEM;
+
+	if (table_init(&db.recs) || table_init(&db.prefixes)) {
+		talloc_free(db.ctx);
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+const void *nodedb_find(const char *name, size_t *size)
+{
+	struct db_rec *rec = rec_find(name);
+
+	if (!rec)
+		return NULL;
+
+	*size = rec->link.len;
+
+	return rec->data;
+}
+
+int nodedb_add(const char *name, const void *data, size_t size)
+{
+	const char *slash = strrchr(name, '/');
+	struct db_prefix *prefix = NULL;
+	struct db_rec *rec;
+
+	if (rec_find(name))
+		return EEXIST;
+
+	if (slash) {
+		prefix = prefix_get(name, slash - name);
+		if (!prefix)
+			return ENOMEM;
+	}
+
+	rec = rec_alloc(prefix, db_hash(name, strlen(name)),
+			slash ? slash + 1 : name, data, size);
+	if (!rec) {
+		prefix_put(prefix);
+		return ENOMEM;
+	}
+
+	table_insert(&db.recs, &rec->link);
+
+	return 0;
+}
+
+int nodedb_replace(const char *name, const void *data, size_t size)
+{
+	struct db_rec *old, *rec;
+
+	old = rec_find(name);
+	if (!old)
+		return ENOENT;
+
+	/* The common case of a node being rewritten with the same size. */
+	if (size == old->link.len) {
+		memmove(old->data, data, size);
+		return 0;
+	}
+
+	rec = rec_alloc(old->prefix, old->link.hash, rec_name(old), data, size);
+	if (!rec)
+		return ENOMEM;
+
+	table_unlink(&db.recs, &old->link);
+	table_insert(&db.recs, &rec->link);
+	db_free(old, rec_size(old->link.len, rec_name(old)));
+
+	return 0;
+}
+
+void nodedb_remove(const char *name)
+{
+	struct db_rec *rec = rec_find(name);
+
+	if (!rec)
+		return;
+
+	table_unlink(&db.recs, &rec->link);
+	prefix_put(rec->prefix);
+	db_free(rec, rec_size(rec->link.len, rec_name(rec)));
+}
+
+int nodedb_iterate(int (*func)(const char *name, const void *data,
+			       void *arg),
+		   void *arg)
+{
+	struct db_link *l, *next;
+	struct db_rec *rec;
+	char *name = NULL;
+	size_t len, plen;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i <= db.recs.mask && !ret; i++) {
+		for (l = db.recs.buckets[i]; l && !ret; l = next) {
+			next = l->next;
+			rec = container_of(l, struct db_rec, link);
+
+			plen = rec->prefix ? rec->prefix->link.len + 1 : 0;
+			len = plen + strlen(rec_name(rec)) + 1;
+			if (talloc_get_size(name) < len) {
+				talloc_free(name);
+				name = talloc_size(NULL, len);
+				if (!name)
+					return ENOMEM;
+			}
+
+			if (rec->prefix) {
+				memcpy(name, rec->prefix->name, plen - 1);
+				name[plen - 1] = '/';
+			}
+			strcpy(name + plen, rec_name(rec));
+
+			ret = func(name, rec->data, arg);
+		}
+	}
+
+	talloc_free(name);
+
+	return ret;
+}
+
+int nodedb_get_stats(const void *ctx, struct connection *conn)
+{
+	unsigned long tables, total;
+	char *resp;
+
+	tables = (db.recs.mask + 1 + db.prefixes.mask + 1) *
+		 sizeof(struct db_link *);
+	total = db.chunks * DB_CHUNK_SIZE + db.large_bytes + tables;
+
+	resp = talloc_asprintf(ctx,
+			       "Node data base:\n"
+			       "%-17s: %8u\n"
+			       "%-17s: %8u\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n",
+			       "nodes", db.recs.count,
+			       "name prefixes", db.prefixes.count,
+			       "chunks", db.chunks,
+			       "chunk bytes used", db.used,
+			       "large records", db.large,
+			       "large bytes", db.large_bytes,
+			       "hash table bytes", tables,
+			       "bytes per node",
+			       db.recs.count ? total / db.recs.count : 0);
+	if (!resp)
+		return ENOMEM;
+
+	send_reply(conn, XS_CONTROL, resp, strlen(resp) + 1);
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+    Node data base of Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XENSTORED_NODEDB_H
+#define _XENSTORED_NODEDB_H
+
+#include <stddef.h>
+
+struct connection;
+
+/* Returns 0 or an errno value. */
+int nodedb_init(const void *ctx);
+
+/* Returns NULL if not found. */
+const void *nodedb_find(const char *name, size_t *size);
+
+/*
+ * Both store a copy of data, the caller keeps ownership of it.
+ * Return 0 or an errno value (EEXIST, ENOENT, ENOMEM).
+ */
+int nodedb_add(const char *name, const void *data, size_t size);
+int nodedb_replace(const char *name, const void *data, size_t size);
+
+void nodedb_remove(const char *name);
+
+/*
+ * Call func for all nodes, stop if it returns non-zero.  func may remove
+ * the node it is called for, but no other one.
+ */
+int nodedb_iterate(int (*func)(const char *name, const void *data,
+			       void *arg),
+		   void *arg);
+
+int nodedb_get_stats(const void *ctx, struct connection *conn);
+
+#endif /* _XENSTORED_NODEDB_H */
@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "transaction.h"
 #include "watch.h"
 #include "domain.h"
@@ -106,6 +107,32 @@
  *    TA2: write node A:   g(2:A) = 6, G = 7
  *    End TA1: g(1:A) == g(A) => okay, B = 1:B, g(B) = 7, G = 8
  *    End TA2: g(2:B) != g(B) => EAGAIN
+ *
+ * Only nodes whose contents have been used for a request of the transaction
+ * (reading its data or children, checking permissions for modifying it), or
+ * which have been found not to exist, or which have been modified, are
+ * checked. Nodes looked at internally only, like the parents of a node when
+ * checking its permissions, are not.
+ *
+ * A node which has been modified in the transaction only by adding children
+ * to it (the parent of a node being created), and which has not been read by
+ * the transaction otherwise, doesn't need to be unchanged either: at the end
+ * of the transaction the new children are added to the current global node,
+ * as long as it has the same permissions as before and none of the new
+ * children has been added concurrently. This avoids conflicts between
+ * transactions creating different nodes below a common parent. The merged
+ * node is subject to the node size and memory quotas like any other write,
+ * failing the transaction with ENOSPC if it exceeds them.
+ *
+ * 5. Two transactions creating nodes below the same parent
+ *    I: g(A) = 1, G = 2
+ *    Start transaction 1: G(1) = 2, G = 3
+ *    Start transaction 2: G(2) = 3, G = 4
+ *    TA1: create node A/B: g(1:A) = 4, g(1:A/B) = 5, G = 6
+ *    TA2: create node A/C: g(2:A) = 6, g(2:A/C) = 7, G = 8
+ *    End TA1: A/B not existing => okay, A = 1:A, A/B = 1:A/B, g(A) = 9, ...
+ *    End TA2: A/C not existing, A changed by adding B only => okay,
+ *             A = A + C, A/C = 2:A/C, ...
  */
 
 struct accessed_node
@@ -126,9 +153,16 @@ struct accessed_node
 	/* Generation count checking required? */
 	bool check_gen;
 
+	/* Contents used for a request? */
+	bool read;
+
 	/* Modified? */
 	bool modified;
 
+	/* Modified only by adding children, original length of children. */
+	bool add_child_only;
+	unsigned int childlen;
+
 	/* Transaction node in data base? */
 	bool ta_node;
 
@@ -169,6 +203,23 @@ struct transaction
 
 uint64_t generation;
 
+/* Maximum number of nodes for which conflicts are counted individually. */
+#define TA_CONFLICT_NODES_MAX 256
+
+struct ta_conflict_node {
+	char *name;
+	unsigned long count;
+};
+
+static struct hashtable *ta_conflict_nodes;
+static unsigned int ta_conflict_nodes_nr;
+
+static struct {
+	unsigned long committed;
+	unsigned long conflicts;
+	unsigned long merged;
+} ta_stats;
+
 void ta_node_created(struct transaction *trans)
 {
 	trans->node_created = true;
@@ -186,6 +237,15 @@ static struct accessed_node *find_accessed_node(struct transaction *trans,
 	return NULL;
 }
 
+void ta_node_read(struct transaction *trans, const char *name)
+{
+	struct accessed_node *i;
+
+	i = find_accessed_node(trans, name);
+	if (i)
+		i->read = true;
+}
+
 static char *transaction_get_node_name(void *ctx, struct transaction *trans,
 				       const char *name)
 {
@@ -286,6 +346,7 @@ int access_node(struct connection *conn, struct node *node,
 			i->generation = node->hdr.generation;
 			i->check_gen = true;
 			if (node->hdr.generation != NO_GENERATION) {
+				i->childlen = node->hdr.childlen;
 				ret = write_node_raw(conn, i->trans_name, node,
 						     NODE_CREATE, true);
 				if (ret)
@@ -297,6 +358,13 @@ int access_node(struct connection *conn, struct node *node,
 		list_add_tail(&i->list, &trans->accessed);
 	}
 
+	if (type == NODE_ACCESS_ADD_CHILD) {
+		if (!i->modified)
+			i->add_child_only = i->ta_node &&
+					    i->generation != NO_GENERATION;
+	} else if (type != NODE_ACCESS_READ)
+		i->add_child_only = false;
+
 	if (type != NODE_ACCESS_READ)
 		i->modified = true;
 
@@ -306,7 +374,7 @@ int access_node(struct connection *conn, struct node *node,
 
 	if (db_name) {
 		*db_name = i->trans_name;
-		if (type == NODE_ACCESS_WRITE)
+		if (type == NODE_ACCESS_WRITE || type == NODE_ACCESS_ADD_CHILD)
 			i->ta_node = true;
 		if (type == NODE_ACCESS_DELETE)
 			i->ta_node = false;
@@ -346,9 +414,111 @@ void queue_watches(struct connection *conn, const char *name, bool watch_exact)
 	}
 }
 
+static bool has_child(const char *children, unsigned int childlen,
+		      const char *name)
+{
+	unsigned int off;
+
+	for (off = 0; off < childlen; off += strlen(children + off) + 1)
+		if (streq(children + off, name))
+			return true;
+
+	return false;
+}
+
+/*
+ * Add the children added in the transaction to the current global node hdr,
+ * storing the result as the transaction specific node.
+ */
+static int merge_children(struct connection *conn, struct accessed_node *i,
+			  const struct node_hdr *hdr, size_t size)
+{
+	const struct node_hdr *ta_hdr;
+	struct node_hdr *new;
+	const char *children, *added;
+	unsigned int addlen, off;
+	size_t ta_size;
+	int ret;
+
+	if (!hdr || hdr->num_perms != i->perms.num ||
+	    memcmp(perms_from_node_hdr(hdr), i->perms.p,
+		   i->perms.num * sizeof(*i->perms.p)))
+		return EAGAIN;
+
+	ta_hdr = db_fetch(i->trans_name, &ta_size);
+	if (!ta_hdr)
+		return EAGAIN;
+
+	/* Children are only ever appended. */
+	added = (const char *)(perms_from_node_hdr(ta_hdr) +
+			       ta_hdr->num_perms) +
+		ta_hdr->datalen + i->childlen;
+	addlen = ta_hdr->childlen - i->childlen;
+
+	children = (const char *)hdr + size - hdr->childlen;
+	for (off = 0; off < addlen; off += strlen(added + off) + 1)
+		if (has_child(children, hdr->childlen, added + off))
+			return EAGAIN;
+
+	/*
+	 * The merged node hasn't been seen by any quota check of the
+	 * transactions, so apply the ones of write_node_raw() to it.
+	 */
+	if (domain_max_chk(conn, ACC_NODESZ, size + addlen))
+		return ENOSPC;
+
+	new = talloc_size(NULL, size + addlen);
+	if (!new)
+		return ENOMEM;
+	memcpy(new, hdr, size);
+	memcpy((char *)new + size, added, addlen);
+	new->childlen += addlen;
+
+	/* Failing here is mostly due to the memory quota. */
+	ret = db_write(conn, i->trans_name, new, size + addlen, NULL,
+		       NODE_MODIFY, false);
+	talloc_free(new);
+
+	return ret ? ENOSPC : 0;
+}
+
+static void count_conflict(const char *name)
+{
+	struct ta_conflict_node *c;
+
+	ta_stats.conflicts++;
+
+	if (!ta_conflict_nodes) {
+		ta_conflict_nodes = create_hashtable(NULL, "ta_conflicts",
+						     hash_from_key_fn,
+						     keys_equal_fn,
+						     HASHTABLE_FREE_VALUE);
+		if (!ta_conflict_nodes)
+			return;
+	}
+
+	c = hashtable_search(ta_conflict_nodes, name);
+	if (!c) {
+		if (ta_conflict_nodes_nr >= TA_CONFLICT_NODES_MAX)
+			return;
+		c = talloc_zero(NULL, struct ta_conflict_node);
+		if (!c)
+			return;
+		c->name = talloc_strdup(c, name);
+		if (!c->name || hashtable_add(ta_conflict_nodes, c->name, c)) {
+			talloc_free(c);
+			return;
+		}
+		ta_conflict_nodes_nr++;
+	}
+
+	c->count++;
+}
+
 /*
  * Finalize transaction:
- * Walk through accessed nodes and check generation against global data.
+ * Walk through accessed nodes and check generation against global data,
+ * merging nodes which only got new children.
  * If all entries match, read the transaction entries and write them without
  * transaction prepended. Delete all transaction specific nodes in the data
  * base.
@@ -359,18 +529,31 @@ static int finalize_transaction(struct connection *conn,
 	struct accessed_node *i, *n;
 	size_t size;
 	const struct node_hdr *hdr;
+	struct node_hdr *own;
+	enum write_node_mode mode;
 	uint64_t gen;
+	int ret;
 
 	list_for_each_entry_safe(i, n, &trans->accessed, list) {
-		if (i->check_gen) {
+		if (i->check_gen && (i->read || i->modified ||
+				     i->generation == NO_GENERATION)) {
 			hdr = db_fetch(i->node, &size);
 			if (!hdr) {
 				gen = NO_GENERATION;
 			} else {
 				gen = hdr->generation;
 			}
-			if (i->generation != gen)
-				return EAGAIN;
+			if (i->generation != gen) {
+				ret = (i->add_child_only && !i->read)
+				      ? merge_children(conn, i, hdr, size)
+				      : EAGAIN;
+				if (ret) {
+					if (ret == EAGAIN)
+						count_conflict(i->node);
+					return ret;
+				}
+				ta_stats.merged++;
+			}
 		}
 
 		/* Entries for unmodified nodes can be removed early. */
@@ -385,27 +568,22 @@ static int finalize_transaction(struct connection *conn,
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
 		if (i->ta_node) {
 			hdr = db_fetch(i->trans_name, &size);
-			if (hdr) {
-				/*
-				 * Delete transaction entry and write it as
-				 * no-TA entry. As we only hold a reference
-				 * to the data, increment its ref count, then
-				 * delete it from the DB. Now we own it and can
-				 * drop the const attribute for changing the
-				 * generation count.
-				 */
-				enum write_node_mode mode;
-				struct node_hdr *own;
-
-				talloc_increase_ref_count(hdr);
+			/*
+			 * Delete transaction entry and write it as no-TA
+			 * entry. The data base only hands out a reference to
+			 * its own copy of the data, so take a private one,
+			 * which can get the new generation count.
+			 */
+			own = hdr ? talloc_memdup(trans, hdr, size) : NULL;
+			if (own) {
 				db_delete(conn, i->trans_name, NULL);
 
-				own = (struct node_hdr *)hdr;
 				own->generation = ++generation;
 				mode = (i->generation == NO_GENERATION)
 				       ? NODE_CREATE : NODE_MODIFY;
 				*is_corrupt |= db_write(conn, i->node, own,
 							size, NULL, mode, true);
+				talloc_free(own);
 			} else {
 				*is_corrupt = true;
 			}
@@ -545,6 +723,7 @@ int do_transaction_end(const void *ctx, struct connection *conn,
 			return ret;
 
 		wrl_apply_debit_trans_commit(conn);
+		ta_stats.committed++;
 
 		/* fix domain entry for each changed domain */
 		acc_fix_domains(&trans->changed_domains, false, true);
@@ -582,6 +761,50 @@ void conn_delete_all_transactions(struct connection *conn)
 	conn->ta_start_time = 0;
 }
 
+static int ta_conflict_node_report(const void *k, void *v, void *arg)
+{
+	const struct ta_conflict_node *c = v;
+	char **resp = arg;
+
+	*resp = talloc_asprintf_append(*resp, "%8lu %s\n", c->count, c->name);
+
+	return *resp ? 0 : ENOMEM;
+}
+
+int transaction_get_stats(const void *ctx, struct connection *conn,
+			  bool reset)
+{
+	char *resp;
+
+	resp = talloc_asprintf(ctx,
+			       "Transactions:\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n"
+			       "Conflicts per node:\n",
+			       "committed", ta_stats.committed,
+			       "conflicts", ta_stats.conflicts,
+			       "merged nodes", ta_stats.merged);
+	if (!resp)
+		return ENOMEM;
+
+	if (ta_conflict_nodes &&
+	    hashtable_iterate(ta_conflict_nodes, ta_conflict_node_report,
+			      &resp))
+		return ENOMEM;
+
+	if (reset) {
+		memset(&ta_stats, 0, sizeof(ta_stats));
+		hashtable_destroy(ta_conflict_nodes);
+		ta_conflict_nodes = NULL;
+		ta_conflict_nodes_nr = 0;
+	}
+
+	send_reply(conn, XS_CONTROL, resp, strlen(resp) + 1);
+
+	return 0;
+}
+
 int check_transactions(struct hashtable *hash)
 {
 	struct connection *conn;
@@ -22,6 +22,7 @@
 enum node_access_type {
     NODE_ACCESS_READ,
     NODE_ACCESS_WRITE,
+    NODE_ACCESS_ADD_CHILD,	/* Write only appending to the children. */
     NODE_ACCESS_DELETE
 };
 
@@ -39,6 +40,9 @@ struct transaction *transaction_lookup(struct connection *conn, uint32_t id);
 /* Set flag for created node. */
 void ta_node_created(struct transaction *trans);
 
+/* The contents of a node have been used for a request. */
+void ta_node_read(struct transaction *trans, const char *name);
+
 /* This node was accessed. */
 int __must_check access_node(struct connection *conn, struct node *node,
                              enum node_access_type type, const char **db_name);
@@ -56,6 +60,10 @@ void fail_transaction(struct transaction *trans);
 struct list_head *transaction_get_changed_domains(struct transaction *trans);
 
 void conn_delete_all_transactions(struct connection *conn);
+
+/* Report statistics of transaction conflicts, optionally resetting them. */
+int transaction_get_stats(const void *ctx, struct connection *conn,
+			  bool reset);
 int check_transactions(struct hashtable *hash);
 
 #endif /* _XENSTORED_TRANSACTION_H */
@@ -23,8 +23,10 @@
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
+#include <syslog.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -36,6 +38,11 @@ struct watch
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same node, from any connection */
+	struct list_head node_list;
+	struct watched_node *watched;
+	struct connection *conn;
+
 	/* Offset into path for skipping prefix (used for relative paths). */
 	unsigned int prefix_len;
 
@@ -43,22 +50,63 @@ struct watch
 	char *node;
 };
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+/*
+ * Index of all watches, keyed by the node watched.  A modified node fires
+ * the watches on itself and on all its ancestors, so only these nodes need
+ * to be looked up rather than every watch of every connection be checked.
+ */
+struct watched_node
 {
-	unsigned int len = strlen(parent);
+	struct list_head watches;
+	unsigned int nr_watches;
+	char *name;
+};
 
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
+static struct hashtable *watched_nodes;
+
+static struct {
+	unsigned long fired;
+	unsigned long lookups;
+	unsigned long matched;
+} watch_stats;
+
+static int destroy_watched_node(void *_watched)
+{
+	struct watched_node *watched = _watched;
+
+	hashtable_remove(watched_nodes, watched->name);
+	return 0;
+}
 
-	if (strncmp(child, parent, len) != 0)
-		return false;
+static struct watched_node *get_watched_node(const char *name)
+{
+	struct watched_node *watched;
+
+	if (!watched_nodes) {
+		watched_nodes = create_hashtable(NULL, "watches",
+						 hash_from_key_fn,
+						 keys_equal_fn, 0);
+		if (!watched_nodes)
+			return NULL;
+	}
+
+	watched = hashtable_search(watched_nodes, name);
+	if (watched)
+		return watched;
+
+	watched = talloc_zero(watched_nodes, struct watched_node);
+	if (!watched)
+		return NULL;
+	watched->name = talloc_strdup(watched, name);
+	if (!watched->name ||
+	    hashtable_add(watched_nodes, watched->name, watched)) {
+		talloc_free(watched);
+		return NULL;
+	}
+	INIT_LIST_HEAD(&watched->watches);
+	talloc_set_destructor(watched, destroy_watched_node);
 
-	return child[len] == '/' || child[len] == '\0';
+	return watched;
 }
 
 static const char *get_watch_path(const struct watch *watch, const char *name)
@@ -111,6 +159,28 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
 	return perm & XS_PERM_READ;
 }
 
+static void fire_watched_node(struct buffered_data *req, const void *ctx,
+			      const char *watched_name, const char *name,
+			      const struct node *node,
+			      struct node_perms *perms)
+{
+	struct watched_node *watched;
+	struct watch *watch;
+
+	watch_stats.lookups++;
+
+	watched = hashtable_search(watched_nodes, watched_name);
+	if (!watched)
+		return;
+
+	list_for_each_entry(watch, &watched->watches, node_list) {
+		watch_stats.matched++;
+		if (watch_permitted(watch->conn, ctx, name, node, perms))
+			send_event(req, watch->conn,
+				   get_watch_path(watch, name), watch->token);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -121,9 +191,8 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
 void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		  const struct node *node, bool exact, struct node_perms *perms)
 {
-	struct connection *i;
 	struct buffered_data *req;
-	struct watch *watch;
+	char *path, *slash;
 
 	/* During transactions, don't fire watches, but queue them. */
 	if (conn && conn->transaction) {
@@ -131,31 +200,43 @@ void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		return;
 	}
 
+	if (!watched_nodes)
+		return;
+
+	watch_stats.fired++;
+
 	req = domain_is_unprivileged(conn) ? conn->in : NULL;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		if (!watch_permitted(i, ctx, name, node, perms))
-			continue;
-
-		list_for_each_entry(watch, &i->watches, list) {
-			if (exact) {
-				if (streq(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			} else {
-				if (is_child(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			}
-		}
+	/* Create an event for each watch on the node. */
+	fire_watched_node(req, ctx, name, name, node, perms);
+	if (exact)
+		return;
+
+	path = talloc_strdup(ctx, name);
+	if (!path) {
+		log("fire_watches: ENOMEM");
+		return;
 	}
+
+	/* And on all of its ancestors, up to and including "/". */
+	while ((slash = strrchr(path, '/')) && path[1]) {
+		slash[slash == path] = '\0';
+		fire_watched_node(req, ctx, path, name, node, perms);
+	}
+
+	talloc_free(path);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	if (watch->watched) {
+		list_del(&watch->node_list);
+		if (!--watch->watched->nr_watches)
+			talloc_free(watch->watched);
+	}
+
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -175,21 +256,30 @@ static struct watch *add_watch(struct connection *conn, const char *path,
 {
 	struct watch *watch;
 
-	watch = talloc(conn, struct watch);
+	watch = talloc_zero(conn, struct watch);
 	if (!watch)
 		goto nomem;
 	watch->node = talloc_strdup(watch, path);
 	watch->token = talloc_strdup(watch, token);
 	if (!watch->node || !watch->token)
 		goto nomem;
+	watch->watched = get_watched_node(path);
+	if (!watch->watched)
+		goto nomem;
 	if (domain_memory_add(conn, conn->id, strlen(path) + strlen(token),
-			      no_quota_check))
+			      no_quota_check)) {
+		if (!watch->watched->nr_watches)
+			talloc_free(watch->watched);
 		goto nomem;
+	}
 
+	watch->conn = conn;
 	watch->prefix_len = relative ? strlen(get_implicit_path(conn)) + 1 : 0;
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &watch->watched->watches);
+	watch->watched->nr_watches++;
 	talloc_set_destructor(watch, destroy_watch);
 
 	return watch;
@@ -281,6 +371,55 @@ void conn_delete_all_watches(struct connection *conn)
 	}
 }
 
+struct watch_index_stats {
+	unsigned int nodes;
+	unsigned int watches;
+	unsigned int max;
+};
+
+static int watched_node_stats(const void *k, void *v, void *arg)
+{
+	const struct watched_node *watched = v;
+	struct watch_index_stats *stats = arg;
+
+	stats->nodes++;
+	stats->watches += watched->nr_watches;
+	if (watched->nr_watches > stats->max)
+		stats->max = watched->nr_watches;
+
+	return 0;
+}
+
+int watch_get_stats(const void *ctx, struct connection *conn)
+{
+	struct watch_index_stats stats = { };
+	char *resp;
+
+	if (watched_nodes)
+		hashtable_iterate(watched_nodes, watched_node_stats, &stats);
+
+	resp = talloc_asprintf(ctx,
+			       "Watch index:\n"
+			       "%-17s: %8u\n"
+			       "%-17s: %8u\n"
+			       "%-17s: %8u\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n"
+			       "%-17s: %8lu\n",
+			       "watches", stats.watches,
+			       "watched nodes", stats.nodes,
+			       "max per node", stats.max,
+			       "fired", watch_stats.fired,
+			       "node lookups", watch_stats.lookups,
+			       "watches matched", watch_stats.matched);
+	if (!resp)
+		return ENOMEM;
+
+	send_reply(conn, XS_CONTROL, resp, strlen(resp) + 1);
+
+	return 0;
+}
+
 const char *dump_state_watches(FILE *fp, struct connection *conn,
 			       unsigned int conn_id)
 {
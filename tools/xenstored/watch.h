@@ -33,6 +33,9 @@ void fire_watches(struct connection *conn, const void *tmp, const char *name,
 
 void conn_delete_all_watches(struct connection *conn);
 
+/* Report statistics of the watch index. */
+int watch_get_stats(const void *ctx, struct connection *conn);
+
 const char *dump_state_watches(FILE *fp, struct connection *conn,
 			       unsigned int conn_id);
 
@@ -1,12 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <errno.h>
 #include "mread.h"
 
+/* Map a file at once if the address space allows, or return NULL. */
+static char *map_file(int fd, off_t size)
+{
+    char *file;
+
+    if ( size <= 0 || size != (size_t)size )
+        return NULL;
+
+    file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    return file == MAP_FAILED ? NULL : file;
+}
+
 mread_handle_t mread_init(int fd)
 {
     struct stat s;
@@ -27,9 +42,141 @@ mread_handle_t mread_init(int fd)
     fstat(fd, &s);
     h->file_size = s.st_size;
 
+    /* Map the whole file if the address space allows, and only fall back
+     * to the cache of windows below if it doesn't. */
+    h->file = map_file(fd, h->file_size);
+
+    return h;
+}
+
+/*
+ * The trace is the pieces of the files given, in order.  Files which can't
+ * be mapped are read piecemeal.  Takes over both arrays.
+ */
+mread_handle_t mread_init_pieces(const int *fds, int nr_fds,
+                                 struct mread_piece *pieces, int nr_pieces)
+{
+    mread_handle_t h;
+    struct stat s;
+    int i;
+
+    h = calloc(1, sizeof(struct mread_ctrl));
+    if ( h )
+        h->sources = calloc(nr_fds, sizeof(*h->sources));
+    if ( !h || !h->sources )
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    h->fd = -1;
+
+    for ( i = 0; i < nr_fds; i++ )
+    {
+        h->sources[i].fd = fds[i];
+        if ( !fstat(fds[i], &s) )
+            h->sources[i].file = map_file(fds[i], s.st_size);
+    }
+
+    for ( i = 0; i < nr_pieces; i++ )
+    {
+        pieces[i].offset = h->file_size;
+        h->file_size += pieces[i].len;
+    }
+    h->pieces = pieces;
+    h->nr_pieces = nr_pieces;
+
     return h;
 }
 
+/* Find the piece containing offset, which must be within the trace. */
+static struct mread_piece *find_piece(mread_handle_t h, off_t offset)
+{
+    struct mread_piece *p = h->pieces + h->last_piece;
+    int lo = 0, hi = h->nr_pieces;
+
+    /* Reads mostly carry on where the previous one ended. */
+    if ( offset >= p->offset && offset < p->offset + p->len )
+        return p;
+    if ( ++p < h->pieces + h->nr_pieces &&
+         offset >= p->offset && offset < p->offset + p->len )
+        goto out;
+
+    while ( hi - lo > 1 )
+    {
+        int mid = (lo + hi) / 2;
+
+        if ( h->pieces[mid].offset <= offset )
+            lo = mid;
+        else
+            hi = mid;
+    }
+    p = h->pieces + lo;
+
+ out:
+    h->last_piece = p - h->pieces;
+    return p;
+}
+
+static void mread_pieces(mread_handle_t h, char *dst, ssize_t len,
+                         off_t offset)
+{
+    struct mread_piece *p = find_piece(h, offset);
+
+    while ( len )
+    {
+        const struct mread_source *src = h->sources + p->src;
+        off_t poff = offset - p->offset;
+        ssize_t n = p->len - poff < len ? p->len - poff : len;
+
+        if ( src->file )
+            memcpy(dst, src->file + p->src_offset + poff, n);
+        else if ( pread(src->fd, dst, n, p->src_offset + poff) != n )
+        {
+            perror("pread");
+            exit(1);
+        }
+
+        dst += n;
+        offset += n;
+        len -= n;
+        p++;
+    }
+}
+
+/* Start reading in a range of the file which is going to be needed soon. */
+void mread_willneed(mread_handle_t h, off_t offset, size_t len)
+{
+    off_t start = offset & ~((1ULL<<PAGE_SHIFT)-1);
+
+    if ( h->sources )
+    {
+        const struct mread_piece *p;
+        const struct mread_source *src;
+
+        if ( offset >= h->file_size )
+            return;
+        p = find_piece(h, offset);
+        src = h->sources + p->src;
+        if ( !src->file )
+            return;
+
+        if ( len > p->offset + p->len - offset )
+            len = p->offset + p->len - offset;
+        offset += p->src_offset - p->offset;
+        start = offset & ~((1ULL<<PAGE_SHIFT)-1);
+        madvise(src->file + start, len + (offset - start), MADV_WILLNEED);
+        return;
+    }
+
+    if ( !h->file || offset >= h->file_size )
+        return;
+    if ( len > h->file_size - offset )
+        len = h->file_size - offset;
+
+    madvise(h->file + start, len + (offset - start), MADV_WILLNEED);
+}
+
 ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
 {
     /* Idea: have a "cache" of N mmaped regions.  If the offset is
@@ -66,6 +213,19 @@ ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
         len = h->file_size - offset;
     }
 
+    if ( h->file )
+    {
+        memcpy(rec, h->file + offset, len);
+        return len;
+    }
+
+    if ( h->sources )
+    {
+        if ( len )
+            mread_pieces(h, rec, len, offset);
+        return len;
+    }
+
     /* Try to find the offset in our range */
     dprintf(warn, " Trying last, %d\n", last);
     if ( h->map[h->last].buffer
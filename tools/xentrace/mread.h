@@ -3,9 +3,25 @@
 #define PAGE_SHIFT 12
 #define MREAD_BUF_SIZE (1ULL<<(PAGE_SHIFT+MREAD_BUF_SHIFT))
 #define MREAD_BUF_MASK (~(MREAD_BUF_SIZE-1))
+/* A stretch of one of several files, making up part of the trace. */
+struct mread_piece {
+    int src;            /* Index of the file */
+    off_t src_offset;   /* Start of the piece in that file */
+    off_t len;
+    off_t offset;       /* Start of the piece in the trace */
+};
 typedef struct mread_ctrl {
     int fd;
     off_t file_size;
+    /* The whole file, if it could be mapped at once */
+    char * file;
+    /* A trace made up of pieces of several files, in order */
+    struct mread_source {
+        int fd;
+        char * file;    /* The whole file, if it could be mapped */
+    } *sources;
+    struct mread_piece *pieces;
+    int nr_pieces, last_piece;
     struct mread_buffer {
         char * buffer;
         off_t start_offset;
@@ -15,4 +31,7 @@ typedef struct mread_ctrl {
 } *mread_handle_t;
 
 mread_handle_t mread_init(int fd);
+mread_handle_t mread_init_pieces(const int *fds, int nr_fds,
+                                 struct mread_piece *pieces, int nr_pieces);
 ssize_t mread64(mread_handle_t h, void *dst, ssize_t len, off_t offset);
+void mread_willneed(mread_handle_t h, off_t offset, size_t len);
@@ -70,6 +70,8 @@ struct {
     struct symbol_struct * symbols;
     char * symbol_file;
     char * trace_file;
+    char ** trace_files;
+    int nr_trace_files;
     int output_defined;
     off_t file_size;
     struct {
@@ -191,6 +193,11 @@ struct {
     int default_guest_paging_levels;
     int sample_size, sample_max;
     enum error_level tolerance; /* Tolerate up to this level of error */
+    struct {
+        /* Seconds after the first record; end 0 for the end of the trace */
+        double start, end;
+        tsc_t start_cycles, end_cycles;
+    } time_window;
     struct {
         tsc_t cycles;
         /* Used if interval is specified in seconds to delay calculating
@@ -1818,6 +1825,8 @@ struct pcpu_info {
 
     /* Information related to scanning thru the file */
     tsc_t first_tsc, last_tsc, order_tsc;
+    int order_index;
+    unsigned long long order_seq;
     off_t file_offset;
     off_t next_cpu_change_offset;
     struct record_info ri;
@@ -1871,6 +1880,10 @@ struct {
     tsc_t buffer_trace_virq_tsc;
     struct pcpu_info pcpu[MAX_CPUS];
 
+    struct {
+        tsc_t start_tsc, end_tsc;
+    } time_window;
+
     struct {
         int id;
         /* Invariant: head null => tail null; head !null => tail valid */
@@ -9385,6 +9398,10 @@ void process_cpu_change(struct pcpu_info *p) {
         p->file_offset += ri->size;
         p->next_cpu_change_offset = p->file_offset + r->window_size;
 
+        /* Have the window read in while the records before it are
+         * processed. */
+        mread_willneed(G.mh, p->file_offset, r->window_size);
+
         if(p->next_cpu_change_offset > G.file_size)
             activate_early_eof();
         else if(p->pid == P.max_active_pcpu)
@@ -9469,6 +9486,10 @@ void process_record(struct pcpu_info *p) {
     if ( opt.dump_no_processing )
         goto out;
 
+    /* Records before the time window only move the pcpu along */
+    if ( ri->tsc < P.time_window.start_tsc )
+        goto out;
+
     p->summary = 1;
 
     if( opt.dump_raw_process )
@@ -9781,8 +9802,15 @@ char * pcpu_string(int pcpu)
     return s;
 }
 
-/* Null terminated */
+/*
+ * Active pcpus, kept in a binary min-heap ordered by the tsc of their next
+ * record, so that putting a pcpu back after processing one of its records
+ * costs O(log n) rather than a walk past all the other active pcpus.  Null
+ * terminated.
+ */
 struct pcpu_info *record_order[MAX_CPUS+1] = { 0 };
+int record_order_count = 0;
+unsigned long long record_order_seq = 0;
 
 /* In the case of identical tsc values, the old algorithm would favor the
  * pcpu with the lowest number.  By default the new algorithm favors the
@@ -9790,83 +9818,98 @@ struct pcpu_info *record_order[MAX_CPUS+1] = { 0 };
  *
  * I think the second way is better; but it's good to be able to use the
  * old ordering, at very lest to verify that there are no (other) ordering
- * differences.  Enabling the below flag will cause the insertion / bubble
- * routines to order by pcpu id as well as tsc, preserving the old order. */
+ * differences.  Enabling the below flag will cause the heap to order by
+ * pcpu id as well as tsc, preserving the old order. */
 //#define PRESERVE_PCPU_ORDERING
 
-/* Steady state:
- * + Entire list is in order, except (potentially) for the first entry
- * + last is pointing to the first entry.
- */
-void record_order_bubble(struct pcpu_info *last)
+static int record_order_before(struct pcpu_info *a, struct pcpu_info *b)
 {
-    int i;
-
-    /* Find the pcpu to "bubble".  This is usually the
-     * first one, but if other pcpus have been activated, it may
-     * not be. */
-    for(i=0; record_order[i] && record_order[i]!=last; i++);
-
-    assert(record_order[i]);
-
-    /* Now bubble it down */
-    for( ;
-        record_order[i+1]
-             && ( record_order[i+1]->order_tsc < last->order_tsc
+    if(a->order_tsc != b->order_tsc)
+        return a->order_tsc < b->order_tsc;
 #ifdef PRESERVE_PCPU_ORDERING
-                  || ( record_order[i+1]->order_tsc == last->order_tsc
-                       && record_order[i+1]->pid < last->pid )
+    return a->pid < b->pid;
+#else
+    return a->order_seq > b->order_seq;
 #endif
-                 ) ;
-        i++)
-        record_order[i]=record_order[i+1];
-    record_order[i]=last;
 }
 
-void record_order_insert(struct pcpu_info *new)
+static void record_order_set(int i, struct pcpu_info *p)
 {
-    int i;
-    struct pcpu_info *p=NULL, *t=NULL;
+    record_order[i]=p;
+    p->order_index=i;
+}
 
-    /* Sanity check: Make sure it's not already in there */
-    for(i=0; record_order[i]; i++)
-        assert(record_order[i]!=new);
+/* Move the pcpu at index i down to its place in the heap */
+static void record_order_sift_down(int i)
+{
+    struct pcpu_info *p=record_order[i];
+    int c;
+
+    while((c=2*i+1) < record_order_count) {
+        if(c+1 < record_order_count
+           && record_order_before(record_order[c+1], record_order[c]))
+            c++;
+        if(!record_order_before(record_order[c], p))
+            break;
+        record_order_set(i, record_order[c]);
+        i=c;
+    }
 
-    /* Find where to insert it */
-    for(i=0;
-        record_order[i]
-             && ( record_order[i]->order_tsc < new->order_tsc
-#ifdef PRESERVE_PCPU_ORDERING
-                  || ( record_order[i]->order_tsc == new->order_tsc
-                       && record_order[i]->pid < new->pid )
-#endif
-                 ) ;
-        i++)
-        ;
+    record_order_set(i, p);
+}
 
-    /* And insert it */
-    for( p=new; p ; i++)
-    {
-        t=record_order[i];
-        record_order[i]=p;
-        p=t;
+/* Move the pcpu at index i up or down to its place in the heap */
+static void record_order_sift(int i)
+{
+    struct pcpu_info *p=record_order[i];
+
+    while(i > 0 && record_order_before(p, record_order[(i-1)/2])) {
+        record_order_set(i, record_order[(i-1)/2]);
+        i=(i-1)/2;
     }
+    record_order_set(i, p);
+
+    record_order_sift_down(i);
 }
 
-void record_order_remove(struct pcpu_info *rem)
+/*
+ * Like the sorted list this heap replaced, a pcpu is only ever bubbled
+ * down: should its tsc go backwards, it isn't moved ahead of the pcpus
+ * already in front of it.
+ */
+void record_order_bubble(struct pcpu_info *last)
 {
-    int i;
+    assert(last->order_index < record_order_count
+           && record_order[last->order_index]==last);
 
-    /* Find where the record is */
-    for(i=0; record_order[i] && record_order[i]!=rem; i++)
-        ;
+    last->order_seq = ++record_order_seq;
+    record_order_sift_down(last->order_index);
+}
+
+void record_order_insert(struct pcpu_info *new)
+{
+    /* Sanity check: Make sure it's not already in there */
+    assert(record_order[new->order_index]!=new);
+
+    new->order_seq = ++record_order_seq;
+    record_order_set(record_order_count++, new);
+    record_order_sift(new->order_index);
+}
+
+void record_order_remove(struct pcpu_info *rem)
+{
+    int i=rem->order_index;
 
     /* Sanity check: Make sure it's actually there! */
-    assert(record_order[i]);
+    assert(i < record_order_count && record_order[i]==rem);
 
-    /* And move everyone forward */
-    for(; (record_order[i]=record_order[i+1]); i++)
-        ;
+    /* And move the last one into its place */
+    record_order_count--;
+    if(i < record_order_count) {
+        record_order_set(i, record_order[record_order_count]);
+        record_order_sift(i);
+    }
+    record_order[record_order_count]=NULL;
 }
 
 struct pcpu_info * choose_next_record(void)
@@ -9891,6 +9934,13 @@ void process_records(void) {
         if(!(p=choose_next_record()))
             return;
 
+        /* Past the time window; wind up as at the end of the file */
+        if(P.time_window.end_tsc && p->order_tsc > P.time_window.end_tsc) {
+            while((p=record_order[0]))
+                deactivate_pcpu(p);
+            return;
+        }
+
         process_record(p);
 
         /* Lost records gets processed twice. */
@@ -10014,6 +10064,113 @@ void report_pcpu(void) {
 
 }
 
+/*
+ * Read the cpu_change record at offset, and the tsc of the first record in
+ * its window with one (0 if none).  Returns the size of the cpu_change
+ * record, or 0 at the end of the file.
+ */
+ssize_t read_window_tsc(off_t offset, struct cpu_change_data *cd, tsc_t *tsc)
+{
+    struct trace_record rec;
+    ssize_t r, size;
+    off_t end;
+
+    r=__read_record(&rec, offset);
+    if(r==0)
+        return 0;
+
+    if(rec.event != TRC_TRACE_CPU_CHANGE || rec.cycle_flag) {
+        fprintf(stderr, "%s: Unexpected record event %x at offset %llx!\n",
+                __func__, rec.event, (unsigned long long)offset);
+        error(ERR_ASSERT, NULL);
+    }
+
+    *cd = *(struct cpu_change_data *)rec.u.notsc.data;
+    if(cd->cpu < 0 || cd->cpu >= MAX_CPUS) {
+        fprintf(stderr, "%s: cpu %d exceeds MAX_CPU %d!\n",
+                __func__, cd->cpu, MAX_CPUS);
+        error(ERR_ASSERT, NULL);
+    }
+
+    *tsc = 0;
+    end = offset + r + cd->window_size;
+    for(offset += r; offset < end; offset += size) {
+        if(!(size=__read_record(&rec, offset)))
+            break;
+        if(rec.cycle_flag) {
+            *tsc = (((tsc_t)rec.u.tsc.tsc_hi) << 32) | rec.u.tsc.tsc_lo;
+            break;
+        }
+    }
+
+    return r;
+}
+
+/*
+ * Work out the time window in tsc, and where in the file to start so that
+ * the records before it needn't all be read: only the cpu_change records,
+ * and the first record of each window, are looked at.  A window lasts
+ * until the next window of the same pcpu, so start at the earliest window
+ * of any pcpu which reaches past the start of the time window.
+ */
+off_t time_window_seek(void)
+{
+    static off_t start_offset[MAX_CPUS];
+    static char seen[MAX_CPUS], after[MAX_CPUS];
+    struct cpu_change_data cd;
+    tsc_t tsc, first_tsc = 0;
+    off_t offset, start = 0;
+    int nr_seen = 0, nr_after = 0, i;
+    ssize_t r;
+
+    /* The trace starts at the earliest record of the first round of
+     * windows. */
+    for(offset = 0;
+        (r=read_window_tsc(offset, &cd, &tsc)) && !seen[cd.cpu];
+        offset += r + cd.window_size) {
+        seen[cd.cpu] = 1;
+        if(tsc && (!first_tsc || tsc < first_tsc))
+            first_tsc = tsc;
+    }
+    memset(seen, 0, sizeof(seen));
+
+    P.time_window.start_tsc = first_tsc + opt.time_window.start_cycles;
+    if(opt.time_window.end_cycles)
+        P.time_window.end_tsc = first_tsc + opt.time_window.end_cycles;
+
+    if(!opt.time_window.start_cycles)
+        return 0;
+
+    for(offset = 0;
+        (r=read_window_tsc(offset, &cd, &tsc));
+        offset += r + cd.window_size) {
+        if(!seen[cd.cpu]) {
+            seen[cd.cpu] = 1;
+            nr_seen++;
+            start_offset[cd.cpu] = offset;
+        }
+
+        if(!tsc)
+            continue;
+        if(tsc <= P.time_window.start_tsc)
+            start_offset[cd.cpu] = offset;
+        else if(!after[cd.cpu]) {
+            after[cd.cpu] = 1;
+            if(++nr_after == nr_seen)
+                break;
+        }
+    }
+
+    for(i=0, start=offset; i<MAX_CPUS; i++)
+        if(seen[i] && start_offset[i] < start)
+            start = start_offset[i];
+
+    fprintf(warn, "%s: starting at offset %llx\n",
+            __func__, (unsigned long long)start);
+
+    return start;
+}
+
 void init_pcpus(void) {
     int i=0;
     off_t offset = 0;
@@ -10029,6 +10186,9 @@ void init_pcpus(void) {
 
     sched_default_domain_init();
 
+    if(opt.time_window.start || opt.time_window.end)
+        offset = time_window_seek();
+
     /* Scan through the cpu_change recs until we see a duplicate */
     do {
         offset = scan_for_new_pcpu(offset);
@@ -10094,6 +10254,8 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_START_TIME,
+    OPT_END_TIME,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10574,13 +10736,37 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_START_TIME:
+    case OPT_END_TIME:
+    {
+        char * inval;
+        double t = strtod(arg, &inval);
+
+        if ( inval == arg || *inval || t < 0 )
+            argp_usage(state);
+
+        if ( key == OPT_START_TIME )
+            opt.time_window.start = t;
+        else
+            opt.time_window.end = t;
+        break;
+    }
+
     case ARGP_KEY_ARG:
     {
+        char **files = realloc(G.trace_files,
+                               (G.nr_trace_files + 1) * sizeof(*files));
+
+        if(!files) {
+            fprintf(stderr, "Malloc failed!\n");
+            error(ERR_SYSTEM, NULL);
+        }
+        files[G.nr_trace_files++] = arg;
+        G.trace_files = files;
+
         /* FIXME - strcpy */
         if (state->arg_num == 0)
             G.trace_file = arg;
-        else
-            argp_usage(state);
     }
     break;
     case ARGP_KEY_END:
@@ -10590,6 +10776,14 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
             interval_header();
         }
 
+        if(opt.time_window.end && opt.time_window.end <= opt.time_window.start)
+        {
+            fprintf(stderr, "ERROR: end time must be after start time\n");
+            exit(1);
+        }
+        opt.time_window.start_cycles = opt.time_window.start * opt.cpu_hz;
+        opt.time_window.end_cycles = opt.time_window.end * opt.cpu_hz;
+
         if(!G.output_defined)
         {
             fprintf(stderr, "No output defined, using summary.\n");
@@ -10863,6 +11057,16 @@ const struct argp_option cmd_opts[] =  {
       .key = OPT_TSC_LOOP_FATAL,
       .doc = "Stop processing and exit if tsc skew tracking detects a dependency loop.", },
 
+    { .name = "start-time",
+      .key = OPT_START_TIME,
+      .arg = "sec",
+      .doc = "Only process the trace from this many seconds after its first record, skipping the records before without processing them.  Times in the output are relative to the start of this window.", },
+
+    { .name = "end-time",
+      .key = OPT_END_TIME,
+      .arg = "sec",
+      .doc = "Stop processing the trace this many seconds after its first record.", },
+
     { .name = "tolerance",
       .key = OPT_TOLERANCE,
       .arg = "errlevel",
@@ -10875,11 +11079,163 @@ const struct argp_option cmd_opts[] =  {
 const struct argp parser_def = {
     .options = cmd_opts,
     .parser = cmd_parser,
-    .args_doc = "[trace file]",
+    .args_doc = "[trace file...]",
     .doc = "",
 };
 
 const char *argp_program_bug_address = "George Dunlap <george.dunlap@eu.citrix.com>";
+/*
+ * "xentrace -p" writes one file per cpu, each a sequence of windows
+ * introduced by a TRC_TRACE_CPU_CHANGE record.  Interleave the windows of
+ * all the files into one stream, in the order of the first timestamp in
+ * each window, so that the pcpus come into view in time order just as with
+ * a single-file trace.  The stream is only a list of pieces of the files,
+ * which mread reads in place: nothing is copied.
+ */
+struct trace_input {
+    const char *name;
+    int fd;
+    off_t pos, size;     /* Next window, and the end of the file */
+    off_t len;           /* Next window with its header; 0 at the end */
+    unsigned long long tsc;
+};
+
+static ssize_t trace_input_read(struct trace_input *in, void *buf,
+                                size_t size, off_t offset)
+{
+    ssize_t ret;
+    size_t done = 0;
+
+    while(done < size) {
+        ret = pread(in->fd, (char *)buf + done, size - done, offset + done);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret < 0) {
+            fprintf(stderr, "Reading %s: %s\n", in->name, strerror(errno));
+            error(ERR_SYSTEM, NULL);
+        }
+        if(ret == 0)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+/* Find the next window of @in; in->len is left 0 at the end of the file. */
+static void trace_input_next(struct trace_input *in)
+{
+    struct {
+        uint32_t header;
+        uint32_t cpu, window_size;
+    } cd;
+    off_t off, end;
+    ssize_t ret;
+
+    in->pos += in->len;
+    in->len = 0;
+    ret = trace_input_read(in, &cd, sizeof(cd), in->pos);
+    if(ret == 0)
+        return;
+
+    if(ret != sizeof(cd) ||
+       cd.header != (TRC_TRACE_CPU_CHANGE | (2 << TRACE_EXTRA_SHIFT))) {
+        fprintf(stderr, "%s: expected cpu change record at %llx\n",
+                in->name, (unsigned long long)in->pos);
+        error(ERR_SYSTEM, NULL);
+    }
+
+    in->len = sizeof(cd) + cd.window_size;
+    end = in->pos + in->len;
+    if(end > in->size) {
+        fprintf(stderr, "%s: truncated window\n", in->name);
+        error(ERR_SYSTEM, NULL);
+    }
+
+    /* Windows without any timestamp keep the previous window's position. */
+    for(off = in->pos + sizeof(cd); off + sizeof(uint32_t) <= end; ) {
+        struct t_rec rec;
+        size_t size;
+
+        trace_input_read(in, &rec, end - off < sizeof(rec) ?
+                         end - off : sizeof(rec), off);
+        size = sizeof(uint32_t) * (1 + rec.extra_u32
+                                   + (rec.cycles_included ? 2 : 0));
+        if(off + size > end)
+            break;
+        if(rec.cycles_included) {
+            in->tsc = ((unsigned long long)rec.u.cycles.cycles_hi << 32)
+                | rec.u.cycles.cycles_lo;
+            break;
+        }
+        off += size;
+    }
+}
+
+static mread_handle_t merge_trace_files(void)
+{
+    struct trace_input *in;
+    struct mread_piece *pieces = NULL;
+    int *fds;
+    int i, nr_pieces = 0, max_pieces = 0;
+
+    in = calloc(G.nr_trace_files, sizeof(*in));
+    fds = calloc(G.nr_trace_files, sizeof(*fds));
+    if(!in || !fds) {
+        fprintf(stderr, "Malloc failed!\n");
+        error(ERR_SYSTEM, NULL);
+    }
+
+    for(i = 0; i < G.nr_trace_files; i++) {
+        struct stat s;
+
+        in[i].name = G.trace_files[i];
+        if((in[i].fd = open(in[i].name, O_RDONLY)) < 0 ||
+           fstat(in[i].fd, &s) < 0) {
+            fprintf(stderr, "Opening %s: %s\n", in[i].name, strerror(errno));
+            error(ERR_SYSTEM, NULL);
+        }
+        in[i].size = s.st_size;
+        fds[i] = in[i].fd;
+        trace_input_next(in + i);
+    }
+
+    for(;;) {
+        struct trace_input *next = NULL;
+        struct mread_piece *last = nr_pieces ? pieces + nr_pieces - 1 : NULL;
+
+        for(i = 0; i < G.nr_trace_files; i++)
+            if(in[i].len && (!next || in[i].tsc < next->tsc))
+                next = in + i;
+        if(!next)
+            break;
+
+        if(last && last->src == next - in &&
+           last->src_offset + last->len == next->pos) {
+            /* Consecutive windows of one file make one piece. */
+            last->len += next->len;
+        } else {
+            if(nr_pieces == max_pieces) {
+                max_pieces = max_pieces ? 2 * max_pieces : 1024;
+                pieces = realloc(pieces, max_pieces * sizeof(*pieces));
+                if(!pieces) {
+                    fprintf(stderr, "Malloc failed!\n");
+                    error(ERR_SYSTEM, NULL);
+                }
+            }
+            pieces[nr_pieces].src = next - in;
+            pieces[nr_pieces].src_offset = next->pos;
+            pieces[nr_pieces].len = next->len;
+            nr_pieces++;
+        }
+
+        trace_input_next(next);
+    }
+
+    free(in);
+
+    return mread_init_pieces(fds, G.nr_trace_files, pieces, nr_pieces);
+}
 
 
 int main(int argc, char *argv[]) {
@@ -10891,17 +11247,22 @@ int main(int argc, char *argv[]) {
     if (G.trace_file == NULL)
         exit(1);
 
-    if ( (G.fd = open(G.trace_file, O_RDONLY)) < 0) {
-        perror("open");
-        error(ERR_SYSTEM, NULL);
+    if (G.nr_trace_files > 1) {
+        G.mh = merge_trace_files();
+        G.file_size = G.mh->file_size;
     } else {
-        struct stat s;
-        fstat(G.fd, &s);
-        G.file_size = s.st_size;
-    }
+        if ( (G.fd = open(G.trace_file, O_RDONLY)) < 0) {
+            perror("open");
+            error(ERR_SYSTEM, NULL);
+        } else {
+            struct stat s;
+            fstat(G.fd, &s);
+            G.file_size = s.st_size;
+        }
 
-    if ( (G.mh = mread_init(G.fd)) == NULL )
-        perror("mread");
+        if ( (G.mh = mread_init(G.fd)) == NULL )
+            perror("mread");
+    }
 
     if (G.symbol_file != NULL)
         parse_symbol_file(G.symbol_file);
@@ -25,7 +25,10 @@
 #include <assert.h>
 #include <ctype.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -34,6 +37,11 @@
 #include <xenevtchn.h>
 #include <xenctrl.h>
 
+/* *BSD has no O_LARGEFILE */
+#ifndef O_LARGEFILE
+#define O_LARGEFILE	0
+#endif
+
 #define PERROR(_m, _a...)                                       \
 do {                                                            \
     int __saved_errno = errno;                                  \
@@ -60,9 +68,11 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned long per_cpu_threads;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        count_lost:1;
 } settings_t;
 
 struct t_struct {
@@ -80,6 +90,17 @@ static xenevtchn_handle *xce_handle = NULL;
 static int virq_port = -1;
 static int outfd = 1;
 
+/* The trace buffers, and the size of the data area of each. */
+static struct t_struct *tbufs;
+static unsigned long data_size;
+
+/* Per-CPU accounting, reported on exit. */
+static struct cpu_stats {
+    unsigned long bytes;        /* Trace data written. */
+    unsigned long lost_records; /* Records Xen had no space for. */
+    unsigned long lost_events;  /* TRC_LOST_RECORDS records. */
+} *cpu_stats;
+
 static void close_handler(int signal)
 {
     interrupted = 1;
@@ -333,28 +354,31 @@ fail:
 }
 
 /**
- * write_buffer - write a section of the trace buffer
+ * write_buffer - write a window of a trace buffer
+ * @fd       - output file
  * @cpu      - source buffer CPU ID
- * @start
- * @size     - size of write (may be less than total window size)
- * @total_size - total size of the window (0 on 2nd write of wrapped windows)
- * @out      - output stream
+ * @iov      - the window: one chunk, or two if it wraps around the buffer
+ * @nr       - number of chunks
+ * @total_size - total size of the window
  *
- * Outputs the trace buffer to a filestream, prepending the CPU and size
- * of the buffer write.
+ * Outputs the trace buffer window to a file, prepending the CPU and size
+ * of the window, in a single write.
  */
-static void write_buffer(unsigned int cpu, unsigned char *start, int size,
-                         int total_size)
+static void write_buffer(int fd, unsigned int cpu, const struct iovec *iov,
+                         int nr, unsigned long total_size)
 {
     struct statvfs stat;
-    size_t written = 0;
-    
+    struct cpu_change_record rec;
+    struct iovec wiov[3];
+    ssize_t written;
+    int i;
+
     if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
     {
         unsigned long long freespace;
 
         /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
+        if ( fstatvfs (fd, &stat) )
         {
             fprintf(stderr, "Statfs failed!\n");
             goto fail;
@@ -362,10 +386,7 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
 
         freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
 
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+        freespace -= total_size;
 
         freespace >>= 20; /* Convert to MB */
 
@@ -376,46 +397,30 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
         }
     }
 
-    /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
-     * windows may involve two writes, so only write the record on the
-     * first write. */
-    if ( total_size != 0 )
+    if ( opts.memory_buffer )
     {
-        if ( opts.memory_buffer )
-        {
-            membuf_reserve_window(cpu, total_size);
-        }
-        else
-        {
-            struct cpu_change_record rec;
+        membuf_reserve_window(cpu, total_size);
+        for ( i = 0; i < nr; i++ )
+            membuf_write(iov[i].iov_base, iov[i].iov_len);
+        return;
+    }
 
-            rec.header = CPU_CHANGE_HEADER;
-            rec.data.cpu = cpu;
-            rec.data.window_size = total_size;
+    /* Write a CPU_BUF record on each buffer "window" written. */
+    rec.header = CPU_CHANGE_HEADER;
+    rec.data.cpu = cpu;
+    rec.data.window_size = total_size;
 
-            written = write(outfd, &rec, sizeof(rec));
-            if ( written != sizeof(rec) )
-            {
-                fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
-                        written);
-                goto fail;
-            }
-        }
-    }
+    wiov[0].iov_base = &rec;
+    wiov[0].iov_len = sizeof(rec);
+    for ( i = 0; i < nr; i++ )
+        wiov[i + 1] = iov[i];
 
-    if ( opts.memory_buffer )
+    written = writev(fd, wiov, nr + 1);
+    if ( written != sizeof(rec) + total_size )
     {
-        membuf_write(start, size);
-    }
-    else
-    {
-        written = write(outfd, start, size);
-        if ( written != size )
-        {
-            fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
-                    size, written);
-            goto fail;
-        }
+        fprintf(stderr, "Write failed! (size %zu, returned %zd)\n",
+                sizeof(rec) + total_size, written);
+        goto fail;
     }
 
     return;
@@ -425,6 +430,54 @@ fail:
     exit(EXIT_FAILURE);
 }
 
+/**
+ * count_lost_records - account for the TRC_LOST_RECORDS records in a chunk
+ * of a trace buffer.  Records never wrap around the end of the buffer, so
+ * each chunk starts and ends on a record boundary.
+ */
+static void count_lost_records(struct cpu_stats *stats,
+                               const unsigned char *p, unsigned long size)
+{
+    const unsigned char *end = p + size;
+
+    while ( p + sizeof(uint32_t) <= end )
+    {
+        const struct t_rec *rec = (const struct t_rec *)p;
+        const uint32_t *extra = rec->cycles_included ?
+            rec->u.cycles.extra_u32 : rec->u.nocycles.extra_u32;
+
+        p = (const unsigned char *)(extra + rec->extra_u32);
+
+        if ( rec->event == TRC_LOST_RECORDS && rec->extra_u32 &&
+             p <= end )
+        {
+            stats->lost_records += extra[0];
+            stats->lost_events++;
+        }
+    }
+}
+
+static void print_stats(unsigned int num)
+{
+    unsigned long bytes = 0, lost = 0;
+    unsigned int i;
+
+    for ( i = 0; i < num; i++ )
+    {
+        bytes += cpu_stats[i].bytes;
+        lost += cpu_stats[i].lost_records;
+        if ( cpu_stats[i].lost_records )
+            fprintf(stderr, "CPU %u: %lu records lost in %lu bursts\n",
+                    i, cpu_stats[i].lost_records, cpu_stats[i].lost_events);
+    }
+
+    if ( opts.count_lost )
+        fprintf(stderr, "%lu bytes of trace data written, %lu records lost\n",
+                bytes, lost);
+    else
+        fprintf(stderr, "%lu bytes of trace data written\n", bytes);
+}
+
 static void disable_tbufs(void)
 {
     xc_interface *xc_handle = xc_interface_open(0,0,0);
@@ -664,6 +717,221 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
 }
 
 
+/**
+ * read_tbuf - write out, and consume, the new records of a CPU's buffer
+ * @cpu:           the CPU
+ * @fd:            the output file
+ */
+static void read_tbuf(unsigned int cpu, int fd)
+{
+    struct t_buf *meta = tbufs->meta[cpu];
+    unsigned char *data = tbufs->data[cpu];
+    unsigned long start_offset, end_offset, window_size, cons, prod;
+    struct iovec iov[2];
+    int i, nr = 1;
+
+    if ( !meta )
+        return;
+
+    /* Read window information only once. */
+    cons = meta->cons;
+    prod = meta->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == prod )
+        return;
+
+    assert(cons < 2*data_size);
+    assert(prod < 2*data_size);
+
+    // NB: if (prod<cons), then (prod-cons)%data_size will not yield
+    // the correct answer because data_size is not a power of 2.
+    if ( prod < cons )
+        window_size = (prod + 2*data_size) - cons;
+    else
+        window_size = prod - cons;
+    assert(window_size > 0);
+    assert(window_size <= data_size);
+
+    start_offset = cons % data_size;
+    end_offset = prod % data_size;
+
+    iov[0].iov_base = data + start_offset;
+    if ( end_offset > start_offset )
+    {
+        /* If window does not wrap, write in one big chunk */
+        iov[0].iov_len = window_size;
+    }
+    else
+    {
+        /* If wrapped, write in two chunks:
+         * - first, start to the end of the buffer
+         * - second, start of buffer to end of window
+         */
+        iov[0].iov_len = data_size - start_offset;
+        iov[1].iov_base = data;
+        iov[1].iov_len = end_offset;
+        nr = 2;
+    }
+
+    /* This touches every record, so only do it when asked to. */
+    if ( opts.count_lost )
+        for ( i = 0; i < nr; i++ )
+            count_lost_records(&cpu_stats[cpu], iov[i].iov_base,
+                               iov[i].iov_len);
+
+    write_buffer(fd, cpu, iov, nr, window_size);
+    cpu_stats[cpu].bytes += window_size;
+
+    xen_mb(); /* read buffer, then update cons. */
+    meta->cons = prod;
+}
+
+/*
+ * Per-CPU capture: each reader thread serves a group of consecutive CPUs,
+ * and writes each CPU's records to a file of its own.  The main thread
+ * handles VIRQ_TBUF and the poll timeout, and starts a new round of reads.
+ */
+struct reader {
+    pthread_t thread;
+    unsigned int first_cpu, end_cpu;
+};
+
+static int *cpu_fds;
+
+static pthread_mutex_t round_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t round_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long round_nr;
+static bool last_round;
+
+static void start_round(bool last)
+{
+    pthread_mutex_lock(&round_lock);
+    round_nr++;
+    last_round = last;
+    pthread_cond_broadcast(&round_cond);
+    pthread_mutex_unlock(&round_lock);
+}
+
+static void *reader_thread(void *arg)
+{
+    const struct reader *rd = arg;
+    unsigned long nr = 0;
+    unsigned int cpu;
+    bool last = false;
+
+    for ( ; ; )
+    {
+        for ( cpu = rd->first_cpu; cpu < rd->end_cpu; cpu++ )
+            read_tbuf(cpu, cpu_fds[cpu]);
+
+        if ( last )
+            break;
+
+        pthread_mutex_lock(&round_lock);
+        while ( round_nr == nr )
+            pthread_cond_wait(&round_cond, &round_lock);
+        nr = round_nr;
+        last = last_round;
+        pthread_mutex_unlock(&round_lock);
+    }
+
+    return NULL;
+}
+
+static void open_cpu_files(unsigned int num)
+{
+    unsigned int i;
+    size_t len = strlen(opts.outfile) + sizeof(".4294967295");
+    char *name = malloc(len);
+
+    cpu_fds = calloc(num, sizeof(*cpu_fds));
+    if ( !cpu_fds || !name )
+    {
+        PERROR("Failed to allocate memory for output files");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < num; i++ )
+    {
+        cpu_fds[i] = -1;
+        if ( !tbufs->meta[i] )
+            continue;
+
+        snprintf(name, len, "%s.%u", opts.outfile, i);
+        cpu_fds[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                          0644);
+        if ( cpu_fds[i] < 0 )
+        {
+            PERROR("Could not open output file %s", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(name);
+}
+
+static void monitor_tbufs_per_cpu(unsigned int num)
+{
+    unsigned int i, nr_readers = opts.per_cpu_threads;
+    struct reader *readers;
+    sigset_t mask, old_mask;
+    int rc;
+
+    if ( nr_readers > num )
+        nr_readers = num;
+
+    readers = calloc(nr_readers, sizeof(*readers));
+    if ( !readers )
+    {
+        PERROR("Failed to allocate memory for reader threads");
+        exit(EXIT_FAILURE);
+    }
+
+    open_cpu_files(num);
+
+    /* Signals are for the main thread, to stop waiting for events. */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    for ( i = 0; i < nr_readers; i++ )
+    {
+        readers[i].first_cpu = (unsigned long)num * i / nr_readers;
+        readers[i].end_cpu = (unsigned long)num * (i + 1) / nr_readers;
+        rc = pthread_create(&readers[i].thread, NULL, reader_thread,
+                            &readers[i]);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Failed to create reader thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    while ( !interrupted )
+    {
+        wait_for_event_or_timeout(opts.poll_sleep);
+        start_round(false);
+    }
+
+    /* Disable tracing, then read through all the buffers one last time */
+    if ( opts.disable_tracing )
+        disable_tbufs();
+    start_round(true);
+
+    for ( i = 0; i < nr_readers; i++ )
+        pthread_join(readers[i].thread, NULL);
+
+    for ( i = 0; i < num; i++ )
+        if ( cpu_fds[i] >= 0 )
+            close(cpu_fds[i]);
+
+    free(cpu_fds);
+    free(readers);
+}
+
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
  * @logfile:       the FILE * representing the file to log to
@@ -672,17 +940,12 @@ static void monitor_tbufs(void)
 {
     int i;
 
-    struct t_struct *tbufs;      /* Pointer to hypervisor maps */
     struct t_buf **meta;         /* pointers to the trace buffer metadata    */
-    unsigned char **data;        /* pointers to the trace buffer data areas
-                                  * where they are mapped into user space.   */
     unsigned long tbufs_mfn;     /* mfn of the tbufs                         */
     unsigned int  num;           /* number of trace buffers / logical CPUS   */
     unsigned long tinfo_size;    /* size of t_info metadata map */
     unsigned long size;          /* size of a single trace buffer            */
 
-    unsigned long data_size;
-
     int last_read = 1;
 
     /* prepare to listen for VIRQ_TBUF */
@@ -691,6 +954,13 @@ static void monitor_tbufs(void)
     /* get number of logical CPUs (and therefore number of trace buffers) */
     num = get_num_cpus();
 
+    cpu_stats = calloc(num, sizeof(*cpu_stats));
+    if ( !cpu_stats )
+    {
+        PERROR("Failed to allocate memory for statistics");
+        exit(EXIT_FAILURE);
+    }
+
     /* setup access to trace buffers */
     get_tbufs(&tbufs_mfn, &tinfo_size);
 
@@ -704,95 +974,49 @@ static void monitor_tbufs(void)
     data_size = size - sizeof(struct t_buf);
 
     meta = tbufs->meta;
-    data = tbufs->data;
 
     if ( opts.discard )
         for ( i = 0; i < num; i++ )
             if ( meta[i] )
                 meta[i]->cons = meta[i]->prod;
 
-    /* now, scan buffers for events */
-    while ( 1 )
+    if ( opts.per_cpu_threads )
+        monitor_tbufs_per_cpu(num);
+    else
     {
-        for ( i = 0; i < num; i++ )
+        /* now, scan buffers for events */
+        while ( 1 )
         {
-            unsigned long start_offset, end_offset, window_size, cons, prod;
+            for ( i = 0; i < num; i++ )
+                read_tbuf(i, outfd);
 
-            if ( !meta[i] )
-                continue;
-
-            /* Read window information only once. */
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
-                continue;
-           
-            assert(cons < 2*data_size);
-            assert(prod < 2*data_size);
-
-            // NB: if (prod<cons), then (prod-cons)%data_size will not yield
-            // the correct answer because data_size is not a power of 2.
-            if ( prod < cons )
-                window_size = (prod + 2*data_size) - cons;
-            else
-                window_size = prod - cons;
-            assert(window_size > 0);
-            assert(window_size <= data_size);
-
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
-
-            if ( end_offset > start_offset )
+            if ( interrupted )
             {
-                /* If window does not wrap, write in one big chunk */
-                write_buffer(i, data[i]+start_offset,
-                             window_size,
-                             window_size);
-            }
-            else
-            {
-                /* If wrapped, write in two chunks:
-                 * - first, start to the end of the buffer
-                 * - second, start of buffer to end of window
-                 */
-                write_buffer(i, data[i] + start_offset,
-                             data_size - start_offset,
-                             window_size);
-                write_buffer(i, data[i],
-                             end_offset,
-                             0);
+                if ( last_read )
+                {
+                    /* Disable tracing, then read through all the buffers one last time */
+                    if ( opts.disable_tracing )
+                        disable_tbufs();
+                    last_read = 0;
+                    continue;
+                }
+                else
+                    break;
             }
 
-            xen_mb(); /* read buffer, then update cons. */
-            meta[i]->cons = prod;
-
+            wait_for_event_or_timeout(opts.poll_sleep);
         }
-
-        if ( interrupted )
-        {
-            if ( last_read )
-            {
-                /* Disable tracing, then read through all the buffers one last time */
-                if ( opts.disable_tracing )
-                    disable_tbufs();
-                last_read = 0;
-                continue;
-            }
-            else
-                break;
-        }
-
-        wait_for_event_or_timeout(opts.poll_sleep);
     }
 
     if ( opts.memory_buffer )
         membuf_dump();
 
+    print_stats(num);
+
     /* cleanup */
     free(meta);
-    free(data);
+    free(tbufs->data);
+    free(cpu_stats);
     /* don't need to munmap - cleanup is automatic */
 }
 
@@ -842,6 +1066,12 @@ static void usage(int status)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -p  --per-cpu=n         Write the records of each CPU to a file of its own,\n" \
+"                          [output file].<cpu>, reading the trace buffers\n" \
+"                          with n threads, each serving a group of CPUs.\n" \
+"                          xenalyze takes all the files, and merges them.\n" \
+"  -L  --lost-records      On exit, report the records Xen lost for each CPU.\n" \
+"                          Costs a pass over every record captured.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -1087,6 +1317,8 @@ static void parse_args(int argc, char **argv)
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
         { "memory-buffer",  required_argument, 0, 'M' },
+        { "per-cpu",        required_argument, 0, 'p' },
+        { "lost-records",   no_argument,       0, 'L' },
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
@@ -1095,7 +1327,7 @@ static void parse_args(int argc, char **argv)
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:p:LDxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1144,6 +1376,16 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'p':
+            opts.per_cpu_threads = argtol(optarg, 0);
+            if ( opts.per_cpu_threads == 0 )
+                usage(EXIT_FAILURE);
+            break;
+
+        case 'L':
+            opts.count_lost = 1;
+            break;
+
         case 'h':
             usage(EXIT_SUCCESS);
             break;
@@ -1158,11 +1400,6 @@ static void parse_args(int argc, char **argv)
         opts.outfile = argv[optind];
 }
 
-/* *BSD has no O_LARGEFILE */
-#ifndef O_LARGEFILE
-#define O_LARGEFILE	0
-#endif
-
 int main(int argc, char **argv)
 {
     struct sigaction act;
@@ -1197,21 +1434,34 @@ int main(int argc, char **argv)
     if ( opts.timeout != 0 ) 
         alarm(opts.timeout);
 
-    if ( opts.outfile )
-        outfd = open(opts.outfile,
-                     O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
-                     0644);
-
-    if ( outfd < 0 )
+    if ( opts.per_cpu_threads )
     {
-        perror("Could not open output file");
-        exit(EXIT_FAILURE);
-    }        
-
-    if ( isatty(outfd) )
+        /* The output file name is the prefix of the per-CPU files. */
+        if ( !opts.outfile || opts.memory_buffer )
+        {
+            fprintf(stderr, "Per-CPU output needs an output file, and no memory buffer.\n");
+            exit(EXIT_FAILURE);
+        }
+        outfd = -1;
+    }
+    else
     {
-        fprintf(stderr, "Cannot output to a TTY, specify a log file.\n");
-        exit(EXIT_FAILURE);
+        if ( opts.outfile )
+            outfd = open(opts.outfile,
+                         O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                         0644);
+
+        if ( outfd < 0 )
+        {
+            perror("Could not open output file");
+            exit(EXIT_FAILURE);
+        }
+
+        if ( isatty(outfd) )
+        {
+            fprintf(stderr, "Cannot output to a TTY, specify a log file.\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     if ( opts.memory_buffer > 0 )
@@ -1228,7 +1478,8 @@ int main(int argc, char **argv)
 
     monitor_tbufs();
 
-    close(outfd);
+    if ( outfd >= 0 )
+        close(outfd);
     return 0;
 }
 
@@ -264,13 +264,13 @@ static void output_numainfo(void)
     }
 
     printf("numa_info              :\n");
-    printf("node:    memsize    memfree    distances\n");
+    printf("node:    memsize    memfree    memdirty    distances\n");
 
     for (i = 0; i < nr; i++) {
         if (info[i].size != LIBXL_NUMAINFO_INVALID_ENTRY) {
-            printf("%4d:    %6"PRIu64"     %6"PRIu64"      %d", i,
-                   info[i].size >> 20, info[i].free >> 20,
-                   info[i].dists[0]);
+            printf("%4d:    %6"PRIu64"     %6"PRIu64"     %6"PRIu64"       %d",
+                   i, info[i].size >> 20, info[i].free >> 20,
+                   info[i].dirty >> 20, info[i].dists[0]);
             for (j = 1; j < info[i].num_dists; j++)
                 printf(",%d", info[i].dists[j]);
             printf("\n");
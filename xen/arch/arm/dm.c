@@ -28,6 +28,7 @@ int dm_op(const struct dmop_args *op_args)
         [XEN_DMOP_destroy_ioreq_server]             = sizeof(struct xen_dm_op_destroy_ioreq_server),
         [XEN_DMOP_set_irq_level]                    = sizeof(struct xen_dm_op_set_irq_level),
         [XEN_DMOP_nr_vcpus]                         = sizeof(struct xen_dm_op_nr_vcpus),
+        [XEN_DMOP_get_ioreq_server_stats]           = sizeof(struct xen_dm_op_get_ioreq_server_stats),
     };
 
     rc = rcu_lock_remote_domain_by_id(op_args->domid, &d);
@@ -2844,6 +2844,7 @@ void hvm_emulate_init_once(
     hvmemul_ctxt->validate = validate;
     hvmemul_ctxt->ctxt.regs = regs;
     hvmemul_ctxt->ctxt.cpu_policy = curr->domain->arch.cpu_policy;
+    hvmemul_ctxt->ctxt.decode_cache = curr->arch.hvm.hvm_io.decode_cache;
     hvmemul_ctxt->ctxt.force_writeback = true;
 }
 
@@ -2978,6 +2979,13 @@ int hvmemul_cache_init(struct vcpu *v)
     if ( !cache )
         return -ENOMEM;
 
+    v->arch.hvm.hvm_io.decode_cache = x86_decode_cache_alloc();
+    if ( !v->arch.hvm.hvm_io.decode_cache )
+    {
+        xfree(cache);
+        return -ENOMEM;
+    }
+
     /* Cache is disabled initially. */
     cache->num_ents = nents + 1;
     cache->max_ents = nents;
@@ -4244,10 +4244,10 @@ static int hvm_set_param(struct domain *d, uint32_t index, uint64_t value)
         /*
          * Update GUEST_CR3 in each VMCS to point at identity map.
          * All foreign updates to guest state must synchronise on
-         * the domctl_lock.
+         * d's domctl_lock.
          */
         rc = -ERESTART;
-        if ( !domctl_lock_acquire() )
+        if ( !domctl_lock_acquire(d) )
             break;
 
         rc = 0;
@@ -4257,7 +4257,7 @@ static int hvm_set_param(struct domain *d, uint32_t index, uint64_t value)
             paging_update_cr3(v, false);
         domain_unpause(d);
 
-        domctl_lock_release();
+        domctl_lock_release(d);
         break;
     case HVM_PARAM_DM_DOMAIN:
         /* The only value this should ever be set to is DOMID_SELF */
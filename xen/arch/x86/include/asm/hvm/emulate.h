@@ -120,6 +120,8 @@ int __must_check hvmemul_cache_init(struct vcpu *v);
 static inline void hvmemul_cache_destroy(struct vcpu *v)
 {
     XFREE(v->arch.hvm.hvm_io.cache);
+    x86_decode_cache_free(v->arch.hvm.hvm_io.decode_cache);
+    v->arch.hvm.hvm_io.decode_cache = NULL;
 }
 bool hvmemul_read_cache(const struct vcpu *v, paddr_t gpa,
                         void *buffer, unsigned int size);
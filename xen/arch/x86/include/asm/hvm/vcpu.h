@@ -55,6 +55,8 @@ struct hvm_vcpu_io {
     unsigned int mmio_insn_bytes;
     unsigned char mmio_insn[16];
     struct hvmemul_cache *cache;
+    /* Decoded insns, for drivers repeatedly hitting emulated MMIO. */
+    struct x86_emulate_decode_cache *decode_cache;
 
     /*
      * For string instruction emulation we need to be able to signal a
@@ -127,6 +127,9 @@ PERFCOUNTER(pauseloop_exits, "vmexits from Pause-Loop Detection")
 
 PERFCOUNTER(iommu_pt_shatters,    "IOMMU page table shatters")
 PERFCOUNTER(iommu_pt_coalesces,   "IOMMU page table coalesces")
+PERFCOUNTER(iommu_qi_waits,       "IOMMU QI wait descriptors")
+PERFCOUNTER(iommu_qi_descs,       "IOMMU QI descriptors waited for")
+PERFCOUNTER_ARRAY(iommu_qi_batch, "IOMMU QI descriptors per wait", 8)
 
 PERFCOUNTER(buslock, "Bus Locks Detected")
 PERFCOUNTER(vmnotify_crash, "domain crashes by Notify VM Exit")
@@ -770,11 +770,11 @@ long do_paging_domctl_cont(
     ret = xsm_domctl(XSM_OTHER, d, op.cmd);
     if ( !ret )
     {
-        if ( domctl_lock_acquire() )
+        if ( domctl_lock_acquire(d) )
         {
             ret = paging_domctl(d, &op.u.shadow_op, u_domctl, 1);
 
-            domctl_lock_release();
+            domctl_lock_release(d);
         }
         else
             ret = -ERESTART;
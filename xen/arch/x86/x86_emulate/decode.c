@@ -12,6 +12,7 @@
 
 #ifdef __XEN__
 # include <xen/err.h>
+# include <xen/xmalloc.h>
 #else
 # define ERR_PTR(val) NULL
 #endif
@@ -1006,6 +1007,7 @@ int x86emul_decode(struct x86_emulate_state *s,
     s->ea.type = OP_NONE;
     s->ea.mem.seg = x86_seg_ds;
     s->ea.reg = PTR_POISON;
+    s->ea_base = s->ea_index = EA_NO_GPR;
     s->ip = ctxt->regs->r(ip);
 
     s->op_bytes = def_op_bytes = ad_bytes = def_ad_bytes =
@@ -1125,7 +1127,11 @@ int x86emul_decode(struct x86_emulate_state *s,
                     break;
                 /* fall through */
             case 4:
-                if ( s->modrm_mod != 3 || in_realmode(ctxt, ops) )
+                if ( s->modrm_mod != 3 )
+                    break;
+                /* CR0.PE isn't part of what a decode cache entry matches. */
+                s->uncacheable = true;
+                if ( in_realmode(ctxt, ops) )
                     break;
                 /* fall through */
             case 8:
@@ -1641,32 +1647,44 @@ int x86emul_decode(struct x86_emulate_state *s,
             {
             case 0:
                 s->ea.mem.off = ctxt->regs->bx + ctxt->regs->si;
+                s->ea_base = 3;
+                s->ea_index = 6;
                 break;
             case 1:
                 s->ea.mem.off = ctxt->regs->bx + ctxt->regs->di;
+                s->ea_base = 3;
+                s->ea_index = 7;
                 break;
             case 2:
                 s->ea.mem.seg = x86_seg_ss;
                 s->ea.mem.off = ctxt->regs->bp + ctxt->regs->si;
+                s->ea_base = 5;
+                s->ea_index = 6;
                 break;
             case 3:
                 s->ea.mem.seg = x86_seg_ss;
                 s->ea.mem.off = ctxt->regs->bp + ctxt->regs->di;
+                s->ea_base = 5;
+                s->ea_index = 7;
                 break;
             case 4:
                 s->ea.mem.off = ctxt->regs->si;
+                s->ea_base = 6;
                 break;
             case 5:
                 s->ea.mem.off = ctxt->regs->di;
+                s->ea_base = 7;
                 break;
             case 6:
                 if ( s->modrm_mod == 0 )
                     break;
                 s->ea.mem.seg = x86_seg_ss;
                 s->ea.mem.off = ctxt->regs->bp;
+                s->ea_base = 5;
                 break;
             case 7:
                 s->ea.mem.off = ctxt->regs->bx;
+                s->ea_base = 3;
                 break;
             }
             switch ( s->modrm_mod )
@@ -1701,10 +1719,11 @@ int x86emul_decode(struct x86_emulate_state *s,
                 {
                     s->ea.mem.off = *decode_gpr(ctxt->regs, s->sib_index);
                     s->ea.mem.off <<= s->sib_scale;
+                    s->ea_index = s->sib_index;
                 }
                 if ( (s->modrm_mod == 0) && ((sib_base & 7) == 5) )
                     s->ea.mem.off += insn_fetch_type(int32_t);
-                else if ( sib_base == 4 )
+                else if ( (s->ea_base = sib_base) == 4 )
                 {
                     s->ea.mem.seg  = x86_seg_ss;
                     s->ea.mem.off += ctxt->regs->r(sp);
@@ -1726,6 +1745,7 @@ int x86emul_decode(struct x86_emulate_state *s,
                 generate_exception_if(d & vSIB, X86_EXC_UD);
                 s->modrm_rm |= (s->rex_prefix & 1) << 3;
                 s->ea.mem.off = *decode_gpr(ctxt->regs, s->modrm_rm);
+                s->ea_base = s->modrm_rm;
                 if ( (s->modrm_rm == 5) && (s->modrm_mod != 0) )
                     s->ea.mem.seg = x86_seg_ss;
             }
@@ -1735,6 +1755,7 @@ int x86emul_decode(struct x86_emulate_state *s,
                 if ( (s->modrm_rm & 7) != 5 )
                     break;
                 s->ea.mem.off = insn_fetch_type(int32_t);
+                s->ea_base = s->ea_index = EA_NO_GPR;
                 pc_rel = mode_64bit();
                 break;
             case 1:
@@ -1935,3 +1956,108 @@ int x86emul_decode(struct x86_emulate_state *s,
  done:
     return rc;
 }
+
+struct x86_emulate_decode_cache {
+    struct decode_cache_entry {
+        unsigned long ip;
+        const struct cpu_policy *cp;
+        unsigned int addr_size;
+        bool vm86;
+        uint8_t len; /* 0 if unused */
+        uint8_t bytes[MAX_INST_LEN];
+        unsigned int opcode;
+        /* ea.mem.off without the values of the GPRs contributing to it. */
+        unsigned long ea_off;
+        struct x86_emulate_state state;
+    } ent[16];
+};
+
+struct x86_emulate_decode_cache *x86_decode_cache_alloc(void)
+{
+    return xzalloc(struct x86_emulate_decode_cache);
+}
+
+void x86_decode_cache_free(struct x86_emulate_decode_cache *cache)
+{
+    xfree(cache);
+}
+
+static unsigned long ea_gprs(const struct x86_emulate_state *s,
+                             struct cpu_user_regs *regs)
+{
+    unsigned long off = 0;
+
+    if ( s->ea_base != EA_NO_GPR )
+        off = *decode_gpr(regs, s->ea_base);
+    if ( s->ea_index != EA_NO_GPR )
+        off += *decode_gpr(regs, s->ea_index) << s->sib_scale;
+
+    return off;
+}
+
+/*
+ * x86emul_decode(), short-circuited by ctxt->decode_cache.  An entry is used
+ * only if the bytes at rIP still are those it was decoded from, and the
+ * execution mode is the same; only the effective address, which depends on
+ * GPR values, needs computing again then.
+ */
+int x86emul_decode_cached(struct x86_emulate_state *s,
+                          struct x86_emulate_ctxt *ctxt,
+                          const struct x86_emulate_ops *ops)
+{
+    struct x86_emulate_decode_cache *cache = ctxt->decode_cache;
+    unsigned long ip = ctxt->regs->r(ip);
+    bool vm86 = ctxt->regs->eflags & X86_EFLAGS_VM;
+    struct decode_cache_entry *e;
+    uint8_t bytes[MAX_INST_LEN];
+    int rc;
+
+    if ( !cache )
+        return x86emul_decode(s, ctxt, ops);
+
+    /* Insns within 16 bytes of one another, a tight loop, never collide. */
+    e = &cache->ent[ip % ARRAY_SIZE(cache->ent)];
+
+    if ( e->len && e->ip == ip && e->cp == ctxt->cpu_policy &&
+         e->addr_size == ctxt->addr_size && e->vm86 == vm86 )
+    {
+        if ( ops->insn_fetch(ip, bytes, e->len, ctxt) == X86EMUL_OKAY &&
+             !memcmp(bytes, e->bytes, e->len) )
+        {
+            *s = e->state;
+            ctxt->opcode = e->opcode;
+            if ( s->ea.type == OP_MEM )
+                s->ea.mem.off = truncate_ea(e->ea_off +
+                                            ea_gprs(s, ctxt->regs));
+
+            return X86EMUL_OKAY;
+        }
+
+        /* Leave any fault to be raised (again) by the full decode. */
+        x86_emul_reset_event(ctxt);
+        e->len = 0;
+    }
+
+    rc = x86emul_decode(s, ctxt, ops);
+    if ( rc != X86EMUL_OKAY || s->uncacheable ||
+         s->ip - ip > sizeof(e->bytes) )
+        return rc;
+
+    if ( ops->insn_fetch(ip, e->bytes, s->ip - ip, ctxt) != X86EMUL_OKAY )
+    {
+        x86_emul_reset_event(ctxt);
+        e->len = 0;
+        return rc;
+    }
+
+    e->ip = ip;
+    e->cp = ctxt->cpu_policy;
+    e->addr_size = ctxt->addr_size;
+    e->vm86 = vm86;
+    e->len = s->ip - ip;
+    e->opcode = ctxt->opcode;
+    e->ea_off = s->ea.mem.off - ea_gprs(s, ctxt->regs);
+    e->state = *s;
+
+    return rc;
+}
@@ -293,11 +293,18 @@ struct x86_emulate_state {
     } blk;
     uint8_t modrm, modrm_mod, modrm_reg, modrm_rm;
     uint8_t sib_index, sib_scale;
+    /*
+     * GPRs whose values went into ea.mem.off (the index one shifted by
+     * sib_scale), for x86emul_decode_cached() to recompute it.
+     */
+    uint8_t ea_base, ea_index;
+#define EA_NO_GPR 0xff
     uint8_t rex_prefix;
     bool lock_prefix;
     bool not_64bit; /* Instruction not available in 64bit. */
     bool fpu_ctrl;  /* Instruction is an FPU control one. */
     bool fp16;      /* Instruction has half-precision FP source operand. */
+    bool uncacheable; /* Decode depended on more than bytes and mode. */
     opcode_desc_t desc;
     union vex vex;
     union evex evex;
@@ -749,6 +756,9 @@ do {                                                            \
 int x86emul_decode(struct x86_emulate_state *s,
                    struct x86_emulate_ctxt *ctxt,
                    const struct x86_emulate_ops *ops);
+int x86emul_decode_cached(struct x86_emulate_state *s,
+                          struct x86_emulate_ctxt *ctxt,
+                          const struct x86_emulate_ops *ops);
 
 int x86emul_fpu(struct x86_emulate_state *s,
                 struct cpu_user_regs *regs,
@@ -1241,7 +1241,7 @@ x86_emulate(
                            (_regs.eflags & X86_EFLAGS_VIP)),
                           X86_EXC_GP, 0);
 
-    rc = x86emul_decode(&state, ctxt, ops);
+    rc = x86emul_decode_cached(&state, ctxt, ops);
     if ( rc != X86EMUL_OKAY )
         return rc;
 
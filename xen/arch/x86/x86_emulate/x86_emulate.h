@@ -565,6 +565,9 @@ struct x86_emulate_ctxt
     /* Caller data that can be used by x86_emulate_ops' routines. */
     void *data;
 
+    /* Optional cache of decoded insns (see x86_decode_cache_alloc()). */
+    struct x86_emulate_decode_cache *decode_cache;
+
     /*
      * Input/output state:
      */
@@ -745,6 +748,17 @@ x86_decode_insn(
         unsigned long offset, void *p_data, unsigned int bytes,
         struct x86_emulate_ctxt *ctxt));
 
+/*
+ * A small cache of decoded insns, letting x86_emulate() skip decoding again
+ * an insn it recently decoded at the same rIP, as happens when a driver
+ * keeps accessing an emulated device's registers.  Entries are only used
+ * while the insn bytes (fetched again through ->insn_fetch()) and the
+ * execution mode are unchanged, so modified code is decoded afresh.  A cache
+ * must not be used by more than one vCPU.
+ */
+struct x86_emulate_decode_cache *x86_decode_cache_alloc(void);
+void x86_decode_cache_free(struct x86_emulate_decode_cache *cache);
+
 unsigned int
 x86_insn_opsize(const struct x86_emulate_state *s);
 int
@@ -630,6 +630,8 @@ struct domain *domain_create(domid_t domid,
     spin_lock_init_prof(d, domain_lock);
     spin_lock_init_prof(d, page_alloc_lock);
     spin_lock_init(&d->hypercall_deadlock_mutex);
+    spin_lock_init_prof(d, domctl_lock);
+    atomic_set(&d->domctl_issuers, 0);
     INIT_PAGE_LIST_HEAD(&d->page_list);
     INIT_PAGE_LIST_HEAD(&d->extra_page_list);
     INIT_PAGE_LIST_HEAD(&d->xenpage_list);
@@ -968,7 +970,7 @@ int domain_kill(struct domain *d)
     if ( d == current->domain )
         return -EINVAL;
 
-    /* Protected by domctl_lock. */
+    /* Protected by d's domctl_lock. */
     switch ( d->is_dying )
     {
     case DOMDYING_alive:
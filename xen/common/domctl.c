@@ -32,7 +32,22 @@
 #include <public/domctl.h>
 #include <xsm/xsm.h>
 
-static DEFINE_SPINLOCK(domctl_lock);
+/*
+ * Held for writing by domctls which need to exclude all others, and for
+ * reading by those which only act on a single domain.  The latter serialise
+ * on the target domain's domctl_lock.
+ */
+static DEFINE_RWLOCK(domctl_lock);
+
+/*
+ * write_trylock() only succeeds with no readers at all, so a steady stream of
+ * single domain domctls could keep a global one from ever getting in.  A
+ * failing writer records the time of its attempt here, and new readers back
+ * off while that is recent.  A writer which gives up without succeeding
+ * stops refreshing the time, so readers are only held off for a short while.
+ */
+static s_time_t domctl_writer_waiting;
+#define DOMCTL_WRITER_WAIT MILLISECS(1)
 
 static int nodemask_to_xenctl_bitmap(struct xenctl_bitmap *xenctl_nodemap,
                                      const nodemask_t *nodemask)
@@ -126,31 +141,165 @@ void getdomaininfo(struct domain *d, struct xen_domctl_getdomaininfo *info)
     arch_get_domain_info(d, info);
 }
 
-bool_t domctl_lock_acquire(void)
+bool domctl_lock_acquire(struct domain *d)
 {
+    struct domain *currd = current->domain;
+    s_time_t writer;
+
     /*
      * Caller may try to pause its own VCPUs. We must prevent deadlock
      * against other non-domctl routines which try to do the same.
      */
-    if ( !spin_trylock(&current->domain->hypercall_deadlock_mutex) )
-        return 0;
+    if ( (!d || d == currd) &&
+         !spin_trylock(&currd->hypercall_deadlock_mutex) )
+        return false;
 
     /*
      * Trylock here is paranoia if we have multiple privileged domains. Then
      * we could have one domain trying to pause another which is spinning
      * on domctl_lock -- results in deadlock.
      */
-    if ( spin_trylock(&domctl_lock) )
-        return 1;
+    if ( !d )
+    {
+        if ( write_trylock(&domctl_lock) )
+        {
+            write_atomic(&domctl_writer_waiting, 0);
+            return true;
+        }
+        write_atomic(&domctl_writer_waiting, NOW());
+        goto unlock_mutex;
+    }
 
-    spin_unlock(&current->domain->hypercall_deadlock_mutex);
-    return 0;
+    writer = read_atomic(&domctl_writer_waiting);
+    if ( writer && NOW() - writer < DOMCTL_WRITER_WAIT )
+        goto unlock_mutex;
+
+    if ( !read_trylock(&domctl_lock) )
+        goto unlock_mutex;
+
+    /*
+     * With the global lock only held for reading, two privileged domains
+     * could each be pausing the other.  Prevent this by refusing to act on
+     * a domain while it is itself issuing domctls for another one: the
+     * issuer announces itself in domctl_issuers before checking nobody
+     * holds its own lock, the target's lock is taken before checking
+     * domctl_issuers, so at least one of two racing domains backs off.
+     */
+    if ( d != currd )
+    {
+        atomic_inc(&currd->domctl_issuers);
+        smp_mb();
+        if ( spin_is_locked(&currd->domctl_lock) )
+            goto dec_issuers;
+    }
+
+    if ( !spin_trylock(&d->domctl_lock) )
+        goto dec_issuers;
+
+    smp_mb();
+    if ( !atomic_read(&d->domctl_issuers) )
+        return true;
+
+    spin_unlock(&d->domctl_lock);
+ dec_issuers:
+    if ( d != currd )
+        atomic_dec(&currd->domctl_issuers);
+    read_unlock(&domctl_lock);
+ unlock_mutex:
+    if ( !d || d == currd )
+        spin_unlock(&currd->hypercall_deadlock_mutex);
+    return false;
 }
 
-void domctl_lock_release(void)
+void domctl_lock_release(struct domain *d)
 {
-    spin_unlock(&domctl_lock);
-    spin_unlock(&current->domain->hypercall_deadlock_mutex);
+    struct domain *currd = current->domain;
+
+    if ( !d )
+        write_unlock(&domctl_lock);
+    else
+    {
+        spin_unlock(&d->domctl_lock);
+        if ( d != currd )
+            atomic_dec(&currd->domctl_issuers);
+        read_unlock(&domctl_lock);
+    }
+
+    if ( !d || d == currd )
+        spin_unlock(&currd->hypercall_deadlock_mutex);
+}
+
+/*
+ * Operations which act on nothing but their target domain only need that
+ * domain's domctl_lock.  Everything else, in particular anything touching
+ * a second domain or host wide state, excludes all other domctls.
+ */
+static bool domctl_is_global(const struct xen_domctl *op,
+                             const struct domain *d)
+{
+    if ( !d || d == dom_io )
+        return true;
+
+    switch ( op->cmd )
+    {
+    case XEN_DOMCTL_setvcpucontext:
+    case XEN_DOMCTL_getvcpucontext:
+    case XEN_DOMCTL_getvcpuinfo:
+    case XEN_DOMCTL_pausedomain:
+    case XEN_DOMCTL_unpausedomain:
+    case XEN_DOMCTL_resumedomain:
+    case XEN_DOMCTL_max_vcpus:
+    case XEN_DOMCTL_soft_reset:
+    case XEN_DOMCTL_soft_reset_cont:
+    case XEN_DOMCTL_destroydomain:
+    case XEN_DOMCTL_setnodeaffinity:
+    case XEN_DOMCTL_getnodeaffinity:
+    case XEN_DOMCTL_setvcpuaffinity:
+    case XEN_DOMCTL_getvcpuaffinity:
+    case XEN_DOMCTL_scheduler_op:
+    case XEN_DOMCTL_getdomaininfo:
+    case XEN_DOMCTL_max_mem:
+    case XEN_DOMCTL_setdomainhandle:
+    case XEN_DOMCTL_setdebugging:
+    case XEN_DOMCTL_settimeoffset:
+    case XEN_DOMCTL_subscribe:
+    case XEN_DOMCTL_irq_permission:
+    case XEN_DOMCTL_iomem_permission:
+    case XEN_DOMCTL_memory_mapping:
+    case XEN_DOMCTL_set_access_required:
+    case XEN_DOMCTL_setvnumainfo:
+    case XEN_DOMCTL_monitor_op:
+    case XEN_DOMCTL_vm_event_op:
+    case XEN_DOMCTL_get_paging_mempool_size:
+    case XEN_DOMCTL_set_paging_mempool_size:
+    /* Architecture specific ones. */
+    case XEN_DOMCTL_shadow_op:
+    case XEN_DOMCTL_ioport_permission:
+    case XEN_DOMCTL_getpageframeinfo3:
+    case XEN_DOMCTL_hypercall_init:
+    case XEN_DOMCTL_sethvmcontext:
+    case XEN_DOMCTL_gethvmcontext:
+    case XEN_DOMCTL_gethvmcontext_partial:
+    case XEN_DOMCTL_set_address_size:
+    case XEN_DOMCTL_get_address_size:
+    case XEN_DOMCTL_sendtrigger:
+    case XEN_DOMCTL_set_ext_vcpucontext:
+    case XEN_DOMCTL_get_ext_vcpucontext:
+    case XEN_DOMCTL_gettscinfo:
+    case XEN_DOMCTL_settscinfo:
+    case XEN_DOMCTL_setvcpuextstate:
+    case XEN_DOMCTL_getvcpuextstate:
+    case XEN_DOMCTL_get_vcpu_msrs:
+    case XEN_DOMCTL_set_vcpu_msrs:
+    case XEN_DOMCTL_get_cpu_policy:
+    case XEN_DOMCTL_set_cpu_policy:
+    case XEN_DOMCTL_vmtrace_op:
+    case XEN_DOMCTL_cacheflush:
+    case XEN_DOMCTL_vuart_op:
+        return false;
+    }
+
+    return true;
 }
 
 void vnuma_destroy(struct vnuma_info *vnuma)
@@ -283,7 +432,7 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     long ret = 0;
     bool_t copyback = 0;
     struct xen_domctl curop, *op = &curop;
-    struct domain *d;
+    struct domain *d, *ld;
 
     if ( copy_from_guest(op, u_domctl, 1) )
         return -EFAULT;
@@ -322,7 +471,8 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     if ( ret )
         goto domctl_out_unlock_domonly;
 
-    if ( !domctl_lock_acquire() )
+    ld = domctl_is_global(op, d) ? NULL : d;
+    if ( !domctl_lock_acquire(ld) )
     {
         if ( d && d != dom_io )
             rcu_unlock_domain(d);
@@ -863,7 +1013,7 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
         break;
     }
 
-    domctl_lock_release();
+    domctl_lock_release(ld);
 
  domctl_out_unlock_domonly:
     if ( d && d != dom_io )
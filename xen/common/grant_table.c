@@ -37,6 +37,7 @@
 #include <xen/domain_page.h>
 #include <xen/iommu.h>
 #include <xen/paging.h>
+#include <xen/perfc.h>
 #include <xen/keyhandler.h>
 #include <xen/radix-tree.h>
 #include <xen/vmap.h>
@@ -269,6 +270,18 @@ struct gnttab_unmap_common {
 /* Number of unmap operations that are done between each tlb flush */
 #define GNTTAB_UNMAP_BATCH_SIZE 32
 
+/* State of a map operation, shared between the map_grant_ref_*() steps */
+struct gnttab_map_common {
+    mfn_t mfn;
+    struct page_info *pg;
+    grant_handle_t handle;
+    unsigned int pin_incr;
+    unsigned int cache_flags;
+};
+
+/* Number of map operations read from the guest at once */
+#define GNTTAB_MAP_BATCH_SIZE 16
+
 
 /*
  * Tracks a mapping of another domain's grant reference. Each domain has a
@@ -991,34 +1004,37 @@ union maptrack_node {
     unsigned long raw;
 };
 
+/*
+ * Mapping a grant is split in three steps, so that a run of operations on the
+ * same granting domain takes that domain's grant lock only once:
+ *  - map_grant_ref_prepare() does the checks not involving the remote grant
+ *    table, and obtains a maptrack handle,
+ *  - map_grant_ref_pin() pins the active entry, with the caller holding the
+ *    remote grant table's read lock,
+ *  - map_grant_ref_complete() creates the mappings, which must not be done
+ *    with that lock held.
+ * Once a step sets a failure status, the later ones only clean up.  The
+ * caller holds an RCU reference to @rd, or passes NULL for a bad domid.
+ */
 static void
-map_grant_ref(
-    struct gnttab_map_grant_ref *op)
+map_grant_ref_prepare(
+    struct gnttab_map_grant_ref *op, struct gnttab_map_common *mc,
+    struct domain *rd)
 {
-    struct domain *ld, *rd, *owner = NULL;
-    struct grant_table *lgt, *rgt;
-    grant_ref_t ref;
-    grant_handle_t handle;
-    mfn_t mfn;
-    struct page_info *pg = NULL;
-    int            rc = GNTST_okay;
-    unsigned int   cache_flags, refcnt = 0, typecnt = 0, pin_incr = 0;
-    bool           host_map_created = false;
-    struct active_grant_entry *act = NULL;
-    struct grant_mapping *mt;
-    grant_entry_header_t *shah;
-    uint16_t *status;
+    struct domain *ld = current->domain;
 
-    ld = current->domain;
+    mc->handle = INVALID_MAPTRACK_HANDLE;
+    mc->pg = NULL;
+    mc->pin_incr = 0;
 
     if ( op->flags & GNTMAP_device_map )
-        pin_incr += (op->flags & GNTMAP_readonly) ? GNTPIN_devr_inc
-                                                  : GNTPIN_devw_inc;
+        mc->pin_incr += (op->flags & GNTMAP_readonly) ? GNTPIN_devr_inc
+                                                      : GNTPIN_devw_inc;
     if ( op->flags & GNTMAP_host_map )
-        pin_incr += (op->flags & GNTMAP_readonly) ? GNTPIN_hstr_inc
-                                                  : GNTPIN_hstw_inc;
+        mc->pin_incr += (op->flags & GNTMAP_readonly) ? GNTPIN_hstr_inc
+                                                      : GNTPIN_hstw_inc;
 
-    if ( unlikely(!pin_incr) )
+    if ( unlikely(!mc->pin_incr) )
     {
         gdprintk(XENLOG_INFO, "Bad flags in grant map op: %x\n", op->flags);
         op->status = GNTST_bad_gntref;
@@ -1034,42 +1050,53 @@ map_grant_ref(
         return;
     }
 
-    if ( unlikely((rd = rcu_lock_domain_by_id(op->dom)) == NULL) )
+    if ( unlikely(!rd) )
     {
         gdprintk(XENLOG_INFO, "Could not find domain %d\n", op->dom);
         op->status = GNTST_bad_domain;
         return;
     }
 
-    rc = xsm_grant_mapref(XSM_HOOK, ld, rd, op->flags);
-    if ( rc )
+    if ( xsm_grant_mapref(XSM_HOOK, ld, rd, op->flags) )
     {
-        rcu_unlock_domain(rd);
         op->status = GNTST_permission_denied;
         return;
     }
 
-    lgt = ld->grant_table;
-    handle = get_maptrack_handle(lgt);
-    if ( unlikely(handle == INVALID_MAPTRACK_HANDLE) )
+    mc->handle = get_maptrack_handle(ld->grant_table);
+    if ( unlikely(mc->handle == INVALID_MAPTRACK_HANDLE) )
     {
-        rcu_unlock_domain(rd);
         gdprintk(XENLOG_INFO, "Failed to obtain maptrack handle\n");
         op->status = GNTST_no_space;
         return;
     }
 
-    rgt = rd->grant_table;
-    grant_read_lock(rgt);
+    op->status = GNTST_okay;
+}
+
+static void
+map_grant_ref_pin(
+    struct gnttab_map_grant_ref *op, struct gnttab_map_common *mc,
+    struct domain *rd)
+{
+    struct domain *ld = current->domain;
+    struct grant_table *rgt = rd->grant_table;
+    grant_ref_t ref = op->ref;
+    struct active_grant_entry *act;
+    grant_entry_header_t *shah;
+    uint16_t *status;
+    int rc;
+
+    if ( op->status != GNTST_okay )
+        return;
 
     /* Bounds check on the grant ref */
-    ref = op->ref;
     if ( unlikely(ref >= nr_grant_entries(rgt)))
     {
         gdprintk(XENLOG_WARNING, "Bad ref %#x for d%d\n",
                  ref, rgt->domain->domain_id);
-        rc = GNTST_bad_gntref;
-        goto unlock_out;
+        op->status = GNTST_bad_gntref;
+        return;
     }
 
     /* This call also ensures the above check cannot be passed speculatively */
@@ -1079,7 +1106,7 @@ map_grant_ref(
     /* If already pinned, check the active domid and avoid refcnt overflow. */
     if ( act->pin &&
          ((act->domid != ld->domain_id) ||
-          (act->pin & GNTPIN_incr2oflow_mask(pin_incr)) ||
+          (act->pin & GNTPIN_incr2oflow_mask(mc->pin_incr)) ||
           (act->is_sub_page)) )
     {
         gdprintk(XENLOG_WARNING,
@@ -1108,13 +1135,17 @@ map_grant_ref(
                                 shared_entry_v1(rgt, ref).frame :
                                 shared_entry_v2(rgt, ref).full_page.frame;
 
-            rc = get_paged_frame(gfn, &mfn, &pg,
+            rc = get_paged_frame(gfn, &mc->mfn, &mc->pg,
                                  op->flags & GNTMAP_readonly, rd);
             if ( rc != GNTST_okay )
-                goto unlock_out_clear;
+            {
+                reduce_status_for_pin(rd, act, status,
+                                      op->flags & GNTMAP_readonly);
+                goto act_release_out;
+            }
             act_set_gfn(act, _gfn(gfn));
             act->domid = ld->domain_id;
-            act->mfn = mfn;
+            act->mfn = mc->mfn;
             act->start = 0;
             act->length = PAGE_SIZE;
             act->is_sub_page = false;
@@ -1123,16 +1154,43 @@ map_grant_ref(
         }
     }
 
-    act->pin += pin_incr;
+    act->pin += mc->pin_incr;
 
-    mfn = act->mfn;
+    mc->mfn = act->mfn;
 
-    cache_flags = (shah->flags & (GTF_PAT | GTF_PWT | GTF_PCD) );
+    mc->cache_flags = (shah->flags & (GTF_PAT | GTF_PWT | GTF_PCD) );
 
+    rc = GNTST_okay;
+
+ act_release_out:
     active_entry_release(act);
-    grant_read_unlock(rgt);
+    op->status = rc;
+}
 
+static void
+map_grant_ref_complete(
+    struct gnttab_map_grant_ref *op, const struct gnttab_map_common *mc,
+    struct domain *rd)
+{
+    struct domain *ld = current->domain, *owner = NULL;
+    struct grant_table *lgt = ld->grant_table, *rgt;
     /* pg may be set, with a refcount included, from get_paged_frame(). */
+    struct page_info *pg = mc->pg;
+    mfn_t mfn = mc->mfn;
+    int            rc;
+    unsigned int   refcnt = 0, typecnt = 0;
+    bool           host_map_created = false;
+    struct active_grant_entry *act;
+    struct grant_mapping *mt;
+    uint16_t *status;
+
+    if ( op->status != GNTST_okay )
+    {
+        if ( mc->handle != INVALID_MAPTRACK_HANDLE )
+            put_maptrack_handle(lgt, mc->handle);
+        return;
+    }
+
     if ( !pg )
     {
         pg = mfn_valid(mfn) ? mfn_to_page(mfn) : NULL;
@@ -1173,7 +1231,7 @@ map_grant_ref(
         if ( op->flags & GNTMAP_host_map )
         {
             rc = create_grant_host_mapping(op->host_addr, mfn, op->flags,
-                                           cache_flags);
+                                           mc->cache_flags);
             if ( rc != GNTST_okay )
                 goto undo_out;
 
@@ -1313,17 +1371,16 @@ map_grant_ref(
      * All maptrack entry users check mt->flags first before using the
      * other fields so just ensure the flags field is stored last.
      */
-    mt = &maptrack_entry(lgt, handle);
+    mt = &maptrack_entry(lgt, mc->handle);
     mt->domid = op->dom;
     mt->ref   = op->ref;
     smp_wmb();
     write_atomic(&mt->flags, op->flags);
 
     op->dev_bus_addr = mfn_to_maddr(mfn);
-    op->handle       = handle;
+    op->handle       = mc->handle;
     op->status       = GNTST_okay;
 
-    rcu_unlock_domain(rd);
     return;
 
  undo_out:
@@ -1339,43 +1396,85 @@ map_grant_ref(
     while ( refcnt-- )
         put_page(pg);
 
+    rgt = rd->grant_table;
     grant_read_lock(rgt);
+    perfc_incr(gnttab_map_locks);
 
     act = active_entry_acquire(rgt, op->ref);
-    act->pin -= pin_incr;
+    act->pin -= mc->pin_incr;
 
- unlock_out_clear:
+    status = evaluate_nospec(rgt->gt_version == 1)
+             ? &shared_entry_header(rgt, op->ref)->flags
+             : &status_entry(rgt, op->ref);
     reduce_status_for_pin(rd, act, status, op->flags & GNTMAP_readonly);
 
- act_release_out:
     active_entry_release(act);
-
- unlock_out:
     grant_read_unlock(rgt);
+
     op->status = rc;
-    put_maptrack_handle(lgt, handle);
-    rcu_unlock_domain(rd);
+    put_maptrack_handle(lgt, mc->handle);
 }
 
 static long
 gnttab_map_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_map_grant_ref_t) uop, unsigned int count)
 {
-    int i;
-    struct gnttab_map_grant_ref op;
+    struct gnttab_map_grant_ref op[GNTTAB_MAP_BATCH_SIZE];
+    struct gnttab_map_common common[GNTTAB_MAP_BATCH_SIZE];
+    unsigned int i, j, k, c, done = 0;
 
-    for ( i = 0; i < count; i++ )
+    while ( count != 0 )
     {
-        if ( i && hypercall_preempt_check() )
-            return i;
+        c = min(count, (unsigned int)GNTTAB_MAP_BATCH_SIZE);
 
-        if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
+        if ( unlikely(__copy_from_guest(op, uop, c)) )
             return -EFAULT;
 
-        map_grant_ref(&op);
+        /*
+         * Deal with each run of operations on the same granting domain in one
+         * go, looking the domain up and taking its grant lock only once.
+         * Runs are made of consecutive entries, so mappings are still
+         * established in the order requested.
+         */
+        for ( i = 0; i < c; i = j )
+        {
+            struct domain *rd = rcu_lock_domain_by_id(op[i].dom);
+
+            for ( j = i; j < c && op[j].dom == op[i].dom; j++ )
+                map_grant_ref_prepare(&op[j], &common[j], rd);
+
+            if ( rd )
+            {
+                grant_read_lock(rd->grant_table);
+                perfc_incr(gnttab_map_locks);
+
+                for ( k = i; k < j; k++ )
+                    map_grant_ref_pin(&op[k], &common[k], rd);
+
+                grant_read_unlock(rd->grant_table);
+            }
+
+            for ( k = i; k < j; k++ )
+                map_grant_ref_complete(&op[k], &common[k], rd);
 
-        if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
+            if ( rd )
+                rcu_unlock_domain(rd);
+
+            perfc_incr(gnttab_map_runs);
+        }
+
+        if ( unlikely(__copy_to_guest(uop, op, c)) )
             return -EFAULT;
+
+        perfc_incr(gnttab_map_batches);
+        perfc_add(gnttab_map_ops, c);
+
+        guest_handle_add_offset(uop, c);
+        count -= c;
+        done += c;
+
+        if ( count && hypercall_preempt_check() )
+            return done;
     }
 
     return 0;
@@ -1528,12 +1627,12 @@ unmap_common(
         put_maptrack_handle(lgt, op->handle);
 
     /*
-     * map_grant_ref() will only increment the refcount (and update the
-     * IOMMU) once per mapping. So we only want to decrement it once the
+     * map_grant_ref_complete() will only increment the refcount (and update
+     * the IOMMU) once per mapping. So we only want to decrement it once the
      * maptrack handle has been put, alongside the further IOMMU update.
      *
      * For the second and third check, see the respective comment in
-     * map_grant_ref().
+     * map_grant_ref_complete().
      */
     if ( put_handle && ld != rd && gnttab_need_iommu_mapping(ld) )
     {
@@ -1678,7 +1777,7 @@ gnttab_unmap_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_grant_ref_t) uop, unsigned int count)
 {
     int i, c, partial_done, done = 0;
-    struct gnttab_unmap_grant_ref op;
+    struct gnttab_unmap_grant_ref op[GNTTAB_UNMAP_BATCH_SIZE];
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
 
     while ( count != 0 )
@@ -1686,13 +1785,14 @@ gnttab_unmap_grant_ref(
         c = min(count, (unsigned int)GNTTAB_UNMAP_BATCH_SIZE);
         partial_done = 0;
 
+        if ( unlikely(__copy_from_guest(op, uop, c)) )
+            goto fault;
+
         for ( i = 0; i < c; i++ )
         {
-            if ( unlikely(__copy_from_guest(&op, uop, 1)) )
-                goto fault;
-            unmap_grant_ref(&op, &common[i]);
+            unmap_grant_ref(&op[i], &common[i]);
             ++partial_done;
-            if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+            if ( unlikely(__copy_field_to_guest(uop, &op[i], status)) )
                 goto fault;
             guest_handle_add_offset(uop, 1);
         }
@@ -1702,6 +1802,9 @@ gnttab_unmap_grant_ref(
         for ( i = 0; i < partial_done; i++ )
             unmap_common_complete(&common[i]);
 
+        perfc_incr(gnttab_unmap_batches);
+        perfc_add(gnttab_unmap_ops, c);
+
         count -= c;
         done += c;
 
@@ -1767,6 +1870,9 @@ gnttab_unmap_and_replace(
         for ( i = 0; i < partial_done; i++ )
             unmap_common_complete(&common[i]);
 
+        perfc_incr(gnttab_unmap_batches);
+        perfc_add(gnttab_unmap_ops, c);
+
         count -= c;
         done += c;
 
@@ -2812,9 +2918,9 @@ acquire_grant_for_copy(
          * act->pin being non-zero should guarantee the page to have a
          * non-zero refcount and hence a valid owner (matching the one on
          * record), with one exception: If the owning domain is dying we
-         * had better not make implications from pin count (map_grant_ref()
-         * updates pin counts before obtaining page references, for
-         * example).
+         * had better not make implications from pin count
+         * (map_grant_ref_pin() updates pin counts before
+         * map_grant_ref_complete() obtains page references, for example).
          */
         if ( td != rd || rd->is_dying )
         {
@@ -3048,8 +3154,15 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
     /* Make sure the above checks are not bypassed speculatively */
     block_speculation();
 
-    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
-           op->len);
+    /*
+     * Whole pages are copied with non-temporal stores where available, to
+     * avoid evicting the copying domain's working set for bulk transfers.
+     */
+    if ( op->len == PAGE_SIZE )
+        copy_page(dest->virt, src->virt);
+    else
+        memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+               op->len);
     gnttab_mark_dirty(dest->domain, dest->mfn);
 
     return GNTST_okay;
@@ -3098,6 +3211,57 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
     return rc;
 }
 
+static void gnttab_copy_next_frame(struct gnttab_copy_ptr *ptr, bool is_gref)
+{
+    ptr->offset = 0;
+    if ( is_gref )
+        ptr->u.ref++;
+    else
+        ptr->u.gmfn++;
+}
+
+/*
+ * Carry out a GNTCOPY_multi_frame copy as one segment per source and
+ * destination frame.  Each segment is checked and mapped as a copy in its own
+ * right, while the buffers of frames shared by consecutive segments (and
+ * operations) are kept mapped.
+ */
+static int gnttab_copy_multi(const struct gnttab_copy *op,
+                             struct gnttab_copy_buf *dest,
+                             struct gnttab_copy_buf *src)
+{
+    struct gnttab_copy seg = *op;
+    unsigned int left = op->len;
+    int rc;
+
+    if ( op->source.offset >= PAGE_SIZE || op->dest.offset >= PAGE_SIZE )
+    {
+        gdprintk(XENLOG_WARNING, "copy offset beyond page area\n");
+        return GNTST_bad_copy_arg;
+    }
+
+    do {
+        seg.len = min_t(unsigned int, left,
+                        PAGE_SIZE - max(seg.source.offset, seg.dest.offset));
+
+        rc = gnttab_copy_one(&seg, dest, src);
+        if ( rc != GNTST_okay )
+            break;
+
+        left -= seg.len;
+        seg.source.offset += seg.len;
+        seg.dest.offset += seg.len;
+
+        if ( seg.source.offset == PAGE_SIZE )
+            gnttab_copy_next_frame(&seg.source,
+                                   op->flags & GNTCOPY_source_gref);
+        if ( seg.dest.offset == PAGE_SIZE )
+            gnttab_copy_next_frame(&seg.dest, op->flags & GNTCOPY_dest_gref);
+    } while ( left );
+
+    return rc;
+}
+
 /*
  * gnttab_copy(), other than the various other helpers of
  * do_grant_table_op(), returns (besides possible error indicators)
@@ -3129,7 +3293,10 @@ static long gnttab_copy(
             break;
         }
 
-        rc = gnttab_copy_one(&op, &dest, &src);
+        if ( op.flags & GNTCOPY_multi_frame )
+            rc = gnttab_copy_multi(&op, &dest, &src);
+        else
+            rc = gnttab_copy_one(&op, &dest, &src);
         if ( rc > 0 )
         {
             rc = count - i;
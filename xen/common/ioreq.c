@@ -24,8 +24,10 @@
 #include <xen/irq.h>
 #include <xen/lib.h>
 #include <xen/paging.h>
+#include <xen/rbtree.h>
 #include <xen/sched.h>
 #include <xen/trace.h>
+#include <xen/vmap.h>
 
 #include <asm/guest_atomics.h>
 #include <asm/ioreq.h>
@@ -261,6 +263,7 @@ bool vcpu_ioreq_handle_completion(struct vcpu *v)
 static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
 {
     struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
+    unsigned int order = buf ? s->bufioreq_order : 0, nr = 1u << order, i;
     struct page_info *page;
 
     if ( iorp->page )
@@ -276,32 +279,53 @@ static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
         return 0;
     }
 
-    page = alloc_domheap_page(s->target, MEMF_no_refcount);
+    page = alloc_domheap_pages(s->target, order, MEMF_no_refcount);
 
     if ( !page )
         return -ENOMEM;
 
-    if ( !get_page_and_type(page, s->target, PGT_writable_page) )
+    for ( i = 0; i < nr; i++ )
+        if ( !get_page_and_type(&page[i], s->target, PGT_writable_page) )
+        {
+            /*
+             * The domain can't possibly know about this page yet, so failure
+             * here is a clear indication of something fishy going on.  Free
+             * the pages we safely can, and leak the rest.
+             */
+            while ( i-- )
+            {
+                put_page_alloc_ref(&page[i]);
+                put_page_and_type(&page[i]);
+            }
+            domain_crash(s->emulator);
+            return -ENODATA;
+        }
+
+    if ( nr == 1 )
+        iorp->va = __map_domain_page_global(page);
+    else
     {
-        /*
-         * The domain can't possibly know about this page yet, so failure
-         * here is a clear indication of something fishy going on.
-         */
-        domain_crash(s->emulator);
-        return -ENODATA;
-    }
+        /* A multi-page buffered ioreq ring needs to be mapped contiguously. */
+        mfn_t mfn[1u << XEN_DMOP_BUFIOREQ_MAX_ORDER];
 
-    iorp->va = __map_domain_page_global(page);
+        for ( i = 0; i < nr; i++ )
+            mfn[i] = mfn_add(page_to_mfn(page), i);
+
+        iorp->va = vmap(mfn, nr);
+    }
     if ( !iorp->va )
         goto fail;
 
     iorp->page = page;
-    clear_page(iorp->va);
+    memset(iorp->va, 0, nr * PAGE_SIZE);
     return 0;
 
  fail:
-    put_page_alloc_ref(page);
-    put_page_and_type(page);
+    for ( i = 0; i < nr; i++ )
+    {
+        put_page_alloc_ref(&page[i]);
+        put_page_and_type(&page[i]);
+    }
 
     return -ENOMEM;
 }
@@ -310,17 +334,59 @@ static void ioreq_server_free_mfn(struct ioreq_server *s, bool buf)
 {
     struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page = iorp->page;
+    unsigned int i, nr = 1u << (buf ? s->bufioreq_order : 0);
 
     if ( !page )
         return;
 
     iorp->page = NULL;
 
-    unmap_domain_page_global(iorp->va);
+    if ( nr == 1 )
+        unmap_domain_page_global(iorp->va);
+    else
+        vunmap(iorp->va);
     iorp->va = NULL;
 
-    put_page_alloc_ref(page);
-    put_page_and_type(page);
+    for ( i = 0; i < nr; i++ )
+    {
+        put_page_alloc_ref(&page[i]);
+        put_page_and_type(&page[i]);
+    }
+}
+
+static unsigned int bufioreq_nr_slots(const struct ioreq_server *s)
+{
+    return s->bufioreq_ext ? IOREQ_BUFFER_EXT_SLOT_NUM(s->bufioreq_order)
+                           : IOREQ_BUFFER_SLOT_NUM;
+}
+
+/*
+ * Locate the pointers, the slots and, for an extended ring, the notification
+ * flag of the buffered ioreq ring of s.  Returns the number of slots.
+ */
+static unsigned int bufioreq_ring(const struct ioreq_server *s,
+                                  union bufioreq_pointers **ptrs,
+                                  buf_ioreq_t **slots, uint32_t **notify)
+{
+    if ( s->bufioreq_ext )
+    {
+        buffered_iopage_ext_t *pg = s->bufioreq.va;
+
+        *ptrs = &pg->ptrs;
+        *slots = (buf_ioreq_t *)(pg + 1);
+        *notify = &pg->notify;
+
+    }
+    else
+    {
+        buffered_iopage_t *pg = s->bufioreq.va;
+
+        *ptrs = &pg->ptrs;
+        *slots = pg->buf_ioreq;
+        *notify = NULL;
+    }
+
+    return bufioreq_nr_slots(s);
 }
 
 bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
@@ -333,7 +399,9 @@ bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
 
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
-        if ( (s->ioreq.page == page) || (s->bufioreq.page == page) )
+        if ( (s->ioreq.page == page) ||
+             (s->bufioreq.page && page >= s->bufioreq.page &&
+              page < s->bufioreq.page + (1u << s->bufioreq_order)) )
         {
             found = true;
             break;
@@ -485,6 +553,276 @@ static void ioreq_server_free_pages(struct ioreq_server *s)
     ioreq_server_free_mfn(s, false);
 }
 
+/*
+ * Index of the I/O ranges of all servers of a domain, one tree per range
+ * type, so that selecting the server for an access doesn't have to look
+ * at each server's rangesets in turn.  The claimed ranges are cut into
+ * disjoint segments, each recording the servers covering all of it.
+ * Segments with the same servers are merged, so every boundary of a
+ * server's range is a segment boundary.
+ */
+struct ioreq_segment {
+    union {
+        struct rb_node node;
+        /* Spare segments, allocated before the index is changed. */
+        struct ioreq_segment *next;
+    };
+    unsigned long s, e;
+    unsigned int servers;
+};
+
+/* Find the highest segment lower than or containing s. */
+static struct ioreq_segment *segment_find(const struct rb_root *root,
+                                          unsigned long s)
+{
+    struct rb_node *n = root->rb_node;
+    struct ioreq_segment *x = NULL, *y;
+
+    while ( n )
+    {
+        y = rb_entry(n, struct ioreq_segment, node);
+        if ( y->s > s )
+            n = n->rb_left;
+        else
+        {
+            x = y;
+            n = n->rb_right;
+        }
+    }
+
+    return x;
+}
+
+static struct ioreq_segment *segment_next(struct ioreq_segment *x)
+{
+    struct rb_node *n = rb_next(&x->node);
+
+    return n ? rb_entry(n, struct ioreq_segment, node) : NULL;
+}
+
+/* Find the lowest segment containing or higher than s. */
+static struct ioreq_segment *segment_find_next(const struct rb_root *root,
+                                               unsigned long s)
+{
+    struct ioreq_segment *x = segment_find(root, s);
+    struct rb_node *n;
+
+    if ( x && x->e >= s )
+        return x;
+
+    n = x ? rb_next(&x->node) : rb_first(root);
+
+    return n ? rb_entry(n, struct ioreq_segment, node) : NULL;
+}
+
+static void segment_insert(struct rb_root *root, struct ioreq_segment *y)
+{
+    struct rb_node **link = &root->rb_node, *parent = NULL;
+
+    while ( *link )
+    {
+        parent = *link;
+        if ( rb_entry(parent, struct ioreq_segment, node)->s > y->s )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    rb_link_node(&y->node, parent, link);
+    rb_insert_color(&y->node, root);
+}
+
+static void segment_erase(struct rb_root *root, struct ioreq_segment *x)
+{
+    rb_erase(&x->node, root);
+    xfree(x);
+}
+
+static struct ioreq_segment *segment_spare(struct ioreq_segment **spare)
+{
+    struct ioreq_segment *x = *spare;
+
+    ASSERT(x);
+    *spare = x->next;
+
+    return x;
+}
+
+/* Start a segment at 'at', splitting the segment containing it. */
+static void segment_split(struct rb_root *root, unsigned long at,
+                          struct ioreq_segment **spare)
+{
+    struct ioreq_segment *x = segment_find(root, at), *y;
+
+    if ( !x || x->s == at || x->e < at )
+        return;
+
+    y = segment_spare(spare);
+    y->s = at;
+    y->e = x->e;
+    y->servers = x->servers;
+    x->e = at - 1;
+    segment_insert(root, y);
+}
+
+/* Drop empty segments and merge equal neighbours in and around [s, e]. */
+static void segment_tidy(struct rb_root *root, unsigned long s,
+                         unsigned long e)
+{
+    struct ioreq_segment *x = segment_find_next(root, s ? s - 1 : 0), *y;
+
+    while ( x )
+    {
+        y = segment_next(x);
+
+        if ( !x->servers )
+        {
+            segment_erase(root, x);
+            x = y;
+            continue;
+        }
+
+        if ( y && y->servers == x->servers && y->s == x->e + 1 )
+        {
+            x->e = y->e;
+            segment_erase(root, y);
+            continue;
+        }
+
+        if ( x->e >= e )
+            break;
+
+        x = y;
+    }
+}
+
+/*
+ * Allocate the segments that adding [s, e] to the index may need: one for
+ * each split at either end, and one for each gap between the segments
+ * already there.
+ */
+static int ioreq_index_reserve(const struct rb_root *root, unsigned long s,
+                               unsigned long e, bool add,
+                               struct ioreq_segment **spare)
+{
+    struct ioreq_segment *x;
+    unsigned int nr = 2;
+
+    if ( add )
+    {
+        nr++;
+        for ( x = segment_find_next(root, s); x && x->s <= e;
+              x = segment_next(x) )
+            nr++;
+    }
+
+    while ( nr-- )
+    {
+        x = xmalloc(struct ioreq_segment);
+        if ( !x )
+            return -ENOMEM;
+        x->next = *spare;
+        *spare = x;
+    }
+
+    return 0;
+}
+
+static void ioreq_index_free(struct ioreq_segment *spare)
+{
+    struct ioreq_segment *x;
+
+    while ( (x = spare) )
+    {
+        spare = x->next;
+        xfree(x);
+    }
+}
+
+/* Add or remove server 'id' for [s, e], using the reserved segments. */
+static void ioreq_index_update(struct rb_root *root, unsigned long s,
+                               unsigned long e, unsigned int id, bool add,
+                               struct ioreq_segment **spare)
+{
+    struct ioreq_segment *x;
+    unsigned long pos;
+
+    segment_split(root, s, spare);
+    if ( e != ~0UL )
+        segment_split(root, e + 1, spare);
+
+    x = segment_find_next(root, s);
+
+    for ( pos = s; ; pos = x->e + 1, x = segment_next(x) )
+    {
+        if ( add && (!x || x->s > pos) )
+        {
+            struct ioreq_segment *y = segment_spare(spare);
+
+            y->s = pos;
+            y->e = x && x->s <= e ? x->s - 1 : e;
+            y->servers = 0;
+            segment_insert(root, y);
+            x = y;
+        }
+
+        if ( !x || x->s > e )
+            break;
+
+        if ( add )
+            x->servers |= 1U << id;
+        else
+            x->servers &= ~(1U << id);
+
+        if ( x->e >= e )
+            break;
+    }
+
+    segment_tidy(root, s, e);
+}
+
+/* The servers whose ranges contain all of [s, e]. */
+static unsigned int ioreq_index_lookup(const struct rb_root *root,
+                                       unsigned long s, unsigned long e)
+{
+    struct ioreq_segment *x = segment_find(root, s), *y;
+    unsigned int servers;
+
+    if ( !x || x->e < s )
+        return 0;
+
+    for ( servers = x->servers; servers && x->e < e; x = y )
+    {
+        y = segment_next(x);
+        if ( !y || y->s != x->e + 1 )
+            return 0;
+        servers &= y->servers;
+    }
+
+    return servers;
+}
+
+/* Drop all ranges of server 'id' from the index. */
+static void ioreq_index_remove_server(struct domain *d, unsigned int id)
+{
+    unsigned int i;
+
+    write_lock(&d->ioreq_server.index_lock);
+
+    for ( i = 0; i < ARRAY_SIZE(d->ioreq_server.index); i++ )
+    {
+        struct rb_root *root = &d->ioreq_server.index[i];
+        struct rb_node *n;
+
+        for ( n = rb_first(root); n; n = rb_next(n) )
+            rb_entry(n, struct ioreq_segment, node)->servers &= ~(1U << id);
+
+        segment_tidy(root, 0, ~0UL);
+    }
+
+    write_unlock(&d->ioreq_server.index_lock);
+}
+
 static void ioreq_server_free_rangesets(struct ioreq_server *s)
 {
     unsigned int i;
@@ -575,6 +913,7 @@ static void ioreq_server_disable(struct ioreq_server *s)
 
 static int ioreq_server_init(struct ioreq_server *s,
                              struct domain *d, int bufioreq_handling,
+                             unsigned int flags, unsigned int bufioreq_order,
                              ioservid_t id)
 {
     struct domain *currd = current->domain;
@@ -598,6 +937,8 @@ static int ioreq_server_init(struct ioreq_server *s,
         return rc;
 
     s->bufioreq_handling = bufioreq_handling;
+    s->bufioreq_ext = flags & XEN_DMOP_bufioreq_ext;
+    s->bufioreq_order = bufioreq_order;
 
     for_each_vcpu ( d, v )
     {
@@ -641,6 +982,7 @@ static void ioreq_server_deinit(struct ioreq_server *s)
 }
 
 static int ioreq_server_create(struct domain *d, int bufioreq_handling,
+                               unsigned int flags, unsigned int bufioreq_order,
                                ioservid_t *id)
 {
     struct ioreq_server *s;
@@ -653,6 +995,17 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
     if ( bufioreq_handling > HVM_IOREQSRV_BUFIOREQ_ATOMIC )
         return -EINVAL;
 
+    if ( flags & ~XEN_DMOP_bufioreq_ext )
+        return -EINVAL;
+
+    if ( (flags & XEN_DMOP_bufioreq_ext) &&
+         bufioreq_handling == HVM_IOREQSRV_BUFIOREQ_OFF )
+        return -EINVAL;
+
+    if ( bufioreq_order > ((flags & XEN_DMOP_bufioreq_ext) ?
+                           XEN_DMOP_BUFIOREQ_MAX_ORDER : 0) )
+        return -EINVAL;
+
     s = xzalloc(struct ioreq_server);
     if ( !s )
         return -ENOMEM;
@@ -676,7 +1029,7 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
      */
     set_ioreq_server(d, i, s);
 
-    rc = ioreq_server_init(s, d, bufioreq_handling, i);
+    rc = ioreq_server_init(s, d, bufioreq_handling, flags, bufioreq_order, i);
     if ( rc )
     {
         set_ioreq_server(d, i, NULL);
@@ -727,6 +1080,7 @@ static int ioreq_server_destroy(struct domain *d, ioservid_t id)
      * set_ioreq_server() since the target domain is paused.
      */
     ioreq_server_deinit(s);
+    ioreq_index_remove_server(d, id);
     set_ioreq_server(d, id, NULL);
 
     domain_unpause(d);
@@ -763,6 +1117,11 @@ static int ioreq_server_get_info(struct domain *d, ioservid_t id,
 
     if ( ioreq_gfn || bufioreq_gfn )
     {
+        /* A multi-page buffered ioreq ring has no guest frame to map. */
+        rc = -EOPNOTSUPP;
+        if ( s->bufioreq_order )
+            goto out;
+
         rc = arch_ioreq_server_map_pages(s);
         if ( rc )
             goto out;
@@ -830,6 +1189,16 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
 
     default:
         rc = -EINVAL;
+        if ( idx < XENMEM_resource_ioreq_server_frame_bufioreq_ext(0) )
+            break;
+
+        idx -= XENMEM_resource_ioreq_server_frame_bufioreq_ext(0);
+        if ( !HANDLE_BUFIOREQ(s) || !s->bufioreq_ext ||
+             idx >= (1u << s->bufioreq_order) )
+            break;
+
+        *mfn = mfn_add(page_to_mfn(s->bufioreq.page), idx);
+        rc = 0;
         break;
     }
 
@@ -839,12 +1208,71 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
     return rc;
 }
 
+static int ioreq_server_get_stats(struct domain *d, ioservid_t id,
+                                  bool reset,
+                                  struct xen_dm_op_get_ioreq_server_stats *data)
+{
+    struct ioreq_server *s;
+    int rc;
+
+    spin_lock_recursive(&d->ioreq_server.lock);
+
+    s = get_ioreq_server(d, id);
+
+    rc = -ENOENT;
+    if ( !s )
+        goto out;
+
+    rc = -EPERM;
+    if ( s->emulator != current->domain )
+        goto out;
+
+    data->slots = data->used = data->max_used = 0;
+    data->requests = data->notifications = data->suppressed = data->full = 0;
+
+    rc = 0;
+    if ( !HANDLE_BUFIOREQ(s) )
+        goto out;
+
+    spin_lock(&s->bufioreq_lock);
+
+    data->slots = bufioreq_nr_slots(s);
+    if ( s->bufioreq.va )
+    {
+        union bufioreq_pointers *ptrs;
+        buf_ioreq_t *slots;
+        uint32_t *notify;
+
+        bufioreq_ring(s, &ptrs, &slots, &notify);
+        data->used = min_t(uint32_t,
+                           ptrs->write_pointer - ptrs->read_pointer,
+                           data->slots);
+    }
+
+    data->max_used = s->bufioreq_stats.max_used;
+    data->requests = s->bufioreq_stats.requests;
+    data->notifications = s->bufioreq_stats.notifications;
+    data->suppressed = s->bufioreq_stats.suppressed;
+    data->full = s->bufioreq_stats.full;
+
+    if ( reset )
+        memset(&s->bufioreq_stats, 0, sizeof(s->bufioreq_stats));
+
+    spin_unlock(&s->bufioreq_lock);
+
+ out:
+    spin_unlock_recursive(&d->ioreq_server.lock);
+
+    return rc;
+}
+
 static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
                                      uint32_t type, uint64_t start,
                                      uint64_t end)
 {
     struct ioreq_server *s;
     struct rangeset *r;
+    struct ioreq_segment *spare = NULL;
     int rc;
 
     if ( start > end )
@@ -883,11 +1311,23 @@ static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
     if ( rangeset_overlaps_range(r, start, end) )
         goto out;
 
-    rc = rangeset_add_range(r, start, end);
+    rc = ioreq_index_reserve(&d->ioreq_server.index[type], start, end, true,
+                             &spare);
+    if ( !rc )
+        rc = rangeset_add_range(r, start, end);
+    if ( !rc )
+    {
+        write_lock(&d->ioreq_server.index_lock);
+        ioreq_index_update(&d->ioreq_server.index[type], start, end, id,
+                           true, &spare);
+        write_unlock(&d->ioreq_server.index_lock);
+    }
 
  out:
     spin_unlock_recursive(&d->ioreq_server.lock);
 
+    ioreq_index_free(spare);
+
     return rc;
 }
 
@@ -897,6 +1337,7 @@ static int ioreq_server_unmap_io_range(struct domain *d, ioservid_t id,
 {
     struct ioreq_server *s;
     struct rangeset *r;
+    struct ioreq_segment *spare = NULL;
     int rc;
 
     if ( start > end )
@@ -935,11 +1376,23 @@ static int ioreq_server_unmap_io_range(struct domain *d, ioservid_t id,
     if ( !rangeset_contains_range(r, start, end) )
         goto out;
 
-    rc = rangeset_remove_range(r, start, end);
+    rc = ioreq_index_reserve(&d->ioreq_server.index[type], start, end, false,
+                             &spare);
+    if ( !rc )
+        rc = rangeset_remove_range(r, start, end);
+    if ( !rc )
+    {
+        write_lock(&d->ioreq_server.index_lock);
+        ioreq_index_update(&d->ioreq_server.index[type], start, end, id,
+                           false, &spare);
+        write_unlock(&d->ioreq_server.index_lock);
+    }
 
  out:
     spin_unlock_recursive(&d->ioreq_server.lock);
 
+    ioreq_index_free(spare);
+
     return rc;
 }
 
@@ -1089,6 +1542,7 @@ void ioreq_server_destroy_all(struct domain *d)
          * set_ioreq_server() since the target domain is being destroyed.
          */
         ioreq_server_deinit(s);
+        ioreq_index_remove_server(d, id);
         set_ioreq_server(d, id, NULL);
 
         xfree(s);
@@ -1103,51 +1557,54 @@ struct ioreq_server *ioreq_server_select(struct domain *d,
     struct ioreq_server *s;
     uint8_t type;
     uint64_t addr;
-    unsigned int id;
+    unsigned long start, end;
+    unsigned int servers;
 
     if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
         return NULL;
 
-    FOR_EACH_IOREQ_SERVER(d, id, s)
+    switch ( type )
     {
-        struct rangeset *r;
-
-        if ( !s->enabled )
-            continue;
-
-        r = s->range[type];
+    case XEN_DMOP_IO_RANGE_PORT:
+        start = addr;
+        end = start + p->size - 1;
+        break;
 
-        switch ( type )
-        {
-            unsigned long start, end;
+    case XEN_DMOP_IO_RANGE_MEMORY:
+        start = ioreq_mmio_first_byte(p);
+        end = ioreq_mmio_last_byte(p);
+        break;
 
-        case XEN_DMOP_IO_RANGE_PORT:
-            start = addr;
-            end = start + p->size - 1;
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    case XEN_DMOP_IO_RANGE_PCI:
+        start = end = addr >> 32;
+        break;
 
-            break;
+    default:
+        return NULL;
+    }
 
-        case XEN_DMOP_IO_RANGE_MEMORY:
-            start = ioreq_mmio_first_byte(p);
-            end = ioreq_mmio_last_byte(p);
+    read_lock(&d->ioreq_server.index_lock);
+    servers = ioreq_index_lookup(&d->ioreq_server.index[type], start, end);
+    read_unlock(&d->ioreq_server.index_lock);
 
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    /* Favour more recently created servers, as FOR_EACH_IOREQ_SERVER() does. */
+    while ( servers )
+    {
+        unsigned int id = fls(servers) - 1;
 
-            break;
+        servers &= ~(1U << id);
 
-        case XEN_DMOP_IO_RANGE_PCI:
-            if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
-            }
+        s = GET_IOREQ_SERVER(d, id);
+        if ( !s || !s->enabled )
+            continue;
 
-            break;
+        if ( type == XEN_DMOP_IO_RANGE_PCI )
+        {
+            p->type = IOREQ_TYPE_PCI_CONFIG;
+            p->addr = addr;
         }
+
+        return s;
     }
 
     return NULL;
@@ -1156,8 +1613,10 @@ struct ioreq_server *ioreq_server_select(struct domain *d,
 static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
 {
     struct domain *d = current->domain;
-    struct ioreq_page *iorp;
-    buffered_iopage_t *pg;
+    union bufioreq_pointers *ptrs;
+    buf_ioreq_t *slots;
+    uint32_t *notify;
+    unsigned int nr, used;
     buf_ioreq_t bp = { .data = p->data,
                        .addr = p->addr,
                        .type = p->type,
@@ -1167,13 +1626,16 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
 
     /* Ensure buffered_iopage fits in a page */
     BUILD_BUG_ON(sizeof(buffered_iopage_t) > PAGE_SIZE);
+    /* ... and the extended ring's slots follow its 64-byte header. */
+    BUILD_BUG_ON(sizeof(buffered_iopage_ext_t) != 64);
+    BUILD_BUG_ON(IOREQ_BUFFER_EXT_SLOT_NUM(0) * sizeof(buf_ioreq_t) +
+                 sizeof(buffered_iopage_ext_t) > PAGE_SIZE);
 
-    iorp = &s->bufioreq;
-    pg = iorp->va;
-
-    if ( !pg )
+    if ( !s->bufioreq.va )
         return IOREQ_STATUS_UNHANDLED;
 
+    nr = bufioreq_ring(s, &ptrs, &slots, &notify);
+
     /*
      * Return 0 for the cases we can't deal with:
      *  - 'addr' is only a 20-bit field, so we cannot address beyond 1MB
@@ -1207,40 +1669,63 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
 
     spin_lock(&s->bufioreq_lock);
 
-    if ( (pg->ptrs.write_pointer - pg->ptrs.read_pointer) >=
-         (IOREQ_BUFFER_SLOT_NUM - qw) )
+    if ( (ptrs->write_pointer - ptrs->read_pointer) >= (nr - qw) )
     {
         /* The queue is full: send the iopacket through the normal path. */
+        s->bufioreq_stats.full++;
         spin_unlock(&s->bufioreq_lock);
         return IOREQ_STATUS_UNHANDLED;
     }
 
-    pg->buf_ioreq[pg->ptrs.write_pointer % IOREQ_BUFFER_SLOT_NUM] = bp;
+    slots[ptrs->write_pointer % nr] = bp;
 
     if ( qw )
     {
         bp.data = p->data >> 32;
-        pg->buf_ioreq[(pg->ptrs.write_pointer+1) % IOREQ_BUFFER_SLOT_NUM] = bp;
+        slots[(ptrs->write_pointer + 1) % nr] = bp;
     }
 
     /* Make the ioreq_t visible /before/ write_pointer. */
     smp_wmb();
-    pg->ptrs.write_pointer += qw ? 2 : 1;
+    ptrs->write_pointer += qw ? 2 : 1;
+
+    s->bufioreq_stats.requests++;
+    used = ptrs->write_pointer - ptrs->read_pointer;
+    if ( used <= nr && used > s->bufioreq_stats.max_used )
+        s->bufioreq_stats.max_used = used;
 
     /* Canonicalize read/write pointers to prevent their overflow. */
     while ( (s->bufioreq_handling == HVM_IOREQSRV_BUFIOREQ_ATOMIC) &&
-            qw++ < IOREQ_BUFFER_SLOT_NUM &&
-            pg->ptrs.read_pointer >= IOREQ_BUFFER_SLOT_NUM )
+            qw++ < nr &&
+            ptrs->read_pointer >= nr )
     {
-        union bufioreq_pointers old = pg->ptrs, new;
-        unsigned int n = old.read_pointer / IOREQ_BUFFER_SLOT_NUM;
+        union bufioreq_pointers old = *ptrs, new;
+        unsigned int n = old.read_pointer / nr;
+
+        new.read_pointer = old.read_pointer - n * nr;
+        new.write_pointer = old.write_pointer - n * nr;
+        guest_cmpxchg64(s->emulator, &ptrs->full, old.full, new.full);
+    }
+
+    /*
+     * The emulator of an extended ring asks for an event by setting notify
+     * before it waits, and then looks at write_pointer again.  Make
+     * write_pointer visible /before/ looking at notify, so that either the
+     * emulator finds the request or we find notify set.
+     */
+    if ( notify )
+        smp_mb();
 
-        new.read_pointer = old.read_pointer - n * IOREQ_BUFFER_SLOT_NUM;
-        new.write_pointer = old.write_pointer - n * IOREQ_BUFFER_SLOT_NUM;
-        guest_cmpxchg64(s->emulator, &pg->ptrs.full, old.full, new.full);
+    if ( !notify ||
+         (read_atomic(notify) &&
+          guest_cmpxchg(s->emulator, notify, 1, 0) == 1) )
+    {
+        notify_via_xen_event_channel(d, s->bufioreq_evtchn);
+        s->bufioreq_stats.notifications++;
     }
+    else
+        s->bufioreq_stats.suppressed++;
 
-    notify_via_xen_event_channel(d, s->bufioreq_evtchn);
     spin_unlock(&s->bufioreq_lock);
 
     return IOREQ_STATUS_HANDLED;
@@ -1331,7 +1816,15 @@ unsigned int ioreq_broadcast(ioreq_t *p, bool buffered)
 
 void ioreq_domain_init(struct domain *d)
 {
+    unsigned int i;
+
+    BUILD_BUG_ON(ARRAY_SIZE(d->ioreq_server.index) != NR_IO_RANGE_TYPES);
+    BUILD_BUG_ON(MAX_NR_IOREQ_SERVERS > sizeof(unsigned int) * 8);
+
     spin_lock_init(&d->ioreq_server.lock);
+    rwlock_init(&d->ioreq_server.index_lock);
+    for ( i = 0; i < NR_IO_RANGE_TYPES; i++ )
+        d->ioreq_server.index[i] = RB_ROOT;
 
     arch_ioreq_domain_init(d);
 }
@@ -1350,11 +1843,11 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
         *const_op = false;
 
         rc = -EINVAL;
-        if ( data->pad[0] || data->pad[1] || data->pad[2] )
+        if ( data->pad )
             break;
 
-        rc = ioreq_server_create(d, data->handle_bufioreq,
-                                 &data->id);
+        rc = ioreq_server_create(d, data->handle_bufioreq, data->flags,
+                                 data->bufioreq_order, &data->id);
         break;
     }
 
@@ -1379,6 +1872,23 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
         break;
     }
 
+    case XEN_DMOP_get_ioreq_server_stats:
+    {
+        struct xen_dm_op_get_ioreq_server_stats *data =
+            &op->u.get_ioreq_server_stats;
+        const uint16_t valid_flags = XEN_DMOP_stats_reset;
+
+        *const_op = false;
+
+        rc = -EINVAL;
+        if ( data->flags & ~valid_flags )
+            break;
+
+        rc = ioreq_server_get_stats(d, data->id,
+                                    data->flags & XEN_DMOP_stats_reset, data);
+        break;
+    }
+
     case XEN_DMOP_map_io_range_to_ioreq_server:
     {
         const struct xen_dm_op_ioreq_server_range *data =
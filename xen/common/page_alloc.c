@@ -120,6 +120,7 @@
  *   regions within it.
  */
 
+#include <xen/cpu.h>
 #include <xen/domain_page.h>
 #include <xen/event.h>
 #include <xen/init.h>
@@ -472,6 +473,13 @@ static long total_avail_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+static struct page_info *mag_alloc(unsigned int zone_lo, unsigned int zone_hi,
+                                   unsigned int memflags, struct domain *d);
+static unsigned long mag_drain_all(void);
+static bool mag_reclaim(unsigned int order, unsigned int memflags,
+                        unsigned int *tries);
+static unsigned long mag_pages(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -510,6 +518,14 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
 
+    /*
+     * Claims are checked against the heap only, so return the pages cached in
+     * magazines to it first.  Magazines refilling in the meantime honour the
+     * existing claims, at worst making this check conservative.
+     */
+    if ( pages )
+        mag_drain_all();
+
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
@@ -569,7 +585,7 @@ void get_outstanding_claims(uint64_t *free_pages, uint64_t *outstanding_pages)
 {
     spin_lock(&heap_lock);
     *outstanding_pages = outstanding_claims;
-    *free_pages =  avail_domheap_pages();
+    *free_pages =  avail_domheap_pages() + mag_pages();
     spin_unlock(&heap_lock);
 }
 
@@ -938,7 +954,7 @@ static struct page_info *alloc_heap_pages(
     struct page_info *pg;
     bool need_tlbflush = false;
     uint32_t tlbflush_timestamp = 0;
-    unsigned int dirty_cnt = 0;
+    unsigned int dirty_cnt = 0, reclaim_tries = 0;
     mfn_t mfn;
 
     /* Make sure there are enough bits in memflags for nodeID. */
@@ -950,6 +966,10 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    if ( order == 0 && (pg = mag_alloc(zone_lo, zone_hi, memflags, d)) )
+        return pg;
+
+ retry:
     spin_lock(&heap_lock);
 
     /*
@@ -961,6 +981,9 @@ static struct page_info *alloc_heap_pages(
            !d || d->outstanding_pages < request) )
     {
         spin_unlock(&heap_lock);
+        /* Pages held in magazines don't count as available.  Reclaim them. */
+        if ( mag_reclaim(order, memflags, &reclaim_tries) )
+            goto retry;
         return NULL;
     }
 
@@ -971,8 +994,10 @@ static struct page_info *alloc_heap_pages(
                             memflags | MEMF_no_scrub, d);
     if ( !pg )
     {
-        /* No suitable memory blocks. Fail the request. */
         spin_unlock(&heap_lock);
+        if ( mag_reclaim(order, memflags, &reclaim_tries) )
+            goto retry;
+        /* No suitable memory blocks. Fail the request. */
         return NULL;
     }
 
@@ -1180,23 +1205,34 @@ static int reserve_offlined_page(struct page_info *head)
 static nodemask_t node_scrubbing;
 
 /*
- * If get_node is true this will return closest node that needs to be scrubbed,
- * with appropriate bit in node_scrubbing set.
+ * CPUs which found no scrubbing to do when they last went idle, and so may be
+ * asleep.  Freeing pages which need scrubbing wakes the ones local to them.
+ */
+static cpumask_t scrub_idle_cpus;
+static cpumask_t scrub_kick_mask; /* Protected by heap_lock. */
+
+static nodeid_t scrub_local_node(void)
+{
+    nodeid_t node = cpu_to_node(smp_processor_id());
+
+    return node == NUMA_NO_NODE ? 0 : node;
+}
+
+/*
+ * If get_node is true this will return closest node that needs to be scrubbed.
+ * Any number of CPUs may scrub their local node, while a memory-only node is
+ * scrubbed by one CPU at a time, with its bit in node_scrubbing set.
  * If get_node is not set, this will return *a* node that needs to be scrubbed.
  * node_scrubbing bitmask will no be updated.
  * If no node needs scrubbing then NUMA_NO_NODE is returned.
  */
 static unsigned int node_to_scrub(bool get_node)
 {
-    nodeid_t node = cpu_to_node(smp_processor_id()), local_node;
+    nodeid_t node = scrub_local_node(), local_node;
     nodeid_t closest = NUMA_NO_NODE;
     u8 dist, shortest = 0xff;
 
-    if ( node == NUMA_NO_NODE )
-        node = 0;
-
-    if ( node_need_scrub[node] &&
-         (!get_node || !node_test_and_set(node, node_scrubbing)) )
+    if ( node_need_scrub[node] )
         return node;
 
     /*
@@ -1243,6 +1279,64 @@ static unsigned int node_to_scrub(bool get_node)
     return closest;
 }
 
+/*
+ * Wake CPUs to scrub pages freed on @node: the idle CPUs of the node itself,
+ * or any one idle CPU for a memory-only node.  Called with the heap lock held.
+ */
+static void scrub_kick(nodeid_t node)
+{
+    unsigned int cpu;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    /* Order the update of node_need_scrub[] against reading the idle mask. */
+    smp_mb();
+
+    if ( cpumask_empty(&scrub_idle_cpus) )
+        return;
+
+    if ( cpumask_empty(&node_to_cpumask(node)) )
+    {
+        cpu = cpumask_any(&scrub_idle_cpus);
+        cpumask_copy(&scrub_kick_mask, cpumask_of(cpu));
+    }
+    else
+        cpumask_and(&scrub_kick_mask, &scrub_idle_cpus,
+                    &node_to_cpumask(node));
+
+    cpumask_and(&scrub_kick_mask, &scrub_kick_mask, &cpu_online_map);
+    __cpumask_clear_cpu(smp_processor_id(), &scrub_kick_mask);
+
+    for_each_cpu ( cpu, &scrub_kick_mask )
+        cpumask_clear_cpu(cpu, &scrub_idle_cpus);
+
+    if ( !cpumask_empty(&scrub_kick_mask) )
+        smp_send_event_check_mask(&scrub_kick_mask);
+}
+
+/*
+ * Find the last buddy in a free list which needs scrubbing and is not being
+ * scrubbed by another CPU already.  Unscrubbed pages are always at the end of
+ * the list.
+ */
+static struct page_info *scrub_next_buddy(nodeid_t node, unsigned int zone,
+                                          unsigned int order)
+{
+    struct page_info *pg;
+
+    for ( pg = page_list_last(&heap(node, zone, order)); pg;
+          pg = page_list_prev(pg, &heap(node, zone, order)) )
+    {
+        if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
+            break;
+
+        if ( pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING )
+            return pg;
+    }
+
+    return NULL;
+}
+
 struct scrub_wait_state {
     struct page_info *pg;
     unsigned int first_dirty;
@@ -1275,10 +1369,19 @@ bool scrub_free_pages(void)
     nodeid_t node;
     unsigned int cnt = 0;
 
+    /*
+     * Advertise being idle before looking for work, so that pages freed
+     * concurrently are either found here or result in this CPU being kicked.
+     */
+    cpumask_set_cpu(cpu, &scrub_idle_cpus);
+    smp_mb__after_atomic();
+
     node = node_to_scrub(true);
     if ( node == NUMA_NO_NODE )
         return false;
 
+    cpumask_clear_cpu(cpu, &scrub_idle_cpus);
+
     spin_lock(&heap_lock);
 
     for ( zone = 0; zone < NR_ZONES; zone++ )
@@ -1286,17 +1389,11 @@ bool scrub_free_pages(void)
         unsigned int order = MAX_ORDER;
 
         do {
-            while ( !page_list_empty(&heap(node, zone, order)) )
+            while ( (pg = scrub_next_buddy(node, zone, order)) )
             {
                 unsigned int i, dirty_cnt;
                 struct scrub_wait_state st;
 
-                /* Unscrubbed pages are always at the end of the list. */
-                pg = page_list_last(&heap(node, zone, order));
-                if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
-                    break;
-
-                ASSERT(pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING);
                 pg->u.free.scrub_state = BUDDY_SCRUBBING;
 
                 spin_unlock(&heap_lock);
@@ -1387,10 +1484,34 @@ bool scrub_free_pages(void)
     spin_unlock(&heap_lock);
 
  out_nolock:
-    node_clear(node, node_scrubbing);
+    if ( node != scrub_local_node() )
+        node_clear(node, node_scrubbing);
+
+    /*
+     * All the remaining dirty buddies are being scrubbed by other CPUs.  Go
+     * to sleep rather than spin, until more pages are freed.
+     */
+    if ( !cnt )
+    {
+        cpumask_set_cpu(cpu, &scrub_idle_cpus);
+        return false;
+    }
+
     return node_to_scrub(false) != NUMA_NO_NODE;
 }
 
+static void release_page_owner(struct page_info *pg, mfn_t mfn)
+{
+    /* If a page has no owner it will need no safety TLB flush. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        page_set_tlbflush_timestamp(pg);
+
+    /* This page is not a guest frame any more. */
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
+}
+
 static bool mark_page_free(struct page_info *pg, mfn_t mfn)
 {
     bool pg_offlined = false;
@@ -1430,20 +1551,13 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
         BUG();
     }
 
-    /* If a page has no owner it will need no safety TLB flush. */
-    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
-    if ( pg->u.free.need_tlbflush )
-        page_set_tlbflush_timestamp(pg);
-
-    /* This page is not a guest frame any more. */
-    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
-    set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
+    release_page_owner(pg, mfn);
 
     return pg_offlined;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
+/* Free 2^@order set of pages, with the heap lock held. */
+static void _free_heap_pages(
     struct page_info *pg, unsigned int order, bool need_scrub)
 {
     unsigned long mask;
@@ -1453,8 +1567,7 @@ static void free_heap_pages(
     bool pg_offlined = false;
 
     ASSERT(order <= MAX_ORDER);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -1474,6 +1587,7 @@ static void free_heap_pages(
     {
         node_need_scrub[node] += 1 << order;
         pg->u.free.first_dirty = 0;
+        scrub_kick(node);
     }
     else
         pg->u.free.first_dirty = INVALID_DIRTY_IDX;
@@ -1537,7 +1651,384 @@ static void free_heap_pages(
 
     if ( pg_offlined )
         reserve_offlined_page(pg);
+}
+
+
+/*************************
+ * PER-CPU PAGE MAGAZINES
+ *
+ * Each CPU keeps a small stack of free order-0 pages from its own NUMA node,
+ * so that most single page allocations and frees avoid the heap lock.  A
+ * magazine is refilled from the heap with one contiguous chunk, and drained
+ * back to it in batches.
+ *
+ * Pages in a magazine are anonymous in-use pages, with no owner and not
+ * counted in avail[] or total_avail_pages.  Only pages freed without
+ * PGC_need_scrub are cached, but they are not scrubbed: their contents are
+ * whatever the previous owner left.  Claims are accounted for by the heap
+ * alone, so while any are outstanding only allocations charged to a claim are
+ * served from magazines, and magazines are drained before a claim is staked.
+ * Small heap allocations failing reclaim cached pages, see mag_reclaim().
+ * As with a page in use, a request to offline one completes when it is
+ * returned to the heap.  The heap lock is never taken with a magazine's lock
+ * held.
+ */
+
+#define MAG_REFILL_ORDER  3
+#define MAG_BATCH         (1U << MAG_REFILL_ORDER)
+#define MAG_HIGH          (8 * MAG_BATCH)
+
+struct page_magazine {
+    spinlock_t lock;
+    struct page_list_head pages;
+    unsigned int count;
+    nodeid_t node;
+};
+
+static DEFINE_PER_CPU(struct page_magazine, page_mag);
+static bool __read_mostly mag_enabled;
+/* Lowest zone cached, keeping DMA memory out of the magazines. */
+static unsigned int __read_mostly mag_zone_lo;
+
+/*
+ * Return pages taken out of magazines to the heap.  Pages may have been freed
+ * by a domain, so a TLB flush for the whole batch is done first.
+ */
+static unsigned int mag_release(struct page_list_head *list)
+{
+    struct page_info *pg;
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+    unsigned int nr = 0;
+
+    page_list_for_each ( pg, list )
+        accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    spin_lock(&heap_lock);
+    while ( (pg = page_list_remove_head(list)) )
+    {
+        _free_heap_pages(pg, 0, false);
+        nr++;
+    }
+    spin_unlock(&heap_lock);
+
+    perfc_add(page_mag_drain, nr);
+
+    return nr;
+}
+
+static unsigned int mag_drain(unsigned int cpu)
+{
+    struct page_magazine *mag = &per_cpu(page_mag, cpu);
+    struct page_info *pg;
+    PAGE_LIST_HEAD(list);
+
+    spin_lock(&mag->lock);
+    while ( (pg = page_list_remove_head(&mag->pages)) )
+        page_list_add_tail(pg, &list);
+    mag->count = 0;
+    spin_unlock(&mag->lock);
+
+    return mag_release(&list);
+}
+
+/* Return the contents of every magazine to the heap. */
+static unsigned long mag_drain_all(void)
+{
+    unsigned int cpu;
+    unsigned long nr = 0;
+
+    if ( !mag_enabled )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        nr += mag_drain(cpu);
+
+    return nr;
+}
+
+/* Whether draining cpu's magazine may help an allocation from node. */
+static bool mag_may_help(unsigned int cpu, nodeid_t node)
+{
+    const struct page_magazine *mag = &per_cpu(page_mag, cpu);
+
+    return ACCESS_ONCE(mag->count) &&
+           (node == NUMA_NO_NODE || mag->node == node);
+}
+
+/*
+ * A heap allocation of 2^order pages failed: return cached pages to the heap
+ * if that may let it succeed.  Magazines hold single pages, so only requests
+ * smaller than a refill stand to gain, which also keeps a failing refill from
+ * emptying the other magazines.  An exact node request only gains from that
+ * node's magazines.  This CPU's magazine is tried first, all of them only if
+ * the retry still fails.  Returns whether to retry, with *tries counting the
+ * attempts made.
+ */
+static bool mag_reclaim(unsigned int order, unsigned int memflags,
+                        unsigned int *tries)
+{
+    nodeid_t node = (memflags & MEMF_exact_node) ? MEMF_get_node(memflags)
+                                                 : NUMA_NO_NODE;
+    unsigned int cpu = smp_processor_id();
+    unsigned long nr = 0;
+
+    if ( !mag_enabled || order >= MAG_REFILL_ORDER )
+        return false;
+
+    if ( *tries == 0 )
+    {
+        ++*tries;
+        if ( mag_may_help(cpu, node) && mag_drain(cpu) )
+            return true;
+    }
+
+    if ( *tries == 1 )
+    {
+        ++*tries;
+        for_each_online_cpu ( cpu )
+            if ( mag_may_help(cpu, node) )
+                nr += mag_drain(cpu);
+    }
+
+    return nr;
+}
+
+/* Pages held in magazines, for reporting free memory.  Racy by nature. */
+static unsigned long mag_pages(void)
+{
+    unsigned int cpu;
+    unsigned long nr = 0;
+
+    if ( !mag_enabled )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        nr += ACCESS_ONCE(per_cpu(page_mag, cpu).count);
+
+    return nr;
+}
+
+static struct page_info *mag_alloc(unsigned int zone_lo, unsigned int zone_hi,
+                                   unsigned int memflags, struct domain *d)
+{
+    struct page_magazine *mag = &this_cpu(page_mag);
+    nodeid_t node = MEMF_get_node(memflags);
+    struct page_info *pg;
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+    unsigned int i, zone;
+
+    if ( !mag_enabled )
+        return NULL;
+
+    /*
+     * Claimed memory is considered unavailable unless the request is made by
+     * a domain with unclaimed pages.  Leave others to alloc_heap_pages()'s
+     * check under the heap lock.
+     */
+    if ( read_atomic(&outstanding_claims) &&
+         ((memflags & MEMF_no_refcount) || !d ||
+          !read_atomic(&d->outstanding_pages)) )
+        return NULL;
+
+    zone_lo = max(zone_lo, mag_zone_lo);
+    if ( zone_lo > zone_hi )
+        return NULL;
+
+    /* Only requests which may be satisfied from the local node. */
+    if ( node == NUMA_NO_NODE
+         ? d && !nodemask_test(mag->node, &d->node_affinity)
+         : node != mag->node )
+        return NULL;
+
+    for ( ; ; )
+    {
+        spin_lock(&mag->lock);
+        pg = page_list_first(&mag->pages);
+        if ( pg &&
+             (zone = page_to_zone(pg)) >= zone_lo && zone <= zone_hi )
+        {
+            page_list_del(pg, &mag->pages);
+            mag->count--;
+        }
+        else
+            pg = NULL;
+        spin_unlock(&mag->lock);
+
+        /* Raced with offline_page().  Let the heap deal with it. */
+        if ( pg && unlikely(pg->count_info != PGC_state_inuse) )
+        {
+            PAGE_LIST_HEAD(list);
+
+            page_list_add(pg, &list);
+            mag_release(&list);
+            continue;
+        }
+
+        break;
+    }
+
+    if ( !pg )
+    {
+        /*
+         * Refill with a chunk from the heap, which is scrubbed and flushed.
+         * No domain is passed so that claims are honoured for the pages being
+         * cached.
+         */
+        pg = alloc_heap_pages(zone_lo, zone_hi, MAG_REFILL_ORDER,
+                              MEMF_node(mag->node) | MEMF_exact_node, NULL);
+        if ( !pg )
+        {
+            perfc_incr(page_mag_miss);
+            return NULL;
+        }
+
+        perfc_incr(page_mag_refill);
+
+        spin_lock(&mag->lock);
+        for ( i = 1; i < MAG_BATCH; i++ )
+        {
+            pg[i].u.free.need_tlbflush = false;
+            page_list_add_tail(&pg[i], &mag->pages);
+        }
+        mag->count += MAG_BATCH - 1;
+        spin_unlock(&mag->lock);
+
+        if ( d )
+            d->last_alloc_node = mag->node;
+
+        return pg;
+    }
+
+    perfc_incr(page_mag_hit);
+
+    if ( !(memflags & MEMF_no_tlbflush) )
+        accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+
+    pg->u.inuse.type_info = PGT_TYPE_INFO_INITIALIZER;
+
+    if ( d )
+        d->last_alloc_node = mag->node;
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    flush_page_to_ram(mfn_x(page_to_mfn(pg)),
+                      !(memflags & MEMF_no_icache_flush));
+
+    return pg;
+}
+
+/* Try to free a single page not needing scrubbing into this CPU's magazine. */
+static bool mag_free(struct page_info *pg)
+{
+    struct page_magazine *mag = &this_cpu(page_mag);
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned long x = pg->count_info;
+    struct page_info *victim;
+    unsigned int i;
+    PAGE_LIST_HEAD(list);
+
+    if ( !mag_enabled || mfn_to_nid(mfn) != mag->node ||
+         page_to_zone(pg) < mag_zone_lo )
+        return false;
+
+    /* Offlining and broken pages are dealt with by the heap. */
+    if ( (x & PGC_state) != PGC_state_inuse ||
+         (x & (PGC_broken | PGC_static)) ||
+         cmpxchg(&pg->count_info, x, PGC_state_inuse) != x )
+        return false;
+
+    release_page_owner(pg, mfn);
+
+    spin_lock(&mag->lock);
+
+    /* Most recently freed pages are reused first, while still cache hot. */
+    page_list_add(pg, &mag->pages);
+
+    if ( ++mag->count > MAG_HIGH )
+    {
+        for ( i = 0; i < MAG_BATCH; i++ )
+        {
+            victim = page_list_last(&mag->pages);
+            page_list_del(victim, &mag->pages);
+            page_list_add_tail(victim, &list);
+        }
+        mag->count -= MAG_BATCH;
+    }
+
+    spin_unlock(&mag->lock);
+
+    perfc_incr(page_mag_free);
+
+    if ( !page_list_empty(&list) )
+        mag_release(&list);
+
+    return true;
+}
+
+static int cf_check mag_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_magazine *mag = &per_cpu(page_mag, cpu);
+    nodeid_t node;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        node = cpu_to_node(cpu);
+        spin_lock_init(&mag->lock);
+        INIT_PAGE_LIST_HEAD(&mag->pages);
+        mag->count = 0;
+        mag->node = node == NUMA_NO_NODE ? 0 : node;
+        break;
 
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        mag_drain(cpu);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block mag_cpu_nfb = {
+    .notifier_call = mag_cpu_callback,
+    .priority = 99
+};
+
+static int __init cf_check mag_presmp_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    mag_zone_lo = dma_bitsize ? bits_to_zone(dma_bitsize) + 1
+                              : MEMZONE_XEN + 1;
+
+    mag_cpu_callback(&mag_cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&mag_cpu_nfb);
+    mag_enabled = true;
+
+    return 0;
+}
+presmp_initcall(mag_presmp_init);
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    if ( order == 0 && !need_scrub && mag_free(pg) )
+        return;
+
+    spin_lock(&heap_lock);
+    _free_heap_pages(pg, order, need_scrub);
     spin_unlock(&heap_lock);
 }
 
@@ -1685,6 +2176,11 @@ int offline_page(mfn_t mfn, int broken, uint32_t *status)
         *status = PG_OFFLINE_XENPAGE | PG_OFFLINE_PENDING |
                   (DOMID_XEN << PG_OFFLINE_OWNER_SHIFT);
     }
+    else if ( mag_drain_all() && page_state_is(pg, offlined) )
+    {
+        /* The page was free, but held in a per-CPU magazine. */
+        *status = PG_OFFLINE_OFFLINED;
+    }
     else
     {
         /*
@@ -2586,6 +3082,12 @@ unsigned long avail_node_heap_pages(unsigned int nodeid)
     return avail_heap_pages(MEMZONE_XEN, NR_ZONES -1, nodeid);
 }
 
+/* Free pages on a node which are still waiting to be scrubbed. */
+unsigned long node_scrub_pages(unsigned int nodeid)
+{
+    return nodeid < MAX_NUMNODES ? read_atomic(&node_need_scrub[nodeid]) : 0;
+}
+
 
 static void cf_check pagealloc_info(unsigned char key)
 {
@@ -2612,6 +3114,17 @@ static void cf_check pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+
+    if ( mag_enabled )
+    {
+        unsigned int cpu;
+
+        total = 0;
+        for_each_online_cpu ( cpu )
+            total += per_cpu(page_mag, cpu).count;
+
+        printk("    Magazines: %lukB\n", total << (PAGE_SHIFT-10));
+    }
 }
 
 static __init int cf_check pagealloc_keyhandler_init(void)
@@ -10,11 +10,12 @@
 #include <xen/sched.h>
 #include <xen/errno.h>
 #include <xen/rangeset.h>
+#include <xen/rbtree.h>
 #include <xsm/xsm.h>
 
-/* An inclusive range [s,e] and pointer to next range in ascending order. */
+/* An inclusive range [s,e] and its node in the tree, ordered by s. */
 struct range {
-    struct list_head list;
+    struct rb_node node;
     unsigned long s, e;
 };
 
@@ -23,8 +24,8 @@ struct rangeset {
     struct list_head rangeset_list;
     struct domain   *domain;
 
-    /* Ordered list of ranges contained in this set, and protecting lock. */
-    struct list_head range_list;
+    /* Tree of ranges contained in this set, and protecting lock. */
+    struct rb_root   range_tree;
 
     /* Number of ranges that can be allocated */
     long             nr_ranges;
@@ -38,20 +39,27 @@ struct rangeset {
 };
 
 /*****************************
- * Private range functions hide the underlying linked-list implemnetation.
+ * Private range functions hide the underlying red-black tree implementation.
+ * Ranges never overlap, so ordering them by start also orders them by end.
  */
 
 /* Find highest range lower than or containing s. NULL if no such range. */
 static struct range *find_range(
     struct rangeset *r, unsigned long s)
 {
+    struct rb_node *n = r->range_tree.rb_node;
     struct range *x = NULL, *y;
 
-    list_for_each_entry ( y, &r->range_list, list )
+    while ( n != NULL )
     {
+        y = rb_entry(n, struct range, node);
         if ( y->s > s )
-            break;
-        x = y;
+            n = n->rb_left;
+        else
+        {
+            x = y;
+            n = n->rb_right;
+        }
     }
 
     return x;
@@ -61,34 +69,50 @@ static struct range *find_range(
 static struct range *first_range(
     struct rangeset *r)
 {
-    if ( list_empty(&r->range_list) )
-        return NULL;
-    return list_entry(r->range_list.next, struct range, list);
+    struct rb_node *n = rb_first(&r->range_tree);
+
+    return n ? rb_entry(n, struct range, node) : NULL;
 }
 
 /* Return range following x in ascending order, or NULL if x is the highest. */
 static struct range *next_range(
     struct rangeset *r, struct range *x)
 {
-    if ( x->list.next == &r->range_list )
-        return NULL;
-    return list_entry(x->list.next, struct range, list);
+    struct rb_node *n = rb_next(&x->node);
+
+    return n ? rb_entry(n, struct range, node) : NULL;
 }
 
 /* Insert range y after range x in r. Insert as first range if x is NULL. */
 static void insert_range(
     struct rangeset *r, struct range *x, struct range *y)
 {
-    list_add(&y->list, (x != NULL) ? &x->list : &r->range_list);
+    struct rb_node **link = &r->range_tree.rb_node, *parent = NULL;
+
+    /* The slot right after x is the leftmost one of its right subtree. */
+    if ( x != NULL )
+    {
+        parent = &x->node;
+        link = &parent->rb_right;
+    }
+
+    while ( *link != NULL )
+    {
+        parent = *link;
+        link = &parent->rb_left;
+    }
+
+    rb_link_node(&y->node, parent, link);
+    rb_insert_color(&y->node, &r->range_tree);
 }
 
-/* Remove a range from its list and free it. */
+/* Remove a range from its tree and free it. */
 static void destroy_range(
     struct rangeset *r, struct range *x)
 {
     r->nr_ranges++;
 
-    list_del(&x->list);
+    rb_erase(&x->node, &r->range_tree);
     xfree(x);
 }
 
@@ -227,7 +251,9 @@ int rangeset_remove_range(
 
         if ( x->s < s )
         {
-            x->e = s - 1;
+            /* x may end below s, in which case it is left alone. */
+            if ( x->e >= s )
+                x->e = s - 1;
             x = next_range(r, x);
         }
 
@@ -238,8 +264,10 @@ int rangeset_remove_range(
             destroy_range(r, t);
         }
 
-        x->s = e + 1;
-        if ( x->s > x->e )
+        /* Not x->s = e + 1 first: that wraps for e == ~0UL. */
+        if ( x->e > e )
+            x->s = e + 1;
+        else
             destroy_range(r, x);
     }
 
@@ -295,7 +323,8 @@ int rangeset_report_ranges(
 
     read_lock(&r->lock);
 
-    for ( x = first_range(r); x && (x->s <= e) && !rc; x = next_range(r, x) )
+    x = find_range(r, s) ?: first_range(r);
+    for ( ; x && (x->s <= e) && !rc; x = next_range(r, x) )
         if ( x->e >= s )
             rc = cb(max(x->s, s), min(x->e, e), ctxt);
 
@@ -325,7 +354,8 @@ int rangeset_claim_range(struct rangeset *r, unsigned long size,
         start = next->e + 1;
     }
 
-    if ( (~0UL - start) + 1 >= size )
+    /* Not (~0UL - start) + 1 >= size: that wraps when the set is empty. */
+    if ( ~0UL - start >= size - 1 )
         goto insert;
 
  out:
@@ -335,20 +365,27 @@ int rangeset_claim_range(struct rangeset *r, unsigned long size,
  insert:
     if ( unlikely(!prev) )
     {
-        next = alloc_range(r);
-        if ( !next )
+        prev = alloc_range(r);
+        if ( !prev )
         {
             write_unlock(&r->lock);
             return -ENOMEM;
         }
 
-        next->s = start;
-        next->e = start + size - 1;
-        insert_range(r, prev, next);
+        prev->s = start;
+        prev->e = start + size - 1;
+        insert_range(r, NULL, prev);
     }
     else
         prev->e += size;
 
+    /* Merge with the following range if the gap got filled entirely. */
+    if ( next && (prev->e + 1) == next->s )
+    {
+        prev->e = next->e;
+        destroy_range(r, next);
+    }
+
     write_unlock(&r->lock);
 
     *s = start;
@@ -417,7 +454,7 @@ bool_t rangeset_contains_singleton(
 bool_t rangeset_is_empty(
     const struct rangeset *r)
 {
-    return ((r == NULL) || list_empty(&r->range_list));
+    return ((r == NULL) || RB_EMPTY_ROOT(&r->range_tree));
 }
 
 struct rangeset *rangeset_new(
@@ -430,7 +467,7 @@ struct rangeset *rangeset_new(
         return NULL;
 
     rwlock_init(&r->lock);
-    INIT_LIST_HEAD(&r->range_list);
+    r->range_tree = RB_ROOT;
     r->nr_ranges = -1;
 
     BUG_ON(flags & ~RANGESETF_prettyprint_hex);
@@ -504,8 +541,6 @@ void rangeset_domain_destroy(
 
 void rangeset_swap(struct rangeset *a, struct rangeset *b)
 {
-    LIST_HEAD(tmp);
-
     if ( a < b )
     {
         write_lock(&a->lock);
@@ -517,9 +552,8 @@ void rangeset_swap(struct rangeset *a, struct rangeset *b)
         write_lock(&a->lock);
     }
 
-    list_splice_init(&a->range_list, &tmp);
-    list_splice_init(&b->range_list, &a->range_list);
-    list_splice(&tmp, &b->range_list);
+    /* Nodes don't point back at the root, so the trees can move as a whole. */
+    SWAP(a->range_tree, b->range_tree);
 
     write_unlock(&a->lock);
     write_unlock(&b->lock);
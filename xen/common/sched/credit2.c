@@ -19,6 +19,7 @@
 #include <xen/event.h>
 #include <xen/time.h>
 #include <xen/perfc.h>
+#include <xen/rbtree.h>
 #include <xen/softirq.h>
 #include <asm/div64.h>
 #include <xen/errno.h>
@@ -496,7 +497,8 @@ struct csched2_runqueue_data {
     spinlock_t lock;           /* Lock for this runqueue                     */
 
     struct list_head rql;      /* List of runqueues                          */
-    struct list_head runq;     /* Ordered list of runnable vms               */
+    struct rb_root runq;       /* Runnable units, ordered by credit          */
+    struct rb_node *runq_first;/* Leftmost (highest credit) unit in runq     */
     unsigned int refcnt;       /* How many CPUs reference this runqueue      */
                                /* (including not yet active ones)            */
     unsigned int nr_cpus;      /* How many CPUs are sharing this runqueue    */
@@ -565,7 +567,7 @@ struct csched2_unit {
     s_time_t load_last_update;         /* Last time average was updated       */
     s_time_t avgload;                  /* Decaying queue load                 */
 
-    struct list_head runq_elem;        /* On the runqueue (rqd->runq)         */
+    struct rb_node runq_elem;          /* On the runqueue (rqd->runq)         */
     struct list_head parked_elem;      /* On the parked_units list            */
     struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
     struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
@@ -832,14 +834,30 @@ static s_time_t c2t(const struct csched2_runqueue_data *rqd, s_time_t credit,
 
 static inline int unit_on_runq(const struct csched2_unit *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
-static inline struct csched2_unit * runq_elem(struct list_head *elem)
+static inline struct csched2_unit * runq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct csched2_unit, runq_elem);
+    return rb_entry(elem, struct csched2_unit, runq_elem);
 }
 
+/* The unit with the most credit on the runqueue, or NULL if empty. */
+static inline struct csched2_unit *runq_first(
+    const struct csched2_runqueue_data *rqd)
+{
+    return rqd->runq_first ? runq_elem(rqd->runq_first) : NULL;
+}
+
+/*
+ * Walk the runqueue in order of credit.  As with list_for_each_safe(), the
+ * unit at 'iter' may be taken off the runqueue during the walk.
+ */
+#define runq_for_each_safe(iter, next, rqd)                 \
+    for ( (iter) = (rqd)->runq_first;                       \
+          (iter) && ((next) = rb_next(iter), true);         \
+          (iter) = (next) )
+
 static inline bool same_node(unsigned int cpua, unsigned int cpub)
 {
     return cpu_to_node(cpua) == cpu_to_node(cpub);
@@ -1431,33 +1449,47 @@ update_load(const struct scheduler *ops,
         update_svc_load(ops, svc, change, now);
 }
 
+/*
+ * The runqueue is a red-black tree ordered by decreasing credit, with units of
+ * equal credit in order of insertion.  Credits of queued units only change
+ * all together (in reset_credit()), and in a monotonic way, so the ordering is
+ * preserved without having to re-sort.
+ */
 static void runq_insert(struct csched2_unit *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = sched_unit_master(svc->unit);
-    struct list_head *runq = &c2rqd(cpu)->runq;
-    int pos = 0;
+    struct csched2_runqueue_data *rqd = c2rqd(cpu);
+    struct rb_node **link = &rqd->runq.rb_node, *parent = NULL;
+    bool leftmost = true;
 
     ASSERT(spin_is_locked(get_sched_res(cpu)->schedule_lock));
 
     ASSERT(!unit_on_runq(svc));
     ASSERT(c2r(cpu) == c2r(sched_unit_master(svc->unit)));
 
-    ASSERT(&svc->rqd->runq == runq);
+    ASSERT(svc->rqd == rqd);
     ASSERT(!is_idle_unit(svc->unit));
     ASSERT(!svc->unit->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    while ( *link )
     {
-        struct csched2_unit * iter_svc = runq_elem(iter);
-
-        if ( svc->credit > iter_svc->credit )
-            break;
+        parent = *link;
 
-        pos++;
+        if ( svc->credit > runq_elem(parent)->credit )
+            link = &parent->rb_left;
+        else
+        {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
     }
-    list_add_tail(&svc->runq_elem, iter);
+
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, &rqd->runq);
+
+    if ( leftmost )
+        rqd->runq_first = &svc->runq_elem;
 
     if ( unlikely(tb_init_done) )
     {
@@ -1465,9 +1497,13 @@ static void runq_insert(struct csched2_unit *svc)
             unsigned unit:16, dom:16;
             unsigned pos;
         } d;
+        const struct rb_node *iter = &svc->runq_elem;
+
         d.dom = svc->unit->domain->domain_id;
         d.unit = svc->unit->unit_id;
-        d.pos = pos;
+        /* Only worth counting the position when it is being traced. */
+        for ( d.pos = 0; (iter = rb_prev(iter)) != NULL; d.pos++ )
+            ;
         __trace_var(TRC_CSCHED2_RUNQ_POS, 1,
                     sizeof(d),
                     (unsigned char *)&d);
@@ -1476,8 +1512,15 @@ static void runq_insert(struct csched2_unit *svc)
 
 static inline void runq_remove(struct csched2_unit *svc)
 {
+    struct csched2_runqueue_data *rqd = svc->rqd;
+
     ASSERT(unit_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+
+    if ( rqd->runq_first == &svc->runq_elem )
+        rqd->runq_first = rb_next(&svc->runq_elem);
+
+    rb_erase(&svc->runq_elem, &rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_unit *svc,
@@ -2188,7 +2231,7 @@ csched2_alloc_udata(const struct scheduler *ops, struct sched_unit *unit,
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->unit = unit;
@@ -3222,7 +3265,7 @@ csched2_unit_insert(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     /* csched2_res_pick() expects the pcpu lock to be held */
     lock = unit_schedule_lock_irq(unit);
@@ -3260,7 +3303,7 @@ csched2_unit_remove(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     SCHED_STAT_CRANK(unit_remove);
 
@@ -3282,7 +3325,7 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(cpu);
-    struct list_head *runq = &rqd->runq;
+    const struct csched2_unit *swait = runq_first(rqd);
     const struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -3320,16 +3363,8 @@ csched2_runtime(const struct scheduler *ops, int cpu,
      * 2) If there's someone waiting whose credit is positive,
      *    run until your credit ~= his.
      */
-    if ( ! list_empty(runq) )
-    {
-        struct csched2_unit *swait = runq_elem(runq->next);
-
-        if ( ! is_idle_unit(swait->unit)
-             && swait->credit > 0 )
-        {
-            rt_credit = snext->credit - swait->credit;
-        }
-    }
+    if ( swait && !is_idle_unit(swait->unit) && swait->credit > 0 )
+        rt_credit = snext->credit - swait->credit;
 
     /*
      * The next guy on the runqueue may actually have a higher credit,
@@ -3378,7 +3413,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                struct csched2_unit *scurr,
                int cpu, s_time_t now)
 {
-    struct list_head *iter, *temp;
+    struct rb_node *iter, *next;
     const struct sched_resource *sr = get_sched_res(cpu);
     struct csched2_unit *snext = NULL;
     struct csched2_private *prv = csched2_priv(sr->scheduler);
@@ -3461,9 +3496,9 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         snext = csched2_unit(sched_idle_unit(cpu));
 
  check_runq:
-    list_for_each_safe( iter, temp, &rqd->runq )
+    runq_for_each_safe( iter, next, rqd )
     {
-        struct csched2_unit * svc = list_entry(iter, struct csched2_unit, runq_elem);
+        struct csched2_unit *svc = runq_elem(iter);
 
         if ( unlikely(tb_init_done) )
         {
@@ -3705,10 +3740,10 @@ static void cf_check csched2_schedule(
          * returned the first unit in the runqueue, for various reasons
          * (e.g., affinity). Only trigger a reset when it does.
          */
-        if ( list_empty(&rqd->runq) )
+        if ( !rqd->runq_first )
             top_credit = snext->credit;
         else
-            top_credit = max(snext->credit, runq_elem(rqd->runq.next)->credit);
+            top_credit = max(snext->credit, runq_first(rqd)->credit);
         if ( top_credit <= CSCHED2_CREDIT_RESET )
         {
             reset_credit(sched_cpu, now, snext);
@@ -3884,7 +3919,7 @@ csched2_dump(const struct scheduler *ops)
 
     list_for_each_entry ( rqd, &prv->rql, rql )
     {
-        struct list_head *iter, *runq = &rqd->runq;
+        struct rb_node *iter;
 
         loop = 0;
         /* We need the lock to scan the runqueue. */
@@ -3896,7 +3931,7 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( iter = rqd->runq_first; iter; iter = rb_next(iter) )
         {
             const struct csched2_unit *svc = runq_elem(iter);
 
@@ -3956,7 +3991,8 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
         BUG_ON(!cpumask_empty(&rqd->active));
         rqd->max_weight = 1;
         INIT_LIST_HEAD(&rqd->svc);
-        INIT_LIST_HEAD(&rqd->runq);
+        rqd->runq = RB_ROOT;
+        rqd->runq_first = NULL;
         spin_lock_init(&rqd->lock);
         prv->active_queues++;
     }
@@ -318,9 +318,11 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
                     {
                         meminfo.memsize = node_spanned_pages(i) << PAGE_SHIFT;
                         meminfo.memfree = avail_node_heap_pages(i) << PAGE_SHIFT;
+                        meminfo.memdirty = node_scrub_pages(i) << PAGE_SHIFT;
                     }
                     else
-                        meminfo.memsize = meminfo.memfree = XEN_INVALID_MEM_SZ;
+                        meminfo.memsize = meminfo.memfree = meminfo.memdirty =
+                            XEN_INVALID_MEM_SZ;
 
                     if ( copy_to_guest_offset(ni->meminfo, i, &meminfo, 1) )
                     {
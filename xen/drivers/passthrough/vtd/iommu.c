@@ -690,6 +690,27 @@ static int __must_check iommu_flush_iotlb_psi(struct vtd_iommu *iommu, u16 did,
     return status;
 }
 
+static int __must_check iommu_flush_iotlb_range(struct vtd_iommu *iommu,
+                                                u16 did, dfn_t dfn,
+                                                unsigned long page_count,
+                                                bool flush_non_present_entry,
+                                                bool flush_dev_iotlb)
+{
+    int status;
+
+    /* apply platform specific errata workarounds */
+    vtd_ops_preamble_quirk(iommu);
+
+    status = iommu->flush.iotlb_range(iommu, did, dfn_to_daddr(dfn),
+                                      page_count, flush_non_present_entry,
+                                      flush_dev_iotlb);
+
+    /* undo platform specific errata workarounds */
+    vtd_ops_postamble_quirk(iommu);
+
+    return status;
+}
+
 static int __must_check iommu_flush_all(void)
 {
     struct acpi_drhd_unit *drhd;
@@ -769,8 +790,14 @@ static int __must_check cf_check iommu_flush_iotlb(struct domain *d, dfn_t dfn,
         if ( iommu_domid == -1 )
             continue;
 
-        if ( !page_count || (page_count & (page_count - 1)) ||
-             dfn_eq(dfn, INVALID_DFN) || !IS_ALIGNED(dfn_x(dfn), page_count) )
+        if ( page_count && !dfn_eq(dfn, INVALID_DFN) &&
+             iommu->flush.iotlb_range )
+            rc = iommu_flush_iotlb_range(iommu, iommu_domid, dfn, page_count,
+                                         !(flush_flags & IOMMU_FLUSHF_modified),
+                                         flush_dev_iotlb);
+        else if ( !page_count || (page_count & (page_count - 1)) ||
+                  dfn_eq(dfn, INVALID_DFN) ||
+                  !IS_ALIGNED(dfn_x(dfn), page_count) )
             rc = iommu_flush_iotlb_dsi(iommu, iommu_domid,
                                        0, flush_dev_iotlb);
         else
@@ -488,6 +488,7 @@ struct vtd_iommu {
     struct acpi_drhd_unit *drhd;
 
     uint64_t qinval_maddr;   /* queue invalidation page machine address */
+    unsigned int qinval_pending; /* descriptors queued since the last wait */
 
     struct {
         uint64_t maddr;   /* interrupt remap table machine address */
@@ -503,6 +504,11 @@ struct vtd_iommu {
                                   unsigned int size_order, u64 type,
                                   bool flush_non_present_entry,
                                   bool flush_dev_iotlb);
+        /* Optional, for invalidating arbitrary page ranges at once. */
+        int __must_check (*iotlb_range)(struct vtd_iommu *iommu, u16 did,
+                                        u64 addr, unsigned long nr,
+                                        bool flush_non_present_entry,
+                                        bool flush_dev_iotlb);
     } flush;
 
     struct list_head ats_devices;
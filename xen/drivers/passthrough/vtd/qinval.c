@@ -32,6 +32,12 @@
 /* Each entry is 16 bytes, and there can be up to 2^7 pages. */
 #define QINVAL_MAX_ENTRY_NR (1u << (7 + PAGE_SHIFT_4K - 4))
 
+/*
+ * Upper bound on the IOTLB invalidation descriptors flush_iotlb_range_qi()
+ * queues ahead of a single wait descriptor.
+ */
+#define QINVAL_IOTLB_BATCH 6
+
 /* Status data flag */
 #define QINVAL_STAT_INIT  0
 #define QINVAL_STAT_DONE  1
@@ -74,6 +80,7 @@ static void qinval_update_qtail(struct vtd_iommu *iommu, unsigned int index)
     ASSERT( spin_is_locked(&iommu->register_lock) );
     val = (index + 1) & (qi_entry_nr - 1);
     dmar_writel(iommu->reg, DMAR_IQT_REG, val * sizeof(struct qinval_entry));
+    iommu->qinval_pending++;
 }
 
 static struct qinval_entry *qi_map_entry(const struct vtd_iommu *iommu,
@@ -116,10 +123,9 @@ static int __must_check queue_invalidate_context_sync(struct vtd_iommu *iommu,
     return invalidate_sync(iommu);
 }
 
-static int __must_check queue_invalidate_iotlb_sync(struct vtd_iommu *iommu,
-                                                    u8 granu, u8 dr, u8 dw,
-                                                    u16 did, u8 am, u8 ih,
-                                                    u64 addr)
+static void queue_invalidate_iotlb(struct vtd_iommu *iommu,
+                                   u8 granu, u8 dr, u8 dw,
+                                   u16 did, u8 am, u8 ih, u64 addr)
 {
     unsigned long flags;
     unsigned int index;
@@ -146,6 +152,14 @@ static int __must_check queue_invalidate_iotlb_sync(struct vtd_iommu *iommu,
     spin_unlock_irqrestore(&iommu->register_lock, flags);
 
     unmap_vtd_domain_page(qinval_entry);
+}
+
+static int __must_check queue_invalidate_iotlb_sync(struct vtd_iommu *iommu,
+                                                    u8 granu, u8 dr, u8 dw,
+                                                    u16 did, u8 am, u8 ih,
+                                                    u64 addr)
+{
+    queue_invalidate_iotlb(iommu, granu, dr, dw, did, am, ih, addr);
 
     return invalidate_sync(iommu);
 }
@@ -174,6 +188,13 @@ static int __must_check queue_invalidate_wait(struct vtd_iommu *iommu,
     qinval_entry->q.inv_wait_dsc.hi.saddr = virt_to_maddr(this_poll_slot);
 
     qinval_update_qtail(iommu, index);
+
+    /* Account the descriptors (from any CPU) this wait completes. */
+    perfc_incr(iommu_qi_waits);
+    perfc_add(iommu_qi_descs, iommu->qinval_pending - 1);
+    perfc_incra(iommu_qi_batch, min(iommu->qinval_pending - 1, 7u));
+    iommu->qinval_pending = 0;
+
     spin_unlock_irqrestore(&iommu->register_lock, flags);
 
     unmap_vtd_domain_page(qinval_entry);
@@ -389,6 +410,72 @@ static int __must_check cf_check flush_iotlb_qi(
     return ret;
 }
 
+/*
+ * Invalidate nr 4k pages from addr, using one page selective invalidation
+ * per naturally aligned power of two block and a single wait descriptor for
+ * all of them.  Ranges needing more than QINVAL_IOTLB_BATCH blocks get a
+ * domain selective invalidation instead.
+ */
+static int __must_check cf_check flush_iotlb_range_qi(
+    struct vtd_iommu *iommu, u16 did, u64 addr, unsigned long nr,
+    bool flush_non_present_entry, bool flush_dev_iotlb)
+{
+    unsigned long start = addr >> PAGE_SHIFT_4K, end = start + nr, pfn;
+    unsigned int order[QINVAL_IOTLB_BATCH], n = 0, i;
+    u8 dr = cap_read_drain(iommu->cap), dw = cap_write_drain(iommu->cap);
+    int ret, rc;
+
+    ASSERT(iommu->qinval_maddr);
+    ASSERT(nr);
+
+    /*
+     * In the non-present entry flush case, if hardware doesn't cache
+     * non-present entries we do nothing.
+     */
+    if ( flush_non_present_entry && !cap_caching_mode(iommu->cap) )
+        return 1;
+
+    for ( pfn = start; cap_pgsel_inv(iommu->cap) && pfn < end;
+          pfn += 1UL << order[n++] )
+    {
+        unsigned int o = cap_max_amask_val(iommu->cap);
+
+        if ( n == ARRAY_SIZE(order) )
+        {
+            n = 0;
+            break;
+        }
+
+        while ( (pfn & ((1UL << o) - 1)) || pfn + (1UL << o) > end )
+            --o;
+        order[n] = o;
+    }
+
+    if ( !n )
+        queue_invalidate_iotlb(iommu,
+                               DMA_TLB_DSI_FLUSH >> DMA_TLB_FLUSH_GRANU_OFFSET,
+                               dr, dw, did, 0, 0, 0);
+    for ( i = 0, pfn = start; i < n; pfn += 1UL << order[i++] )
+        queue_invalidate_iotlb(iommu,
+                               DMA_TLB_PSI_FLUSH >> DMA_TLB_FLUSH_GRANU_OFFSET,
+                               dr, dw, did, order[i], 0,
+                               (u64)pfn << PAGE_SHIFT_4K);
+
+    ret = invalidate_sync(iommu);
+
+    if ( flush_dev_iotlb )
+    {
+        rc = n == 1 ? dev_invalidate_iotlb(iommu, did, addr, order[0],
+                                           DMA_TLB_PSI_FLUSH)
+                    : dev_invalidate_iotlb(iommu, did, 0, 0,
+                                           DMA_TLB_DSI_FLUSH);
+        if ( !ret )
+            ret = rc;
+    }
+
+    return ret;
+}
+
 int enable_qinval(struct vtd_iommu *iommu)
 {
     u32 sts;
@@ -407,15 +494,18 @@ int enable_qinval(struct vtd_iommu *iommu)
         if ( !qi_entry_nr )
         {
             /*
-             * With the present synchronous model, we need two slots for every
-             * operation (the operation itself and a wait descriptor).  There
-             * can be one such pair of requests pending per CPU.  One extra
-             * entry is needed as the ring is considered full when there's
-             * only one entry left.
+             * With the present synchronous model, we need up to
+             * QINVAL_IOTLB_BATCH + 1 slots for every operation (the
+             * operation's descriptors and a wait descriptor).  There can be
+             * one such group of requests pending per CPU.  One extra entry is
+             * needed as the ring is considered full when there's only one
+             * entry left.
              */
-            BUILD_BUG_ON(CONFIG_NR_CPUS * 2 >= QINVAL_MAX_ENTRY_NR);
-            qi_pg_order = get_order_from_bytes((num_present_cpus() * 2 + 1) *
-                                               sizeof(struct qinval_entry));
+            BUILD_BUG_ON(CONFIG_NR_CPUS * (QINVAL_IOTLB_BATCH + 1) >=
+                         QINVAL_MAX_ENTRY_NR);
+            qi_pg_order = get_order_from_bytes(
+                (num_present_cpus() * (QINVAL_IOTLB_BATCH + 1) + 1) *
+                sizeof(struct qinval_entry));
             qi_entry_nr = (PAGE_SIZE << qi_pg_order) /
                           sizeof(struct qinval_entry);
 
@@ -437,6 +527,7 @@ int enable_qinval(struct vtd_iommu *iommu)
 
     iommu->flush.context = flush_context_qi;
     iommu->flush.iotlb   = flush_iotlb_qi;
+    iommu->flush.iotlb_range = flush_iotlb_range_qi;
 
     spin_lock_irqsave(&iommu->register_lock, flags);
 
@@ -503,6 +594,8 @@ void disable_qinval(struct vtd_iommu *iommu)
 out:
     spin_unlock_irqrestore(&iommu->register_lock, flags);
 
+    iommu->flush.iotlb_range = NULL;
+
     /*
      * Assign callbacks to noop to catch errors if register-based invalidation
      * isn't supported.
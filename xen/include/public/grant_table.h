@@ -433,12 +433,22 @@ DEFINE_XEN_GUEST_HANDLE(gnttab_transfer_t);
  * source_offset specifies an offset in the source frame, dest_offset
  * the offset in the target frame and  len specifies the number of
  * bytes to be copied.
+ *
+ * Without GNTCOPY_multi_frame, the copy must not cross the end of either
+ * frame.  With it, either side of the copy may extend into the following
+ * frames, continuing at offset 0 of the next grant reference (ref + 1) or of
+ * the next frame (gmfn + 1) whenever the end of a frame is reached.  Each of
+ * these must be granted, or accessible, in full.  If an error is encountered
+ * part way, the data preceding the failing frame may already have been
+ * copied.  Older hypervisors fail such copies with GNTST_bad_copy_arg.
  */
 
 #define _GNTCOPY_source_gref      (0)
 #define GNTCOPY_source_gref       (1<<_GNTCOPY_source_gref)
 #define _GNTCOPY_dest_gref        (1)
 #define GNTCOPY_dest_gref         (1<<_GNTCOPY_dest_gref)
+#define _GNTCOPY_multi_frame      (2)
+#define GNTCOPY_multi_frame       (1<<_GNTCOPY_multi_frame)
 
 struct gnttab_copy {
     /* IN parameters. */
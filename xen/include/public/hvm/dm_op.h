@@ -44,13 +44,31 @@ typedef uint16_t ioservid_t;
  * hvm_op.h. If the value is HVM_IOREQSRV_BUFIOREQ_OFF then  the buffered
  * ioreq ring will not be allocated and hence all emulation requests to
  * this server will be synchronous.
+ *
+ * If <flags> contains XEN_DMOP_bufioreq_ext then the buffered ioreq ring
+ * is a struct buffered_iopage_ext (see ioreq.h) of 2^<bufioreq_order>
+ * pages, rather than a struct buffered_iopage, and Xen only notifies the
+ * emulator of new buffered requests when it has asked for it. Rings of
+ * more than one page can only be mapped using XENMEM_acquire_resource.
+ * <bufioreq_order> must be zero unless XEN_DMOP_bufioreq_ext is set.
  */
 #define XEN_DMOP_create_ioreq_server 1
 
 struct xen_dm_op_create_ioreq_server {
     /* IN - should server handle buffered ioreqs */
     uint8_t handle_bufioreq;
-    uint8_t pad[3];
+    /* IN - flags */
+    uint8_t flags;
+
+#define _XEN_DMOP_bufioreq_ext 0
+#define XEN_DMOP_bufioreq_ext (1u << _XEN_DMOP_bufioreq_ext)
+
+    /* IN - size of an extended buffered ioreq ring, as a page order */
+    uint8_t bufioreq_order;
+
+#define XEN_DMOP_BUFIOREQ_MAX_ORDER 4
+
+    uint8_t pad;
     /* OUT - server id */
     ioservid_t id;
 };
@@ -444,6 +462,46 @@ struct xen_dm_op_nr_vcpus {
 };
 typedef struct xen_dm_op_nr_vcpus xen_dm_op_nr_vcpus_t;
 
+/*
+ * XEN_DMOP_get_ioreq_server_stats: Get the buffered ioreq ring statistics
+ *                                  of IOREQ Server <id>.
+ *
+ * <slots> is the size of the ring, <used> the number of slots holding
+ * requests not yet consumed by the emulator, and <max_used> the highest
+ * such number seen by Xen after queuing a request. <requests> counts the
+ * buffered requests queued (a 64-bit write uses two slots but counts
+ * once), <notifications> the events sent to the emulator for them and
+ * <suppressed> the events not sent because the emulator had not asked for
+ * one (see XEN_DMOP_bufioreq_ext). <full> counts the requests which were
+ * sent synchronously because the ring had no room for them.
+ * If <flags> contains XEN_DMOP_stats_reset then <max_used> and the
+ * counters are reset once they have been read.
+ * All values are zero if the IOREQ Server is not handling buffered
+ * emulation requests.
+ */
+#define XEN_DMOP_get_ioreq_server_stats 21
+
+struct xen_dm_op_get_ioreq_server_stats {
+    /* IN - server id */
+    ioservid_t id;
+    /* IN - flags */
+    uint16_t flags;
+
+#define _XEN_DMOP_stats_reset 0
+#define XEN_DMOP_stats_reset (1u << _XEN_DMOP_stats_reset)
+
+    /* OUT - ring size and occupancy, in slots */
+    uint32_t slots;
+    uint32_t used;
+    uint32_t max_used;
+    /* OUT - counters */
+    uint64_aligned_t requests;
+    uint64_aligned_t notifications;
+    uint64_aligned_t suppressed;
+    uint64_aligned_t full;
+};
+typedef struct xen_dm_op_get_ioreq_server_stats xen_dm_op_get_ioreq_server_stats_t;
+
 struct xen_dm_op {
     uint32_t op;
     uint32_t pad;
@@ -468,6 +526,7 @@ struct xen_dm_op {
         xen_dm_op_relocate_memory_t relocate_memory;
         xen_dm_op_pin_memory_cacheattr_t pin_memory_cacheattr;
         xen_dm_op_nr_vcpus_t nr_vcpus;
+        xen_dm_op_get_ioreq_server_stats_t get_ioreq_server_stats;
     } u;
 };
 
@@ -81,6 +81,32 @@ struct buffered_iopage {
 }; /* NB. Size of this structure must be no greater than one page. */
 typedef struct buffered_iopage buffered_iopage_t;
 
+/*
+ * Buffered ioreq ring of an IOREQ Server created with XEN_DMOP_bufioreq_ext
+ * (see dm_op.h): 2^order pages holding this 64-byte header, immediately
+ * followed by IOREQ_BUFFER_EXT_SLOT_NUM(order) buf_ioreq_t slots.
+ *
+ * Xen only sends an event for new requests when it finds <notify> set,
+ * clearing it as it does so, which lets a busy emulator drain the ring
+ * without an event for each request. The emulator sets <notify> to 1
+ * whenever it is about to wait for the event (including the first time)
+ * and must then, after a full memory barrier, check <write_pointer> again
+ * before waiting: requests queued before Xen saw <notify> set are found by
+ * that check, and an event is sent for any queued after.
+ */
+#define IOREQ_BUFFER_EXT_SLOT_NUM(order) (((4096u << (order)) - 64) / 8)
+struct buffered_iopage_ext {
+#ifdef __XEN__
+    union bufioreq_pointers ptrs;
+#else
+    uint32_t read_pointer;
+    uint32_t write_pointer;
+#endif
+    uint32_t notify;
+    uint32_t pad[13];
+};
+typedef struct buffered_iopage_ext buffered_iopage_ext_t;
+
 /*
  * ACPI Control/Event register locations. Location is controlled by a
  * version number in HVM_PARAM_ACPI_IOPORTS_LOCATION.
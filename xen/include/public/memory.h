@@ -664,6 +664,12 @@ struct xen_mem_acquire_resource {
 
 #define XENMEM_resource_ioreq_server_frame_bufioreq 0
 #define XENMEM_resource_ioreq_server_frame_ioreq(n) (1 + (n))
+/*
+ * Page n of an extended buffered ioreq ring (see XEN_DMOP_bufioreq_ext).
+ * Page 0 is also frame XENMEM_resource_ioreq_server_frame_bufioreq. These
+ * frames are not counted in the size of the resource.
+ */
+#define XENMEM_resource_ioreq_server_frame_bufioreq_ext(n) (0x1000000 + (n))
 
     /*
      * IN/OUT - If the tools domain is PV then, upon return, frame_list
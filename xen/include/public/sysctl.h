@@ -18,7 +18,7 @@
 #include "domctl.h"
 #include "physdev.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x00000015
+#define XEN_SYSCTL_INTERFACE_VERSION 0x00000016
 
 /*
  * Read console content from Xen buffer ring.
@@ -632,6 +632,7 @@ struct xen_sysctl_cputopoinfo {
 struct xen_sysctl_meminfo {
     uint64_t memsize;
     uint64_t memfree;
+    uint64_t memdirty;          /* Part of memfree still to be scrubbed. */
 };
 typedef struct xen_sysctl_meminfo xen_sysctl_meminfo_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_meminfo_t);
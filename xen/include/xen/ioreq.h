@@ -36,7 +36,6 @@ struct ioreq_vcpu {
     bool             pending;
 };
 
-#define NR_IO_RANGE_TYPES (XEN_DMOP_IO_RANGE_PCI + 1)
 #define MAX_NR_IO_RANGES  256
 
 struct ioreq_server {
@@ -55,6 +54,15 @@ struct ioreq_server {
     struct rangeset        *range[NR_IO_RANGE_TYPES];
     bool                   enabled;
     uint8_t                bufioreq_handling;
+    /* Extended buffered ioreq ring (XEN_DMOP_bufioreq_ext)? */
+    bool                   bufioreq_ext;
+    uint8_t                bufioreq_order;
+
+    /* Buffered ioreq ring statistics, protected by bufioreq_lock */
+    struct {
+        unsigned int       max_used;
+        uint64_t           requests, notifications, suppressed, full;
+    } bufioreq_stats;
 };
 
 static inline paddr_t ioreq_mmio_first_byte(const ioreq_t *p)
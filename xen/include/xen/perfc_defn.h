@@ -83,4 +83,17 @@ PERFCOUNTER(tickled_cpu_overridden, "csched2: tickled_cpu_overridden")
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+PERFCOUNTER(gnttab_map_batches,     "grant: map batches")
+PERFCOUNTER(gnttab_map_runs,        "grant: map runs per granting domain")
+PERFCOUNTER(gnttab_map_ops,         "grant: map operations")
+PERFCOUNTER(gnttab_map_locks,       "grant: map remote grant lock acquisitions")
+PERFCOUNTER(gnttab_unmap_batches,   "grant: unmap batches (TLB flushes)")
+PERFCOUNTER(gnttab_unmap_ops,       "grant: unmap operations")
+
+PERFCOUNTER(page_mag_hit,           "page_alloc: magazine hits")
+PERFCOUNTER(page_mag_refill,        "page_alloc: magazine refills")
+PERFCOUNTER(page_mag_miss,          "page_alloc: magazine misses")
+PERFCOUNTER(page_mag_free,          "page_alloc: magazine frees")
+PERFCOUNTER(page_mag_drain,         "page_alloc: magazine pages drained")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
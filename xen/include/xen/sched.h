@@ -14,6 +14,7 @@
 #include <xen/cpumask.h>
 #include <xen/nodemask.h>
 #include <xen/radix-tree.h>
+#include <xen/rbtree.h>
 #include <xen/multicall.h>
 #include <xen/nospec.h>
 #include <xen/tasklet.h>
@@ -29,6 +30,7 @@
 #include <public/sysctl.h>
 #include <public/vcpu.h>
 #include <public/event_channel.h>
+#include <public/hvm/dm_op.h>
 
 #ifdef CONFIG_COMPAT
 #include <compat/vcpu.h>
@@ -364,6 +366,7 @@ struct sched_unit {
 struct evtchn_port_ops;
 
 #define MAX_NR_IOREQ_SERVERS 8
+#define NR_IO_RANGE_TYPES (XEN_DMOP_IO_RANGE_PCI + 1)
 
 struct domain
 {
@@ -543,6 +546,14 @@ struct domain
      */
     spinlock_t hypercall_deadlock_mutex;
 
+    /*
+     * Serialises domctls targeting this domain.  domctl_issuers counts
+     * domctls issued by this domain for other ones, see
+     * domctl_lock_acquire().
+     */
+    spinlock_t domctl_lock;
+    atomic_t   domctl_issuers;
+
     struct lock_profile_qhead profile_head;
 
     /* Various vm_events */
@@ -599,6 +610,13 @@ struct domain
     struct {
         spinlock_t              lock;
         struct ioreq_server     *server[MAX_NR_IOREQ_SERVERS];
+        /*
+         * The I/O ranges of all servers, per range type, for selecting the
+         * server of an access.  Changed with both locks held, looked up
+         * with only index_lock.
+         */
+        rwlock_t                index_lock;
+        struct rb_root          index[NR_IO_RANGE_TYPES];
     } ioreq_server;
 #endif
 